@@ -13,7 +13,7 @@
 /*                                                                            */
 /* V4L support substantially re-written (2014) following examples and         */
 /* suggestions by Vincent Hourdin.                                            */
-/* The implementation of the fifo buffer for V4L frame grabbing is a direct   */
+/* The queue of captured V4L frames replaces a fifo buffer that was a direct  */
 /* transcription of code by Vincent Hourdin.                                  */
 /*                                                                            */
 /* Copyright (C) 2009 - 2014  Edward Simonson                                 */
@@ -61,6 +61,14 @@
 #ifdef HAVE_LIBPARAPIN
 #include <parapin.h>
 #endif
+#if (defined (__ARM_NEON) || defined (__ARM_NEON__)) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define AUGCAM_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define AUGCAM_SSE2
+#endif
 
 #define GOQAT_AUGCAM
 #include "interface.h"
@@ -71,6 +79,8 @@
 #define AUG_BLACK         0  /* Black level for autoguider data        */
 #define AUG_WHITE_1     255  /* White level for 1-byte autoguider data */
 #define AUG_WHITE_2   65535  /* White level for 2-byte autoguider data */
+#define AUG_DISPLAY_MS  200  /* Min. interval between displayed frames */
+#define AUG_V4L_BUFFERS   4  /* Number of V4L buffers to request       */
 
 #define FOURCC(a,b,c,d) (guint)((((guint)d)<<24)+(((guint)c)<<16)+(((guint)b)<<8)+a)
 /* The following 4CC's aren't provided by V4L2 */
@@ -132,6 +142,7 @@ static gboolean V4L_list_video_settings (guint32 pixelformat);
 static void V4L_list_frame_sizes (guint32 pixelformat);
 static void V4L_list_frame_rates (guint32 pixelformat, gint width, gint height);
 static void V4L_list_current_settings (struct v4l2_format *vid_fmt);
+static gboolean V4L_queue_buffer (gint index);
 static gint v4l2ioctl (gint fh, gint request, void *arg);
 #endif  /* V4L2 */
 #ifdef HAVE_SX_CAM
@@ -150,6 +161,13 @@ struct cam_img *get_aug_image_struct (void);
 
 static void initialise_image_decoding (void);
 static gboolean convert_to_grey (void);
+static void convert_to_display (void);
+static void grey_from_8bit (gushort *dst, const guchar *src, guint n, 
+							guint incr);
+static void grey_from_16bit (gushort *dst, const guchar *src, guint n);
+static void grey_from_colour (gushort *dst, const guchar *src, guint n);
+static void grey_subtract (gushort *data, const gushort *dark, gushort black,
+						   guint n);
 
 
 /******************************************************************************/
@@ -331,7 +349,7 @@ gboolean augcam_open (void)
 		goto open_err;
 	}
 	
-	/* If V4L, aug->r083 points into the fifo buffer */
+	/* If V4L, aug->r083 points into a video buffer while a frame is used */
 	if (aug->device != V4L) {
 		if (!(aug->r083 = (guchar *) g_malloc0 (aug->cam_cap.max_h * 
 								   aug->cam_cap.max_v * 3 * sizeof (guchar)))) {
@@ -475,13 +493,9 @@ gboolean augcam_close (void)
 		aug->ff161 = NULL;
 	}
 	
-	/* If V4L, aug->r083 points into the fifo buffer */
-	if (aug->r083) {
-		if (aug->device != V4L)
-			g_free (aug->r083);
-		else
-			g_free (aug->vid_dat.fifo.alloc); /* Allocated in OpenV4LDevice */
-	}
+	/* If V4L, aug->r083 points into a video buffer while a frame is used */
+	if (aug->r083 && aug->device != V4L)
+		g_free (aug->r083);
 	aug->r083 = NULL;
 	
 	if (aug->disp083) {
@@ -575,12 +589,9 @@ gboolean augcam_image_ready (void)
 			return TRUE;
 			break;
 		case V4L:
-			g_static_mutex_lock (&aug->vid_dat.fifo.mutex);
-			/* If buffer[0] is not NULL then it will point to the start of a
-			 * block of allocated memory where an image can be found.
-			 */
-			Ready = (aug->vid_dat.fifo.buffer[0] != NULL);
-			g_static_mutex_unlock (&aug->vid_dat.fifo.mutex);
+			g_static_mutex_lock (&aug->vid_dat.queue.mutex);
+			Ready = (aug->vid_dat.queue.count > 0);
+			g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
 			return Ready;
 			break;
 		#ifdef HAVE_SX_CAM
@@ -613,7 +624,7 @@ gboolean augcam_capture_exposure (void)
 			 */
 		break;
 		case V4L:
-			/* augcam_grab_v4l_buffer stores a buffer in the fifo and
+			/* augcam_grab_v4l_buffer adds a frame to the queue and
 			 * augcam_process_image points aug->r083 to it, so nothing more 
 			 * to do here.
 			 */
@@ -659,48 +670,84 @@ gboolean augcam_capture_exposure (void)
 
 gboolean augcam_process_image (void)
 {
-	/* Do image processing */
+	/* Do image processing.  The guide star centroid is found for every frame,
+	 * but the image is displayed and the histogram and flux plots are drawn
+	 * at most every AUG_DISPLAY_MS milliseconds (and for every frame that is
+	 * to be saved), so that display work doesn't limit the guiding rate.
+	 */
+	
+	static guint last_display = 0;
+	guint now;
+	gint64 age;
+	gboolean Display, OK;
 	 
 	if (aug->device == V4L) {
-		g_static_mutex_lock (&aug->vid_dat.fifo.mutex);
-		if (!aug->vid_dat.fifo.buffer[0]) { /* Shouldn't happen: image_ready */
-			g_static_mutex_unlock (&aug->vid_dat.fifo.mutex);
+		g_static_mutex_lock (&aug->vid_dat.queue.mutex);
+		if (!aug->vid_dat.queue.count) { /* Shouldn't happen: image_ready */
+			g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
 			return show_error (__func__, "No image to process!");
 		}
-		/* buffer[0] always gets filled first, so points to the location of the
-		 * older frame, if the buffer holds two.
+		/* Take the oldest frame from the queue.  Its buffer isn't re-queued 
+		 * with the driver until we have finished with it, so there's no need
+		 * to copy it.
 		 */
-		aug->r083 = aug->vid_dat.fifo.buffer[0];
-		g_static_mutex_unlock (&aug->vid_dat.fifo.mutex);
+		aug->vid_dat.queue.current = 
+						   aug->vid_dat.queue.frame[aug->vid_dat.queue.head];
+		aug->vid_dat.queue.head = (aug->vid_dat.queue.head + 1) % 
+													 aug->vid_dat.bufnum;
+		aug->vid_dat.queue.count--;
+		aug->r083 = aug->vid_dat.buffers[
+								  aug->vid_dat.queue.current.index].start;
+		g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
+		
+		/* Set the end of the exposure to the time the frame was captured */
+		
+		now = loop_elapsed_since_first_iteration ();
+		age = (g_get_monotonic_time () - aug->vid_dat.queue.current.stamp) /
+																		  1000;
+		aug->exd.exp_end = (age > 0 && age < now) ? now - age : now;
 	}
 	
 	/* Convert to greyscale and dark subtract if required */
 	
-	if (!convert_to_grey ())
-		return FALSE;
+	OK = convert_to_grey ();
 		
 	if (aug->device == V4L) {
-		g_static_mutex_lock (&aug->vid_dat.fifo.mutex);
-		/* Finished with the buffered frame, so now 'release' it to be
-		 * overwritten.  buffer[0] will now point to the newer frame (if there 
-		 * are two); otherwise is set to NULL if buffer[1] has not been set in
-		 * the GrabV4LBuffer routine in the mean time.
+		/* Finished with the frame, so hand its buffer back to the grabber
+		 * thread to be re-queued with the driver.
 		 */
-		aug->vid_dat.fifo.buffer[0] = aug->vid_dat.fifo.buffer[1];
-		aug->vid_dat.fifo.buffer[1] = NULL;
-		g_static_mutex_unlock (&aug->vid_dat.fifo.mutex);
+		g_static_mutex_lock (&aug->vid_dat.queue.mutex);
+		aug->vid_dat.queue.release[aug->vid_dat.queue.nrelease++] = 
+											  aug->vid_dat.queue.current.index;
+		g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
+		aug->r083 = NULL;
 	}
 	
-	/* Display the image data */
+	if (!OK)
+		return FALSE;
+	
+	/* Display the image data if it's time to do so */
+	
+	now = loop_elapsed_since_first_iteration ();
+	Display = (!aug->canv.cviImage || aug->canv.NewRect || aug->AutoSave ||
+			   now - last_display >= AUG_DISPLAY_MS);
+	if (Display) {
+		last_display = now;
+		convert_to_display ();
+		if (!ui_show_augcanv_image ())
+			return FALSE;
+	}
 	
-	if (!ui_show_augcanv_image ())
+	/* Find the star centroid, and draw the histogram and flux plots */
+	
+	if (!image_calc_centroid ())
 		return FALSE;
 	
-	if (!image_calc_hist_and_flux ())
+	if (Display && !image_calc_hist_and_flux ())
 	    return FALSE;
 	    
 	/* Write the motion of the star centroid, if requested (this is calculated 
-	 * in the image_calc_hist_and_flux routine).  Also draw the position on the 
+	 * in the image_calc_centroid routine).  Also draw the position on the 
 	 * autoguider trace display, if required.
 	 */
 		
@@ -1271,12 +1318,15 @@ static gboolean OpenV4LDevice (gchar *device)
 	/* Initialise and queue memory buffers */
 
 	memset (&reqbuf, 0, sizeof (reqbuf));
-    reqbuf.count = 2;  /* Note: The driver may allocate more than this */
+    reqbuf.count = AUG_V4L_BUFFERS;  /* The driver may allocate more or less */
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     reqbuf.memory = V4L2_MEMORY_MMAP;
 	if (v4l2ioctl (aug->fd, VIDIOC_REQBUFS, &reqbuf))
 		return show_error (__func__, "Buffer memory request failed");
+	if (reqbuf.count < 2)
+		return show_error (__func__, "Need at least two video buffers");
 		                                                              
+	aug->vid_dat.queue.queued = 0;
     aug->vid_dat.buffers = calloc (reqbuf.count, sizeof(*aug->vid_dat.buffers));
     for (aug->vid_dat.bufnum = 0; aug->vid_dat.bufnum < reqbuf.count; 
                                                         aug->vid_dat.bufnum++) {
@@ -1297,14 +1347,20 @@ static gboolean OpenV4LDevice (gchar *device)
         if (MAP_FAILED == aug->vid_dat.buffers[aug->vid_dat.bufnum].start)
 			return show_error (__func__, "Unable to map buffer memory");
 
-		if (v4l2ioctl (aug->fd, VIDIOC_QBUF, &buffer))
+		if (!V4L_queue_buffer (buffer.index))
 			return show_error (__func__, "Unable to queue memory buffer");
     }
    
-	/* Allocate fifo buffer */
+	/* Initialise the queue of captured frames */
 	
-	aug->vid_dat.fifo.size = aug->vid_dat.buffers[0].length;
-	aug->vid_dat.fifo.alloc = g_malloc (aug->vid_dat.fifo.size * 2);
+	aug->vid_dat.queue.frame = g_new0 (struct v4l_frame, aug->vid_dat.bufnum);
+	aug->vid_dat.queue.release = g_new0 (gint, aug->vid_dat.bufnum);
+	aug->vid_dat.queue.head = 0;
+	aug->vid_dat.queue.count = 0;
+	aug->vid_dat.queue.nrelease = 0;
+	aug->vid_dat.frames_tot = 0;
+	aug->vid_dat.frames_drop = 0;
+	aug->vid_dat.frames_lost = 0;
 	
 	/* Start streaming */
 	
@@ -1334,13 +1390,21 @@ static gboolean CloseV4LDevice (void)
 		v4l2_munmap (aug->vid_dat.buffers[i].start, 
 		             aug->vid_dat.buffers[i].length);
 	}
+	free (aug->vid_dat.buffers);
+	aug->vid_dat.buffers = NULL;
+	g_free (aug->vid_dat.queue.frame);
+	g_free (aug->vid_dat.queue.release);
+	aug->vid_dat.queue.frame = NULL;
+	aug->vid_dat.queue.release = NULL;
+	aug->vid_dat.queue.count = 0;
 	
 	if (aug->vid_dat.frames_tot)
-		L_print ("Dropped %d out of %d frames (%5.2f %%)\n", 
+		L_print ("Dropped %d out of %d frames (%5.2f %%); driver missed %d\n",
 	                                                  aug->vid_dat.frames_drop, 
 	                                                  aug->vid_dat.frames_tot,
 	                                    100 *(gfloat) aug->vid_dat.frames_drop / 
-	                                         (gfloat) aug->vid_dat.frames_tot);
+	                                         (gfloat) aug->vid_dat.frames_tot,
+	                                                  aug->vid_dat.frames_lost);
 		             
 	/* Close device */
                 
@@ -1353,16 +1417,37 @@ static gboolean CloseV4LDevice (void)
 #ifdef HAVE_LIBV4L2
 gboolean augcam_grab_v4l_buffer (void)
 {
-	/* Grab a frame from the V4L device */
+	/* Grab a frame from the V4L device and add it to the queue of frames
+	 * waiting to be processed.  The frame's buffer is held (i.e. not re-queued
+	 * with the driver) until augcam_process_image has finished with it.  At
+	 * least one buffer is always left queued with the driver, so that capture
+	 * never stalls; if there would be none, the oldest waiting frame is
+	 * dropped.  Gaps in the driver's frame sequence numbers are counted as
+	 * frames missed by the driver.  All the buffer ioctls are made from here
+	 * (i.e. from the grabber thread), so that they don't have to wait for
+	 * a blocked VIDIOC_DQBUF to return.
+	 */
     
 	struct v4l2_buffer buffer;
-	gint r, fifo_pos = -1;
-	guchar* fifo_dest;
+	struct v4l_frame *f;
+	gint i, r, drop = -1;
+	gint64 stamp;
 	
 	/* Check the device is available */
 	
 	if (!aug->Open)
 		return FALSE;
+	
+	/* Re-queue the buffers that have been finished with */
+	
+	g_static_mutex_lock (&aug->vid_dat.queue.mutex);
+	for (i = 0; i < aug->vid_dat.queue.nrelease; i++)
+		if (!V4L_queue_buffer (aug->vid_dat.queue.release[i])) {
+			g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
+			return show_error (__func__, "Error re-queueing buffer");
+		}
+	aug->vid_dat.queue.nrelease = 0;
+	g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
 		
     /* De-queue a buffer */
     
@@ -1372,54 +1457,78 @@ gboolean augcam_grab_v4l_buffer (void)
 	if ((r = v4l2ioctl (aug->fd, VIDIOC_DQBUF, &buffer))) {
 		if (r == ENODEV)
 			return FALSE;  /* Device has gone away */
-		/* With the fifo buffer system, it's not bad to return TRUE */
+		/* With the frame queue, it's not bad to return TRUE */
 		return TRUE;
 	}
-			
-	/* Copy buffered image in fifo */
-	
-	g_static_mutex_lock(&aug->vid_dat.fifo.mutex);
-	if (!aug->vid_dat.fifo.buffer[0]) { /* i.e. if the buffer is empty */
-		fifo_pos = 0;
-		fifo_dest = aug->vid_dat.fifo.alloc;  /* Base of first location */
-	} else if (!aug->vid_dat.fifo.buffer[1]) {  
-		/* i.e. if augcam_process_image hasn't reset buffer[0] but buffer[1] 
-		 * doesn't point to anything yet...
-		 */
-		fifo_pos = 1;
-		if (aug->vid_dat.fifo.buffer[0] == aug->vid_dat.fifo.alloc) {  
-			/* Occupied slot points to first location, so store in second 
-			 * location.
-			 */
-			fifo_dest = aug->vid_dat.fifo.alloc + aug->vid_dat.fifo.size;
-		} else {
-			/* Occupied slot points to second location, so store in first 
-			 * location.
-			 */
-			fifo_dest = aug->vid_dat.fifo.alloc;
-		}
+	aug->vid_dat.queue.queued--;
+	
+	/* Use the driver's time stamp if it's from the monotonic clock */
+	
+	#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+	if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == 
+										   V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		stamp = (gint64) buffer.timestamp.tv_sec * G_USEC_PER_SEC + 
+											 buffer.timestamp.tv_usec;
+	else
+	#endif
+		stamp = g_get_monotonic_time ();
+	
+	/* Add the frame to the queue */
+	
+	g_static_mutex_lock (&aug->vid_dat.queue.mutex);
+	if (aug->vid_dat.frames_tot && 
+		buffer.sequence > aug->vid_dat.queue.sequence + 1) {
+		aug->vid_dat.frames_lost += buffer.sequence - 
+									aug->vid_dat.queue.sequence - 1;
+		G_print ("V4L driver missed frames (%d/%d)\n", 
+				 aug->vid_dat.frames_lost, aug->vid_dat.frames_tot);
 	}
-	if (fifo_pos >= 0) {  
-		/* Copy most-recently dequeued buffer to the appropriate empty slot...*/
-		memcpy (fifo_dest,
-				aug->vid_dat.buffers[buffer.index].start,
-				aug->vid_dat.fifo.size);
-		aug->vid_dat.fifo.buffer[fifo_pos] = fifo_dest; /*... and point to it */
-		aug->vid_dat.frames_tot++;
-	} else {
+	aug->vid_dat.queue.sequence = buffer.sequence;
+	aug->vid_dat.frames_tot++;
+	
+	if (!aug->vid_dat.queue.queued && !aug->vid_dat.queue.nrelease) {
+		if (aug->vid_dat.queue.count) {
+			drop = aug->vid_dat.queue.frame[aug->vid_dat.queue.head].index;
+			aug->vid_dat.queue.head = (aug->vid_dat.queue.head + 1) % 
+													   aug->vid_dat.bufnum;
+			aug->vid_dat.queue.count--;
+		} else
+			drop = buffer.index;
 		aug->vid_dat.frames_drop++;
 		G_print ("V4L dropping frame (%d/%d)\n", aug->vid_dat.frames_drop, 
 		                                         aug->vid_dat.frames_tot);
 	}
-	g_static_mutex_unlock (&aug->vid_dat.fifo.mutex);
+	if (drop != buffer.index) {
+		f = &aug->vid_dat.queue.frame[(aug->vid_dat.queue.head + 
+							aug->vid_dat.queue.count++) % aug->vid_dat.bufnum];
+		f->index = buffer.index;
+		f->stamp = stamp;
+	}
+	g_static_mutex_unlock (&aug->vid_dat.queue.mutex);
 	
-	/* Re-queue buffer */
+	/* Re-queue the dropped frame's buffer */
 		
-	if (v4l2ioctl (aug->fd, VIDIOC_QBUF, &buffer))
+	if (drop >= 0 && !V4L_queue_buffer (drop))
 		return show_error (__func__, "Error re-queueing buffer");
 		
 	return TRUE;
 }
+
+static gboolean V4L_queue_buffer (gint index)
+{
+	/* Queue the given buffer with the driver */
+	
+	struct v4l2_buffer buffer;
+	
+	memset (&buffer, 0, sizeof (buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.index = index;
+	if (v4l2ioctl (aug->fd, VIDIOC_QBUF, &buffer))
+		return FALSE;
+	aug->vid_dat.queue.queued++;
+	return TRUE;
+}
 #endif
 
 #ifdef HAVE_LIBV4L2
@@ -1979,9 +2088,13 @@ static void initialise_image_decoding (void)
 
 static gboolean convert_to_grey (void)
 {
-	/* Convert image data to greyscale suitable for display on the image canvas,
-	 * dark-subtracting, background-subtracting and gamma-correcting as 
-	 * appropriate.  Also derive some image statistics.
+	/* Convert image data to greyscale, dark-subtracting and background-
+	 * subtracting as appropriate, and derive the statistics of the selection
+	 * rectangle used for finding the guide star.  This is done for every 
+	 * frame, so each data format is converted in its own loop (using SIMD
+	 * instructions where available) and the statistics are collected over
+	 * the selection rectangle only.  The data for display on the image canvas
+	 * are prepared by convert_to_display, which is called less often.
 	 *
 	 * On entering this routine:-
 	 * 
@@ -1997,20 +2110,16 @@ static gboolean convert_to_grey (void)
 	 *        'ff161'   contains (possibly) dark-subtracted or background-
 	 *                  subtracted data at a maximum of 16-bit per pixel
 	 *                  greyscale.
-	 *        'disp083' contains (possibly) dark-subtracted, background-
-	 *                  subtracted or gamma-adjusted data in three bytes per 
-	 *                  pixel greyscale format (i.e. actually in RGB format, but
-	 *                  with the R, G, and B bytes for each pixel set to the 
-	 *                  same value).
 	 */
 	
 	gushort row, col;
 	gushort xo1, xo2, yo1, yo2;
-	guint size, count, reject;
-	gint val = 0;
-    gint i, j, k;
-    gdouble gamma_scale, diff, rms;
-	guchar *iptr = NULL;
+	guint n, size, count, reject;
+	gint val;
+    gint i, j;
+    gdouble diff, rms;
+	guchar *iptr;
+	gushort *data;
 	
 	/* Return if no image */
 	
@@ -2027,162 +2136,105 @@ static gboolean convert_to_grey (void)
 	if (aug->dark.Capture)
 		augcam_read_dark_frame ();    /* Fills aug->dk161 */
 	
-    /* Initialise some values for calculating pixel statistics and get the
-	 * coordinates of the selection rectangle within the displayed image.
+	/* Convert to greyscale (if not already) */
+	
+	n = aug->exd.h_pix * aug->exd.v_pix;
+	if (aug->device == UNICAP || aug->device == V4L) {
+		iptr = aug->r083 + aug->vid_dat.byte_offset;
+		if (aug->vid_dat.type == VIDBUF_GREY1)
+			grey_from_8bit (aug->ff161, iptr, n, aug->vid_dat.byte_incr);
+		else if (aug->vid_dat.type == VIDBUF_GREY2)
+			grey_from_16bit (aug->ff161, iptr, n);
+		else if (aug->vid_dat.type == VIDBUF_COL3)
+			grey_from_colour (aug->ff161, iptr, n);
+	} else if (aug->device == SX || aug->device == SX_GH) {
+		memcpy (aug->ff161, aug->r161, n * sizeof (gushort));
+	}
+	
+	/* If this is a dark frame, average with the previous stored one(s) */
+	
+	if (aug->dark.Capture)
+		for (i = 0; i < n; i++)
+			aug->dark.dk161[i] = (aug->dark.dk161[i] * ndark + aug->ff161[i]) /
+															   (ndark + 1);
+	
+	/* Subtract dark frame, if required, and the background cut-off level */
+	
+	grey_subtract (aug->ff161, aug->dark.Subtract ? aug->dark.dk161 : NULL,
+				   aug->imdisp.black, n);
+	
+	/* Get pixel statistics in the selection rectangle.  aug->rect is for the
+	 * (possibly dark-subtracted and/or background-adjusted) image; these 
+	 * values are used for determining the guide star location.  aug->img is
+	 * for the raw data; these values are reported on the Image window status
+	 * bar.
 	 */
 	
-	aug->pic.min[GREY].val = aug->imdisp.W;
-	aug->pic.max[GREY].val = aug->imdisp.B;
 	aug->rect.min[GREY].val = aug->imdisp.W;
 	aug->rect.max[GREY].val = aug->imdisp.B;
 	aug->img.min[GREY].val = aug->imdisp.W;
 	aug->img.max[GREY].val = aug->imdisp.B;
 	memset (aug->rect.mode[GREY].hist, 0, (aug->imdisp.W + 1) * sizeof (guint));
 	aug->rect.mode[GREY].peakcount = 0;
-	is_in_image (aug, &xo1, &yo1, &xo2, &yo2);
-	
-	gamma_scale = pow (aug->imdisp.W, aug->imdisp.gamma) + 0.01;
 	
-	iptr = aug->r083+aug->vid_dat.byte_offset;
-	for (i = 0; i < aug->exd.h_pix * aug->exd.v_pix; i++) {
-		
-		/* Loop over entire image and convert to greyscale (if not already) */
-		
-		if (aug->device == UNICAP || aug->device == V4L) {
-			if (aug->vid_dat.type == VIDBUF_GREY1)
-				val = *iptr;
-			else if (aug->vid_dat.type == VIDBUF_GREY2)
-				val = *(iptr+1) * 256 + *iptr; /* Swap bytes and combine */
-			else if (aug->vid_dat.type == VIDBUF_COL3) {
-				switch (aug->imdisp.greyscale) {
-					case LUMIN:
-						if (aug->vid_dat.pixfmt == V4L2_PIX_FMT_RGB24)
-							val = (gushort) (0.11 * (gfloat) *iptr +
-											 0.59 * (gfloat) *(iptr+1) +
-											 0.30 * (gfloat) *(iptr+2));
-						else /* BGR24 */
-							val = (gushort) (0.11 * (gfloat) *(iptr+2) +
-											 0.59 * (gfloat) *(iptr+1) +
-											 0.30 * (gfloat) *iptr);
-						break;
-					case DESAT:
-						val = (MAX (*iptr, MAX (*(iptr+1), *(iptr+2)) +
-							   MIN (*iptr, MAX (*(iptr+1), *(iptr+2)))))/2;							
-						break;
-					case MAXIM:
-						val = MAX (*iptr, MAX (*(iptr+1), *(iptr+2)));
-						break;
-					case MONO:  /* Keeps the compiler quiet! */
-						break;
+	if (is_in_image (aug, &xo1, &yo1, &xo2, &yo2)) {
+		for (row = yo1; row <= yo2; row++) {
+			data = aug->ff161 + row * aug->exd.h_pix;
+			for (col = xo1; col <= xo2; col++) {
+				val = data[col];
+				aug->rect.min[GREY].val = MIN (aug->rect.min[GREY].val, val);
+				if (val > aug->rect.max[GREY].val) {
+					aug->rect.max[GREY].val = val;
+					aug->rect.max[GREY].h = col;
+					aug->rect.max[GREY].v = row;
+				}
+				aug->img.min[GREY].val = MIN (aug->img.min[GREY].val, 
+										 aug->r161[row * aug->exd.h_pix + col]);
+				aug->img.max[GREY].val = MAX (aug->img.max[GREY].val, 
+										 aug->r161[row * aug->exd.h_pix + col]);
+				if (++aug->rect.mode[GREY].hist[val] > 
+											   aug->rect.mode[GREY].peakcount) {
+					aug->rect.mode[GREY].peakcount = 
+											   aug->rect.mode[GREY].hist[val];
+					aug->rect.mode[GREY].peakbin = val;
 				}
 			}
-			iptr += aug->vid_dat.byte_incr;/* Set in initialise_image_decoding*/
-		} else if (aug->device == SX || aug->device == SX_GH) {
-			val = aug->r161[i];
 		}
-		
-		/* If this is a dark frame, average with the previous stored one(s) */
-		
-		if (aug->dark.Capture)
-			aug->dark.dk161[i] = (aug->dark.dk161[i] * ndark + val)/(ndark + 1);		
 	
-		/* Subtract dark frame, if required */		
-
-		if (aug->dark.Subtract)
-			val = MAX (val - aug->dark.dk161[i], 0);
-	
-		/* Subtract the background cut-off level */
-		
-		val = MAX (val - aug->imdisp.black, 0);
-		
-		/* Get pixel statistics in the (possibly dark-subtracted and/or 
-		 * background-adjusted) image.
+		/* Estimate the sky background as the median value in the selected 
+		 * area.  This will be a slight over-estimate but is more stable than
+		 * the histogram peak bin.
 		 */
 		
-		/* aug->pic is for the entire displayed image; these values are       */
-		/* written to the FITS header if an autoguider image is saved.        */
-		aug->pic.min[GREY].val = MIN (aug->pic.min[GREY].val, val);
-		aug->pic.max[GREY].val = MAX (aug->pic.max[GREY].val, val);
-		
-		/* aug->rect is for just the displayed image within the selection     */
-		/* rectangle; these values are used for determining the guide star    */
-		/* location.  aug->img is for the raw data (also just within the      */
-		/* selection rectangle in this case); these values are reported on    */
-		/* the Image window status bar.                                       */
-		col = i%aug->exd.h_pix;
-		row = i / aug->exd.h_pix;
-		if (yo1 <= row && row <= yo2 && xo1 <= col && col <= xo2) {
-			aug->rect.min[GREY].val = MIN (aug->rect.min[GREY].val, val);
-			if (val > aug->rect.max[GREY].val) {
-				aug->rect.max[GREY].val = val;
-				aug->rect.max[GREY].h = col;
-				aug->rect.max[GREY].v = row;
-			}
-			aug->img.min[GREY].val = MIN (aug->img.min[GREY].val, 
-										 aug->r161[row * aug->exd.h_pix + col]);
-			aug->img.max[GREY].val = MAX (aug->img.max[GREY].val, 
-										 aug->r161[row * aug->exd.h_pix + col]);
-			if (++aug->rect.mode[GREY].hist[val] > 
-											   aug->rect.mode[GREY].peakcount) {
-				aug->rect.mode[GREY].peakcount = aug->rect.mode[GREY].hist[val];
-                aug->rect.mode[GREY].peakbin = val;
-			}
+		size = (yo2 - yo1 + 1) * (xo2 - xo1 + 1);
+		for (i = 0, count = 0; i < (aug->imdisp.W + 1); i++) {
+			count += aug->rect.mode[GREY].hist[i];
+			if (count >= size / 2)
+				break;
 		}
+		aug->rect.stdev[GREY].median = i;
 		
-		/* Set the values for the displayed image.  Note that we expand up 
-		 * to 3 bytes per pixel RGB format at this point for display on image 
-		 * canvas.  Gamma-adjust the SX data for image display.
+		/* Estimate the standard deviation of the background in the selected
+		 * area.  Atempt to reject stars as far as possible by ignoring values
+		 * that deviate from the median by more than 50%.
 		 */
-		 
-		if (aug->device == UNICAP || aug->device == V4L) {
-			for (k = 0; k < 3; k++)
-				aug->disp083[i*3 + k] = val;
-		} else if (aug->device == SX || aug->device == SX_GH) {
-			if (aug->imdisp.gamma >= 0.995) { /* Gamma value essentially == 1 */
-				for (k = 0; k < 3; k++)
-					aug->disp083[i*3 + k] = val >> (aug->cam_cap.bitspp - 8);
-			} else {
-				for (k = 0; k < 3; k++)
-					aug->disp083[i*3 + k] = (guchar) 255 * 
-								     pow (val, aug->imdisp.gamma) / gamma_scale;
+		
+		rms = 0.0;
+		reject = 0;
+		for (i = yo1; i <= yo2; i++) {
+			for (j = xo1; j <= xo2; j++) {	
+				val = aug->ff161[aug->exd.h_pix * i + j];
+				if (val > 0.5 * aug->rect.stdev[GREY].median && 
+					val < 1.5 * aug->rect.stdev[GREY].median) {
+					diff = (gdouble) val - aug->rect.stdev[GREY].median;
+					rms += diff * diff;
+				} else
+					reject++;
 			}
 		}
-		aug->ff161[i] = val;                            /* For centroiding    */
+		aug->rect.stdev[GREY].val = sqrt (rms / (size - reject));
 	}
 	
-	/* Estimate the sky background as the median value in the selected area.  
-	 * This will be a slight over-estimate but is more stable than the histogram
-	 * peak bin.
-	 */
-	
-	size = (yo2 - yo1 + 1) * (xo2 - xo1 + 1);
-	for (i = 0, count = 0; i < (aug->imdisp.W + 1); i++) {
-		count += aug->rect.mode[GREY].hist[i];
-		if (count >= size / 2)
-			break;
-	}
-	aug->rect.stdev[GREY].median = i;
-	
-	/* Estimate the standard deviation of the background in the selected area.
-	 * Atempt to reject stars as far as possible by ignoring values that
-	 * deviate from the median by more than 50%.
-	 */
-	
-	rms = 0.0;
-	reject = 0;
-	for (i = yo1; i <= yo2; i++) {
-		for (j = xo1; j <= xo2; j++) {	
-			val = aug->ff161[aug->exd.h_pix * i + j];
-			if (val > 0.5 * aug->rect.stdev[GREY].median && 
-				val < 1.5 * aug->rect.stdev[GREY].median) {
-				diff = (gdouble) val - aug->rect.stdev[GREY].median;
-				rms += diff * diff;
-			} else
-				reject++;
-		}
-	}
-	aug->rect.stdev[GREY].val = sqrt (rms / (size - reject));
-	
 	/* Write dark frame to file if capturing and averaging */
 	
 	if (aug->dark.Capture) {
@@ -2196,3 +2248,165 @@ static gboolean convert_to_grey (void)
 
 	return TRUE;
 }
+
+static void convert_to_display (void)
+{
+	/* Prepare the data in 'ff161' for display on the image canvas in 'disp083',
+	 * in three bytes per pixel greyscale format (i.e. actually in RGB format,
+	 * but with the R, G, and B bytes for each pixel set to the same value).
+	 * Gamma-adjust the SX data for image display.  Also get the pixel
+	 * statistics for the entire image; these values are written to the FITS
+	 * header if an autoguider image is saved.
+	 */
+	
+	guint i, n;
+	guchar *disp;
+	gushort val;
+	gdouble gamma_scale;
+	
+	aug->pic.min[GREY].val = aug->imdisp.W;
+	aug->pic.max[GREY].val = aug->imdisp.B;
+	gamma_scale = pow (aug->imdisp.W, aug->imdisp.gamma) + 0.01;
+	
+	n = aug->exd.h_pix * aug->exd.v_pix;
+	for (i = 0, disp = aug->disp083; i < n; i++, disp += 3) {
+		val = aug->ff161[i];
+		aug->pic.min[GREY].val = MIN (aug->pic.min[GREY].val, val);
+		aug->pic.max[GREY].val = MAX (aug->pic.max[GREY].val, val);
+		if (aug->device == UNICAP || aug->device == V4L) {
+			disp[0] = disp[1] = disp[2] = val;
+		} else if (aug->device == SX || aug->device == SX_GH) {
+			if (aug->imdisp.gamma >= 0.995)   /* Gamma value essentially == 1 */
+				disp[0] = disp[1] = disp[2] = val >> (aug->cam_cap.bitspp - 8);
+			else
+				disp[0] = disp[1] = disp[2] = (guchar) 255 * 
+								     pow (val, aug->imdisp.gamma) / gamma_scale;
+		}
+	}
+}
+
+static void grey_from_8bit (gushort *dst, const guchar *src, guint n, 
+							guint incr)
+{
+	/* Copy n 8-bit greyscale values, incr bytes apart, from src to dst */
+	
+	guint i = 0;
+	
+	if (incr == 1) {
+		#if defined (AUGCAM_NEON)
+		for (; i + 16 <= n; i += 16) {
+			uint8x16_t v = vld1q_u8 (src + i);
+			vst1q_u16 (dst + i, vmovl_u8 (vget_low_u8 (v)));
+			vst1q_u16 (dst + i + 8, vmovl_u8 (vget_high_u8 (v)));
+		}
+		#elif defined (AUGCAM_SSE2)
+		__m128i zero = _mm_setzero_si128 ();
+		for (; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (src + i));
+			_mm_storeu_si128 ((__m128i *) (dst + i), 
+							  _mm_unpacklo_epi8 (v, zero));
+			_mm_storeu_si128 ((__m128i *) (dst + i + 8), 
+							  _mm_unpackhi_epi8 (v, zero));
+		}
+		#endif
+	} else if (incr == 2) {  /* Y-plane of YUYV etc.: the last 16 bytes */
+		#if defined (AUGCAM_NEON)     /*  loaded must all be in the image */
+		for (; i + 8 < n; i += 8)
+			vst1q_u16 (dst + i, vmovl_u8 (vld2_u8 (src + 2 * i).val[0]));
+		#elif defined (AUGCAM_SSE2)
+		__m128i mask = _mm_set1_epi16 (0x00ff);
+		for (; i + 8 < n; i += 8)
+			_mm_storeu_si128 ((__m128i *) (dst + i), _mm_and_si128 (
+					  _mm_loadu_si128 ((const __m128i *) (src + 2 * i)), mask));
+		#endif
+	}
+	for (; i < n; i++)
+		dst[i] = src[i * incr];
+}
+
+static void grey_from_16bit (gushort *dst, const guchar *src, guint n)
+{
+	/* Copy n 16-bit little-endian greyscale values from src to dst */
+	
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy (dst, src, n * sizeof (gushort));
+	#else
+	guint i;
+	
+	for (i = 0; i < n; i++, src += 2)
+		dst[i] = *(src+1) * 256 + *src; /* Swap bytes and combine */
+	#endif
+}
+
+static void grey_from_colour (gushort *dst, const guchar *src, guint n)
+{
+	/* Convert n 3-byte colour values from src to greyscale in dst, by the
+	 * method selected on the image window.
+	 */
+	
+	guint i, a, c;
+	
+	a = (aug->vid_dat.pixfmt == V4L2_PIX_FMT_RGB24) ? 0 : 2; /* Else BGR24 */
+	c = 2 - a;
+	switch (aug->imdisp.greyscale) {
+		case LUMIN:
+			for (i = 0; i < n; i++, src += 3)
+				dst[i] = (gushort) (0.11 * (gfloat) *(src+a) +
+									0.59 * (gfloat) *(src+1) +
+									0.30 * (gfloat) *(src+c));
+			break;
+		case DESAT:
+			for (i = 0; i < n; i++, src += 3)
+				dst[i] = (MAX (*src, MAX (*(src+1), *(src+2)) +
+						  MIN (*src, MAX (*(src+1), *(src+2)))))/2;
+			break;
+		case MAXIM:
+			for (i = 0; i < n; i++, src += 3)
+				dst[i] = MAX (*src, MAX (*(src+1), *(src+2)));
+			break;
+		case MONO:
+			memset (dst, 0, n * sizeof (gushort));
+			break;
+	}
+}
+
+static void grey_subtract (gushort *data, const gushort *dark, gushort black,
+						   guint n)
+{
+	/* Subtract the dark frame (if not NULL) and then the black level from n
+	 * values, clipping at zero.
+	 */
+	
+	guint i = 0;
+	gint val;
+	
+	if (!dark && !black)
+		return;
+	
+	#if defined (AUGCAM_NEON)
+	uint16x8_t b = vdupq_n_u16 (black);
+	if (dark)
+		for (; i + 8 <= n; i += 8)
+			vst1q_u16 (data + i, vqsubq_u16 (vqsubq_u16 (vld1q_u16 (data + i),
+												vld1q_u16 (dark + i)), b));
+	else
+		for (; i + 8 <= n; i += 8)
+			vst1q_u16 (data + i, vqsubq_u16 (vld1q_u16 (data + i), b));
+	#elif defined (AUGCAM_SSE2)
+	__m128i b = _mm_set1_epi16 ((gshort) black);
+	if (dark)
+		for (; i + 8 <= n; i += 8)
+			_mm_storeu_si128 ((__m128i *) (data + i), _mm_subs_epu16 (
+					  _mm_subs_epu16 (
+						  _mm_loadu_si128 ((const __m128i *) (data + i)),
+						  _mm_loadu_si128 ((const __m128i *) (dark + i))), b));
+	else
+		for (; i + 8 <= n; i += 8)
+			_mm_storeu_si128 ((__m128i *) (data + i), _mm_subs_epu16 (
+					  _mm_loadu_si128 ((const __m128i *) (data + i)), b));
+	#endif
+	for (; i < n; i++) {
+		val = dark ? MAX ((gint) data[i] - dark[i], 0) : data[i];
+		data[i] = MAX (val - black, 0);
+	}
+}
@@ -0,0 +1,755 @@
+/******************************************************************************/
+/*                          CCD CALIBRATION LIBRARY                           */
+/*                                                                            */
+/* Builds master bias, dark and flat frames from stacks of exposures and      */
+/* calibrates images with them.  Each master is the sigma-clipped median of   */
+/* its frames, combined in parallel.  Darks are kept for several exposure     */
+/* lengths and CCD temperatures, and flats for each filter.  The masters are  */
+/* kept in memory and in files in the library folder, so they survive a      */
+/* restart.  Images are calibrated in 16-bit integer arithmetic: the bias and */
+/* scaled dark are combined once into a single offset frame that is kept for  */
+/* re-use, and the flat is stored as a fixed-point gain.                      */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#if (defined (__ARM_NEON) || defined (__ARM_NEON__)) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define CALIB_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define CALIB_SSE2
+#endif
+
+#include "calib.h"
+
+#define CALIB_MAX_MASTERS 24              /* Most master frames in library    */
+#define CALIB_MAX_THREADS 4               /* Most threads combining frames    */
+#define CALIB_CLIP_SIGMA 3.0f             /* Rejection limit (std. devs.)     */
+#define CALIB_CLIP_ITER 3                 /* Most rejection iterations        */
+#define CALIB_MIN_SIGMA 0.5f              /* Least std. dev. (ADU) for above  */
+#define CALIB_EXP_TOL 0.01                /* Max. dark exposure error without */
+                                          /*  a bias to scale it              */
+#define CALIB_GAIN_SHIFT 14               /* Flat gain is a Q14 fixed-point   */
+#define CALIB_GAIN_ONE (1 << CALIB_GAIN_SHIFT) /*  number (1.0 = 16384)       */
+#define CALIB_FLAT_MIN 0.25f              /* Least usable flat response       */
+#define CALIB_MAGIC "GQCALIB1"            /* Identifies a master frame file   */
+
+/* Median of the sorted values a[l] to a[h - 1] */
+#define CALIB_MEDIAN(a, l, h) (((h) - (l)) % 2 ? (a)[((l) + (h)) / 2] : \
+				  0.5f * ((a)[((l) + (h)) / 2 - 1] + (a)[((l) + (h)) / 2]))
+
+struct calib_master {                     /* A master frame in the library    */
+	struct calib_frame cf;                /* Exposures it was made from       */
+	int nframes;                          /* Number of frames combined        */
+	long built;                           /* Time built (s since the epoch)   */
+	unsigned short *data;                 /* ADU (bias, dark) or gain (flat)  */
+};
+
+struct calib_head {                       /* Header of a master frame file    */
+	char magic[8];                        /* CALIB_MAGIC                      */
+	struct calib_frame cf;                /* As for struct calib_master       */
+	int nframes;
+	long built;
+};
+
+struct calib_job {                        /* A run of pixels for one thread   */
+	unsigned short * const *frame;        /* Frames being combined            */
+	const float *scale;                   /* Scale factor for each frame      */
+	int n;                                /* Number of frames                 */
+	int type;                             /* Type of master being made        */
+	float norm;                           /* Normalises a flat to unity       */
+	size_t first, last;                   /* Range of pixels to combine       */
+	unsigned short *out;                  /* Master frame                     */
+};
+
+static char *calib_dir = NULL;            /* Folder holding the library       */
+static struct calib_master master[CALIB_MAX_MASTERS];
+static unsigned int calib_gen = 0;        /* Changes when a master changes    */
+
+static unsigned short *stack[CALIB_MAX_FRAMES]; /* Frames to be combined      */
+static double stack_mean[CALIB_MAX_FRAMES];     /* Mean level of each flat    */
+static size_t stack_len = 0;              /* Allocated pixels in each frame   */
+static int nstack = 0;                    /* Number of frames stacked         */
+static double stack_temp;                 /* Sum of their CCD temperatures    */
+static struct calib_frame stack_cf;       /* The first of them                */
+
+static struct {                           /* Offset frame kept for re-use:    */
+	unsigned short *data;                 /*  bias + scaled dark - pedestal   */
+	size_t len;                           /* Allocated pixels                 */
+	int bias, dark, flat, pedestal;       /* Masters and pedestal used...     */
+	double exp;                           /*  ...for this exposure length...  */
+	unsigned int gen;                     /*  ...and library generation       */
+	int Valid;
+} offset = {NULL, 0, -1, -1, -1, 0, 0.0, 0, FALSE};
+
+
+/******************************************************************************/
+/*                              CALIBRATION                                   */
+/******************************************************************************/
+
+int calib_open (const char *dir);
+void calib_close (void);
+int calib_add_frame (const struct calib_frame *cf, const unsigned short *data,
+					 struct calib_frame *done);
+int calib_flush (struct calib_frame *done);
+int calib_pending (void);
+int calib_apply (const struct calib_frame *cf, unsigned short *data);
+static gpointer calib_combine (gpointer data);
+static float calib_clipped_median (float *v, float *d, int n);
+static void calib_sort (float *v, int n);
+static const unsigned short *calib_offset (const struct calib_frame *cf,
+										   int bias, int dark, int flat,
+										   int pedestal);
+static void calib_correct (unsigned short *data, const unsigned short *off,
+						   const unsigned short *gain, size_t n);
+static int calib_find (int type, const struct calib_frame *cf, int bias);
+static int calib_slot (const struct calib_frame *cf);
+static int calib_same_geometry (const struct calib_frame *a,
+								const struct calib_frame *b);
+static int calib_same_stack (const struct calib_frame *cf);
+static int calib_save (int slot);
+static void calib_path (char *path, int slot, const char *suffix);
+
+
+int calib_open (const char *dir)
+{
+	/* Open the library in the given folder, creating the folder if necessary,
+	 * and read any master frames saved there.  Files that are not valid
+	 * master frames are ignored.  Returns TRUE on success or FALSE with errno
+	 * set.
+	 */
+
+	struct calib_head head;
+	char path[PATH_MAX];
+	size_t n;
+	FILE *fp;
+	int i;
+
+	calib_close ();
+	if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+		return FALSE;
+	if (!(calib_dir = strdup (dir)))
+		return FALSE;
+
+	for (i = 0; i < CALIB_MAX_MASTERS; i++) {
+		calib_path (path, i, "");
+		if (!(fp = fopen (path, "rb")))
+			continue;
+		if (fread (&head, sizeof (head), 1, fp) == 1 &&
+			!memcmp (head.magic, CALIB_MAGIC, sizeof (head.magic)) &&
+			(head.cf.type == CALIB_BIAS || head.cf.type == CALIB_DARK ||
+			 head.cf.type == CALIB_FLAT) &&
+			head.cf.h_pix > 0 && head.cf.h_pix <= USHRT_MAX &&
+			head.cf.v_pix > 0 && head.cf.v_pix <= USHRT_MAX) {
+			n = (size_t) head.cf.h_pix * head.cf.v_pix;
+			head.cf.filter[sizeof (head.cf.filter) - 1] = '\0';
+			if ((master[i].data = malloc (n * sizeof (unsigned short)))) {
+				if (fread (master[i].data, sizeof (unsigned short), n, fp)==n){
+					master[i].cf = head.cf;
+					master[i].nframes = head.nframes;
+					master[i].built = head.built;
+				} else {
+					free (master[i].data);
+					master[i].data = NULL;
+				}
+			}
+		}
+		fclose (fp);
+	}
+	calib_gen++;
+	return TRUE;
+}
+
+void calib_close (void)
+{
+	/* Free the library and discard any frames waiting to be combined */
+
+	int i;
+
+	for (i = 0; i < CALIB_MAX_MASTERS; i++) {
+		free (master[i].data);
+		master[i].data = NULL;
+	}
+	for (i = 0; i < CALIB_MAX_FRAMES; i++) {
+		free (stack[i]);
+		stack[i] = NULL;
+	}
+	stack_len = 0;
+	nstack = 0;
+	free (offset.data);
+	offset.data = NULL;
+	offset.len = 0;
+	offset.Valid = FALSE;
+	free (calib_dir);
+	calib_dir = NULL;
+}
+
+int calib_add_frame (const struct calib_frame *cf, const unsigned short *data,
+					 struct calib_frame *done)
+{
+	/* Add a bias, dark or flat frame to the stack of frames to be combined
+	 * into a master.  A frame that does not belong with those already stacked
+	 * (a different type, size, exposure length and so on) causes them to be
+	 * combined first, as does the stack becoming full.  Flats have the bias
+	 * and dark removed as they are stacked, so that they can be normalised.
+	 * Returns the number of frames in the stack that was combined, with its
+	 * description in 'done' (fewer than CALIB_MIN_FRAMES are discarded
+	 * instead), 0 if the frame was just stacked, or -1 with errno set.
+	 */
+
+	const unsigned short *off;
+	size_t i, n = (size_t) cf->h_pix * cf->v_pix;
+	double sum;
+	int bias, closed = 0;
+
+	if (nstack && !calib_same_stack (cf))
+		if ((closed = calib_flush (done)) < 0)
+			return -1;
+
+	if (n > stack_len) {
+		for (i = 0; i < CALIB_MAX_FRAMES; i++) {
+			free (stack[i]);
+			stack[i] = NULL;
+		}
+		stack_len = n;
+	}
+	if (!stack[nstack] &&
+		!(stack[nstack] = malloc (stack_len * sizeof (unsigned short)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (cf->type == CALIB_FLAT) {
+		bias = calib_find (CALIB_BIAS, cf, -1);
+		if (!(off = calib_offset (cf, bias, calib_find (CALIB_DARK, cf, bias),
+								  -1, 0))) {
+			errno = ENOMEM;
+			return -1;
+		}
+		sum = 0.0;
+		for (i = 0; i < n; i++) {
+			stack[nstack][i] = data[i] > off[i] ? data[i] - off[i] : 0;
+			sum += stack[nstack][i];
+		}
+		stack_mean[nstack] = sum > n ? sum / n : 1.0;
+	} else
+		memcpy (stack[nstack], data, n * sizeof (unsigned short));
+
+	if (!nstack) {
+		stack_cf = *cf;
+		stack_temp = 0.0;
+	}
+	stack_temp += cf->temp;
+	if (++nstack == CALIB_MAX_FRAMES)
+		closed = calib_flush (done);
+
+	return closed;
+}
+
+int calib_flush (struct calib_frame *done)
+{
+	/* Combine the stacked frames into a master, replacing any with the same
+	 * description, and save it.  The master is usable even if saving fails.
+	 * Returns as for calib_add_frame.
+	 */
+
+	struct calib_job job[CALIB_MAX_THREADS];
+	GThread *thread[CALIB_MAX_THREADS];
+	float scale[CALIB_MAX_FRAMES];
+	unsigned short *out;
+	double ref;
+	size_t n;
+	long ncpu;
+	int f, t, slot, nthreads, nframes = nstack;
+
+	if (!nframes)
+		return 0;
+	nstack = 0;
+	stack_cf.temp = stack_temp / nframes;
+	*done = stack_cf;
+	if (nframes < CALIB_MIN_FRAMES)
+		return nframes;
+
+	n = (size_t) stack_cf.h_pix * stack_cf.v_pix;
+	if (!(out = malloc (n * sizeof (unsigned short)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Flats are scaled to a common level so that they can be combined;
+	 * the result is then normalised to unity.
+	 */
+
+	ref = 0.0;
+	if (stack_cf.type == CALIB_FLAT)
+		for (f = 0; f < nframes; f++)
+			ref += stack_mean[f] / nframes;
+	for (f = 0; f < nframes; f++)
+		scale[f] = stack_cf.type == CALIB_FLAT ? ref / stack_mean[f] : 1.0f;
+
+	/* Divide the pixels between the threads and combine them */
+
+	ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > CALIB_MAX_THREADS ? CALIB_MAX_THREADS : ncpu;
+	nthreads = nthreads < 1 ? 1 : nthreads;
+	for (t = 0; t < nthreads; t++) {
+		job[t].frame = stack;
+		job[t].scale = scale;
+		job[t].n = nframes;
+		job[t].type = stack_cf.type;
+		job[t].norm = ref > 0.0 ? 1.0 / ref : 1.0;
+		job[t].first = n * t / nthreads;
+		job[t].last = n * (t + 1) / nthreads;
+		job[t].out = out;
+		thread[t] = t ? g_thread_create (calib_combine, &job[t], TRUE, NULL) :
+		                                                                  NULL;
+	}
+	calib_combine (&job[0]);
+	for (t = 1; t < nthreads; t++) {
+		if (thread[t])
+			g_thread_join (thread[t]);
+		else
+			calib_combine (&job[t]);  /* Do it here if the thread failed */
+	}
+
+	/* Put the master in the library and save it */
+
+	slot = calib_slot (&stack_cf);
+	free (master[slot].data);
+	master[slot].cf = stack_cf;
+	master[slot].nframes = nframes;
+	master[slot].built = (long) time (NULL);
+	master[slot].data = out;
+	calib_gen++;
+
+	return calib_save (slot) ? nframes : -1;
+}
+
+int calib_pending (void)
+{
+	/* Return the number of frames waiting to be combined */
+
+	return nstack;
+}
+
+int calib_apply (const struct calib_frame *cf, unsigned short *data)
+{
+	/* Calibrate an image in place with the best matching masters: the bias,
+	 * the dark nearest in temperature (within CALIB_TEMP_TOL) and exposure
+	 * length, scaled to the image exposure, and the flat for the image
+	 * filter.  CALIB_PEDESTAL is added when the bias or dark is subtracted,
+	 * so that noise in the sky background is not clipped at zero.  Returns
+	 * the CALIB_ flags for the masters applied (0 if there are none) or -1
+	 * with errno set.
+	 */
+
+	const unsigned short *off;
+	int bias, dark, flat, flags;
+
+	bias = calib_find (CALIB_BIAS, cf, -1);
+	dark = calib_find (CALIB_DARK, cf, bias);
+	flat = calib_find (CALIB_FLAT, cf, -1);
+	if (bias < 0 && dark < 0 && flat < 0)
+		return 0;
+
+	if (!(off = calib_offset (cf, bias, dark, flat, (bias >= 0 || dark >= 0) ?
+														CALIB_PEDESTAL : 0))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	calib_correct (data, off, flat >= 0 ? master[flat].data : NULL,
+				   (size_t) cf->h_pix * cf->v_pix);
+
+	flags = (bias >= 0 ? CALIB_BIAS : 0) | (flat >= 0 ? CALIB_FLAT : 0);
+	if (dark >= 0)  /* A dark without a bias includes it */
+		flags |= CALIB_DARK | CALIB_BIAS;
+	return flags;
+}
+
+static gpointer calib_combine (gpointer data)
+{
+	/* Thread function to combine a run of pixels from the stacked frames.
+	 * Bias and dark masters are in ADU; a flat master is the gain that
+	 * corrects the pixel response, in Q14 fixed point.  Pixels that respond
+	 * too weakly to be corrected (dead or shadowed) are given unit gain.
+	 */
+
+	struct calib_job *job = data;
+	float v[CALIB_MAX_FRAMES], d[CALIB_MAX_FRAMES], med;
+	size_t i;
+	int f;
+
+	for (i = job->first; i < job->last; i++) {
+		for (f = 0; f < job->n; f++)
+			v[f] = job->frame[f][i] * job->scale[f];
+		med = calib_clipped_median (v, d, job->n);
+		if (job->type == CALIB_FLAT) {
+			med *= job->norm;
+			if (med < CALIB_FLAT_MIN)
+				job->out[i] = CALIB_GAIN_ONE;
+			else
+				job->out[i] = CALIB_GAIN_ONE / med > USHRT_MAX ? USHRT_MAX :
+											 lrintf (CALIB_GAIN_ONE / med);
+		} else
+			job->out[i] = med > USHRT_MAX ? USHRT_MAX : lrintf (med);
+	}
+	return NULL;
+}
+
+static float calib_clipped_median (float *v, float *d, int n)
+{
+	/* Return the median of the n values in v after repeatedly rejecting those
+	 * more than CALIB_CLIP_SIGMA standard deviations from the median.  The
+	 * standard deviation is estimated from the median absolute deviation, so
+	 * that a cosmic ray or satellite trail in one frame does not inflate it.
+	 * v is sorted in place, so the values kept are always a contiguous run;
+	 * d is workspace of the same size.
+	 */
+
+	float med, lim;
+	int k, lo = 0, hi = n, it;
+
+	calib_sort (v, n);
+	med = CALIB_MEDIAN (v, lo, hi);
+	for (it = 0; it < CALIB_CLIP_ITER && hi - lo >= CALIB_MIN_FRAMES; it++) {
+		for (k = lo; k < hi; k++)
+			d[k - lo] = fabsf (v[k] - med);
+		calib_sort (d, hi - lo);
+		lim = 1.4826f * CALIB_MEDIAN (d, 0, hi - lo);
+		lim = CALIB_CLIP_SIGMA * (lim > CALIB_MIN_SIGMA ? lim : CALIB_MIN_SIGMA);
+		for (k = lo; k < hi && med - v[k] > lim; k++)
+			;
+		if (k == lo && v[hi - 1] - med <= lim)
+			break;
+		lo = k;
+		while (hi > lo && v[hi - 1] - med > lim)
+			hi--;
+		med = CALIB_MEDIAN (v, lo, hi);
+	}
+	return med;
+}
+
+static void calib_sort (float *v, int n)
+{
+	/* Insertion sort; there are never more than CALIB_MAX_FRAMES values */
+
+	float x;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		x = v[i];
+		for (j = i; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
+
+static const unsigned short *calib_offset (const struct calib_frame *cf,
+										   int bias, int dark, int flat,
+										   int pedestal)
+{
+	/* Return the frame to be subtracted from an exposure of the given length:
+	 * the bias plus the dark current scaled by exposure length, less the
+	 * pedestal divided by the flat gain (so that the pedestal is unchanged
+	 * by the gain that is applied next), clamped to 0 - 65535.  A dark
+	 * without a bias is used as it is (calib_find only chooses one of the
+	 * right length).  Any of the masters may be absent (-1).  The frame is
+	 * kept and re-used for following exposures of the same length.  Returns
+	 * NULL if out of memory.
+	 */
+
+	const unsigned short *b, *d, *g;
+	size_t i, n = (size_t) cf->h_pix * cf->v_pix;
+	float s;
+	long o;
+
+	if (offset.Valid && offset.gen == calib_gen && offset.bias == bias &&
+		offset.dark == dark && offset.flat == flat &&
+		offset.pedestal == pedestal && offset.exp == cf->exp &&
+		n <= offset.len)
+		return offset.data;
+
+	if (n > offset.len) {
+		free (offset.data);
+		offset.len = 0;
+		if (!(offset.data = malloc (n * sizeof (unsigned short))))
+			return NULL;
+		offset.len = n;
+	}
+	offset.Valid = FALSE;
+
+	b = bias >= 0 ? master[bias].data : NULL;
+	d = dark >= 0 ? master[dark].data : NULL;
+	g = flat >= 0 ? master[flat].data : NULL;
+	s = (d && b && master[dark].cf.exp > 0.0) ? cf->exp / master[dark].cf.exp :
+											   1.0f;
+	for (i = 0; i < n; i++) {
+		if (b && d)
+			o = b[i] + lrintf (((long) d[i] - b[i]) * s);
+		else
+			o = d ? d[i] : b ? b[i] : 0;
+		if (pedestal)
+			o -= g ? (pedestal * CALIB_GAIN_ONE + g[i] / 2) / g[i] : pedestal;
+		offset.data[i] = o < 0 ? 0 : o > USHRT_MAX ? USHRT_MAX : o;
+	}
+
+	offset.bias = bias;
+	offset.dark = dark;
+	offset.flat = flat;
+	offset.pedestal = pedestal;
+	offset.exp = cf->exp;
+	offset.gen = calib_gen;
+	offset.Valid = TRUE;
+	return offset.data;
+}
+
+static void calib_correct (unsigned short *data, const unsigned short *off,
+						   const unsigned short *gain, size_t n)
+{
+	/* Subtract the offset frame from the data, stopping at zero, and multiply
+	 * by the flat gain (if any), rounding and saturating at 65535.  The
+	 * product of two 16-bit values fits in 32 bits, so no precision is lost.
+	 * Eight pixels at a time with NEON or SSE2.
+	 */
+
+	size_t i = 0;
+	unsigned int p;
+
+	#ifdef CALIB_NEON
+	uint16x8_t v, g;
+	uint32x4_t p0, p1;
+
+	if (gain) {
+		for (; i + 8 <= n; i += 8) {
+			v = vqsubq_u16 (vld1q_u16 (data + i), vld1q_u16 (off + i));
+			g = vld1q_u16 (gain + i);
+			p0 = vmull_u16 (vget_low_u16 (v), vget_low_u16 (g));
+			p1 = vmull_u16 (vget_high_u16 (v), vget_high_u16 (g));
+			vst1q_u16 (data + i,
+					   vcombine_u16 (vqrshrn_n_u32 (p0, CALIB_GAIN_SHIFT),
+									 vqrshrn_n_u32 (p1, CALIB_GAIN_SHIFT)));
+		}
+	} else {
+		for (; i + 8 <= n; i += 8)
+			vst1q_u16 (data + i, vqsubq_u16 (vld1q_u16 (data + i),
+											 vld1q_u16 (off + i)));
+	}
+	#elif defined (CALIB_SSE2)
+	__m128i v, g, lo, hi, p0, p1;
+	const __m128i round = _mm_set1_epi32 (1 << (CALIB_GAIN_SHIFT - 1));
+	const __m128i bias32 = _mm_set1_epi32 (0x8000);
+	const __m128i bias16 = _mm_set1_epi16 ((short) 0x8000);
+
+	if (gain) {
+		for (; i + 8 <= n; i += 8) {
+			v = _mm_subs_epu16 (_mm_loadu_si128 ((const __m128i *)(data + i)),
+								_mm_loadu_si128 ((const __m128i *)(off + i)));
+			g = _mm_loadu_si128 ((const __m128i *)(gain + i));
+			lo = _mm_mullo_epi16 (v, g);
+			hi = _mm_mulhi_epu16 (v, g);
+			p0 = _mm_srli_epi32 (_mm_add_epi32 (_mm_unpacklo_epi16 (lo, hi),
+											round), CALIB_GAIN_SHIFT);
+			p1 = _mm_srli_epi32 (_mm_add_epi32 (_mm_unpackhi_epi16 (lo, hi),
+											round), CALIB_GAIN_SHIFT);
+			/* No unsigned 32-to-16 bit pack in SSE2, so offset to signed */
+			v = _mm_packs_epi32 (_mm_sub_epi32 (p0, bias32),
+								 _mm_sub_epi32 (p1, bias32));
+			_mm_storeu_si128 ((__m128i *)(data + i), _mm_xor_si128 (v, bias16));
+		}
+	} else {
+		for (; i + 8 <= n; i += 8)
+			_mm_storeu_si128 ((__m128i *)(data + i),
+				_mm_subs_epu16 (_mm_loadu_si128 ((const __m128i *)(data + i)),
+								_mm_loadu_si128 ((const __m128i *)(off + i))));
+	}
+	#endif
+
+	for (; i < n; i++) {
+		p = data[i] > off[i] ? data[i] - off[i] : 0;
+		if (gain) {
+			p = (p * gain[i] + (1 << (CALIB_GAIN_SHIFT - 1))) >>
+															CALIB_GAIN_SHIFT;
+			p = p > USHRT_MAX ? USHRT_MAX : p;
+		}
+		data[i] = p;
+	}
+}
+
+static int calib_find (int type, const struct calib_frame *cf, int bias)
+{
+	/* Return the library slot of the master of the given type to use for an
+	 * exposure, or -1 if there is none.  Masters must match the exposure size,
+	 * binning and position on the chip, and flats must match the filter.
+	 * For darks, 'bias' is the bias master to be used with the dark: if there
+	 * is none, the dark cannot be scaled and must match the exposure length.
+	 * The dark chosen is the nearest in temperature and exposure length.
+	 */
+
+	const struct calib_master *m;
+	double dt, r, score, best_score = 0.0;
+	int i, best = -1;
+
+	for (i = 0; i < CALIB_MAX_MASTERS; i++) {
+		m = &master[i];
+		if (!m->data || m->cf.type != type || !calib_same_geometry (&m->cf,cf))
+			continue;
+		if (type == CALIB_FLAT && strcmp (m->cf.filter, cf->filter))
+			continue;
+		score = -m->built;  /* Otherwise prefer the newest */
+		if (type == CALIB_DARK) {
+			if ((dt = fabs (m->cf.temp - cf->temp)) > CALIB_TEMP_TOL)
+				continue;
+			if (m->cf.exp > 0.0 && cf->exp > 0.0)
+				r = fabs (log (cf->exp / m->cf.exp));
+			else
+				r = m->cf.exp == cf->exp ? 0.0 : HUGE_VAL;
+			if (bias < 0 && r > log (1.0 + CALIB_EXP_TOL))
+				continue;
+			score = r + dt / CALIB_TEMP_TOL;
+		}
+		if (best < 0 || score < best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+static int calib_slot (const struct calib_frame *cf)
+{
+	/* Return the library slot for a new master: that of the master it
+	 * replaces, if there is one with the same description, otherwise a free
+	 * slot or, failing that, the slot of the oldest master.
+	 */
+
+	const struct calib_master *m;
+	int i, free_slot = -1, oldest = 0;
+
+	for (i = 0; i < CALIB_MAX_MASTERS; i++) {
+		m = &master[i];
+		if (!m->data) {
+			if (free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+		if (m->built < master[oldest].built || !master[oldest].data)
+			oldest = i;
+		if (m->cf.type == cf->type && calib_same_geometry (&m->cf, cf) &&
+			(cf->type == CALIB_BIAS ||
+			 (cf->type == CALIB_FLAT && !strcmp (m->cf.filter, cf->filter)) ||
+			 (cf->type == CALIB_DARK &&
+			  fabs (m->cf.exp - cf->exp) <= CALIB_EXP_TOL * cf->exp &&
+			  fabs (m->cf.temp - cf->temp) <= CALIB_TEMP_TOL / 2.0)))
+			return i;
+	}
+	return free_slot >= 0 ? free_slot : oldest;
+}
+
+static int calib_same_geometry (const struct calib_frame *a,
+								const struct calib_frame *b)
+{
+	/* Return TRUE if the frames cover the same pixels on the chip */
+
+	return a->h_pix == b->h_pix && a->v_pix == b->v_pix &&
+		   a->h_bin == b->h_bin && a->v_bin == b->v_bin &&
+		   a->h_top_l == b->h_top_l && a->v_top_l == b->v_top_l;
+}
+
+static int calib_same_stack (const struct calib_frame *cf)
+{
+	/* Return TRUE if the frame can be combined with those already stacked.
+	 * Flats may differ in exposure length (for twilight flats, say) since
+	 * each is normalised.
+	 */
+
+	if (cf->type != stack_cf.type || !calib_same_geometry (cf, &stack_cf))
+		return FALSE;
+	switch (cf->type) {
+		case CALIB_DARK:
+			return fabs (cf->exp - stack_cf.exp) <= CALIB_EXP_TOL * cf->exp &&
+				   fabs (cf->temp - stack_cf.temp) <= CALIB_TEMP_TOL / 2.0;
+		case CALIB_FLAT:
+			return !strcmp (cf->filter, stack_cf.filter);
+		default:
+			return TRUE;
+	}
+}
+
+static int calib_save (int slot)
+{
+	/* Save a master to its file in the library folder.  It is written to a
+	 * temporary file that is then renamed, so a master is never left half
+	 * written.  Returns TRUE on success or FALSE with errno set.
+	 */
+
+	struct calib_head head;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	size_t n;
+	FILE *fp;
+	int err;
+
+	memset (&head, 0, sizeof (head));
+	memcpy (head.magic, CALIB_MAGIC, sizeof (head.magic));
+	head.cf = master[slot].cf;
+	head.nframes = master[slot].nframes;
+	head.built = master[slot].built;
+	n = (size_t) head.cf.h_pix * head.cf.v_pix;
+
+	calib_path (path, slot, "");
+	calib_path (tmp, slot, ".tmp");
+	if (!(fp = fopen (tmp, "wb")))
+		return FALSE;
+	if (fwrite (&head, sizeof (head), 1, fp) != 1 ||
+		fwrite (master[slot].data, sizeof (unsigned short), n, fp) != n) {
+		err = errno;
+		fclose (fp);
+		unlink (tmp);
+		errno = err;
+		return FALSE;
+	}
+	if (fclose (fp) || rename (tmp, path) < 0) {
+		err = errno;
+		unlink (tmp);
+		errno = err;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void calib_path (char *path, int slot, const char *suffix)
+{
+	/* Make the file name of a master frame, which holds PATH_MAX characters */
+
+	snprintf (path, PATH_MAX, "%s/master_%02d.cal%s", calib_dir, slot, suffix);
+}
@@ -0,0 +1,54 @@
+/******************************************************************************/
+/*                   HEADER FILE FOR CCD CALIBRATION LIBRARY                  */
+/*                                                                            */
+/* Header file for the master bias, dark and flat frame library.              */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef GOQAT_CALIB_H
+#define GOQAT_CALIB_H
+
+#define CALIB_BIAS 1                      /* Frame types, also used as flags  */
+#define CALIB_DARK 2                      /*  for the calibrations applied    */
+#define CALIB_FLAT 4                      /*  to an image                     */
+
+#define CALIB_MIN_FRAMES 3                /* Fewest frames for a master       */
+#define CALIB_MAX_FRAMES 16               /* Most frames for a master         */
+#define CALIB_PEDESTAL 100                /* Added to calibrated data (ADU)   */
+#define CALIB_TEMP_TOL 2.0                /* Max. dark temperature error (C)  */
+
+struct calib_frame {                      /* Describes an exposure            */
+	int type;                             /* CALIB_BIAS/DARK/FLAT, 0 if image */
+	int h_pix, v_pix;                     /* Size of the frame                */
+	int h_bin, v_bin;                     /* Binning                          */
+	int h_top_l, v_top_l;                 /* Position on the chip             */
+	double exp;                           /* Exposure length (s)              */
+	double temp;                          /* CCD temperature (C)              */
+	char filter[32];                      /* Filter name                      */
+};
+
+extern int calib_open (const char *dir);
+extern void calib_close (void);
+extern int calib_add_frame (const struct calib_frame *cf,
+							const unsigned short *data,
+							struct calib_frame *done);
+extern int calib_flush (struct calib_frame *done);
+extern int calib_pending (void);
+extern int calib_apply (const struct calib_frame *cf, unsigned short *data);
+
+#endif /* GOQAT_CALIB_H */
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -45,10 +46,53 @@
 #include "sx.h"
 #endif
 
+#include "calib.h"
+
 #define CCD_BLACK     0                     /* Black level */
 #define CCD_WHITE 65535                     /* White level */
 
+#define HFD_SPLIT        8   /* Sub-pixels per side of pixel for HFD profile  */
+#define HFD_BINS        20   /* Radial profile bins per pixel                 */
+#define HFD_MAX_STARS    8   /* Max. stars measured in each image             */
+#define HFD_MIN_PIX      3   /* Min. pixels above background in a star        */
+#define HFD_MIN_PEAK   0.1   /* Min. peak of a star relative to the brightest */
+#define HFD_MAX_THREADS  4   /* Max. threads for measuring stars              */
+
+struct hfd_star {            /* Star measured for HFD                         */
+	gint h, v;               /* Pixel nearest the centre-of-weight            */
+	gint r;                  /* Half-width of box in which star is measured   */
+	gdouble peak;            /* Peak value above background                   */
+	gdouble mean_h, mean_v;  /* Centre-of-weight                              */
+	gdouble flux;            /* Total flux above background                   */
+	gdouble hfd, fwhm;       /* Half-flux diameter and FWHM                   */
+	gboolean OK;             /* TRUE if star has been measured                */
+};
+
+struct hfd_blob {            /* Group of connected pixels above background    */
+	gdouble flux;            /* Total flux above background...                */
+	gdouble sumh, sumv;      /*  ...and flux-weighted sums of coordinates     */
+	gdouble peak;            /* Peak value above background                   */
+	gint npix;               /* Number of pixels                              */
+};
+
+struct hfd_work {            /* Stars measured by one thread                  */
+	struct hfd_star *stars;  /* Stars...                                      */
+	gint first, step, num;   /*  ...first, interval and total number          */
+	gdouble bg;              /* Background level                              */
+	gdouble *dx2, *dy2;      /* Squared sub-pixel offsets from C-of-W         */
+	gdouble *prof;           /* Radial profile                                */
+	gint len_d, len_prof;    /* Allocated lengths of buffers                  */
+};
+
 static struct cam_img ccd_cam_obj, *ccd;
+static struct hfd_work hfd_work[HFD_MAX_THREADS]; /* Buffers kept for re-use  */
+static gdouble *hfd_flux_h = NULL; /* Flux in each column for HFD plot        */
+static gint hfd_len_h = 0;         /* Allocated length of hfd_flux_h          */
+static gint *hfd_lab = NULL;       /* Label of each pixel when finding stars  */
+static gint *hfd_parent = NULL;    /* Parent of each label                    */
+static gint hfd_len_lab = 0;       /* Allocated length of label buffers       */
+static struct hfd_blob *hfd_blob = NULL; /* Groups of pixels                  */
+static gint hfd_len_blob = 0;      /* Allocated length of hfd_blob            */
 	
 /******************************************************************************/
 /*                           MISCELLANEOUS FUNCTIONS                          */
@@ -67,14 +111,20 @@ gboolean ccdcam_image_ready (void);
 gboolean ccdcam_download_image (void);
 gboolean ccdcam_process_image (void);
 gboolean ccdcam_debayer (void);
+static void ccdcam_calibrate (void);
+void ccdcam_calib_flush (void);
+static gboolean ccdcam_calib_open (void);
+static void ccdcam_calib_done (gint n, struct calib_frame *cf);
 gboolean ccdcam_set_temperature (gboolean *AtTemperature);
 void ccdcam_set_fast_readspeed (gboolean Set);
 gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, gint box,
 						     struct exposure_data *exd, gdouble *hfd);
-static gdouble HFD_row_flux (gushort row[], gushort npix, gushort pix_split,
-							 gdouble pix_h, gdouble pix_v, 
-							 gdouble meanh, gdouble meanv, 
-                             gdouble hfd, gdouble bg);
+static gint HFD_find_stars (struct hfd_star *stars, gdouble bg, gint box,
+							gdouble *flux_h);
+static gint HFD_find_root (gint l);
+static gpointer HFD_measure_stars (gpointer data);
+static void HFD_measure_star (struct hfd_work *w, struct hfd_star *s);
+static gint HFD_compare (gconstpointer a, gconstpointer b);
 gboolean ccdcam_plot_temperatures (void);
 gboolean ccdcam_get_status (void);
 static int (*camera_get_cameras) (const char *serial[], const char *desc[], 
@@ -144,6 +194,7 @@ void ccdcam_init (void)
 	ccd->FileSaved = TRUE;
 	ccd->Display = TRUE;
 	ccd->Error = FALSE;
+	ccd->calstat = 0;
 	
 	if (FirstPass) {
 		/* Initialise some values for the first pass through this routine, but
@@ -158,6 +209,7 @@ void ccdcam_init (void)
 		ccd->FastFocus = FALSE;
 		ccd->AutoSave = FALSE;
 		ccd->SavePeriodic = FALSE;
+		ccd->Calibrate = FALSE;
 		
 		FirstPass = FALSE;
 	}
@@ -426,6 +478,8 @@ gboolean ccdcam_close (void)
 	if (!ccd->Open)  /* return if not opened */
 		return TRUE;
 	
+	ccdcam_calib_flush ();
+	
 	switch (ccd->device) {
 		#ifdef HAVE_QSI
 		case QSI:
@@ -707,6 +761,14 @@ gboolean ccdcam_process_image (void)
 {
 	/* Do some processing on the image data and tidy up after the exposure */
 	
+	/* Calibrate the data with the master frames, or stack them for a new
+	 * master if this is a bias, dark or flat exposure.
+	 */
+	
+	ccd->calstat = 0;
+	if (ccd->Calibrate)
+		ccdcam_calibrate ();
+	
 	image_get_stats (ccd, C_GREY);
 	
 	/* Optionally embed the image in the full chip area */
@@ -759,89 +821,167 @@ gboolean ccdcam_process_image (void)
 
 gboolean ccdcam_debayer (void)
 {
-	/* Debayer the data */
+	/* Debayer the data.  If the image is embedded in the full chip area, the
+	 * debayered image is embedded in the same way rather than debayering the
+	 * full frame a second time; the rest of the frame is set to the minimum
+	 * value in the exposed part, as for the raw data (see image_embed_data).
+	 * Debayering is only done for unbinned images, so there is no expansion.
+	 */
 	
+	gushort min, *dst;
 	gint tile;
+	guint i, row, left, right, width;
 	
 	if (!ccd->r161)
 		return FALSE;
-	if (ccd->FullFrame && !ccd->ff161)
+	if (ccd->FullFrame && !ccd->ff163)
 		return FALSE;
 	
 	tile = debayer_get_tile (ccd->bayer_pattern, ccd->exd.h_top_l, 
 							 ccd->exd.v_top_l);
 	
-	switch (ccd->imdisp.debayer) {
-		case DB_SIMP:
-			dc1394_bayer_Simple_uint16 (
-			                            ccd->r161, ccd->db163, 
-										ccd->exd.h_pix, ccd->exd.v_pix, 
-										tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_Simple_uint16 (
-										ccd->ff161, ccd->ff163, 
-										ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-										tile, 16);
-			break;
-		case DB_NEAR:
-			dc1394_bayer_NearestNeighbor_uint16 (
-			                            ccd->r161, ccd->db163, 
-										ccd->exd.h_pix, ccd->exd.v_pix,
-										tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_NearestNeighbor_uint16 (
-										ccd->ff161, ccd->ff163, 
-										ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-									    tile, 16);
-			break;
-		case DB_BILIN:
-			dc1394_bayer_Bilinear_uint16 (
-			                            ccd->r161, ccd->db163,
-										ccd->exd.h_pix, ccd->exd.v_pix, 
-										tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_Bilinear_uint16 (
-										ccd->ff161, ccd->ff163, 
-									    ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-									    tile, 16);
-			break;
-		case DB_QUAL:
-			dc1394_bayer_HQLinear_uint16 (
-			                            ccd->r161, ccd->db163, 
-										ccd->exd.h_pix, ccd->exd.v_pix, 
-										tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_HQLinear_uint16 (
-										ccd->ff161, ccd->ff163, 
-										ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-										tile, 16);
-			break;
-		case DB_DOWN:
-			dc1394_bayer_Downsample_uint16 (
-			                            ccd->r161, ccd->db163, 
-										ccd->exd.h_pix, ccd->exd.v_pix, 
-										tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_Downsample_uint16 (
-										ccd->ff161, ccd->ff163, 
-									    ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-									    tile, 16);
-			break;
-		case DB_GRADS:
-			dc1394_bayer_VNG_uint16 (
-			                            ccd->r161, ccd->db163, 
-									    ccd->exd.h_pix, ccd->exd.v_pix, 
-									    tile, 16);
-		    if (ccd->FullFrame)
-				dc1394_bayer_VNG_uint16 (
-										ccd->ff161, ccd->ff163, 
-									    ccd->cam_cap.max_h, ccd->cam_cap.max_v,
-										tile, 16);
-			break;
+	if (debayer_image (ccd->imdisp.debayer, ccd->r161, ccd->db163,
+					   ccd->exd.h_pix, ccd->exd.v_pix, tile, 16))
+		return FALSE;
+	
+	/* Each row of the full frame is filled in one pass: the debayered row
+	 * is copied in and only the pixels either side of it (or the whole row,
+	 * outside the exposed area) are set to the minimum.
+	 */
+	
+	if (ccd->FullFrame) {
+		min = ccd->img.min[GREY].val;
+		left = 3 * ccd->exd.h_top_l;
+		right = 3 * (ccd->exd.h_top_l + ccd->exd.h_pix);
+		width = 3 * ccd->cam_cap.max_h;
+		dst = ccd->ff163;
+		for (row = 0; row < ccd->cam_cap.max_v; row++, dst += width) {
+			if (row < ccd->exd.v_top_l || 
+				row >= ccd->exd.v_top_l + ccd->exd.v_pix) {
+				for (i = 0; i < width; i++)
+					dst[i] = min;
+				continue;
+			}
+			for (i = 0; i < left; i++)
+				dst[i] = min;
+			memcpy (dst + left, ccd->db163 + 3 * (row - ccd->exd.v_top_l) *
+					ccd->exd.h_pix, 3 * ccd->exd.h_pix * sizeof (gushort));
+			for (i = right; i < width; i++)
+				dst[i] = min;
+		}
 	}
 	return TRUE;
 }
 
+static void ccdcam_calibrate (void)
+{
+	/* Add a bias, dark or flat frame to the stack of frames for its master,
+	 * or calibrate any other exposure with the best matching masters in the
+	 * library.  Any frames still stacked are combined before an exposure is
+	 * calibrated, so that it can use the new master.  Darks are matched by
+	 * the CCD temperature last read from the camera.
+	 */
+	
+	struct calib_frame cf, done;
+	gint n;
+	
+	if (!ccdcam_calib_open ())
+		return;
+	
+	memset (&cf, 0, sizeof (struct calib_frame));
+	if (!strcmp (ccd->exd.ExpType, "BIAS"))
+		cf.type = CALIB_BIAS;
+	else if (!strcmp (ccd->exd.ExpType, "DARK"))
+		cf.type = CALIB_DARK;
+	else if (!strcmp (ccd->exd.ExpType, "FLAT"))
+		cf.type = CALIB_FLAT;
+	cf.h_pix = ccd->exd.h_pix;
+	cf.v_pix = ccd->exd.v_pix;
+	cf.h_bin = ccd->exd.h_bin;
+	cf.v_bin = ccd->exd.v_bin;
+	cf.h_top_l = ccd->exd.h_top_l;
+	cf.v_top_l = ccd->exd.v_top_l;
+	cf.exp = ccd->exd.act_len;
+	cf.temp = ccd->state.c_ccd;
+	g_strlcpy (cf.filter, ccd->exd.filter ? ccd->exd.filter : "", 
+			   sizeof (cf.filter));
+	
+	if (cf.type) {
+		n = calib_add_frame (&cf, ccd->r161, &done);
+		ccdcam_calib_done (n, &done);
+		if (calib_pending ())
+			L_print ("Stacked %s frame %d for master\n", ccd->exd.ExpType,
+					 calib_pending ());
+	} else {
+		ccdcam_calib_flush ();
+		if ((n = calib_apply (&cf, ccd->r161)) < 0)
+			L_print ("{r}Error calibrating image: %s\n", g_strerror (errno));
+		else if (!n)
+			L_print ("{o}No master frames match this image - not "
+					 "calibrated\n");
+		else
+			ccd->calstat = n;
+	}
+}
+
+void ccdcam_calib_flush (void)
+{
+	/* Combine any frames still stacked into a master */
+	
+	struct calib_frame done;
+	
+	if (calib_pending ())
+		ccdcam_calib_done (calib_flush (&done), &done);
+}
+
+static gboolean ccdcam_calib_open (void)
+{
+	/* Open the calibration library in the 'calib' folder under PrivatePath,
+	 * if not already open.
+	 */
+	
+	static gboolean Open = FALSE;
+	gchar *dir;
+	
+	if (Open)
+		return TRUE;
+	
+	dir = g_build_filename (PrivatePath, "calib", NULL);
+	if (!(Open = calib_open (dir)))
+		L_print ("{r}Unable to open calibration library %s: %s\n", dir, 
+				 g_strerror (errno));
+	g_free (dir);
+	return Open;
+}
+
+static void ccdcam_calib_done (gint n, struct calib_frame *cf)
+{
+	/* Report on a stack of n frames that has been combined into a master */
+	
+	const gchar *type;
+	
+	if (!n)
+		return;
+	if (n < 0) {
+		L_print ("{r}Error making master frame: %s\n", g_strerror (errno));
+		return;
+	}
+	
+	type = cf->type == CALIB_BIAS ? "bias" : cf->type == CALIB_DARK ? 
+														  "dark" : "flat";
+	if (n < CALIB_MIN_FRAMES)
+		L_print ("{o}Only %d %s frame(s) stacked; at least %d are needed for "
+				 "a master - discarded\n", n, type, CALIB_MIN_FRAMES);
+	else if (cf->type == CALIB_DARK)
+		L_print ("{b}Made master dark from %d frames (%.3fs at %.1fC)\n", n,
+				 cf->exp, cf->temp);
+	else if (cf->type == CALIB_FLAT)
+		L_print ("{b}Made master flat from %d frames (filter '%s')\n", n,
+				 cf->filter);
+	else
+		L_print ("{b}Made master bias from %d frames\n", n);
+}
+
 gboolean ccdcam_set_temperature (gboolean *AtTemperature)
 {
 	/* If the requested temperature is greater than the current heatsink
@@ -932,15 +1072,20 @@ void ccdcam_set_fast_readspeed (gboolean Set)
 gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, gint box, 
 						     struct exposure_data *exd, gdouble *hfd)
 {
-	gushort h, v, pix_h, pix_v;
-	gushort npix, pix_split, niter;
-	gint tick;
-	gdouble *flux_h, *flux_v, totflux, bg, val;
-	gdouble hfd_old, hfd_max, hfd_u, hfd_l;
-	static gdouble hfd_plot = 0.0;
-	gdouble f, flux = 0.0;
+	/* Measure the half-flux diameter of the stars in the image.  Up to
+	 * HFD_MAX_STARS of the brightest stars are found, and measured in 
+	 * parallel; the HFD returned is the median of their HFDs, so that one
+	 * odd star (e.g. saturated, or a double) doesn't upset the result.  The
+	 * next image is centred on the brightest star.
+	 */
 	
-	gushort MAX_HFD_ITER = 100;
+	struct hfd_star stars[HFD_MAX_STARS], *bright;
+	GThread *thread[HFD_MAX_THREADS];
+	gint h, i, n, t, nstars, nthreads, tick;
+	glong ncpus;
+	gdouble hfds[HFD_MAX_STARS], fwhms[HFD_MAX_STARS], bg, fwhm;
+	static gdouble hfd_plot = 0.0;
+	gdouble flux = 0.0;
 	
 	/* If the requested image area is not already a subset of the full chip,
 	 * set the selected imaging area to be a box centred on the brightest
@@ -986,99 +1131,73 @@ gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, gint box,
 		return TRUE;
 	}
 	
-    /* Calculate centre-of-weight of image.  Note that this is 0-based, and that
-	 * 0 means C-of-W is at the centre of the zeroth pixel, 1 is at the centre
-	 * of the first pixel (i.e. the second pixel in the row) etc.  Note also
-	 * that the calculated value is relative to (0, 0) at the top left corner
-	 * of the analysed image (which may be a subset of the full chip area).
+	/* Find the stars, with the background set to 4 sigma above the mode.
+	 * The flux in each column is summed at the same time for plotting.
 	 */
-  
-    flux_h = (double *) g_malloc0 (ccd->exd.h_pix * sizeof (double));
-    flux_v = (double *) g_malloc0 (ccd->exd.v_pix * sizeof (double));
-    totflux = 0;        /* Set background to 4 sigma above mode */
-    bg = ccd->img.mode[GREY].peakbin + 4.0 * ccd->img.stdev[GREY].val;
-    for (v = 0; v < ccd->exd.v_pix; v++)
-		for (h = 0; h < ccd->exd.h_pix; h++) {
-			val = MAX (ccd->r161[v * ccd->exd.h_pix + h] - bg, 0);
-			flux_h[h] += val;
-			flux_v[v] += val;
-			totflux += val;
-		}
-	
-	ccd->img.mean[GREY].h = 0;	
-	for (h = 0; h < ccd->exd.h_pix; h++)
-		ccd->img.mean[GREY].h += h * flux_h[h];
-	ccd->img.mean[GREY].h /= totflux;  /* Mean h position */
-	ccd->img.mean[GREY].v = 0;	
-	for (v = 1; v < ccd->exd.v_pix; v++)
-		ccd->img.mean[GREY].v += v * flux_v[v];
-	ccd->img.mean[GREY].v /= totflux;  /* Mean v position */
 	
-	if (isnan (ccd->img.mean[GREY].h) || isnan (ccd->img.mean[GREY].v)) {
-		L_print ("{o}Can't find a star for focusing!\n");
-		g_free (flux_h);
-		g_free (flux_v);
-		return FALSE;
+	if (Plot && hfd_len_h < ccd->exd.h_pix) {
+		hfd_len_h = ccd->exd.h_pix;
+		hfd_flux_h = (gdouble *) g_realloc (hfd_flux_h, 
+		                                    hfd_len_h * sizeof (gdouble));
 	}
+	bg = ccd->img.mode[GREY].peakbin + 4.0 * ccd->img.stdev[GREY].val;
+	nstars = HFD_find_stars (stars, bg, MAX (box / ccd->exd.h_bin, 2), 
+							 Plot ? hfd_flux_h : NULL);
 	
-	/* Find half-flux diameter via binary search */
+	/* Share the stars between the threads.  The first share is done in this
+	 * thread, and the others in their own threads if they can be created.
+	 */
 	
-	hfd_max = 2 * MIN (MIN (ccd->exd.h_pix - ccd->img.mean[GREY].h, 
-							ccd->img.mean[GREY].h),
-	                   MIN (ccd->exd.v_pix - ccd->img.mean[GREY].v, 
-							ccd->img.mean[GREY].v));
-	*hfd = hfd_max / 2;  /* Starting value */
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+	nthreads = MAX (MIN (nstars, MIN (HFD_MAX_THREADS, ncpus)), 1);
+	for (t = 0; t < nthreads; t++) {
+		hfd_work[t].stars = stars;
+		hfd_work[t].first = t;
+		hfd_work[t].step = nthreads;
+		hfd_work[t].num = nstars;
+		hfd_work[t].bg = bg;
+		thread[t] = t ? g_thread_create (HFD_measure_stars, &hfd_work[t], 
+										 TRUE, NULL) : NULL;
+	}
+	HFD_measure_stars (&hfd_work[0]);
+	for (t = 1; t < nthreads; t++) {
+		if (thread[t])
+			g_thread_join (thread[t]);
+		else
+			HFD_measure_stars (&hfd_work[t]);
+	}
 	
-	hfd_old = 0.0;    /* Previous guess */
-	hfd_u = hfd_max;  /* Upper limit    */
-	hfd_l = 0.0;      /* Lower limit    */
-	niter = 0;
-	while (ABS (*hfd - hfd_old) / *hfd > 0.001) {
-		
-		/* For a given row of 'npix' pixels, with pixels of size 'pix_size' 
-		 * units on a side, and starting image coordinate of 'pix_h', 'pix_v', 
-		 * return the flux in this row bounded by a circle of diameter hfd 
-		 * centred at ('meanh', 'meanv').  Here, pix starts at (0,0) in top left
-		 * corner of top left pixel.  Repeat this for each row of data 
-		 * containing the hfd circle, and sum total fluxes.
-		 */
-		
-		npix = (gint) MIN (*hfd + 10, hfd_max); /* Allow space surrounding hfd*/
-		if (npix % 2)                     /* Make sure even no. pixels in row */
-			npix--;
-	
-		pix_h = (gint) ccd->img.mean[GREY].h - npix / 2;
-		for (pix_v = (gint) ccd->img.mean[GREY].v - npix / 2, flux = 0.0; 
-			 pix_v < (gint) ccd->img.mean[GREY].v + npix / 2; pix_v++) {
-	
-			/* Divide pixel into 100 each way if hfd <= 10.0 */
-		    pix_split = *hfd > 10.0 ? 1 : 100;
-			f = HFD_row_flux (ccd->r161+ccd->exd.h_pix*pix_v+pix_h, npix,
-							  pix_split, (gdouble) pix_h, (gdouble) pix_v, 
-							  (gdouble) ccd->img.mean[GREY].h, 
-				              (gdouble) ccd->img.mean[GREY].v, 
-							  *hfd, bg);
-			flux += f;
-		}
-		hfd_old = *hfd;
-		if (flux > 0.5 * totflux) {
-			hfd_u = *hfd;
-			*hfd = (*hfd + hfd_l) / 2.0;
-		} else {
-			hfd_l = *hfd;
-			*hfd = (*hfd + hfd_u) / 2.0;
+	/* Take the median of the HFD and FWHM values */
+	
+	for (i = 0, n = 0, bright = NULL; i < nstars; i++) {
+		if (stars[i].OK) {
+			hfds[n] = stars[i].hfd;
+			fwhms[n++] = stars[i].fwhm;
+			if (!bright)
+				bright = &stars[i];
 		}
-		if (niter++ == MAX_HFD_ITER) {
-			L_print ("{r}Maximum iterations reached in HFD calculation... "
-					 "Giving up!\n");
-			g_free (flux_h);
-			g_free (flux_v);
-			return FALSE;
-		}			
 	}
-	L_print ("HFD flux: %.4f, total flux: %.4f, ratio: %.4f, HFD: %.4f, "
-			 "position: %d\n", flux, totflux, flux / totflux, *hfd,
-			 exd->focus_pos);
+	if (!n) {
+		L_print ("{o}Can't find a star for focusing!\n");
+		return FALSE;
+	}
+	qsort (hfds, n, sizeof (gdouble), HFD_compare);
+	qsort (fwhms, n, sizeof (gdouble), HFD_compare);
+	*hfd = n % 2 ? hfds[n / 2] : (hfds[n / 2 - 1] + hfds[n / 2]) / 2.0;
+	fwhm = n % 2 ? fwhms[n / 2] : (fwhms[n / 2 - 1] + fwhms[n / 2]) / 2.0;
+	
+	/* Centre-of-weight of the brightest star.  Note that this is 0-based, and
+	 * that 0 means C-of-W is at the centre of the zeroth pixel, 1 is at the 
+	 * centre of the first pixel (i.e. the second pixel in the row) etc.  Note
+	 * also that the value is relative to (0, 0) at the top left corner of the
+	 * analysed image (which may be a subset of the full chip area).
+	 */
+	
+	ccd->img.mean[GREY].h = bright->mean_h;
+	ccd->img.mean[GREY].v = bright->mean_v;
+	
+	L_print ("HFD: %.4f, FWHM: %.4f, stars: %d, flux: %.4f, position: %d\n",
+			 *hfd, fwhm, n, bright->flux, exd->focus_pos);
 	
 	/* Plot graphs and re-scale if necessary */
 	
@@ -1087,8 +1206,8 @@ gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, gint box,
 		flux = 0.0;
 		Grace_ErasePlot (0, 0);
 		for (h = 0; h < ccd->exd.h_pix; h++) {
-			flux = MAX (flux, flux_h[h]);
-			Grace_PlotPoints (0, 0, h, flux_h[h]);
+			flux = MAX (flux, hfd_flux_h[h]);
+			Grace_PlotPoints (0, 0, h, hfd_flux_h[h]);
 		}
 		Grace_SetYAxis (0, -flux / 10.0, flux * 1.1);
 		
@@ -1120,72 +1239,285 @@ gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, gint box,
 			             (ccd->img.mean[GREY].v - ccd->exd.v_pix / 2) * 
 						  ccd->exd.v_bin), 1, ccd->cam_cap.max_v);
 	
-	g_free (flux_h);
-	g_free (flux_v);
 	return TRUE;
 }
 
-static gdouble HFD_row_flux (gushort row[], gushort npix, gushort pix_split,
-							 gdouble pix_h, gdouble pix_v, 
-							 gdouble meanh, gdouble meanv, 
-                             gdouble hfd, gdouble bg)
+static gint HFD_find_stars (struct hfd_star *stars, gdouble bg, gint box,
+							gdouble *flux_h)
 {
-	/* Return the total flux lying within the circle of given hfd, for the
-	 * given row of pixels.
+	/* Find the brightest stars in the image, as groups of connected pixels
+	 * above the background (so that a saturated or defocused star, which 
+	 * may have many local maxima, counts as one star).  The groups are found
+	 * by labelling the pixels in one pass, merging the labels of connected
+	 * groups with a union-find, and then collecting the flux and centre-of-
+	 * weight of each group in a second pass.  Groups of fewer than 
+	 * HFD_MIN_PIX pixels, or fainter than HFD_MIN_PEAK of the brightest, are
+	 * ignored.  Each star is measured in a box of half-width 'box' pixels 
+	 * about its centre-of-weight, or less if it is close to the edge of the
+	 * image or to another star.  If flux_h is not NULL, the flux in each 
+	 * column of the image is returned in it.  Returns the number of stars.
 	 */
 	
-	gushort corners;
-	gushort i, h, v;
-	gdouble hfd2, flux;
-	gdouble pix_h_orig, pix_v_orig;
-	 
-	/* Check where corners of each pixel lie relative to HFD circle... 
-	 * Note that relative to the top left corner of the pixel, meanh and meanv
-	 * are actually shifted by 0.5 pixels.  (In other words, the top left corner
-	 * of the top left pixel (pixel 0) lies at (0, 0), but meanh = 0 and 
-	 * meanv = 0 means that the centre-of-weight lies at the middle of that 
-	 * pixel, i.e. at (0.5, 0.5)).  A value of 0.25 of the total pixel (or sub-
-	 * pixel) flux is assigned for each pixel corner that lies within the HFD
-	 * circle - this seems to give accurate results even for a 'star' of just
-	 * one pixel.
-	 */	 
-	 
-	hfd2 = hfd * hfd / 4.0;
-	flux = 0.0;
-	pix_v_orig = pix_v;
-	pix_h_orig = pix_h - 1;
-	for (i = 0; i < npix; i++) {
-		pix_h_orig++;
-	 	for (v = 0; v < pix_split; v++) {
-			pix_v = pix_v_orig + (gdouble) v / pix_split;
-	 		for (h = 0; h < pix_split; h++) {
-				corners = 0;
-				pix_h = pix_h_orig + (gdouble) h / pix_split;
-	 			/* Top left corner */
-	 			if (pow (pix_h - (meanh + 0.5), 2) + 
-	 	    		pow (pix_v - (meanv + 0.5), 2) <= hfd2)
-	 				corners++;
-	 			/* Top right corner */
-	 			if (pow ((pix_h + 1.0 / pix_split) - (meanh + 0.5), 2) + 
-	 	    		pow (pix_v - (meanv + 0.5), 2) <= hfd2)
-	 				corners++;
-	 			/* Bottom left corner */
-	 			if (pow (pix_h - (meanh + 0.5), 2) + 
-	 	    		pow ((pix_v + 1.0 / pix_split) - (meanv + 0.5), 2) < hfd2) 
-	 				corners++;
-	 			/* Bottom right corner */
-	 			if (pow ((pix_h + 1.0 / pix_split) - (meanh + 0.5), 2) + 
-	 	   		    pow ((pix_v + 1.0 / pix_split) - (meanv + 0.5), 2) < hfd2)
-	 				corners++;
-				
-				flux += corners / 4.0 * MAX (row[i] - bg, 0);
-	 		}
-	 	}
+	struct hfd_blob *blob;
+	gushort *p;
+	gint h, v, i, k, l, n, r, d2, nlab, nblob, nstars;
+	gint h_pix = ccd->exd.h_pix, v_pix = ccd->exd.v_pix;
+	gint nb[4];
+	gdouble val;
+	
+	if (flux_h)
+		memset (flux_h, 0, h_pix * sizeof (gdouble));
+	
+	if (hfd_len_lab < h_pix * v_pix) {
+		hfd_len_lab = h_pix * v_pix;
+		hfd_lab = (gint *) g_realloc (hfd_lab, hfd_len_lab * sizeof (gint));
+		hfd_parent = (gint *) g_realloc (hfd_parent, 
+										 hfd_len_lab * sizeof (gint));
 	}
-		
-	/* Scale value according to pix_split squared */
 	
-	return flux / pow (pix_split, 2);
+	/* Label the pixels above the background, joining each to any labelled
+	 * neighbours to the left and in the row above.
+	 */
+	
+	nlab = 0;
+	for (v = 0, i = 0; v < v_pix; v++) {
+		p = ccd->r161 + v * h_pix;
+		for (h = 0; h < h_pix; h++, i++) {
+			if ((val = p[h] - bg) <= 0.0) {
+				hfd_lab[i] = -1;
+				continue;
+			}
+			if (flux_h)
+				flux_h[h] += val;
+			nb[0] = h > 0 ? hfd_lab[i - 1] : -1;
+			nb[1] = h > 0 && v > 0 ? hfd_lab[i - h_pix - 1] : -1;
+			nb[2] = v > 0 ? hfd_lab[i - h_pix] : -1;
+			nb[3] = h < h_pix - 1 && v > 0 ? hfd_lab[i - h_pix + 1] : -1;
+			for (k = 0, l = -1; k < 4; k++) {
+				if (nb[k] < 0)
+					continue;
+				n = HFD_find_root (nb[k]);
+				if (l < 0)
+					l = n;
+				else if (n != l) {
+					hfd_parent[MAX (n, l)] = MIN (n, l);
+					l = MIN (n, l);
+				}
+			}
+			if (l < 0) {
+				l = nlab++;
+				hfd_parent[l] = l;
+			}
+			hfd_lab[i] = l;
+		}
+	}
+	
+	/* Number the groups, and collect the flux and centre-of-weight of each.
+	 * The root of a group always has the lowest label in it, so is numbered
+	 * (as a negative value) before the other labels in the group.
+	 */
+	
+	for (k = 0, nblob = 0; k < nlab; k++) {
+		for (l = k; hfd_parent[l] >= 0 && hfd_parent[l] != l; 
+			 l = hfd_parent[l])
+			;
+		hfd_parent[k] = hfd_parent[l] < 0 ? hfd_parent[l] : -(++nblob);
+	}
+	if (hfd_len_blob < nblob) {
+		hfd_len_blob = nblob;
+		hfd_blob = (struct hfd_blob *) g_realloc (hfd_blob, 
+										  hfd_len_blob * sizeof (*hfd_blob));
+	}
+	memset (hfd_blob, 0, nblob * sizeof (*hfd_blob));
+	for (v = 0, i = 0; v < v_pix; v++) {
+		p = ccd->r161 + v * h_pix;
+		for (h = 0; h < h_pix; h++, i++) {
+			if (hfd_lab[i] < 0)
+				continue;
+			blob = &hfd_blob[-hfd_parent[hfd_lab[i]] - 1];
+			val = p[h] - bg;
+			blob->flux += val;
+			blob->sumh += val * h;
+			blob->sumv += val * v;
+			blob->peak = MAX (blob->peak, val);
+			blob->npix++;
+		}
+	}
+	
+	/* Select the brightest groups, in order of brightness */
+	
+	for (k = 0, nstars = 0; k < nblob; k++) {
+		blob = &hfd_blob[k];
+		if (blob->npix < HFD_MIN_PIX)
+			continue;
+		if (nstars == HFD_MAX_STARS && blob->peak <= stars[nstars - 1].peak)
+			continue;
+		for (i = MIN (nstars, HFD_MAX_STARS - 1); 
+			 i > 0 && stars[i - 1].peak < blob->peak; i--)
+			stars[i] = stars[i - 1];
+		stars[i].h = (gint) rint (blob->sumh / blob->flux);
+		stars[i].v = (gint) rint (blob->sumv / blob->flux);
+		stars[i].peak = blob->peak;
+		nstars = MIN (nstars + 1, HFD_MAX_STARS);
+	}
+	for (k = 1; k < nstars; k++)
+		if (stars[k].peak < HFD_MIN_PEAK * stars[0].peak)
+			break;
+	nstars = nstars ? k : 0;
+	
+	/* Set the size of the box for each star */
+	
+	for (i = 0; i < nstars; i++) {
+		r = MIN (MIN (box, MIN (stars[i].h, h_pix - 1 - stars[i].h)),
+				 MIN (stars[i].v, v_pix - 1 - stars[i].v));
+		for (k = 0; k < nstars; k++) {
+			if (k == i)
+				continue;
+			d2 = (stars[i].h - stars[k].h) * (stars[i].h - stars[k].h) + 
+				 (stars[i].v - stars[k].v) * (stars[i].v - stars[k].v);
+			r = MIN (r, (gint) (sqrt (d2) / 2.0));
+		}
+		stars[i].r = r;
+		stars[i].OK = FALSE;
+	}
+	
+	return nstars;
+}
+
+static gint HFD_find_root (gint l)
+{
+	/* Return the root label of the group containing label l, pointing the
+	 * labels on the way directly at the root.
+	 */
+	
+	gint root;
+	
+	for (root = l; hfd_parent[root] != root; root = hfd_parent[root])
+		;
+	while (hfd_parent[l] != root) {
+		gint next = hfd_parent[l];
+		hfd_parent[l] = root;
+		l = next;
+	}
+	return root;
+}
+
+static gpointer HFD_measure_stars (gpointer data)
+{
+	/* Measure every step'th star, starting at the first */
+	
+	struct hfd_work *w = data;
+	gint i;
+	
+	for (i = w->first; i < w->num; i += w->step)
+		HFD_measure_star (w, &w->stars[i]);
+	
+	return NULL;
+}
+
+static void HFD_measure_star (struct hfd_work *w, struct hfd_star *s)
+{
+	/* Measure the centre-of-weight, FWHM and HFD of the star in its box.
+	 * The FWHM is found from the second moment of the flux, assuming a
+	 * Gaussian profile.  For the HFD, each pixel with flux above the 
+	 * background is divided into HFD_SPLIT x HFD_SPLIT sub-pixels, and the
+	 * flux of each sub-pixel is added to the radial profile bin (of width
+	 * 1/HFD_BINS pixel) that contains its centre.  The squared offsets of the
+	 * sub-pixel centres from the centre-of-weight are tabulated for each axis
+	 * beforehand.  The HFD is then found in a single cumulative pass through
+	 * the profile, interpolating within the bin that contains half the flux.
+	 * Buffers are kept from one star to the next.
+	 */
+	
+	gushort *row;
+	gint h, v, a, b, n, nbins;
+	gdouble f, sum, sumh, sumv, sumhh, sumvv, mh, mv, var, half, cum;
+	gdouble *dx2, *dy2, *prof;
+	
+	n = 2 * s->r + 1;
+	if (s->r < 2)
+		return;
+	
+	/* Centre-of-weight and second moment */
+	
+	sum = sumh = sumv = sumhh = sumvv = 0.0;
+	for (v = 0; v < n; v++) {
+		row = ccd->r161 + (s->v - s->r + v) * ccd->exd.h_pix + s->h - s->r;
+		for (h = 0; h < n; h++) {
+			if ((f = row[h] - w->bg) <= 0.0)
+				continue;
+			sum += f;
+			sumh += f * h;
+			sumv += f * v;
+			sumhh += f * h * h;
+			sumvv += f * v * v;
+		}
+	}
+	if (sum <= 0.0)
+		return;
+	mh = sumh / sum;
+	mv = sumv / sum;
+	var = (sumhh / sum - mh * mh + sumvv / sum - mv * mv) / 2.0;
+	s->fwhm = 2.0 * sqrt (2.0 * M_LN2 * MAX (var, 0.0));
+	s->mean_h = s->h - s->r + mh;
+	s->mean_v = s->v - s->r + mv;
+	s->flux = sum;
+	
+	/* Tables of squared sub-pixel offsets, and the radial profile */
+	
+	if (w->len_d < n * HFD_SPLIT) {
+		w->len_d = n * HFD_SPLIT;
+		w->dx2 = (gdouble *) g_realloc (w->dx2, w->len_d * sizeof (gdouble));
+		w->dy2 = (gdouble *) g_realloc (w->dy2, w->len_d * sizeof (gdouble));
+	}
+	dx2 = w->dx2;
+	dy2 = w->dy2;
+	for (a = 0; a < n * HFD_SPLIT; a++) {
+		f = (a + 0.5) / HFD_SPLIT - 0.5;
+		dx2[a] = (f - mh) * (f - mh);
+		dy2[a] = (f - mv) * (f - mv);
+	}
+	
+	nbins = (gint) (n * M_SQRT2 * HFD_BINS) + 2;
+	if (w->len_prof < nbins) {
+		w->len_prof = nbins;
+		w->prof = (gdouble *) g_realloc (w->prof, nbins * sizeof (gdouble));
+	}
+	prof = w->prof;
+	memset (prof, 0, nbins * sizeof (gdouble));
+	
+	for (v = 0; v < n; v++) {
+		row = ccd->r161 + (s->v - s->r + v) * ccd->exd.h_pix + s->h - s->r;
+		for (h = 0; h < n; h++) {
+			if ((f = row[h] - w->bg) <= 0.0)
+				continue;
+			f /= HFD_SPLIT * HFD_SPLIT;
+			for (a = v * HFD_SPLIT; a < (v + 1) * HFD_SPLIT; a++)
+				for (b = h * HFD_SPLIT; b < (h + 1) * HFD_SPLIT; b++)
+					prof[(gint) (sqrt (dy2[a] + dx2[b]) * HFD_BINS)] += f;
+		}
+	}
+	
+	/* Find the radius containing half the flux */
+	
+	half = sum / 2.0;
+	s->hfd = 2.0 * nbins / HFD_BINS;
+	for (b = 0, cum = 0.0; b < nbins; cum += prof[b++]) {
+		if (cum + prof[b] >= half) {
+			s->hfd = 2.0 * (b + (half - cum) / prof[b]) / HFD_BINS;
+			break;
+		}
+	}
+	s->OK = TRUE;
+}
+
+static gint HFD_compare (gconstpointer a, gconstpointer b)
+{
+	/* Compare two values for sorting */
+	
+	gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+	
+	return x < y ? -1 : x > y;
 }
 
 gboolean ccdcam_plot_temperatures (void)
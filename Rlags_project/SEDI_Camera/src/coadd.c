@@ -0,0 +1,531 @@
+/******************************************************************************/
+/*                             IMAGE CO-ADDITION                              */
+/*                                                                            */
+/* Co-adds repeated exposures of the same field into a mean image and a map   */
+/* of its noise.  Each frame is added as soon as it is read: the first frame  */
+/* is kept as a reference and later ones are accumulated as 32-bit sums of    */
+/* their differences from it, and 64-bit sums of the squared differences,     */
+/* using SIMD where available.  Working from the reference keeps the squares  */
+/* small and the variance accurate without a second pass over the frames.     */
+/*                                                                            */
+/* Optionally, outliers such as cosmic ray hits are rejected as they arrive:  */
+/* once a pixel has COADD_MIN_CLIP values, a new value further than kappa     */
+/* standard deviations from their mean is left out.  A standard deviation     */
+/* from so few values is unreliable, so it is never taken to be less than     */
+/* that given by a noise model (variance against signal level) fitted to the  */
+/* whole frame, and any change in the overall level of the frame (a brighter  */
+/* lamp, say) is allowed for.  That can't catch an outlier among the first    */
+/* few values, so the largest value at each pixel is also kept and tested     */
+/* against the others when the stack is finished.                             */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TRUE  1
+#define FALSE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+
+#if (defined (__ARM_NEON) || defined (__ARM_NEON__)) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define COADD_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define COADD_SSE2
+#endif
+
+#include "coadd.h"
+
+#define COADD_MIN_SIGMA 1.0               /* Least std. dev. (ADU) for        */
+                                          /*  rejecting values                */
+#define COADD_MODEL_BINS 64               /* Signal levels in noise model     */
+#define COADD_MODEL_MIN 100               /* Fewest pixels in a level to use  */
+#define COADD_MODEL_CLIP 16.0             /* Leave out pixel variances above  */
+                                          /*  this times their level's mean   */
+#define COADD_SAMPLE 4096                 /* Pixels sampled for level change  */
+#define COADD_MIN_SPAN 100.0              /* Least range of levels (ADU) to   */
+                                          /*  fit a change in gain            */
+
+struct coadd_pt {                         /* A pixel sampled for level change */
+	float l;                              /* Level of the stack               */
+	float r;                              /* New value minus the level        */
+};
+
+
+/******************************************************************************/
+/*                              CO-ADDITION                                   */
+/******************************************************************************/
+
+int coadd_start (struct coadd *c, int h_pix, int v_pix, double kappa);
+void coadd_add (struct coadd *c, const unsigned short *data);
+void coadd_finish (struct coadd *c, unsigned short *mean,
+				   unsigned short *noise);
+void coadd_free (struct coadd *c);
+static void coadd_accumulate (struct coadd *c, const unsigned short *data,
+							  int Max);
+static void coadd_clip (struct coadd *c, const unsigned short *data);
+static void coadd_model (struct coadd *c);
+static void coadd_trend (const struct coadd *c, const unsigned short *data,
+						 double *off, double *gain);
+static float coadd_median (float *v, int n);
+static int coadd_cmp_pt (const void *a, const void *b);
+static int coadd_cmp_float (const void *a, const void *b);
+static double coadd_variance (const struct coadd *c, int k, double s,
+							  double q, unsigned short ref);
+
+
+int coadd_start (struct coadd *c, int h_pix, int v_pix, double kappa)
+{
+	/* Start a new, empty stack of h_pix x v_pix frames, re-using the buffers
+	 * of any previous stack if they are big enough.  The structure must be
+	 * zeroed before it is first used.  Values are rejected if kappa is
+	 * greater than zero.  Returns TRUE on success or FALSE with errno set.
+	 */
+
+	size_t n = (size_t) h_pix * v_pix;
+
+	if (n > c->len) {
+		coadd_free (c);
+		c->ref = malloc (n * sizeof (unsigned short));
+		c->sum = malloc (n * sizeof (int32_t));
+		c->sumsq = malloc (n * sizeof (uint64_t));
+		c->max = malloc (n * sizeof (unsigned short));
+		c->nrej = malloc (n * sizeof (unsigned short));
+		if (!c->ref || !c->sum || !c->sumsq || !c->max || !c->nrej) {
+			coadd_free (c);
+			errno = ENOMEM;
+			return FALSE;
+		}
+		c->len = n;
+	}
+	c->h_pix = h_pix;
+	c->v_pix = v_pix;
+	c->kappa = kappa > 0.0 ? kappa : 0.0;
+	c->n = 0;
+	c->rejected = 0;
+	memset (c->model, 0, sizeof (c->model));
+	return TRUE;
+}
+
+void coadd_add (struct coadd *c, const unsigned short *data)
+{
+	/* Add a frame to the stack.  The first becomes the reference, and values
+	 * are only tested for rejection once there are enough to test them
+	 * against, so until then every frame goes straight into the sums.  The
+	 * noise model is fitted just before the first frame that is tested.
+	 */
+
+	size_t n = (size_t) c->h_pix * c->v_pix;
+
+	if (c->n >= COADD_MAX_FRAMES)
+		return;
+
+	if (!c->n) {
+		memcpy (c->ref, data, n * sizeof (unsigned short));
+		memcpy (c->max, data, n * sizeof (unsigned short));
+		memset (c->sum, 0, n * sizeof (int32_t));
+		memset (c->sumsq, 0, n * sizeof (uint64_t));
+		memset (c->nrej, 0, n * sizeof (unsigned short));
+	} else if (c->kappa > 0.0 && c->n >= COADD_MIN_CLIP) {
+		if (c->n == COADD_MIN_CLIP)
+			coadd_model (c);
+		coadd_clip (c, data);
+	} else
+		coadd_accumulate (c, data, c->kappa > 0.0);
+	c->n++;
+}
+
+void coadd_finish (struct coadd *c, unsigned short *mean,
+				   unsigned short *noise)
+{
+	/* Write the mean of the stacked values at each pixel, rounded to the
+	 * nearest ADU, and its standard error in units of 1/COADD_NOISE_SCALE
+	 * ADU; the noise is USHRT_MAX where it can't be estimated.  If values are
+	 * being rejected, the largest value at each pixel is first tested against
+	 * the rest.  Either output may be NULL.  The stack is left empty.
+	 */
+
+	double kappa2 = c->kappa * c->kappa, m, v, s, q;
+	long d;
+	size_t i, n = (size_t) c->h_pix * c->v_pix;
+	int k;
+
+	for (i = 0; i < n && c->n; i++) {
+		k = c->n - c->nrej[i];
+		s = c->sum[i];
+		q = c->sumsq[i];
+		if (c->kappa > 0.0 && k > COADD_MIN_CLIP) {
+			d = (long) c->max[i] - c->ref[i];
+			m = (s - d) / (k - 1);
+			v = coadd_variance (c, k - 1, s - d, q - (double) d * d,
+								c->ref[i]);
+			if ((d - m) * (d - m) > kappa2 * v) {
+				s -= d;
+				q -= (double) d * d;
+				k--;
+				c->rejected++;
+			}
+		}
+
+		m = s / k;
+		if (mean) {
+			d = lrint (c->ref[i] + m);
+			mean[i] = d < 0 ? 0 : (d > USHRT_MAX ? USHRT_MAX : d);
+		}
+		if (noise) {
+			if (k > 1) {
+				v = (q - s * m) / (k - 1);
+				d = lrint (sqrt ((v > 0.0 ? v : 0.0) / k) * COADD_NOISE_SCALE);
+				noise[i] = d > USHRT_MAX ? USHRT_MAX : d;
+			} else
+				noise[i] = USHRT_MAX;
+		}
+	}
+	c->n = 0;
+}
+
+void coadd_free (struct coadd *c)
+{
+	/* Free the buffers of a stack */
+
+	free (c->ref);
+	free (c->sum);
+	free (c->sumsq);
+	free (c->max);
+	free (c->nrej);
+	c->ref = c->max = c->nrej = NULL;
+	c->sum = NULL;
+	c->sumsq = NULL;
+	c->len = 0;
+	c->n = 0;
+}
+
+static void coadd_accumulate (struct coadd *c, const unsigned short *data,
+							  int Max)
+{
+	/* Add every value of a frame to the sums, and keep the largest value at
+	 * each pixel if Max is TRUE.  The absolute difference from the reference
+	 * is squared as a 16 x 16 -> 32 bit product and widened into the 64-bit
+	 * sums.
+	 */
+
+	const unsigned short *ref = c->ref;
+	int32_t *sum = c->sum;
+	uint64_t *sumsq = c->sumsq;
+	unsigned short *max = c->max;
+	size_t i = 0, n = (size_t) c->h_pix * c->v_pix;
+	int d;
+
+	#if defined (COADD_NEON)
+	uint16x8_t x, r, a;
+	uint32x4_t s0, s1;
+
+	for (; i + 8 <= n; i += 8) {
+		x = vld1q_u16 (data + i);
+		r = vld1q_u16 (ref + i);
+		vst1q_s32 (sum + i, vaddq_s32 (vld1q_s32 (sum + i),
+			vreinterpretq_s32_u32 (vsubl_u16 (vget_low_u16 (x),
+											  vget_low_u16 (r)))));
+		vst1q_s32 (sum + i + 4, vaddq_s32 (vld1q_s32 (sum + i + 4),
+			vreinterpretq_s32_u32 (vsubl_u16 (vget_high_u16 (x),
+											  vget_high_u16 (r)))));
+		a = vabdq_u16 (x, r);
+		s0 = vmull_u16 (vget_low_u16 (a), vget_low_u16 (a));
+		s1 = vmull_u16 (vget_high_u16 (a), vget_high_u16 (a));
+		vst1q_u64 (sumsq + i, vaddw_u32 (vld1q_u64 (sumsq + i),
+										 vget_low_u32 (s0)));
+		vst1q_u64 (sumsq + i + 2, vaddw_u32 (vld1q_u64 (sumsq + i + 2),
+											 vget_high_u32 (s0)));
+		vst1q_u64 (sumsq + i + 4, vaddw_u32 (vld1q_u64 (sumsq + i + 4),
+											 vget_low_u32 (s1)));
+		vst1q_u64 (sumsq + i + 6, vaddw_u32 (vld1q_u64 (sumsq + i + 6),
+											 vget_high_u32 (s1)));
+		if (Max)
+			vst1q_u16 (max + i, vmaxq_u16 (vld1q_u16 (max + i), x));
+	}
+	#elif defined (COADD_SSE2)
+	__m128i x, r, a, lo, hi, s0, s1, *p;
+	const __m128i zero = _mm_setzero_si128 ();
+
+	for (; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128 ((const __m128i *)(data + i));
+		r = _mm_loadu_si128 ((const __m128i *)(ref + i));
+		lo = _mm_sub_epi32 (_mm_unpacklo_epi16 (x, zero),
+							_mm_unpacklo_epi16 (r, zero));
+		hi = _mm_sub_epi32 (_mm_unpackhi_epi16 (x, zero),
+							_mm_unpackhi_epi16 (r, zero));
+		p = (__m128i *)(sum + i);
+		_mm_storeu_si128 (p, _mm_add_epi32 (_mm_loadu_si128 (p), lo));
+		_mm_storeu_si128 (p + 1, _mm_add_epi32 (_mm_loadu_si128 (p + 1), hi));
+
+		/* No 16-bit absolute difference in SSE2, so OR the saturated ones */
+		a = _mm_or_si128 (_mm_subs_epu16 (x, r), _mm_subs_epu16 (r, x));
+		lo = _mm_mullo_epi16 (a, a);
+		hi = _mm_mulhi_epu16 (a, a);
+		s0 = _mm_unpacklo_epi16 (lo, hi);
+		s1 = _mm_unpackhi_epi16 (lo, hi);
+		p = (__m128i *)(sumsq + i);
+		_mm_storeu_si128 (p, _mm_add_epi64 (_mm_loadu_si128 (p),
+											_mm_unpacklo_epi32 (s0, zero)));
+		_mm_storeu_si128 (p + 1, _mm_add_epi64 (_mm_loadu_si128 (p + 1),
+											_mm_unpackhi_epi32 (s0, zero)));
+		_mm_storeu_si128 (p + 2, _mm_add_epi64 (_mm_loadu_si128 (p + 2),
+											_mm_unpacklo_epi32 (s1, zero)));
+		_mm_storeu_si128 (p + 3, _mm_add_epi64 (_mm_loadu_si128 (p + 3),
+											_mm_unpackhi_epi32 (s1, zero)));
+
+		/* No unsigned 16-bit maximum either: max(a,b) = (a -sat b) + b */
+		if (Max) {
+			p = (__m128i *)(max + i);
+			a = _mm_loadu_si128 (p);
+			_mm_storeu_si128 (p, _mm_add_epi16 (_mm_subs_epu16 (x, a), a));
+		}
+	}
+	#endif
+
+	for (; i < n; i++) {
+		d = (int) data[i] - ref[i];
+		sum[i] += d;
+		sumsq[i] += (uint64_t) ((int64_t) d * d);
+		if (Max && data[i] > max[i])
+			max[i] = data[i];
+	}
+}
+
+static void coadd_clip (struct coadd *c, const unsigned short *data)
+{
+	/* Add a frame, leaving out any value more than kappa standard deviations
+	 * from the mean of those already added at its pixel, once that has been
+	 * adjusted for the change in level of the whole frame.  The values that
+	 * are kept are added as they are.  The test needs the mean and variance
+	 * of each pixel in double precision, so this is done one pixel at a time.
+	 */
+
+	double kappa2 = c->kappa * c->kappa, m, v, e, off, gain;
+	size_t i, n = (size_t) c->h_pix * c->v_pix;
+	int d, k;
+
+	coadd_trend (c, data, &off, &gain);
+	for (i = 0; i < n; i++) {
+		d = (int) data[i] - c->ref[i];
+		k = c->n - c->nrej[i];
+		m = (double) c->sum[i] / k;
+		e = d - m - (off + gain * (c->ref[i] + m));
+		v = coadd_variance (c, k, c->sum[i], c->sumsq[i], c->ref[i]);
+		if (e * e > kappa2 * v) {
+			c->nrej[i]++;
+			c->rejected++;
+			continue;
+		}
+		c->sum[i] += d;
+		c->sumsq[i] += (uint64_t) ((int64_t) d * d);
+		if (data[i] > c->max[i])
+			c->max[i] = data[i];
+	}
+}
+
+static void coadd_model (struct coadd *c)
+{
+	/* Fit the noise model to the frames added so far, none of which have had
+	 * values rejected.  The pixel variances are averaged in bins of signal
+	 * level, leaving out those inflated by outliers, and a quadratic in the
+	 * level (read noise, photon noise and any change in the illumination from
+	 * frame to frame) is fitted to the averages by least squares.  Each is
+	 * weighted by the inverse of its own variance, which goes as the square
+	 * of the average over the number of pixels, so that a sparse level made
+	 * up of pixels hit by cosmic rays counts for almost nothing.  If there
+	 * are too few levels for a quadratic, a line or a constant is fitted.
+	 */
+
+	double sv[COADD_MODEL_BINS], sx[COADD_MODEL_BINS], lim[COADD_MODEL_BINS];
+	long cnt[COADD_MODEL_BINS];
+	double a[3][4], m, v, x, w, p, t;
+	size_t i, n = (size_t) c->h_pix * c->v_pix;
+	int b, j, r, pass, nbins, npar, k = c->n;
+
+	memset (c->model, 0, sizeof (c->model));
+	if (k < 2)
+		return;
+
+	for (b = 0; b < COADD_MODEL_BINS; b++)
+		lim[b] = HUGE_VAL;
+	for (pass = 0; pass < 3; pass++) {
+		memset (sv, 0, sizeof (sv));
+		memset (sx, 0, sizeof (sx));
+		memset (cnt, 0, sizeof (cnt));
+		for (i = 0; i < n; i++) {
+			m = (double) c->sum[i] / k;
+			v = ((double) c->sumsq[i] - c->sum[i] * m) / (k - 1);
+			x = (c->ref[i] + m) / 65536.0;
+			b = x * COADD_MODEL_BINS;
+			b = b < 0 ? 0 : (b >= COADD_MODEL_BINS ? COADD_MODEL_BINS - 1 : b);
+			if (v > lim[b])
+				continue;
+			sv[b] += v;
+			sx[b] += x;
+			cnt[b]++;
+		}
+		for (b = 0; b < COADD_MODEL_BINS; b++)
+			if (cnt[b])
+				lim[b] = COADD_MODEL_CLIP * (sv[b] / cnt[b]) +
+							 COADD_MIN_SIGMA * COADD_MIN_SIGMA;
+	}
+
+	/* Normal equations for the weighted fit, as an augmented matrix */
+
+	for (nbins = 0, b = 0; b < COADD_MODEL_BINS; b++)
+		nbins += cnt[b] >= COADD_MODEL_MIN;
+	npar = nbins < 3 ? nbins : 3;
+	if (!npar)
+		return;
+	memset (a, 0, sizeof (a));
+	for (b = 0; b < COADD_MODEL_BINS; b++) {
+		if (cnt[b] < COADD_MODEL_MIN)
+			continue;
+		x = sx[b] / cnt[b];
+		v = sv[b] / cnt[b];
+		w = cnt[b] / (v * v + 1.0);
+		for (r = 0; r < npar; r++) {
+			for (j = 0; j < npar; j++)
+				a[r][j] += w * pow (x, r + j);
+			a[r][3] += w * pow (x, r) * v;
+		}
+	}
+
+	/* Gauss-Jordan elimination; the matrix is positive definite */
+
+	for (r = 0; r < npar; r++) {
+		if ((p = a[r][r]) <= 0.0)
+			return;
+		for (j = r; j < 4; j++)
+			a[r][j] /= p;
+		for (b = 0; b < npar; b++) {
+			if (b == r)
+				continue;
+			t = a[b][r];
+			for (j = r; j < 4; j++)
+				a[b][j] -= t * a[r][j];
+		}
+	}
+	for (r = 0; r < npar; r++)
+		c->model[r] = a[r][3];
+}
+
+static void coadd_trend (const struct coadd *c, const unsigned short *data,
+						 double *off, double *gain)
+{
+	/* Estimate the change in level of a new frame from the stack so far, as
+	 * off + gain * level.  A sample of pixels is split into its darker and
+	 * brighter halves, and the line is drawn through the median level and
+	 * median change of each half, which outliers hardly affect.  If the
+	 * levels don't span enough for a gain, only the offset is found.
+	 */
+
+	struct coadd_pt pt[COADD_SAMPLE];
+	float v[COADD_SAMPLE];
+	float l_lo, l_hi, r_lo, r_hi;
+	size_t i, step, n = (size_t) c->h_pix * c->v_pix;
+	int j, k, np, half;
+
+	step = n / COADD_SAMPLE + 1;
+	for (i = 0, np = 0; i < n && np < COADD_SAMPLE; i += step, np++) {
+		k = c->n - c->nrej[i];
+		pt[np].l = c->ref[i] + (float) c->sum[i] / k;
+		pt[np].r = data[i] - pt[np].l;
+	}
+	*off = *gain = 0.0;
+	if (np < 2)
+		return;
+
+	qsort (pt, np, sizeof (struct coadd_pt), coadd_cmp_pt);
+	half = np / 2;
+	for (j = 0; j < half; j++)
+		v[j] = pt[j].l;
+	l_lo = coadd_median (v, half);
+	for (j = 0; j < half; j++)
+		v[j] = pt[j].r;
+	r_lo = coadd_median (v, half);
+	for (j = half; j < np; j++)
+		v[j - half] = pt[j].l;
+	l_hi = coadd_median (v, np - half);
+	for (j = half; j < np; j++)
+		v[j - half] = pt[j].r;
+	r_hi = coadd_median (v, np - half);
+
+	if (l_hi - l_lo >= COADD_MIN_SPAN) {
+		*gain = (r_hi - r_lo) / (l_hi - l_lo);
+		*off = r_lo - *gain * l_lo;
+	} else {
+		for (j = 0; j < np; j++)
+			v[j] = pt[j].r;
+		*off = coadd_median (v, np);
+	}
+}
+
+static float coadd_median (float *v, int n)
+{
+	/* Return the median of n values, sorting them in the process */
+
+	qsort (v, n, sizeof (float), coadd_cmp_float);
+	return n % 2 ? v[n / 2] : 0.5f * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static int coadd_cmp_pt (const void *a, const void *b)
+{
+	/* Order sampled pixels by level for qsort */
+
+	float la = ((const struct coadd_pt *) a)->l;
+	float lb = ((const struct coadd_pt *) b)->l;
+
+	return (la > lb) - (la < lb);
+}
+
+static int coadd_cmp_float (const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+static double coadd_variance (const struct coadd *c, int k, double s,
+							  double q, unsigned short ref)
+{
+	/* Return the variance of a new value about the mean of k values at a
+	 * pixel, given their sum s and sum of squares q (as differences from the
+	 * reference value ref): that of the values themselves or of the noise
+	 * model at their level, whichever is larger, plus that of their mean.
+	 */
+
+	double m = s / k, x = (ref + m) / 65536.0, v, vm;
+
+	v = k > 1 ? (q - s * m) / (k - 1) : 0.0;
+	vm = c->model[0] + (c->model[1] + c->model[2] * x) * x;
+	v = v > vm ? v : vm;
+	v = v > COADD_MIN_SIGMA * COADD_MIN_SIGMA ?
+						 v : COADD_MIN_SIGMA * COADD_MIN_SIGMA;
+	return v * (1.0 + 1.0 / k);
+}
@@ -0,0 +1,56 @@
+/******************************************************************************/
+/*                      HEADER FILE FOR IMAGE CO-ADDITION                     */
+/*                                                                            */
+/* Header file for co-adding (stacking) repeated exposures.                   */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef GOQAT_COADD_H
+#define GOQAT_COADD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define COADD_MAX_FRAMES 1000             /* Most frames in one stack         */
+#define COADD_MIN_CLIP 2                  /* Fewest values to clip against    */
+#define COADD_NOISE_SCALE 16              /* Noise map units per ADU          */
+
+struct coadd {                            /* A stack of frames being co-added */
+	int h_pix, v_pix;                     /* Size of the frames               */
+	int n;                                /* Number of frames added           */
+	double kappa;                         /* Rejection limit (std. devs.), or */
+	                                      /*  0 to keep every value           */
+	unsigned long rejected;               /* Values rejected so far           */
+	double model[3];                      /* Noise model: variance at level L */
+	                                      /*  is model[0] + model[1] x +      */
+	                                      /*  model[2] x^2, x = L / 65536     */
+	size_t len;                           /* Allocated pixels                 */
+	unsigned short *ref;                  /* The first frame                  */
+	int32_t *sum;                         /* Sums of differences from ref...  */
+	uint64_t *sumsq;                      /*  ...and of their squares         */
+	unsigned short *max;                  /* Largest value at each pixel      */
+	unsigned short *nrej;                 /* Values rejected at each pixel    */
+};
+
+extern int coadd_start (struct coadd *c, int h_pix, int v_pix, double kappa);
+extern void coadd_add (struct coadd *c, const unsigned short *data);
+extern void coadd_finish (struct coadd *c, unsigned short *mean,
+						  unsigned short *noise);
+extern void coadd_free (struct coadd *c);
+
+#endif /* GOQAT_COADD_H */
@@ -4,7 +4,8 @@
 /* All the routines for decoding raw bayer data are contained in this module. */
 /* This code is a cut-down version of bayer.c from the libdc1394 project by   */
 /* Damien Douxchamps and Frederic Devernay, apart from the debayer_get_tile   */
-/* function.  The original authors' comments have been retained in the code.  */
+/* and debayer_image functions.  The original authors' comments have been     */
+/* retained in the code.                                                      */
 /*                                                                            */
 /* Copyright (C) 2009 - 2014  Edward Simonson                                 */
 /*                                                                            */
@@ -33,6 +34,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define uint16_t unsigned short int 
 #define uint32_t unsigned int
@@ -59,6 +62,31 @@ typedef enum {
   DC1394_TRUE
 } dc1394bool_t;
 
+#define DEBAYER_MAX_THREADS 4          /* Most threads decoding bands         */
+#define DEBAYER_MIN_ROWS 64            /* Fewest rows worth a thread          */
+
+enum Debayer {                         /* Methods for debayer_image; must be  */
+	DB_SIMP,                           /*  the same as enum Debayer in        */
+	DB_NEAR,                           /*  interface.h                        */
+	DB_BILIN,
+	DB_QUAL,
+	DB_DOWN,
+	DB_GRADS,
+	DB_AHD,
+	DB_METHODS
+};
+
+typedef enum {
+  DC1394_BAYER_METHOD_NEAREST = 0,
+  DC1394_BAYER_METHOD_SIMPLE,
+  DC1394_BAYER_METHOD_BILINEAR,
+  DC1394_BAYER_METHOD_HQLINEAR,
+  DC1394_BAYER_METHOD_DOWNSAMPLE,
+  DC1394_BAYER_METHOD_EDGESENSE,
+  DC1394_BAYER_METHOD_VNG,
+  DC1394_BAYER_METHOD_AHD
+} dc1394bayer_method_t;
+
 #define DC1394_BAYER_METHOD_MIN  DC1394_BAYER_METHOD_NEAREST
 #define DC1394_BAYER_METHOD_MAX  DC1394_BAYER_METHOD_AHD
 #define DC1394_BAYER_METHOD_NUM  (DC1394_BAYER_METHOD_MAX-DC1394_BAYER_METHOD_MIN+1)
@@ -71,6 +99,16 @@ typedef enum {
   DC1394_INVALID_BAYER_METHOD,
 } dc1394error_t;
 
+struct debayer_band {                  /* A band of rows for one thread       */
+	const uint16_t *bayer;             /* Raw data for the whole image        */
+	uint16_t *rgb;                     /* Decoded data for the whole image    */
+	uint16_t *buf;                     /* Band and halo rows, decoded         */
+	int sx, sy, tile, bits, method;    /* As passed to debayer_image          */
+	int first, last;                   /* Range of rows to decode             */
+	int halo;                          /* Extra rows decoded either side      */
+	dc1394error_t err;                 /* Result of decoding                  */
+};
+
 /******************************************************************************/
 /*                           MISCELLANEOUS FUNCTIONS                          */
 /******************************************************************************/
@@ -102,6 +140,12 @@ dc1394error_t dc1394_bayer_AHD_uint16 (
 						 const uint16_t *restrict bayer, uint16_t *restrict dst,
 						 int sx, int sy,dc1394color_filter_t pattern, int bits);
 int debayer_get_tile (int pattern, short h_offset, short v_offset);
+int debayer_image (int method, const uint16_t *bayer, uint16_t *rgb,
+				   int sx, int sy, int tile, int bits);
+static dc1394error_t debayer_decode (int method, const uint16_t *bayer,
+									 uint16_t *rgb, int sx, int sy, int tile,
+									 int bits);
+static void *debayer_band (void *data);
 
 
 /******************************************************************************/
@@ -822,7 +866,7 @@ dc1394error_t dc1394_bayer_VNG_uint16 (
 						 int sx, int sy,dc1394color_filter_t pattern, int bits)
 {
     const int height = sy, width = sx;
-    static const signed char *cp;
+    const signed char *cp;          /* Not static: bands run in parallel */
     /* The following has the same type as the image */
     uint16_t (*brow[5])[3], *pix;                     /* [FD] */
     int code[8][2][320], *ip, gval[8], gmin, gmax, sum[4];
@@ -1190,3 +1234,138 @@ int debayer_get_tile (int pattern, short h_offset, short v_offset)
 	
 	return TILE[pattern + h_offset%2 + 3 * (v_offset%2)];
 }
+
+int debayer_image (int method, const uint16_t *bayer, uint16_t *rgb,
+				   int sx, int sy, int tile, int bits)
+{
+	/* Debayer the image with the given method (one of enum Debayer), in
+	 * parallel where that's worthwhile.  The image is divided into bands of
+	 * rows, each of which is decoded by a separate thread together with
+	 * enough 'halo' rows either side for every pixel in the band to be
+	 * computed exactly as if the whole image were decoded at once; only the
+	 * band itself is then copied to the output.  Bands start on even rows so
+	 * that each has the same bayer tile as the whole image.  The simpler
+	 * methods take little longer than copying the bands would, so they are
+	 * always done in one go.  Returns zero on success (as for the dc1394
+	 * functions).
+	 */
+
+	/* Rows needed either side of each output row, rounded up to even, or
+	 * -1 if the method isn't worth doing in parallel.
+	 */
+
+	const int HALO[DB_METHODS] = {-1, -1, -1, 2, -1, 4, 6};
+
+	struct debayer_band band[DEBAYER_MAX_THREADS];
+	pthread_t thread[DEBAYER_MAX_THREADS];
+	int started[DEBAYER_MAX_THREADS];
+	long ncpu;
+	int t, nthreads, rows;
+	dc1394bool_t Error = DC1394_FALSE;
+
+	if (method < 0 || method >= DB_METHODS)
+		return DC1394_INVALID_BAYER_METHOD;
+
+	ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	nthreads = sy / DEBAYER_MIN_ROWS;
+	nthreads = nthreads > ncpu ? ncpu : nthreads;
+	nthreads = nthreads > DEBAYER_MAX_THREADS ? DEBAYER_MAX_THREADS : nthreads;
+	if (nthreads < 2 || HALO[method] < 0)
+		return debayer_decode (method, bayer, rgb, sx, sy, tile, bits);
+
+	/* AHD initialises its colour tables on first use, so do that here */
+
+	if (method == DB_AHD && ahd_inited == DC1394_FALSE) {
+		cam_to_cielab (NULL, NULL);
+		ahd_inited = DC1394_TRUE;
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		band[t].bayer = bayer;
+		band[t].rgb = rgb;
+		band[t].sx = sx;
+		band[t].sy = sy;
+		band[t].tile = tile;
+		band[t].bits = bits;
+		band[t].method = method;
+		band[t].halo = HALO[method];
+		band[t].first = ((long) sy * t / nthreads) & ~1;
+		band[t].last = t < nthreads - 1 ?
+					   ((long) sy * (t + 1) / nthreads) & ~1 : sy;
+		rows = band[t].last - band[t].first + 2 * band[t].halo;
+		if (!(band[t].buf = calloc ((size_t) 3 * sx * rows,
+									sizeof (uint16_t))))
+			Error = DC1394_TRUE;
+	}
+
+	if (Error) {  /* Decode the image in one go */
+		for (t = 0; t < nthreads; t++)
+			free (band[t].buf);
+		return debayer_decode (method, bayer, rgb, sx, sy, tile, bits);
+	}
+
+	for (t = 1; t < nthreads; t++)  /* Do it here if a thread fails */
+		if (!(started[t] = !pthread_create (&thread[t], NULL, debayer_band,
+											&band[t])))
+			debayer_band (&band[t]);
+	debayer_band (&band[0]);
+	for (t = 1; t < nthreads; t++)
+		if (started[t])
+			pthread_join (thread[t], NULL);
+
+	for (t = 0; t < nthreads; t++) {
+		free (band[t].buf);
+		if (band[t].err != DC1394_SUCCESS)
+			return band[t].err;
+	}
+	return DC1394_SUCCESS;
+}
+
+static dc1394error_t debayer_decode (int method, const uint16_t *bayer,
+									 uint16_t *rgb, int sx, int sy, int tile,
+									 int bits)
+{
+	/* Decode the given rows with the given method */
+
+	switch (method) {
+		case DB_SIMP:
+			return dc1394_bayer_Simple_uint16 (bayer, rgb, sx, sy, tile,
+											   bits);
+		case DB_NEAR:
+			return dc1394_bayer_NearestNeighbor_uint16 (bayer, rgb, sx, sy,
+														tile, bits);
+		case DB_BILIN:
+			return dc1394_bayer_Bilinear_uint16 (bayer, rgb, sx, sy, tile,
+												 bits);
+		case DB_QUAL:
+			return dc1394_bayer_HQLinear_uint16 (bayer, rgb, sx, sy, tile,
+												 bits);
+		case DB_DOWN:
+			return dc1394_bayer_Downsample_uint16 (bayer, rgb, sx, sy, tile,
+												   bits);
+		case DB_GRADS:
+			return dc1394_bayer_VNG_uint16 (bayer, rgb, sx, sy, tile, bits);
+		case DB_AHD:
+			return dc1394_bayer_AHD_uint16 (bayer, rgb, sx, sy, tile, bits);
+	}
+	return DC1394_INVALID_BAYER_METHOD;
+}
+
+static void *debayer_band (void *data)
+{
+	/* Decode one band of rows together with its halo, then copy the band to
+	 * the output.
+	 */
+
+	struct debayer_band *b = data;
+	int top, bottom;
+
+	top = b->first - b->halo < 0 ? 0 : b->first - b->halo;
+	bottom = b->last + b->halo > b->sy ? b->sy : b->last + b->halo;
+	b->err = debayer_decode (b->method, b->bayer + (long) top * b->sx, b->buf,
+							 b->sx, bottom - top, b->tile, b->bits);
+	memcpy (b->rgb + (long) b->first * b->sx * 3,
+			b->buf + (long) (b->first - top) * b->sx * 3,
+			(size_t) (b->last - b->first) * b->sx * 3 * sizeof (uint16_t));
+	return NULL;
+}
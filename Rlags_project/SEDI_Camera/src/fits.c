@@ -0,0 +1,677 @@
+/******************************************************************************/
+/*                             FITS FILE WRITER                               */
+/*                                                                            */
+/* Writes 16-bit FITS images for both GoQat (image.c) and sedid.  The data    */
+/* are converted a block at a time into a reusable, page-aligned buffer and   */
+/* streamed to the file as they are converted, instead of building the whole  */
+/* HDU in memory first.  Files named *.fz are instead written losslessly as   */
+/* Rice tile-compressed images (the fpack convention), one tile per row, with */
+/* the tiles encoded in parallel.  Further images may be appended to a file   */
+/* as IMAGE extensions (or compressed ones, for *.fz).                        */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TRUE  1
+#define FALSE 0
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if (defined (__ARM_NEON) || defined (__ARM_NEON__)) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define FITS_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define FITS_SSE2
+#endif
+
+#include "fits.h"
+
+#define FITS_BUF_SIZE (96 * FITS_REC_LEN) /* Output buffer; 270 KiB, holding  */
+#define FITS_PAGE 4096                    /*  whole records                   */
+
+#define RICE_BLOCK 32                     /* Pixels per Rice block            */
+#define RICE_FSMAX 14                     /* Largest split for 16-bit data    */
+#define RICE_MAX_THREADS 4                /* Most threads encoding tiles      */
+#define RICE_MIN_TILES 64                 /* Fewest tiles worth a thread      */
+
+static unsigned short *fits_buf = NULL;   /* Reused for every file written    */
+static pthread_mutex_t fits_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct rice_bits {                        /* Bit stream being written         */
+	unsigned char *p;                     /* Next output byte                 */
+	unsigned int buf;                     /* Bits not yet output...           */
+	int n;                                /*  ...and how many of them         */
+};
+
+struct rice_job {                         /* A run of tiles for one thread    */
+	const unsigned char *data;            /* Image data as passed in          */
+	int depth, stride, h_pix, v_pix;      /* Image layout                     */
+	int first, last;                      /* Range of tiles to encode         */
+	short *row;                           /* Row being compressed             */
+	unsigned char *out;                   /* Compressed tiles, end to end     */
+	unsigned int *len;                    /* Compressed length of each tile   */
+	size_t total;                         /* Total compressed length          */
+};
+
+
+/******************************************************************************/
+/*                                FITS OUTPUT                                 */
+/******************************************************************************/
+
+void fits_card (char *header, int *h, const char *fmt, ...);
+int fits_write_image (const char *file, const char *header, int head_len,
+					  const void *data, int depth, int stride,
+					  int h_pix, int v_pix);
+int fits_append_image (const char *file, const char *header, int head_len,
+					   const void *data, int depth, int stride,
+					   int h_pix, int v_pix);
+int fits_is_compressed (const char *file);
+static int fits_write_hdu (const char *file, int Append, const char *header,
+						   int head_len, const void *data, int depth,
+						   int stride, int h_pix, int v_pix);
+static int fits_write_rice (const char *file, int Append, const char *header,
+							int head_len, const void *data, int depth,
+							int stride, int h_pix, int v_pix);
+static void *fits_rice_tiles (void *data);
+static size_t fits_rice_encode (unsigned char *out, const short *a, int n);
+static void fits_rice_put (struct rice_bits *b, unsigned int val, int nbits);
+static void fits_convert (unsigned short *dst, const void *src, int depth,
+						  int stride, int n);
+static int fits_writev (int fd, struct iovec *iov, int iovcnt);
+
+
+void fits_card (char *header, int *h, const char *fmt, ...)
+{
+	/* Write one 80-character card image at header[*h] and advance *h to the
+	 * next card.  The header is assumed to have been filled with spaces, so
+	 * the card is left padded with spaces; anything longer than a card is
+	 * truncated.
+	 */
+
+	va_list ap;
+	char card[FITS_CARD_LEN + 1];
+	int len;
+
+	va_start (ap, fmt);
+	len = vsnprintf (card, sizeof (card), fmt, ap);
+	va_end (ap);
+	if (len > FITS_CARD_LEN)
+		len = FITS_CARD_LEN;
+	if (len > 0)
+		memcpy (&header[*h], card, len);
+	*h += FITS_CARD_LEN;
+}
+
+int fits_write_image (const char *file, const char *header, int head_len,
+					  const void *data, int depth, int stride,
+					  int h_pix, int v_pix)
+{
+	/* Write a FITS file comprising the given header (head_len bytes, a whole
+	 * number of records) followed by h_pix x v_pix values of data, adjusted
+	 * to be in the range -32768 to 32767 and in big-endian format.  The
+	 * values are 'depth' bytes each (1 or 2), and successive pixels are
+	 * 'stride' values apart (e.g. 3 for one component of RGB data).  The
+	 * rows are written in reverse order, so that other software displays an
+	 * inverted image on the chip the right way up.  The data are padded with
+	 * zeros to a whole number of records.
+	 * The header goes out with the first block of data in a single writev
+	 * call; each following block is written as soon as it is converted.
+	 * Returns TRUE on success; on failure, returns FALSE with errno set and
+	 * the file may be incomplete.
+	 * If the file name ends in '.fz', the image is written as a Rice
+	 * tile-compressed FITS file instead (see fits_write_rice).
+	 * Files may be written from several threads at once: the first uses the
+	 * shared buffer and the others allocate their own for the duration.
+	 */
+
+	return fits_write_hdu (file, FALSE, header, head_len, data, depth, stride,
+						   h_pix, v_pix);
+}
+
+int fits_append_image (const char *file, const char *header, int head_len,
+					   const void *data, int depth, int stride,
+					   int h_pix, int v_pix)
+{
+	/* As fits_write_image, but append the image to an existing file as an
+	 * extension.  The header must start with XTENSION = 'IMAGE' and have
+	 * PCOUNT and GCOUNT cards, and the primary header of the file must
+	 * include EXTEND = T.  A compressed image is appended as a further
+	 * binary table, which must follow one written by fits_write_image.
+	 */
+
+	return fits_write_hdu (file, TRUE, header, head_len, data, depth, stride,
+						   h_pix, v_pix);
+}
+
+static int fits_write_hdu (const char *file, int Append, const char *header,
+						   int head_len, const void *data, int depth,
+						   int stride, int h_pix, int v_pix)
+{
+	/* Write one HDU for fits_write_image or fits_append_image */
+
+	struct iovec iov[2];
+	unsigned short *buf = NULL;
+	const unsigned char *row;
+	int fd, v, h, n, fill, pad, iovcnt, Locked, Error = FALSE, err = 0;
+
+	if (fits_is_compressed (file))
+		return fits_write_rice (file, Append, header, head_len, data, depth,
+								stride, h_pix, v_pix);
+
+	if ((fd = open (file, O_WRONLY | O_CREAT | (Append ? O_APPEND : O_TRUNC),
+					0644)) < 0)
+		return FALSE;
+
+	if ((Locked = !pthread_mutex_trylock (&fits_mutex))) {
+		if (!fits_buf &&
+			posix_memalign ((void **) &fits_buf, FITS_PAGE, FITS_BUF_SIZE))
+			fits_buf = NULL;
+		buf = fits_buf;
+	}
+	if (!buf && posix_memalign ((void **) &buf, FITS_PAGE, FITS_BUF_SIZE)) {
+		if (Locked)
+			pthread_mutex_unlock (&fits_mutex);
+		close (fd);
+		errno = ENOMEM;
+		return FALSE;
+	}
+
+	iov[0].iov_base = (void *) header;
+	iov[0].iov_len = head_len;
+	iovcnt = 1;
+	fill = 0;
+
+	/* Convert as much of each row as fits in the buffer, writing the buffer
+	 * out whenever it is full.
+	 */
+
+	for (v = v_pix - 1; v >= 0 && !Error; v--) {
+		row = (const unsigned char *) data +
+							(size_t) v * h_pix * stride * depth;
+		for (h = 0; h < h_pix && !Error; h += n) {
+			n = FITS_BUF_SIZE / sizeof (short) - fill;
+			n = h_pix - h < n ? h_pix - h : n;
+			fits_convert (buf + fill, row + (size_t) h * stride * depth,
+						  depth, stride, n);
+			fill += n;
+			if (fill == FITS_BUF_SIZE / sizeof (short)) {
+				iov[iovcnt].iov_base = buf;
+				iov[iovcnt].iov_len = FITS_BUF_SIZE;
+				Error = !fits_writev (fd, iov, iovcnt + 1);
+				iovcnt = fill = 0;
+			}
+		}
+	}
+
+	/* Pad the last record with zeros and write whatever is left */
+
+	if (!Error) {
+		pad = (FITS_REC_LEN - (fill * sizeof (short)) % FITS_REC_LEN) %
+																  FITS_REC_LEN;
+		memset ((char *) buf + fill * sizeof (short), 0, pad);
+		iov[iovcnt].iov_base = buf;
+		iov[iovcnt].iov_len = fill * sizeof (short) + pad;
+		Error = !fits_writev (fd, iov, iovcnt + 1);
+	}
+	if (Error)
+		err = errno;
+	if (!Locked || buf != fits_buf)
+		free (buf);
+	if (Locked)
+		pthread_mutex_unlock (&fits_mutex);
+
+	if (close (fd) < 0 && !Error) {
+		Error = TRUE;
+		err = errno;
+	}
+	errno = err;
+	return !Error;
+}
+
+int fits_is_compressed (const char *file)
+{
+	/* Return TRUE if the named file is to be written compressed, i.e. its
+	 * name ends in '.fz'.
+	 */
+
+	size_t len = strlen (file);
+
+	return len > 3 && !strcmp (file + len - 3, ".fz");
+}
+
+static int fits_write_rice (const char *file, int Append, const char *header,
+							int head_len, const void *data, int depth,
+							int stride, int h_pix, int v_pix)
+{
+	/* Write the image as a tile-compressed FITS file: an empty primary HDU
+	 * followed by a binary table extension holding the Rice-compressed rows,
+	 * which standard software (cfitsio, funpack, astropy, ds9) reads as an
+	 * ordinary image.  Each row is one tile; runs of tiles are compressed
+	 * in parallel into separate buffers, which are then written out in
+	 * order.  The values and row order are as for fits_write_image, and the
+	 * caller's header cards are carried over apart from those describing
+	 * the uncompressed data, which are replaced by their 'Z' equivalents.
+	 * If Append is TRUE, just the binary table is appended to the file, and
+	 * describes an image extension rather than a primary image.
+	 * Returns TRUE on success or FALSE with errno set.
+	 */
+
+	struct rice_job job[RICE_MAX_THREADS];
+	pthread_t thread[RICE_MAX_THREADS];
+	int started[RICE_MAX_THREADS];
+	struct iovec iov[RICE_MAX_THREADS + 4];
+	char *hdr = NULL, *key, tform[32];
+	unsigned char *table = NULL;
+	static const char zero[FITS_REC_LEN];
+	size_t heap = 0, max_len = 0, tile_max;
+	long ncpu;
+	int fd, i, t, h, n, cards, hdr_len, nthreads, iovcnt;
+	int Error = FALSE, err = 0;
+
+	/* Divide the rows between the threads and encode them */
+
+	ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	nthreads = v_pix / RICE_MIN_TILES;
+	nthreads = nthreads > ncpu ? ncpu : nthreads;
+	nthreads = nthreads > RICE_MAX_THREADS ? RICE_MAX_THREADS : nthreads;
+	nthreads = nthreads < 1 ? 1 : nthreads;
+
+	tile_max = 2 * (size_t) h_pix + h_pix / RICE_BLOCK + 4;
+	for (t = 0; t < nthreads; t++) {
+		job[t].data = data;
+		job[t].depth = depth;
+		job[t].stride = stride;
+		job[t].h_pix = h_pix;
+		job[t].v_pix = v_pix;
+		job[t].first = (long) v_pix * t / nthreads;
+		job[t].last = (long) v_pix * (t + 1) / nthreads;
+		job[t].row = malloc (h_pix * sizeof (short));
+		job[t].out = malloc ((job[t].last - job[t].first) * tile_max);
+		job[t].len = malloc ((job[t].last - job[t].first) *
+												  sizeof (unsigned int));
+		if (!job[t].row || !job[t].out || !job[t].len)
+			Error = TRUE;
+	}
+	if (!Error) {
+		for (t = 1; t < nthreads; t++)  /* Do it here if a thread fails */
+			if (!(started[t] = !pthread_create (&thread[t], NULL,
+												fits_rice_tiles, &job[t])))
+				fits_rice_tiles (&job[t]);
+		fits_rice_tiles (&job[0]);
+		for (t = 1; t < nthreads; t++)
+			if (started[t])
+				pthread_join (thread[t], NULL);
+	}
+
+	/* Build the table of (length, offset) descriptors for the tiles */
+
+	if (!Error && !(table = malloc ((size_t) v_pix * 8)))
+		Error = TRUE;
+	for (t = 0; t < nthreads && !Error; t++) {
+		for (i = 0; i < job[t].last - job[t].first; i++) {
+			n = 8 * (job[t].first + i);
+			table[n] = job[t].len[i] >> 24;
+			table[n + 1] = job[t].len[i] >> 16;
+			table[n + 2] = job[t].len[i] >> 8;
+			table[n + 3] = job[t].len[i];
+			table[n + 4] = heap >> 24;
+			table[n + 5] = heap >> 16;
+			table[n + 6] = heap >> 8;
+			table[n + 7] = heap;
+			heap += job[t].len[i];
+			max_len = job[t].len[i] > max_len ? job[t].len[i] : max_len;
+		}
+	}
+
+	/* Make the headers: the primary HDU first (unless appending), then the
+	 * table extension with the caller's cards appended.
+	 */
+
+	cards = 30 + head_len / FITS_CARD_LEN;
+	hdr_len = FITS_REC_LEN + (cards * FITS_CARD_LEN + FITS_REC_LEN - 1) /
+											   FITS_REC_LEN * FITS_REC_LEN;
+	if (!Error && !(hdr = malloc (hdr_len)))
+		Error = TRUE;
+	if (!Error) {
+		memset (hdr, ' ', hdr_len);
+		h = 0;
+		if (!Append) {
+			fits_card (hdr, &h, "SIMPLE  =                    T /"
+								"   Standard conforming file");
+			fits_card (hdr, &h, "BITPIX  =                   16 /"
+								"   16 bits per pixel");
+			fits_card (hdr, &h, "NAXIS   =                    0 /"
+								"   no data in primary HDU");
+			fits_card (hdr, &h, "EXTEND  =                    T /"
+								"   image is in extension");
+			fits_card (hdr, &h, "END");
+			h = FITS_REC_LEN;
+		}
+		fits_card (hdr, &h, "XTENSION= 'BINTABLE'           /"
+							"   binary table extension");
+		fits_card (hdr, &h, "BITPIX  =                    8 /"
+							"   8-bit bytes");
+		fits_card (hdr, &h, "NAXIS   =                    2 /"
+							"   2-dimensional binary table");
+		fits_card (hdr, &h, "NAXIS1  =                    8 /"
+							"   width of table in bytes");
+		fits_card (hdr, &h, "NAXIS2  = %20i /   number of rows in table",
+				   v_pix);
+		fits_card (hdr, &h, "PCOUNT  = %20lu /   size of heap",
+				   (unsigned long) heap);
+		fits_card (hdr, &h, "GCOUNT  =                    1 /"
+							"   one data group");
+		fits_card (hdr, &h, "TFIELDS =                    1 /"
+							"   number of fields in each row");
+		fits_card (hdr, &h, "TTYPE1  = 'COMPRESSED_DATA'    /"
+							"   label for field 1");
+		snprintf (tform, sizeof (tform), "'1PB(%lu)'", (unsigned long) max_len);
+		fits_card (hdr, &h, "TFORM1  = %-20s /   data format of field", tform);
+		fits_card (hdr, &h, "ZIMAGE  =                    T /"
+							"   extension contains compressed image");
+		if (Append) {
+			fits_card (hdr, &h, "ZTENSION= 'IMAGE   '           /"
+								"   original extension type");
+			fits_card (hdr, &h, "ZPCOUNT =                    0 /"
+								"   original PCOUNT");
+			fits_card (hdr, &h, "ZGCOUNT =                    1 /"
+								"   original GCOUNT");
+		} else
+			fits_card (hdr, &h, "ZSIMPLE =                    T /"
+								"   file does conform to FITS standard");
+		fits_card (hdr, &h, "ZBITPIX =                   16 /"
+							"   data type of original image");
+		fits_card (hdr, &h, "ZNAXIS  =                    2 /"
+							"   dimension of original image");
+		fits_card (hdr, &h, "ZNAXIS1 = %20i /   length of original image axis",
+				   h_pix);
+		fits_card (hdr, &h, "ZNAXIS2 = %20i /   length of original image axis",
+				   v_pix);
+		fits_card (hdr, &h, "ZTILE1  = %20i /   size of tiles to be compressed",
+				   h_pix);
+		fits_card (hdr, &h, "ZTILE2  =                    1 /"
+							"   size of tiles to be compressed");
+		fits_card (hdr, &h, "ZCMPTYPE= 'RICE_1'             /"
+							"   compression algorithm");
+		fits_card (hdr, &h, "ZNAME1  = 'BLOCKSIZE'          /"
+							"   compression block size");
+		fits_card (hdr, &h, "ZVAL1   = %20i /   pixels per block", RICE_BLOCK);
+		fits_card (hdr, &h, "ZNAME2  = 'BYTEPIX '           /"
+							"   bytes per pixel");
+		fits_card (hdr, &h, "ZVAL2   =                    2 /"
+							"   bytes per pixel");
+		for (i = 0; i < head_len; i += FITS_CARD_LEN) {
+			key = (char *) header + i;
+			if (!strncmp (key, "END     ", 8))
+				break;
+			if (!strncmp (key, "SIMPLE  ", 8) ||
+				!strncmp (key, "XTENSION", 8) ||
+				!strncmp (key, "BITPIX  ", 8) ||
+				!strncmp (key, "NAXIS", 5) || !strncmp (key, "EXTEND  ", 8) ||
+				!strncmp (key, "PCOUNT  ", 8) || !strncmp (key, "GCOUNT  ", 8))
+				continue;
+			memcpy (hdr + h, key, FITS_CARD_LEN);
+			h += FITS_CARD_LEN;
+		}
+		fits_card (hdr, &h, "END");
+		hdr_len = (h + FITS_REC_LEN - 1) / FITS_REC_LEN * FITS_REC_LEN;
+	}
+
+	/* Write the headers, table, heap and padding in one go */
+
+	if (!Error) {
+		if ((fd = open (file, O_WRONLY | O_CREAT |
+						(Append ? O_APPEND : O_TRUNC), 0644)) < 0) {
+			Error = TRUE;
+			err = errno;
+		} else {
+			iov[0].iov_base = hdr;
+			iov[0].iov_len = hdr_len;
+			iov[1].iov_base = table;
+			iov[1].iov_len = (size_t) v_pix * 8;
+			for (t = 0, iovcnt = 2; t < nthreads; t++, iovcnt++) {
+				iov[iovcnt].iov_base = job[t].out;
+				iov[iovcnt].iov_len = job[t].total;
+			}
+			iov[iovcnt].iov_base = (void *) zero;
+			iov[iovcnt++].iov_len = (FITS_REC_LEN - ((size_t) v_pix * 8 +
+									 heap) % FITS_REC_LEN) % FITS_REC_LEN;
+			Error = !fits_writev (fd, iov, iovcnt);
+			if (Error)
+				err = errno;
+			if (close (fd) < 0 && !Error) {
+				Error = TRUE;
+				err = errno;
+			}
+		}
+	} else
+		err = ENOMEM;
+
+	for (t = 0; t < nthreads; t++) {
+		free (job[t].row);
+		free (job[t].out);
+		free (job[t].len);
+	}
+	free (table);
+	free (hdr);
+	errno = err;
+	return !Error;
+}
+
+static void *fits_rice_tiles (void *data)
+{
+	/* Thread function to compress a run of tiles (rows) end to end into
+	 * job->out.  The values are offset in the same way as for the
+	 * uncompressed image, but kept in native byte order.
+	 */
+
+	struct rice_job *job = data;
+	const unsigned char *row;
+	unsigned char *p = job->out;
+	int t, i;
+
+	for (t = job->first; t < job->last; t++) {
+		row = job->data + (size_t) (job->v_pix - 1 - t) * job->h_pix *
+												  job->stride * job->depth;
+		if (job->depth == 1)
+			for (i = 0; i < job->h_pix; i++)
+				job->row[i] = row[i * job->stride] ^ 0x8000;
+		else
+			for (i = 0; i < job->h_pix; i++)
+				job->row[i] = ((const unsigned short *) row)[i * job->stride] ^
+																	  0x8000;
+		job->len[t - job->first] = fits_rice_encode (p, job->row, job->h_pix);
+		p += job->len[t - job->first];
+	}
+	job->total = p - job->out;
+	return NULL;
+}
+
+static size_t fits_rice_encode (unsigned char *out, const short *a, int n)
+{
+	/* Rice-compress n 16-bit values into 'out', returning the number of
+	 * bytes written.  This is the RICE_1 format of cfitsio's fits_rcomp_short:
+	 * the first value is stored as it is, then the differences between
+	 * successive values, mapped to non-negative numbers, are coded in blocks
+	 * of RICE_BLOCK.  Each block starts with a 4-bit code giving the number
+	 * of low bits (fs) that are stored directly; the rest of each value is
+	 * stored in unary.  Code 0 marks a block of zero differences and code
+	 * RICE_FSMAX + 1 a block of raw 16-bit differences.  The output is at
+	 * most 2n + n / RICE_BLOCK + 4 bytes long.
+	 */
+
+	struct rice_bits b;
+	unsigned int diff[RICE_BLOCK], sum, psum, top;
+	short last, d;
+	int i, j, len, fs;
+
+	b.p = out;
+	b.buf = 0;
+	b.n = 0;
+	if (n <= 0)
+		return 0;
+
+	fits_rice_put (&b, (unsigned short) a[0], 16);
+	last = a[0];
+
+	for (i = 0; i < n; i += RICE_BLOCK) {
+		len = n - i < RICE_BLOCK ? n - i : RICE_BLOCK;
+
+		/* Map the differences to non-negative numbers: 0, -1, 1, -2, 2...
+		 * become 0, 1, 2, 3, 4...
+		 */
+
+		for (sum = 0, j = 0; j < len; j++) {
+			d = a[i + j] - last;
+			last = a[i + j];
+			diff[j] = d < 0 ? ~(d * 2) & 0xffff : d * 2;
+			sum += diff[j];
+		}
+
+		/* Choose the split from the mean difference */
+
+		psum = sum > (unsigned int) len / 2 + 1 ?
+							(sum - len / 2 - 1) / len >> 1 : 0;
+		for (fs = 0; psum; fs++)
+			psum >>= 1;
+
+		if (fs >= RICE_FSMAX) {
+			fits_rice_put (&b, RICE_FSMAX + 1, 4);
+			for (j = 0; j < len; j++)
+				fits_rice_put (&b, diff[j], 16);
+		} else if (!sum) {
+			fits_rice_put (&b, 0, 4);
+		} else {
+			fits_rice_put (&b, fs + 1, 4);
+			for (j = 0; j < len; j++) {
+				for (top = diff[j] >> fs; top >= 16; top -= 16)
+					fits_rice_put (&b, 0, 16);
+				fits_rice_put (&b, 1, top + 1);
+				if (fs)
+					fits_rice_put (&b, diff[j], fs);
+			}
+		}
+	}
+
+	if (b.n)
+		*b.p++ = b.buf << (8 - b.n);
+	return b.p - out;
+}
+
+static void fits_rice_put (struct rice_bits *b, unsigned int val, int nbits)
+{
+	/* Append the low nbits (up to 16) of val to the bit stream, most
+	 * significant bit first, writing out each byte as it is completed.
+	 */
+
+	b->buf = b->buf << nbits | (val & ((1U << nbits) - 1));
+	b->n += nbits;
+	while (b->n >= 8) {
+		b->n -= 8;
+		*b->p++ = b->buf >> b->n;
+	}
+}
+
+static void fits_convert (unsigned short *dst, const void *src, int depth,
+						  int stride, int n)
+{
+	/* Convert n values to FITS format: subtract the offset (the same as
+	 * flipping the top bit) and store big-endian.  Contiguous 16-bit data
+	 * are done eight values at a time with NEON or SSE2 if available.
+	 */
+
+	const unsigned short *s16 = (const unsigned short *) src;
+	const unsigned char *s8 = (const unsigned char *) src;
+	unsigned char *d8 = (unsigned char *) dst;
+	unsigned short val;
+	int i = 0;
+
+	if (depth == 1) {
+		for (; i < n; i++) {
+			val = s8[i * stride] ^ 0x8000;
+			d8[2 * i] = val >> 8;
+			d8[2 * i + 1] = val & 0xff;
+		}
+		return;
+	}
+
+	if (stride == 1) {
+#if defined (FITS_NEON)
+		uint16x8_t v, m = vdupq_n_u16 (0x8000);
+
+		for (; i + 8 <= n; i += 8) {
+			v = veorq_u16 (vld1q_u16 (s16 + i), m);
+			vst1q_u16 (dst + i, vreinterpretq_u16_u8 (
+								vrev16q_u8 (vreinterpretq_u8_u16 (v))));
+		}
+#elif defined (FITS_SSE2)
+		__m128i v, m = _mm_set1_epi16 ((short) 0x8000);
+
+		for (; i + 8 <= n; i += 8) {
+			v = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (s16 + i)),
+							   m);
+			v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+			_mm_storeu_si128 ((__m128i *) (dst + i), v);
+		}
+#endif
+	}
+
+	for (; i < n; i++) {
+		val = s16[i * stride] ^ 0x8000;
+		d8[2 * i] = val >> 8;
+		d8[2 * i + 1] = val & 0xff;
+	}
+}
+
+static int fits_writev (int fd, struct iovec *iov, int iovcnt)
+{
+	/* Write out all of the given buffers, allowing for partial writes */
+
+	ssize_t n;
+
+	while (iovcnt) {
+		if ((n = writev (fd, iov, iovcnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		while (iovcnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return TRUE;
+}
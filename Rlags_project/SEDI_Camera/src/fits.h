@@ -0,0 +1,39 @@
+/******************************************************************************/
+/*                      HEADER FILE FOR FITS FILE WRITER                      */
+/*                                                                            */
+/* Header file for the FITS file writer shared by GoQat and sedid.            */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef GOQAT_FITS_H
+#define GOQAT_FITS_H
+
+#define FITS_REC_LEN 2880                 /* Length of a FITS logical record  */
+#define FITS_CARD_LEN 80                  /* Length of a header card image    */
+#define FITS_OFFSET 32768                 /* BZERO for unsigned 16-bit data   */
+
+extern void fits_card (char *header, int *h, const char *fmt, ...);
+extern int fits_write_image (const char *file, const char *header,
+							 int head_len, const void *data, int depth,
+							 int stride, int h_pix, int v_pix);
+extern int fits_append_image (const char *file, const char *header,
+							  int head_len, const void *data, int depth,
+							  int stride, int h_pix, int v_pix);
+extern int fits_is_compressed (const char *file);
+
+#endif /* GOQAT_FITS_H */
@@ -30,6 +30,7 @@
 #ifdef HAVE_LIBUSB
 
 #include <pthread.h>
+#include <time.h>
 
 #include "gqusb.h"
 
@@ -37,6 +38,13 @@
 #define FALSE 0
 
 #define GQUSB_BULK_TIMEOUT 1000
+#define GQUSB_READ_STALL 10.0   /* Seconds without data before giving up     */
+
+struct gqusb_urb {              /* One bulk read transfer of an async read   */
+	struct libusb_transfer *xfer;
+	int busy;                   /* TRUE while submitted                      */
+	int done;                   /* Set by gqusb_urb_done when complete       */
+};
 
 static struct libusb_context *gqctx;
 static struct libusb_device **devices;
@@ -59,6 +67,14 @@ int gqusb_bulk_write_unlock (struct usbdevice *u_dev, unsigned char *data,
 							 int length);
 int gqusb_bulk_io (struct usbdevice *u_dev, unsigned char *wdata, int wlength,
 										    unsigned char *rdata, int rlength);
+int gqusb_bulk_io_async (struct usbdevice *u_dev, 
+						 unsigned char *wdata, int wlength,
+						 unsigned char *rdata, int rlength,
+						 void (*chunk_func) (void *data, int offset, int length),
+						 void *data);
+static void LIBUSB_CALL gqusb_urb_done (struct libusb_transfer *xfer);
+static void gqusb_cancel_urbs (struct gqusb_urb urb[]);
+static double gqusb_elapsed (struct timespec *since);
 
 
 /******************************************************************************/
@@ -465,5 +481,212 @@ io_error:
 	return FALSE;
 }
 
+int gqusb_bulk_io_async (struct usbdevice *u_dev, 
+						 unsigned char *wdata, int wlength,
+						 unsigned char *rdata, int rlength,
+						 void (*chunk_func) (void *data, int offset, int length),
+						 void *data)
+{
+	/* As gqusb_bulk_io, but for large reads such as image downloads.  Instead
+	 * of one synchronous transfer, the read is split into GQUSB_URB_SIZE
+	 * pieces and GQUSB_NUM_URBS of them are kept queued on the endpoint, so
+	 * the device never waits for the host between transfers.  Each transfer
+	 * reads straight into its place in rdata.  Transfers on a bulk endpoint
+	 * complete in the order they were submitted; as each one completes,
+	 * chunk_func (if not NULL) is called with the offset and length of the new
+	 * data, so the caller can process the start of the buffer while the rest 
+	 * is still arriving.  The read fails if no data arrives for 
+	 * GQUSB_READ_STALL seconds, rather than waiting forever.  The size of the 
+	 * read and the time it took are left in u_dev->read_bytes and 
+	 * u_dev->read_secs.
+	 */
+	
+	struct gqusb_urb urb[GQUSB_NUM_URBS];
+	struct gqusb_urb *u;
+	struct timespec start, last;
+	struct timeval tv;
+	int i, err, tr, last_state, head, next, len, inflight, Failed;
+	
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &last_state);
+	pthread_mutex_lock (&u_dev->io_mutex);
+	
+	u_dev->func = __func__;
+	u_dev->err = NULL;
+	
+	if (wlength) {
+		if (!u_dev->output.num) {
+			u_dev->err = "No output endpoint!";
+			goto io_error;
+		}
+		
+		err = libusb_bulk_transfer (u_dev->handle,
+									u_dev->output.address,
+									wdata,
+									wlength, 
+									&tr,
+									GQUSB_BULK_TIMEOUT);
+		if (err != 0) {
+			u_dev->err = "Error writing to device";
+			goto io_error;
+		}
+		if (tr < wlength) {
+			u_dev->err = "Insufficient data written to device";
+			goto io_error;
+		}
+	}
+	
+	if (!rlength)
+		goto io_done;
+	if (!u_dev->input.num) {
+		u_dev->err = "No input endpoint!";
+		goto io_error;
+	}
+	
+	for (i = 0; i < GQUSB_NUM_URBS; i++) {
+		urb[i].busy = FALSE;
+		urb[i].done = FALSE;
+		urb[i].xfer = libusb_alloc_transfer (0);
+	}
+	
+	/* Queue the first transfers */
+	
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	last = start;
+	Failed = FALSE;
+	inflight = 0;
+	for (next = 0, i = 0; i < GQUSB_NUM_URBS && next < rlength; i++) {
+		u = &urb[i];
+		if (!u->xfer) {
+			u_dev->err = "Unable to allocate USB transfer";
+			Failed = TRUE;
+			break;
+		}
+		len = rlength - next < GQUSB_URB_SIZE ? rlength - next : GQUSB_URB_SIZE;
+		libusb_fill_bulk_transfer (u->xfer, u_dev->handle, u_dev->input.address,
+								   rdata + next, len, gqusb_urb_done, u, 0);
+		if (libusb_submit_transfer (u->xfer)) {
+			u_dev->err = "Error reading from device";
+			Failed = TRUE;
+			break;
+		}
+		u->busy = TRUE;
+		inflight++;
+		next += len;
+	}
+	if (Failed)
+		gqusb_cancel_urbs (urb);
+	
+	/* Deal with each transfer in turn as it completes, and re-queue it for
+	 * the next part of the buffer.  After a failure, just wait for any
+	 * cancelled transfers to finish; they still point into rdata.
+	 */
+	
+	head = 0;
+	while (inflight) {
+		u = &urb[head];
+		if (!u->busy) {
+			head = (head + 1) % GQUSB_NUM_URBS;
+			continue;
+		}
+		if (!u->done) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			libusb_handle_events_timeout_completed (gqctx, &tv, &u->done);
+			if (!u->done && !Failed && 
+				gqusb_elapsed (&last) > GQUSB_READ_STALL) {
+				u_dev->err = "Timed out reading from device";
+				Failed = TRUE;
+				gqusb_cancel_urbs (urb);
+			}
+			continue;
+		}
+		
+		u->busy = FALSE;
+		u->done = FALSE;
+		inflight--;
+		clock_gettime (CLOCK_MONOTONIC, &last);
+		
+		if (!Failed) {
+			if (u->xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+				u_dev->err = "Error reading from device";
+				Failed = TRUE;
+			} else if (u->xfer->actual_length < u->xfer->length) {
+				u_dev->err = "Insufficient data returned from device";
+				Failed = TRUE;
+			}
+			if (Failed) {
+				gqusb_cancel_urbs (urb);
+			} else {
+				if (chunk_func)
+					chunk_func (data, u->xfer->buffer - rdata, 
+								u->xfer->actual_length);
+				if (next < rlength) {
+					len = rlength - next < GQUSB_URB_SIZE ? 
+										   rlength - next : GQUSB_URB_SIZE;
+					libusb_fill_bulk_transfer (u->xfer, u_dev->handle, 
+											   u_dev->input.address, 
+											   rdata + next, len, 
+											   gqusb_urb_done, u, 0);
+					if (libusb_submit_transfer (u->xfer)) {
+						u_dev->err = "Error reading from device";
+						Failed = TRUE;
+						gqusb_cancel_urbs (urb);
+					} else {
+						u->busy = TRUE;
+						inflight++;
+						next += len;
+					}
+				}
+			}
+		}
+		head = (head + 1) % GQUSB_NUM_URBS;
+	}
+	
+	for (i = 0; i < GQUSB_NUM_URBS; i++)
+		if (urb[i].xfer)
+			libusb_free_transfer (urb[i].xfer);
+	if (Failed)
+		goto io_error;
+	
+	u_dev->read_bytes = rlength;
+	u_dev->read_secs = gqusb_elapsed (&start);
+
+io_done:
+	pthread_mutex_unlock (&u_dev->io_mutex);
+	pthread_setcancelstate (last_state, NULL);
+	return TRUE;
+	
+io_error:
+	pthread_mutex_unlock (&u_dev->io_mutex);
+	pthread_setcancelstate (last_state, NULL);
+	return FALSE;
+}
+
+static void LIBUSB_CALL gqusb_urb_done (struct libusb_transfer *xfer)
+{
+	/* Transfer completion callback, called from libusb_handle_events_* */
+	
+	((struct gqusb_urb *) xfer->user_data)->done = TRUE;
+}
+
+static void gqusb_cancel_urbs (struct gqusb_urb urb[])
+{
+	/* Cancel every transfer that is still queued */
+	
+	int i;
+	
+	for (i = 0; i < GQUSB_NUM_URBS; i++)
+		if (urb[i].busy && !urb[i].done)
+			libusb_cancel_transfer (urb[i].xfer);
+}
+
+static double gqusb_elapsed (struct timespec *since)
+{
+	struct timespec now;
+	
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
 #endif /* HAVE_LIBUSB */
 
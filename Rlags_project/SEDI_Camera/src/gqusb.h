@@ -32,6 +32,9 @@
 #ifdef HAVE_LIBUSB
 #include <libusb-1.0/libusb.h>
 
+#define GQUSB_NUM_URBS 4                  /* Bulk reads kept in flight        */
+#define GQUSB_URB_SIZE 65536              /* Bytes per bulk read transfer     */
+
 struct uendpoint {                        /* USB endpoint                     */
 	unsigned char address;
 	int num;
@@ -48,6 +51,8 @@ struct usbdevice {
 	int idx;                          /* Index in array of device descriptions*/
 	const char *func;                     /* Name of current gqusb function   */
 	char *err;                            /* Error message                    */
+	long read_bytes;                      /* Bytes in last async bulk read    */
+	double read_secs;                     /* ...and time taken to read them   */
 };
 
 extern void gqusb_init (void);
@@ -67,6 +72,12 @@ extern int gqusb_bulk_write_unlock (struct usbdevice *u_dev,unsigned char *data,
 extern int gqusb_bulk_io (struct usbdevice *u_dev, 
 						  unsigned char *wdata, int wlength,
 						  unsigned char *rdata, int rlength);
+extern int gqusb_bulk_io_async (struct usbdevice *u_dev, 
+								unsigned char *wdata, int wlength,
+								unsigned char *rdata, int rlength,
+								void (*chunk_func) (void *data, int offset, 
+													int length),
+								void *data);
 								
 #endif /* HAVE_LIBUSB */
 #endif /* GOQAT_USB */
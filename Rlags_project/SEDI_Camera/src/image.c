@@ -35,6 +35,13 @@
 #include <errno.h>
 #include <locale.h>
 #include <math.h>
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGE_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define IMAGE_SSE2
+#endif
 #ifdef HAVE_LIBGRACE_NP
 #include <grace_np.h>
 #endif
@@ -46,9 +53,32 @@ static XPA xpa;
 
 #define GOQAT_IMAGE
 #include "interface.h"
+#include "fits.h"
+#include "calib.h"
 
 #define DS9_CCD "CCD_Image"          /* DS9 window title for CCD image        */
 #define DS9_AUG "Autoguider_Image"   /* DS9 window title for autoguider image */
+#define STATS_MAX_THREADS 4          /* Max. threads for image statistics     */
+#define STATS_MIN_PIXELS 262144      /* Min. pixels per statistics thread     */
+#define CSIZE_MAX 99                 /* Max. autoguider centroid box size     */
+
+struct stats_strip {                 /* Partial statistics for a strip of rows*/
+	gushort *data;                   /* Image data                            */
+	gint h_pix;                      /* Pixels per row                        */
+	gint row0, rows;                 /* First row and number of rows in strip */
+	guint *hist;                     /* Histogram for this strip              */
+	gushort min, max, max_h, max_v;  /* Min., max. and location of max.       */
+	guint64 sum, sumsq;              /* Sum and sum of squares of values      */
+};
+
+static struct {                      /* Autoguider centroid, kept for display */
+	gushort hc1, hc2, vc1, vc2;      /* Centroid box                          */
+	gdouble flux_h[CSIZE_MAX];       /* Sum of each column in box...          */
+	gdouble flux_v[CSIZE_MAX];       /*  ...and of each row                   */
+	gfloat shift_h, shift_v;         /* Shift since selection rectangle drawn */
+	gfloat rms_h, rms_v;             /* RMS shift                             */
+	gboolean Valid;                  /* TRUE if calculated since last display */
+} cen;
 
 #ifdef HAVE_LIBGRACE_NP
 static gboolean G_Error = FALSE;     /* TRUE if Grace plotting error occurs   */
@@ -69,13 +99,20 @@ gboolean xpa_display_image (struct cam_img *img, enum Colour colour);
 gboolean xpa_get_rect_coords (gfloat *x, gfloat *y, gfloat *w, gfloat *h);
 static gboolean xpa_messages (gint i, gchar *bufs[], gchar *names[], 
 							  gchar *messages[]);
+gboolean image_calc_centroid (void);
 gboolean image_calc_hist_and_flux (void);
 gboolean is_in_image (struct cam_img *img, gushort *xoff1, gushort *yoff1,
 	                                       gushort *xoff2, gushort *yoff2);
 void image_get_stats (struct cam_img *img, enum ColsPix c);
+static gpointer image_get_strip_stats (gpointer data);
 gboolean image_embed_data (struct cam_img *img);
+static void image_fill (gushort *dst, gushort val, guint n);
+static void image_expand_row (gushort *dst, const gushort *src, guint n,
+							  guint bin);
 gboolean image_save_as_fits (struct cam_img *img, gchar *savefile, 
 	                         enum Colour colour, gboolean display);
+gint image_fits_header (struct cam_img *img, gchar *header, 
+	                    enum Colour colour, gboolean display);
 #ifdef HAVE_LIBGRACE_NP
 gboolean Grace_Open (gchar *plot, gboolean *AlreadyOpen);
 void Grace_SetXAxis (gushort graph, gfloat xmin, gfloat xmax);
@@ -459,17 +496,126 @@ static gboolean xpa_messages (gint i, gchar *bufs[], gchar *names[],
 	return xpa_error;
 }
 
+gboolean image_calc_centroid (void)
+{
+	/* Calculate the mean x and y positions (centroid) of the data in the 
+	 * centroid area, centred on the brightest pixel in the selection 
+	 * rectangle.  The sky background estimate plus the requested number of
+	 * standard deviations is subtracted from each pixel first, clipping at
+	 * zero.  This is done for every autoguider frame, so it makes just one
+	 * pass over the centroid area, keeping the sum of each column and row for
+	 * the flux plots drawn by image_calc_hist_and_flux.  Note that the raw
+	 * camera data may have had the background level globally subtracted using
+	 * the slider in the autoguider window, and/or may be dark-subtracted.
+	 */
+	
+	struct cam_img *aug = get_aug_image_struct ();
+	
+	gushort xo1, xo2, yo1, yo2, csemi;
+	gushort h, v, *row;
+	gint val, bg;
+	static guint numframes, reset_time = 0;
+	static gfloat init_h, init_v;
+	gdouble sumv, sigmah = 0.0, sigmav = 0.0, sum = 0.0;
+
+	/* Return if there's no image presently displayed */
+	
+	if (!aug->canv.cviImage)
+		return TRUE;
+	
+	/* Get the coordinates of the area of overlap between selection rectangle
+	 * and image.  It's not a fatal error if there's no overlap, so return
+	 * without doing anything.
+	 */
+	
+	if (!is_in_image (aug, &xo1, &yo1, &xo2, &yo2))
+		return TRUE;
+	
+	/* Get the coordinates of the centroid box, constraining it to within
+	 * the boundaries of the image.
+	 */
+	
+	csemi = (MIN (aug->canv.csize, CSIZE_MAX) - 1) / 2;
+	cen.hc1 = aug->rect.max[GREY].h - csemi > 0 ? 
+								   aug->rect.max[GREY].h - csemi : 0;
+	cen.hc2 = MIN (aug->rect.max[GREY].h + csemi, aug->exd.h_pix - 1);
+	cen.vc1 = aug->rect.max[GREY].v - csemi > 0 ? 
+								   aug->rect.max[GREY].v - csemi : 0;
+	cen.vc2 = MIN (aug->rect.max[GREY].v + csemi, aug->exd.v_pix - 1);
+	
+	/* Sum the background-subtracted values in each column and row */
+	
+	bg = aug->rect.stdev[GREY].median + 
+		 (gushort) (aug->imdisp.stdev * aug->rect.stdev[GREY].val);
+	memset (cen.flux_h, 0, sizeof (cen.flux_h));
+	for (v = cen.vc1; v <= cen.vc2; v++) {
+		row = aug->ff161 + aug->exd.h_pix * v;
+		for (h = cen.hc1, sumv = 0.0; h <= cen.hc2; h++) {
+			val = MAX ((gint) row[h] - bg, 0);
+			cen.flux_h[h - cen.hc1] += val;
+			sumv += val;
+		}
+		cen.flux_v[v - cen.vc1] = sumv;
+		sigmav += (v - cen.vc1) * sumv;
+		sum += sumv;
+	}
+	for (h = cen.hc1; h <= cen.hc2; h++)
+		sigmah += (h - cen.hc1) * cen.flux_h[h - cen.hc1];
+	
+	aug->rect.mean[GREY].h = cen.hc1 + (gfloat) (sigmah / sum); /* Mean h pos */
+	aug->rect.mean[GREY].v = cen.vc1 + (gfloat) (sigmav / sum); /* Mean v pos */
+	
+	/* Calculate the rms shift in the centroid position */
+		
+	if (aug->canv.NewRect || isnan (cen.rms_h) || isnan (cen.rms_v)) {
+		numframes = 0;
+		cen.rms_h = 0.0;
+		cen.rms_v = 0.0;
+		aug->exd.frame_rate = 0;
+		init_h = aug->rect.mean[GREY].h;
+		init_v = aug->rect.mean[GREY].v;
+		reset_time = loop_elapsed_since_first_iteration ();
+	}
+	
+	numframes++;
+	cen.shift_h = aug->rect.mean[GREY].h - init_h;
+	cen.shift_v = aug->rect.mean[GREY].v - init_v;
+	cen.rms_h = sqrt ((cen.rms_h * cen.rms_h * (numframes - 1) + 
+					   cen.shift_h * cen.shift_h) / numframes);
+	cen.rms_v = sqrt ((cen.rms_v * cen.rms_v * (numframes - 1) + 
+					   cen.shift_v * cen.shift_v) / numframes);
+	
+	/* Calculate the shift North/South and East/West since the selection
+	 * rectangle was last re-drawn.
+	 */
+	
+	aug->rect.shift_ns = cen.shift_h * aug->autog.s.Uvec_N[0] + 
+	                     cen.shift_v * aug->autog.s.Uvec_N[1];
+	/* Want a shift east to be negative by default on the trace display and in*/
+	/* the star positions file (i.e. for north up and east left, star moves to*/
+	/* lower pixel numbers on the display when going east (left).             */ 
+	aug->rect.shift_ew = - (cen.shift_h * aug->autog.s.Uvec_E[0] + 
+	                        cen.shift_v * aug->autog.s.Uvec_E[1]);
+	                        
+	/* Calculate average frame rate */
+	
+	aug->exd.frame_rate = (numframes - 1) * 1000.0 / 
+			       (loop_elapsed_since_first_iteration () - reset_time);
+			       
+	aug->canv.NewRect = FALSE;
+	cen.Valid = TRUE;
+	return TRUE;
+}
+
 gboolean image_calc_hist_and_flux (void)
 {
 	/* Generate histogram plot of the data within the selection rectangle and x 
-	 * and y flux plots of the data within the centroid area.  Each point in the
-	 * x flux plot is the sum of each column, and each point in the y flux plot 
-	 * is the sum of each row.  Also calculate the mean x and y positions 
-	 * (centroid) of the data in the centroid area.  Note that the raw camera 
-	 * data may have had the background level globally subtracted using the 
-	 * slider in the autoguider window, and/or may be dark-subtracted.  The 
-	 * Image window is shown/hidden after being created, so pointers are freed 
-	 * when the application ends.
+	 * and y flux plots of the data within the centroid area, using the sums
+	 * kept by image_calc_centroid.  Each point in the x flux plot is the sum
+	 * of each column, and each point in the y flux plot is the sum of each
+	 * row.  This is called at a lower rate than image_calc_centroid, since
+	 * it only updates the display.  The Image window is shown/hidden after 
+	 * being created, so pointers are freed when the application ends.
 	 */
 	
 	struct cam_img *aug = get_aug_image_struct ();
@@ -484,29 +630,16 @@ gboolean image_calc_hist_and_flux (void)
 	static GooCanvasItem *cviVPlotMax = NULL;
 	static GooCanvasItem *cviHLabel = NULL;
 	static GooCanvasItem *cviVLabel = NULL;
-	gushort xo1, xo2, yo1, yo2;
-	gushort hc1, hc2, vc1, vc2, csemi;
-	gushort h, v, val, hp, vp;
-	static guint numframes, reset_time = 0;
+	gushort hp, vp;
 	guint i, j, k;
 	guint counts[BOXSIZE], peak = 0;
-	static gfloat init_h, init_v, shift_h, shift_v;
-	static gfloat rms_h = 0, rms_v = 0;
 	gdouble maxh = 0.0, maxv = 0.0;
-	gdouble sumh = 0.0, sigmah = 0.0, sumv = 0.0, sigmav = 0.0;
 
-	/* Return if there's no image presently displayed */
+	/* Return if the centroid hasn't been calculated for this image */
 	
-	if (!aug->canv.cviImage)
-		return TRUE;
-	
-	/* Get the coordinates of the area of overlap between selection rectangle
-	 * and image.  It's not a fatal error if there's no overlap, so return
-	 * without doing anything.
-	 */
-	
-	if (!is_in_image (aug, &xo1, &yo1, &xo2, &yo2))
+	if (!cen.Valid)
 		return TRUE;
+	cen.Valid = FALSE;
 	
 	/* Set up histogram points structure and scale the points values so that it
 	 * displays in the right place on the canvas.  This is un-ref'd in the call 
@@ -550,70 +683,31 @@ gboolean image_calc_hist_and_flux (void)
 	                                     "red",
 	                                     cviHistScale);
 	
-	/* Get the coordinates of the centroid box, constraining it to within
-	 * the boundaries of the image.
-	 */
-	
-	csemi = (aug->canv.csize - 1) / 2;
-	hc1 = aug->rect.max[GREY].h - csemi > 0 ? aug->rect.max[GREY].h - csemi : 0;
-	hc2 = aug->rect.max[GREY].h + csemi < aug->exd.h_pix ? 
-								 aug->rect.max[GREY].h + csemi : aug->exd.h_pix;
-	vc1 = aug->rect.max[GREY].v - csemi > 0 ? aug->rect.max[GREY].v - csemi : 0;
-	vc2 = aug->rect.max[GREY].v + csemi < aug->exd.v_pix ? 
-								 aug->rect.max[GREY].v + csemi : aug->exd.v_pix;
-	hp = hc2 - hc1 + 1;
-	vp = vc2 - vc1 + 1;
-	
 	/* Set up the flux plot points structures.  They are un-ref'd in the call to 
 	 * ui_show_augcanv_plot later - no need to un-ref them here.
 	 */
 	
+	hp = cen.hc2 - cen.hc1 + 1;
+	vp = cen.vc2 - cen.vc1 + 1;
 	cvpHFlux = goo_canvas_points_new (hp * 2);
-	for (i = 0; i <  hp * 4; i++)
-		cvpHFlux->coords[i] = 0;	
-
 	cvpVFlux = goo_canvas_points_new (vp * 2);
-	for (i = 0; i <  vp * 4; i++)
-		cvpVFlux->coords[i] = 0;
 	
 	/* Now do flux plots... The coords arrays contain the 'x' values for the
      * plot in the even-numbered indices and the 'y' values in the odd-numbered 
-	 * indices.  Here we are storing just the 'y' values for the time being, but
-	 * since the flux plots are drawn as a series of horizontal bars for each
-	 * 'y' value, we have to store each 'y' value twice (in successive slots).
-	 * The contents of the flux coords arrays are used for the centroid 
-	 * calculation, so we subtract the sky background estimate first.
-	 */
-	
-	for (v = vc1, i = 1; v <= vc2; v++, i += 4)
-		for (h = hc1, j = 1; h <= hc2; h++, j += 4) {		
-			val = aug->ff161[aug->exd.h_pix * v + h];
-			val = MAX ((gint) val - (aug->rect.stdev[GREY].median +
-				  (gushort)(aug->imdisp.stdev * aug->rect.stdev[GREY].val)), 0);
-			cvpHFlux->coords[j] += val;
-			cvpHFlux->coords[j + 2] += val;
-			cvpVFlux->coords[i] += val;      /* Could reverse this too, to    */
-			cvpVFlux->coords[i + 2] += val;  /* match reversed v-coordinate!  */
-		}
-				
-	/* Determine maximum value for each flux plot.  Also find weighted h and v
-	 * positions of maximum flux.  Then set bin contents so that the flux plots 
-	 * display in the correct place.
+	 * indices.  Since the flux plots are drawn as a series of horizontal bars
+	 * for each 'y' value, we have to store each 'y' value twice (in successive
+	 * slots).  Determine maximum value for each flux plot, and then set bin 
+	 * contents so that the flux plots display in the correct place.
 	 */
 		
 	/* X flux plot ... */
 
-	for (h = 1, j = 1; j < 4 * hp; j += 4) {
-		maxh = MAX (cvpHFlux->coords[j], maxh);
-		sigmah += h++ * cvpHFlux->coords[j];
-		sumh += cvpHFlux->coords[j];
-	}
-	aug->rect.mean[GREY].h = hc1 + (gfloat) (sigmah / sumh) - 1; /* Mean h pos*/
-	
-	for (j = 1; j < 4 * hp; j += 2)                              /* 'y' values*/
-		cvpHFlux->coords[j] = (gdouble) (YHIST + 2 * (BOXSIZE + YGAP)) + 
-     	                      (gdouble) BOXSIZE * (1.0 - cvpHFlux->coords[j] /
-	                           maxh);
+	for (i = 0; i < hp; i++)
+		maxh = MAX (cen.flux_h[i], maxh);
+	for (i = 0, j = 1; i < hp; i++, j += 4)                      /* 'y' values*/
+		cvpHFlux->coords[j] = cvpHFlux->coords[j + 2] = 
+				(gdouble) (YHIST + 2 * (BOXSIZE + YGAP)) + 
+				(gdouble) BOXSIZE * (1.0 - cen.flux_h[i] / maxh);
 			
 	cvpHFlux->coords[0] = (gdouble) XPLOT;                       /* 'x' values*/
 	for (j = 2; j < 4 * hp - 2; j += 4) {
@@ -640,17 +734,12 @@ gboolean image_calc_hist_and_flux (void)
 
 	/* Y flux plot ... */
 	
-	for (v = 1, i = 1; i < 4 * vp; i += 4) {
-		maxv = MAX (cvpVFlux->coords[i], maxv);
-		sigmav += v++ * cvpVFlux->coords[i];
-		sumv += cvpVFlux->coords[i];
-	}
-	aug->rect.mean[GREY].v = vc1 + (gfloat) (sigmav / sumv) - 1; /* Mean v pos*/
-	
-	for (i = 1; i < 4 * vp; i += 2)                              /* 'y' values*/
-		cvpVFlux->coords[i] = (gdouble) (YHIST + BOXSIZE + YGAP) + 
-     	                      (gdouble) BOXSIZE * (1.0 - cvpVFlux->coords[i] /
-	                           maxv);
+	for (i = 0; i < vp; i++)
+		maxv = MAX (cen.flux_v[i], maxv);
+	for (i = 0, j = 1; i < vp; i++, j += 4)                      /* 'y' values*/
+		cvpVFlux->coords[j] = cvpVFlux->coords[j + 2] = 
+				(gdouble) (YHIST + BOXSIZE + YGAP) + 
+				(gdouble) BOXSIZE * (1.0 - cen.flux_v[i] / maxv);
 			
 	cvpVFlux->coords[0] = (gdouble) XPLOT;                       /* 'x' values*/
 	for (i = 2; i < 4 * vp - 2; i += 4) {
@@ -681,33 +770,17 @@ gboolean image_calc_hist_and_flux (void)
 				              (aug->img.max[GREY].val >= aug->imdisp.satlevel),
                               aug->exd.h_top_l + aug->rect.mean[GREY].h,
 				              aug->exd.v_top_l + aug->rect.mean[GREY].v, 
-				              hc1 + aug->exd.h_top_l,
-				              hc2 + aug->exd.h_top_l,
-				              vc1 + aug->exd.v_top_l,
-				              vc2 + aug->exd.v_top_l);
+				              cen.hc1 + aug->exd.h_top_l,
+				              cen.hc2 + aug->exd.h_top_l,
+				              cen.vc1 + aug->exd.v_top_l,
+				              cen.vc2 + aug->exd.v_top_l);
 	
-	/* Calculate and display the rms shift in the centroid position */
-		
-	if (aug->canv.NewRect || isnan (rms_h) || isnan (rms_v)) {
-		numframes = 0;
-		rms_h = 0.0;
-		rms_v = 0.0;
-		aug->exd.frame_rate = 0;
-		init_h = aug->rect.mean[GREY].h;
-		init_v = aug->rect.mean[GREY].v;
-		reset_time = loop_elapsed_since_first_iteration ();
-	}
-	
-	numframes++;
-	shift_h = aug->rect.mean[GREY].h - init_h;
-	shift_v = aug->rect.mean[GREY].v - init_v;
-	rms_h = sqrt((rms_h * rms_h * (numframes-1) + shift_h * shift_h)/numframes);
-	rms_v = sqrt((rms_v * rms_v * (numframes-1) + shift_v * shift_v)/numframes);
+	/* Display the rms shift in the centroid position */
 		
 	cviHLabel = ui_show_augcanv_text ((gdouble) XPLOT,
 	                         (gdouble)(YHIST + 3 * (BOXSIZE + TGAP) + 2 * YGAP),
 						     "RMS:",
-						     rms_h,
+						     cen.rms_h,
 						     2,
 						     3,
 		  			         "orange",
@@ -716,31 +789,13 @@ gboolean image_calc_hist_and_flux (void)
 	cviVLabel = ui_show_augcanv_text ((gdouble) XPLOT,
 	                         (gdouble)(YHIST + 2 * BOXSIZE + YGAP + 3 * TGAP),
 						     "RMS:",
-						     rms_v,
+						     cen.rms_v,
 						     2,
 						     3,
 					         "orange",
 						     cviVLabel);
 	
-	/* Calculate the shift North/South and East/West since the selection
-	 * rectangle was last re-drawn.
-	 */
-	
-	aug->rect.shift_ns = shift_h * aug->autog.s.Uvec_N[0] + 
-	                     shift_v * aug->autog.s.Uvec_N[1];
-	/* Want a shift east to be negative by default on the trace display and in*/
-	/* the star positions file (i.e. for north up and east left, star moves to*/
-	/* lower pixel numbers on the display when going east (left).             */ 
-	aug->rect.shift_ew = - (shift_h * aug->autog.s.Uvec_E[0] + 
-	                        shift_v * aug->autog.s.Uvec_E[1]);
-	                        
-	/* Calculate average frame rate */
-	
-	aug->exd.frame_rate = (numframes - 1) * 1000.0 / 
-			       (loop_elapsed_since_first_iteration () - reset_time);
 	G_print ("Average autoguider frame rate: %f\n", aug->exd.frame_rate);
-			       
-	aug->canv.NewRect = FALSE;
 	return TRUE;
 }
 
@@ -784,117 +839,259 @@ gboolean is_in_image (struct cam_img *img, gushort *xoff1, gushort *yoff1,
 
 void image_get_stats (struct cam_img *img, enum ColsPix c)
 {
-	/* Get some image statistics */
+	/* Get some image statistics.  For greyscale images, everything is 
+	 * collected in a single pass over the data, split into strips of rows 
+	 * that are processed in parallel for large images.  Each strip has its
+	 * own histogram; these are merged at the end, finding the mode at the 
+	 * same time.  The standard deviation comes from the sums of the values 
+	 * and of their squares, and the 3-sigma clipped standard deviation from
+	 * the same sums over the clipped range of the histogram.
+	 */
 	
-	gushort row, col;
-	guint counts;
-	gint i, j, totpix;
-	gfloat stdev_new;
+	struct stats_strip strip[STATS_MAX_THREADS];
+	GThread *thread[STATS_MAX_THREADS];
+	gushort *p;
+	guint *hist;
+	guint64 counts, sum1, sum2;
+	gint i, j, t, nthreads, totpix;
+	glong ncpus;
+	gdouble mean, var;
 	
 	totpix = img->exd.h_pix * img->exd.v_pix;  /* Total pixels in image */
 	
 	if (c == C_GREY) {  /* Greyscale */
 		
+		hist = img->img.mode[GREY].hist;
+		memset (hist, 0, (img->imdisp.W + 1) * sizeof (guint));
+		
+		/* Share the rows between the threads.  The first strip is done in 
+		 * this thread, and the others in their own threads if they can be 
+		 * created.
+		 */
+		
+		ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+		nthreads = MIN (totpix / STATS_MIN_PIXELS, 
+						MIN (STATS_MAX_THREADS, ncpus));
+		nthreads = MAX (MIN (nthreads, img->exd.v_pix), 1);
+		for (t = 0; t < nthreads; t++) {
+			strip[t].data = img->r161;
+			strip[t].h_pix = img->exd.h_pix;
+			strip[t].row0 = img->exd.v_pix * t / nthreads;
+			strip[t].rows = img->exd.v_pix * (t + 1) / nthreads - 
+															strip[t].row0;
+			strip[t].hist = t ? (guint *) g_malloc0 ((img->imdisp.W + 1) * 
+												  sizeof (guint)) : hist;
+			thread[t] = t ? g_thread_create (image_get_strip_stats, 
+											 &strip[t], TRUE, NULL) : NULL;
+		}
+		image_get_strip_stats (&strip[0]);
+		for (t = 1; t < nthreads; t++) {
+			if (thread[t])
+				g_thread_join (thread[t]);
+			else
+				image_get_strip_stats (&strip[t]);
+		}
+		
+		/* Combine the strips; the first maximum in the image is reported */
+		
 		img->img.min[GREY].val = img->imdisp.W;          /* Initialise values */
 		img->img.max[GREY].val = img->imdisp.B;
-		img->img.mean[GREY].val = 0;
-		memset (img->img.mode[GREY].hist,0,(img->imdisp.W + 1) * sizeof(guint));
-		
-		for (i = 0; i < totpix; i++) {
-			col = i%img->exd.h_pix;
-			row = i / img->exd.h_pix;		                     /* Minimum */
-			img->img.min[GREY].val = MIN (img->img.min[GREY].val, img->r161[i]);
-			if (img->r161[i] > img->img.max[GREY].val) {  /* Max. and location*/
-				img->img.max[GREY].val = img->r161[i];
-				img->img.max[GREY].h = col;
-				img->img.max[GREY].v = row;
+		sum1 = sum2 = 0;
+		for (t = 0; t < nthreads; t++) {
+			img->img.min[GREY].val = MIN (img->img.min[GREY].val, strip[t].min);
+			if (strip[t].max > img->img.max[GREY].val) {  /* Max. and location*/
+				img->img.max[GREY].val = strip[t].max;
+				img->img.max[GREY].h = strip[t].max_h;
+				img->img.max[GREY].v = strip[t].max_v;
 			}
-			img->img.mean[GREY].val += img->r161[i];
-			++img->img.mode[GREY].hist[img->r161[i]];            /* Histogram */
+			sum1 += strip[t].sum;
+			sum2 += strip[t].sumsq;
 		}
-		img->img.mean[GREY].val /= totpix;                       /* Mean */
-		img->img.mode[GREY].peakcount = 0;
-		img->img.stdev[GREY].val = 0;
-	    for (i = 0; i <= img->imdisp.W; i++) {
-		    if (img->img.mode[GREY].hist[i] > img->img.mode[GREY].peakcount) {
-				img->img.mode[GREY].peakcount = img->img.mode[GREY].hist[i];
-				img->img.mode[GREY].peakbin = i;                 /* Mode */
+		mean = (gdouble) sum1 / totpix;
+		img->img.mean[GREY].val = mean;                          /* Mean */
+		var = (gdouble) sum2 / totpix - mean * mean;
+		img->img.stdev[GREY].val = sqrt (MAX (var, 0));          /* Stdev */
+		
+		img->img.mode[GREY].peakcount = 0;      /* Merge histograms and mode */
+		for (i = 0; i <= img->imdisp.W; i++) {
+			for (t = 1; t < nthreads; t++)
+				hist[i] += strip[t].hist[i];
+			if (hist[i] > img->img.mode[GREY].peakcount) {
+				img->img.mode[GREY].peakcount = hist[i];
+				img->img.mode[GREY].peakbin = i;
 			}
-			img->img.stdev[GREY].val += pow ((i - img->img.mean[GREY].val), 2) *
-			                                        img->img.mode[GREY].hist[i];
-		}                                                        /* Stdev */
-		img->img.stdev[GREY].val = sqrt (img->img.stdev[GREY].val / totpix);
+		}
+		for (t = 1; t < nthreads; t++)
+			g_free (strip[t].hist);
 		
-		stdev_new = counts = 0;   /* Calc. 3-sigma clipped standard deviation */
-  	    for (i = (gint) 
+		counts = sum1 = sum2 = 0; /* Calc. 3-sigma clipped standard deviation */
+		for (i = (gint) 
 			 MAX ((img->img.mode[GREY].peakbin - 3 * 
 				   img->img.stdev[GREY].val), 0);
-		     i <= (gint) MIN ((img->img.mode[GREY].peakbin + 3 * 
+			 i <= (gint) MIN ((img->img.mode[GREY].peakbin + 3 * 
 							   img->img.stdev[GREY].val), img->imdisp.W);
-		     i++) {
-		    stdev_new += pow ((i - img->img.mean[GREY].val), 2) * 
-				                                    img->img.mode[GREY].hist[i];
-  		    counts += img->img.mode[GREY].hist[i];
-	    }                                             /* 3-sig. clipped stdev */
-  	    img->img.stdev[GREY].val = sqrt ((stdev_new / counts));		
+			 i++) {
+			counts += hist[i];
+			sum1 += (guint64) i * hist[i];
+			sum2 += (guint64) i * i * hist[i];
+		}
+		var = (sum2 - 2 * mean * sum1 + mean * mean * counts) / counts;
+		img->img.stdev[GREY].val = sqrt (MAX (var, 0));  /* 3-sig. clipped */
 		
 	} else {  /* Calculate simple stats for all colour components in one pass */
-		for (i = 0; i < c; i++) {
-			img->img.min[c].val = img->imdisp.W;
-			img->img.max[c].val = img->imdisp.B;
+		for (j = 0; j < c; j++) {
+			img->img.min[j].val = img->imdisp.W;
+			img->img.max[j].val = img->imdisp.B;
 		}
 		
-		for (i = 0; i < totpix; i ++) {
-			col = i%img->exd.h_pix;
-			row = i / img->exd.h_pix;
+		for (p = img->db163, i = 0; i < totpix; i++, p += c) {
 			for (j = 0; j < c; j++) {
-				img->img.min[j].val = MIN (img->img.min[j].val, 
-										                 img->db163[i * 3 + j]);
-				img->img.max[j].val = MAX (img->img.max[j].val, 
-										                 img->db163[i * 3 + j]);
+				img->img.min[j].val = MIN (img->img.min[j].val, p[j]);
+				img->img.max[j].val = MAX (img->img.max[j].val, p[j]);
 			}
 		}
 	}
 }
 
+static gpointer image_get_strip_stats (gpointer data)
+{
+	/* Collect the statistics for a strip of rows of a greyscale image.  Each
+	 * row is first scanned for the minimum, maximum and sums, in a simple 
+	 * loop that the compiler can vectorise, and is then added to the 
+	 * histogram while it is still in the cache.  Row and column are only 
+	 * worked out when a row holds a new maximum.
+	 */
+	
+	struct stats_strip *s = (struct stats_strip *) data;
+	gushort *row, rmin, rmax;
+	guint *hist = s->hist;           /* Local copies, so that the histogram */
+	gint h_pix = s->h_pix;           /*  updates can't alias them           */
+	guint64 sum, sumsq;
+	gint h, v;
+	
+	s->min = G_MAXUSHORT;
+	s->max = s->max_h = s->max_v = 0;
+	s->sum = s->sumsq = 0;
+	
+	for (v = s->row0; v < s->row0 + s->rows; v++) {
+		row = s->data + (gsize) v * h_pix;
+		rmin = G_MAXUSHORT;
+		rmax = 0;
+		sum = sumsq = 0;
+		for (h = 0; h < h_pix; h++) {
+			rmin = MIN (rmin, row[h]);
+			rmax = MAX (rmax, row[h]);
+			sum += row[h];
+			sumsq += (guint) row[h] * row[h];
+		}
+		for (h = 0; h < h_pix; h++)
+			++hist[row[h]];
+		
+		s->min = MIN (s->min, rmin);
+		if (rmax > s->max || v == s->row0) {
+			s->max = rmax;
+			for (h = 0; row[h] != rmax; h++)
+				;
+			s->max_h = h;
+			s->max_v = v;
+		}
+		s->sum += sum;
+		s->sumsq += sumsq;
+	}
+	
+	return NULL;
+}
+
 gboolean image_embed_data (struct cam_img *img)
 {
 	/* Embed the image data in an image the size of the full imaging area, 
 	 * expanding back to actual area of coverage, if binned.  The value in the
 	 * blank areas of the full image is set to the minimum value in the exposed
-	 * part.
+	 * part.  Only the blank areas are filled; each row of the image is
+	 * expanded once and then copied for the rest of its binned rows.
 	 */
 	
-	gushort val;
-	gushort m, n, h, v;
-	guint i, k;
+	gushort min, *dst;
+	guint max_h, h_len, h_left, h_right, v, m;
 	
 	if (img->r161 == NULL)
 		return FALSE;
 	if (img->ff161 == NULL)
 		return FALSE;
 	
-	i = img->cam_cap.max_h * img->cam_cap.max_v;
-	while (i)
-		img->ff161[--i] = img->img.min[GREY].val;
-
-	k = img->exd.h_top_l + img->exd.v_top_l * img->cam_cap.max_h;
-	for (v = 0; v < img->exd.v_pix * img->exd.v_bin; v += img->exd.v_bin)
-    	for (m = 0; m < img->exd.v_bin; m++) {
-      		for (h = 0; h < img->exd.h_pix*img->exd.h_bin; h += img->exd.h_bin){
-        		for (n = 0; n < img->exd.h_bin; n++) {
-					val = img->r161[img->exd.h_pix * 
-					                   v / img->exd.v_bin + h / img->exd.h_bin];
+	min = img->img.min[GREY].val;
+	max_h = img->cam_cap.max_h;
+	h_len = img->exd.h_pix * img->exd.h_bin;
+	h_left = img->exd.h_top_l;
+	h_right = max_h - h_left - h_len;
+	
+	image_fill (img->ff161, min, img->exd.v_top_l * max_h);
+	dst = img->ff161 + img->exd.v_top_l * max_h;
+	for (v = 0; v < img->exd.v_pix; v++) {
+		image_fill (dst, min, h_left);
+		image_expand_row (dst + h_left, img->r161 + v * img->exd.h_pix,
+						  img->exd.h_pix, img->exd.h_bin);
+		image_fill (dst + h_left + h_len, min, h_right);
+		for (m = 1; m < img->exd.v_bin; m++)
+			memcpy (dst + m * max_h, dst, max_h * sizeof (gushort));
+		dst += img->exd.v_bin * max_h;
+	}
+	image_fill (dst, min, img->ff161 + max_h * img->cam_cap.max_v - dst);
+	
+	return TRUE;
+}
 
-					/* Set the image pixel data */	
+static void image_fill (gushort *dst, gushort val, guint n)
+{
+	/* Set n values starting at dst to val */
+	
+	guint i = 0;
+	
+	#if defined (IMAGE_NEON)
+	uint16x8_t v = vdupq_n_u16 (val);
+	for (; i + 8 <= n; i += 8)
+		vst1q_u16 (dst + i, v);
+	#elif defined (IMAGE_SSE2)
+	__m128i v = _mm_set1_epi16 ((gshort) val);
+	for (; i + 8 <= n; i += 8)
+		_mm_storeu_si128 ((__m128i *) (dst + i), v);
+	#endif
+	for (; i < n; i++)
+		dst[i] = val;
+}
 
-					img->ff161[k++] = val;
-				}
-			}
-			k += img->cam_cap.max_h - img->exd.h_pix * img->exd.h_bin;
-		}
+static void image_expand_row (gushort *dst, const gushort *src, guint n,
+							  guint bin)
+{
+	/* Copy n values from src to dst, repeating each one bin times */
 	
-	return TRUE;
+	guint i = 0, j;
+	
+	if (bin == 1) {
+		memcpy (dst, src, n * sizeof (gushort));
+		return;
+	}
+	if (bin == 2) {
+		#if defined (IMAGE_NEON)
+		for (; i + 8 <= n; i += 8)
+			vst2q_u16 (dst + 2 * i, (uint16x8x2_t) {{vld1q_u16 (src + i),
+													  vld1q_u16 (src + i)}});
+		#elif defined (IMAGE_SSE2)
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (src + i));
+			_mm_storeu_si128 ((__m128i *) (dst + 2 * i),
+							  _mm_unpacklo_epi16 (v, v));
+			_mm_storeu_si128 ((__m128i *) (dst + 2 * i + 8),
+							  _mm_unpackhi_epi16 (v, v));
+		}
+		#endif
+		for (; i < n; i++)
+			dst[2 * i] = dst[2 * i + 1] = src[i];
+		return;
+	}
+	for (; i < n; i++)
+		for (j = 0; j < bin; j++)
+			*dst++ = src[i];
 }
 
 gboolean image_save_as_fits (struct cam_img *img, gchar *savefile, 
@@ -910,32 +1107,73 @@ gboolean image_save_as_fits (struct cam_img *img, gchar *savefile,
 	 * otherwise we are saving the raw image data for use elsewhere.
 	 * This routine is called three times for a colour image; once each for the 
 	 * R, G and B components.
+	 * The header is built by image_fits_header and the data are streamed to
+	 * the file by fits_write_image (see fits.c), so no copy of the whole HDU
+	 * is made.
+	 * If savefile ends in '.fz', fits_write_image writes a Rice
+	 * tile-compressed file instead, with the same header cards.
+	 */
+
+	const void *data = NULL;
+	gint head_len, depth = 2, stride = 1, h_pix, v_pix;
+	gchar header[FITS_REC_LEN];
+	
+	head_len = image_fits_header (img, header, colour, display);
+	
+	/* Write the data, swapping the rows so that other software (e.g. DS9,
+	 * Starlink's Gaia and Kappa routines or the GIMP) display an inverted
+	 * image on the chip the right way up.  (Hence a picture taken with a 
+	 * camera lens attached to the chip would appear correctly).
 	 */
 
-	const gint REC_LEN = 2880;
-	const gint HEAD_LEN = 1 * 2880;
-	const gint CARD_LEN = 80;
-	const gint OFFSET = 32768;	
+	if (display && img->id == CCD && img->FullFrame) {
+		h_pix = img->cam_cap.max_h;
+		v_pix = img->cam_cap.max_v;
+	} else {
+		h_pix = img->exd.h_pix;
+		v_pix = img->exd.v_pix;
+	}
 	
-	gshort *data;
-	gushort	bytes_per_pixel;
-	gint h, i = 0, j, k, numpix, numbytes;
-	gchar *header, *string;
-	void *hdu;
+	if (img->id == CCD) {
+		if (colour == GREY) {
+			data = (display && img->FullFrame) ? img->ff161 : img->r161;
+		} else {
+			data = ((display && img->FullFrame) ? img->ff163 : img->db163) + 
+																		colour;
+			stride = 3;
+		}
+	} else if (img->id == AUG) {
+		data = img->disp083;
+		depth = 1;
+		stride = 3;  /* Always assumed to equal 3 at this stage! */
+	} else if (img->id == VID) {
+		data = img->r161;
+	}
+	if (!data)
+		return show_error (__func__, "No image data to save");
 	
-	FILE *fp;
+	if (!fits_write_image (savefile, header, head_len, data, depth, stride,
+						   h_pix, v_pix))
+		return show_error (__func__, "Error writing image file");
 	
-	/* Allocate memory for the HDU (header plus data plus padding) */
+	return TRUE;
+}
+
+gint image_fits_header (struct cam_img *img, gchar *header, 
+	                    enum Colour colour, gboolean display)
+{
+	/* Build the primary header for image_save_as_fits in header, which must
+	 * hold FITS_REC_LEN bytes, and return its length.  The video frame export
+	 * in video.c builds headers here and writes the data itself.
+	 */
 
-	if (display && img->id == CCD && img->FullFrame)
-		numpix = img->cam_cap.max_h * img->cam_cap.max_v;
-	else
-		numpix = img->exd.h_pix * img->exd.v_pix;
-	numbytes = (gint) (HEAD_LEN + numpix * sizeof (gshort) +
-	                  (REC_LEN - fmod (numpix * sizeof (gshort), REC_LEN)));
-	if (!(hdu = g_malloc (numbytes)))
-		return show_error (__func__, "Unable to allocate memory for HDU");
-	header = (char *) memset (hdu, ' ', HEAD_LEN);
+	const gint HEAD_LEN = 1 * FITS_REC_LEN;
+	const gint OFFSET = FITS_OFFSET;
+	
+	gint h;
+	gchar *string;
+	
+	memset (header, ' ', HEAD_LEN);
 	
 	/* Set C locale to ensure correct format of FITS entries with 
 	 * decimal point.
@@ -943,185 +1181,121 @@ gboolean image_save_as_fits (struct cam_img *img, gchar *savefile,
 	 
 	setlocale (LC_NUMERIC, "C");
 	
-	/* Write the header records to the HDU */
+	/* Write the header records */
 	
-	h = -CARD_LEN;
+	h = 0;
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "SIMPLE  =                    T /"
+	fits_card (header, &h, "SIMPLE  =                    T /"
 	                  "   Standard conforming file");
-	header[strlen (header)] = ' ';     /* Overwrite closing '\0' from sprintf */
 
-	h += CARD_LEN;
-	sprintf (&header[h], "BITPIX  =                   16 /"
+	fits_card (header, &h, "BITPIX  =                   16 /"
 	                  "   16 bits per pixel");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "NAXIS   =                    2 /"
+	fits_card (header, &h, "NAXIS   =                    2 /"
 	                  "   2 image axes");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "NAXIS1  = %20i /   no. pixels on horizontal axis", 
+	fits_card (header, &h, "NAXIS1  = %20i /   no. pixels on horizontal axis", 
 		    (display && img->id == CCD && img->FullFrame) ? 
 			 img->cam_cap.max_h : img->exd.h_pix);
-	header[strlen (header)] = ' ';	
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "NAXIS2  = %20i /   no. pixels on vertical axis",
+	fits_card (header, &h, "NAXIS2  = %20i /   no. pixels on vertical axis",
 	        (display && img->id == CCD && img->FullFrame) ? 
 			 img->cam_cap.max_v : img->exd.v_pix);
-	header[strlen (header)] = ' ';
 
-	h += CARD_LEN;
-	sprintf (&header[h], "CTYPE1  = ' '                  /"
+	fits_card (header, &h, "CTYPE1  = ' '                  /"
 	                  "   axis 1 data type");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CRPIX1  =                  1.0 /"
+	fits_card (header, &h, "CRPIX1  =                  1.0 /"
 	                  "   reference point at first pixel on axis 1");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CRVAL1  = %20.1f /"
+	fits_card (header, &h, "CRVAL1  = %20.1f /"
 	                  "   pixel offset from start of frame on axis 1",
 		              (img->id != CCD ? 
 			           0 : display && img->id == CCD && img->FullFrame ?
 			           0 : (gfloat) (img->exd.h_top_l)));
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CDELT1  = %20i /"
+	fits_card (header, &h, "CDELT1  = %20i /"
 	                     "   rate of increase of pixel count ", img->exd.h_bin);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CTYPE2  = ' '                  /"
+	fits_card (header, &h, "CTYPE2  = ' '                  /"
 	                  "   axis 2 data type");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CRPIX2  =                  1.0 /"
+	fits_card (header, &h, "CRPIX2  =                  1.0 /"
 	                  "   reference point at first pixel on axis 2");
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CRVAL2  = %20.1f /"
+	fits_card (header, &h, "CRVAL2  = %20.1f /"
 	                  "   pixel offset from start of frame on axis 2",
 			          (img->id != CCD ? 
 					   0 :  display && img->id == CCD && img->FullFrame ?
 			           0 : (gfloat) (img->cam_cap.max_v - 
 		              (img->exd.v_top_l + img->exd.v_pix * img->exd.v_bin))));					  
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CDELT2  = %20i /"
+	fits_card (header, &h, "CDELT2  = %20i /"
 	                     "   rate of increase of pixel count ", img->exd.v_bin);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "BINX1   = %20i /   pixel binning on X1 axis",
+	fits_card (header, &h, "BINX1   = %20i /   pixel binning on X1 axis",
 																img->exd.h_bin);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "BINX2   = %20i /   pixel binning on X2 axis",
+	fits_card (header, &h, "BINX2   = %20i /   pixel binning on X2 axis",
 																img->exd.v_bin);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "BZERO   = %20i /"
+	fits_card (header, &h, "BZERO   = %20i /"
 	                  "   offset to add back on for unsigned integers", OFFSET);
-	header[strlen (header)] = ' ';
 
-	h += CARD_LEN;
-	sprintf (&header[h], "DATAMAX = %20i /   maximum data value", 
+	fits_card (header, &h, "DATAMAX = %20i /   maximum data value", 
 	    (img->id == AUG) ? img->pic.max[colour].val : img->img.max[colour].val);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "DATAMIN = %20i /   minimum data value", 
+	fits_card (header, &h, "DATAMIN = %20i /   minimum data value", 
 	    (img->id == AUG) ? img->pic.min[colour].val : img->img.min[colour].val);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "CCDTEMP = %20.1f /   CCD temperature (C)", 
+	fits_card (header, &h, "CCDTEMP = %20.1f /   CCD temperature (C)", 
 	                                                          img->state.c_ccd);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "FOCUSPOS= %20i /   focuser position", 
+	fits_card (header, &h, "FOCUSPOS= %20i /   focuser position", 
 			                                               img->fits.focus_pos);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "FOCUSTMP= %20.1f /   focuser temperature (C)",
+	fits_card (header, &h, "FOCUSTMP= %20.1f /   focuser temperature (C)",
 			                                              img->fits.focus_temp);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "DATE-OBS= '%-23s'/"
+	fits_card (header, &h, "DATE-OBS= '%-23s'/"
 	                  "   date of start of observation (UTC)", 
 					                                        img->fits.date_obs);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "UTSTART = '%-12s'       /"
+	fits_card (header, &h, "UTSTART = '%-12s'       /"
 	                  "   time of start of observation (UTC)", 
 					                                         img->fits.utstart);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "TM-START= %20.3f /"
+	fits_card (header, &h, "TM-START= %20.3f /"
 	                  "   seconds since midnight (UTC) at start of obs.",
 					                                        img->fits.tm_start);
-	header[strlen (header)] = ' ';	
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "EXPTIME = %20.3f /"
+	fits_card (header, &h, "EXPTIME = %20.3f /"
 	                  "   exposure length (seconds)",(gdouble)img->exd.act_len);
-	header[strlen (header)] = ' ';	
 	
-	h += CARD_LEN;
 	string = get_entry_string ("txtTelescop");
-	sprintf (&header[h], "TELESCOP= '%s'", (img->id != VID) ? string : "");
-	header[strlen (header)] = ' ';
+	fits_card (header, &h, "TELESCOP= '%s'", (img->id != VID) ? string : "");
 	g_free (string);
 
-	h += CARD_LEN;
 	string = get_entry_string ("txtInstrume");
-	sprintf (&header[h], "INSTRUME= '%s'", (img->id != VID) ? string : "");
-	header[strlen (header)] = ' ';
+	fits_card (header, &h, "INSTRUME= '%s'", (img->id != VID) ? string : "");
 	g_free (string);
 	
-	h += CARD_LEN;
 	string = get_entry_string ("txtObserver");
-	sprintf (&header[h], "OBSERVER= '%s'", (img->id != VID) ? string : "");
-	header[strlen (header)] = ' ';
+	fits_card (header, &h, "OBSERVER= '%s'", (img->id != VID) ? string : "");
 	g_free (string);
 	
-	h += CARD_LEN;
 	string = get_entry_string ("txtObject");
-	sprintf (&header[h], "OBJECT  = '%s'", (img->id != VID) ? string : "");
-	header[strlen (header)] = ' ';
+	fits_card (header, &h, "OBJECT  = '%s'", (img->id != VID) ? string : "");
 	g_free (string);
 	
-	h += CARD_LEN;	
-	sprintf (&header[h], "EQUINOX = %20.4f /"
+	fits_card (header, &h, "EQUINOX = %20.4f /"
 	                  "   Julian epoch of coordinates", img->fits.epoch);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "RA      = '%8s'           /"
+	fits_card (header, &h, "RA      = '%8s'           /"
 	                  "   Right Ascension of center of image", img->fits.RA);
-	header[strlen (header)] = ' ';
 	
-	h += CARD_LEN;
-	sprintf (&header[h], "DEC     = '%9s'          /"
+	fits_card (header, &h, "DEC     = '%9s'          /"
 	                  "   declination of center of image", img->fits.Dec);
-	header[strlen (header)] = ' ';
 	
 	if (img->id == CCD && !img->Debayer && img->bayer_pattern >= 0 && 
 		img->exd.h_bin == 1 && img->exd.v_bin == 1) {
@@ -1153,97 +1327,29 @@ gboolean image_save_as_fits (struct cam_img *img, gchar *savefile,
 			default:
 				bp = "??";
 		}
-		h += CARD_LEN;
-		sprintf (&header[h], "BAYERPAT= '%2s'                 /"
+		fits_card (header, &h, "BAYERPAT= '%2s'                 /"
 						  "   bayer pattern at start of image", bp);
-		header[strlen (header)] = ' ';
+	}
+	
+	if (img->calstat) {
+		fits_card (header, &h, "CALSTAT = '%-3s'                /"
+				   "   calibrated with master bias/dark/flat", 
+				   img->calstat & CALIB_DARK ? 
+				   (img->calstat & CALIB_FLAT ? "BDF" : "BD") :
+				   img->calstat & CALIB_BIAS ? 
+				   (img->calstat & CALIB_FLAT ? "BF" : "B") : "F");
+		if (img->calstat & (CALIB_BIAS | CALIB_DARK))
+			fits_card (header, &h, "PEDESTAL= %20i /"
+					   "   value added to calibrated data", CALIB_PEDESTAL);
 	}
 
-	h += CARD_LEN;	
-	sprintf (&header[h], "END");
-	header[strlen (header)] = ' ';
+	fits_card (header, &h, "END");
 	
 	/* Restore locale setting to local value */
 	 
 	setlocale (LC_NUMERIC, "");
 	
-	/* Write the data to the HDU, swapping the rows so that other software
-	 * (e.g. DS9, Starlink's Gaia and Kappa routines or the GIMP) display an 
-	 * inverted image on the chip the right way up.  (Hence a picture taken with
-	 * a camera lens attached to the chip would appear correctly).
-	 */
-
-	data = (gshort *) hdu;
-	if (img->id == CCD) {
-		if (colour == GREY) {
-			if (display && img->FullFrame) {
-				for (i = HEAD_LEN / sizeof (gshort),
-					 k = numpix - img->cam_cap.max_h;
-					 k >= 0; k -= img->cam_cap.max_h)
-					for (j = k; j < (k + img->cam_cap.max_h); j++)
-						data[i++] = GINT16_TO_BE (img->ff161[j] - OFFSET);
-			} else {
-				for (i = HEAD_LEN / sizeof (gshort),
-					 k = numpix - img->exd.h_pix;
-					 k >= 0; k -= img->exd.h_pix)
-					for (j = k; j < (k + img->exd.h_pix); j++)
-						data[i++] = GINT16_TO_BE (img->r161[j] - OFFSET);
-			}
-		} else {
-			if (display && img->FullFrame) {
-				for (i = HEAD_LEN / sizeof (gshort),
-					 k = numpix - img->cam_cap.max_h;
-					 k >= 0; k -= img->cam_cap.max_h)
-					for (j = k; j < (k + img->cam_cap.max_h); j++)
-						data[i++] = GINT16_TO_BE (
-									       img->ff163[colour + j * 3] - OFFSET);
-			} else {
-				for (i = HEAD_LEN / sizeof (gshort),
-					 k = numpix - img->exd.h_pix;
-					 k >= 0; k -= img->exd.h_pix)
-					for (j = k; j < (k + img->exd.h_pix); j++)
-						data[i++] = GINT16_TO_BE (
-									   	   img->db163[colour + j * 3] - OFFSET);
-			}
-		}
-	} else if (img->id == AUG) {
-		bytes_per_pixel = 3;  /* Always assumed to equal 3 at this stage! */
-		for (i = HEAD_LEN / sizeof (gshort),
-			 k = numpix - img->exd.h_pix; 
-			 k >= 0; k -= img->exd.h_pix)
-			for (j = k; j < (k + img->exd.h_pix); j++)
-				data[i++] = GINT16_TO_BE (
-								    img->disp083[j * bytes_per_pixel] - OFFSET);
-	} else if (img->id == VID) {
-		for (i = HEAD_LEN / sizeof (gshort),
-			 k = numpix - img->exd.h_pix; 
-		     k >= 0; k -= img->exd.h_pix)
-			for (j = k; j < (k + img->exd.h_pix); j++)
-				data[i++] = GINT16_TO_BE (img->r161[j] - OFFSET);
-	}
-	
-	/* Fill any remaining space with zeros */
-	
-	while (i < numbytes / sizeof (gshort))
-		data[i++] = 0;
-	
-	/* Write the HDU to a disk file */
-	
-    if (!(fp = fopen (savefile, "wb"))) {
-		g_free (hdu);
-		return show_error (__func__, "Error writing image file (fopen)");
-	}
-	
-    if (fwrite (hdu, sizeof (gchar), numbytes, fp) < numbytes) {
-		g_free (hdu);
-		fclose (fp);
-		return show_error (__func__, "Error writing image file (fwrite)");
-	}
-	fclose (fp);
-
-	g_free (hdu);
-	
-	return TRUE;
+	return HEAD_LEN;
 }
 
 #ifdef HAVE_LIBGRACE_NP
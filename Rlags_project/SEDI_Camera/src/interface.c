@@ -310,6 +310,7 @@ void on_btnStart_clicked (GtkButton *button, gpointer data);
 void on_btnCancel_clicked (GtkButton *button, gpointer data);
 void on_btnInterrupt_clicked (GtkButton *button, gpointer data);
 void on_chkAutoSave_toggled (GtkButton *button, gpointer data);
+void on_chkCalibrateCCD_toggled (GtkButton *button, gpointer data);
 void on_chkSaveEvery_toggled (GtkButton *button, gpointer data);
 void on_chkWatchActive_toggled (GtkButton *button, gpointer data);
 void on_btnPPClose_clicked (GtkButton *button, gpointer data);
@@ -499,7 +500,7 @@ gboolean get_entry_float (const gchar *name,
 gchar *get_entry_string (const gchar *name);
 static void get_spin_int (const gchar *name, gint *val);
 static void get_spin_float (const gchar *name, gdouble *val);
-static void set_entry_int (const gchar *name, gint val);
+void set_entry_int (const gchar *name, gint val);
 void set_entry_float (const gchar *name, gdouble val);
 void set_entry_string (const gchar *name, gchar *string);
 static void set_spin_float (const gchar *name, gdouble val);
@@ -555,6 +556,7 @@ void ui_show_photom_points (gchar *filename, gfloat aperture);
 void set_video_range_adjustment (guint num_frames);
 void set_video_range_value (guint frame_num);
 gushort get_video_framebufsize (void);
+gushort get_video_ringsize (void);
 static void ui_show_status_bar_info (void);
 
 static gchar *get_open_filename (GtkWindow *window, gchar *filename);
@@ -3349,6 +3351,22 @@ void on_chkAutoSave_toggled (GtkButton *button, gpointer data)
 	img->AutoSave = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button));
 }
 
+void on_chkCalibrateCCD_toggled (GtkButton *button, gpointer data)
+{
+	/* Toggle calibration of CCD images on and off.  If on, bias, dark and
+	 * flat exposures are combined into master frames and other exposures are
+	 * calibrated with them.  Any frames stacked when it is turned off are
+	 * combined straight away.
+	 */
+	
+	struct cam_img *ccd = get_ccd_image_struct ();
+	
+	ccd->Calibrate = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button));
+	W_config_d ("Misc/CalibrateCCD", ccd->Calibrate);
+	if (!ccd->Calibrate)
+		ccdcam_calib_flush ();
+}
+
 void on_chkSaveEvery_toggled (GtkButton *button, gpointer data)
 {
 	/* Schedule the autoguider image to be saved periodically,
@@ -5039,7 +5057,6 @@ void on_btnTaskStart_clicked (GtkButton *button, gpointer data)
 	/* Start execution of tasks in the list */
 	
 	GtkWidget *w;
-	gboolean error;
 	
 	/* Close task editing window, if it's open */
 	
@@ -5052,13 +5069,10 @@ void on_btnTaskStart_clicked (GtkButton *button, gpointer data)
 	/* Check for errors in task list */
 	
 	L_print ("{b}Checking task list for errors...\n");
-	tasks_start ();
-	while (tasks_execute_tasks (TRUE, &error))
-		;
 	
 	/* Start tasks if no error */
 	
-	if (!error) {
+	if (tasks_check_tasks ()) {
 		L_print ("{b}Task list OK\n");
 		set_task_buttons (TRUE);
 		tasks_start ();
@@ -5086,7 +5100,7 @@ void on_btnTaskStop_clicked (GtkButton *button, gpointer data)
 {
 	/* Stop execution of tasks in the list */
 	
-	tasks_stop ();
+	tasks_stop (TRUE);
 	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON 
 	                         (xml_get_widget (xml_app, "btnTaskPause")), FALSE);	
 	set_task_buttons (FALSE);
@@ -5559,13 +5573,21 @@ void on_btnPBOpenFile_clicked (GtkButton *button, gpointer data)
 void on_txtPBFrameNum_activate (GtkEditable *editable, gpointer data)
 {
 	/* Show the specified frame number if the user presses 'Enter' in
-	 * the 'frame number' text box.
+	 * the 'frame number' text box.  A UTC time stamp may be entered instead,
+	 * to show the first frame at or after that time.
 	 */
 	
 	gint num;
+	gchar *entry;
 	
-	get_entry_int ("txtPBFrameNum", 1, 999999, 1, NO_PAGE, &num);
-	video_show_frame (num);
+	entry = get_entry_string ("txtPBFrameNum");
+	if (strchr (entry, ':')) {
+		video_show_time (entry);
+	} else {
+		get_entry_int ("txtPBFrameNum", 1, 999999, 1, NO_PAGE, &num);
+		video_show_frame (num);
+	}
+	g_free (entry);
 }
 
 void on_txtPBTimeStamp_activate (GtkEditable *editable, gpointer data)
@@ -6887,7 +6909,7 @@ static void get_spin_float (const gchar *name, gdouble *val)
 	}
 }
 
-static void set_entry_int (const gchar *name, gint val)
+void set_entry_int (const gchar *name, gint val)
 {
 	/* Write val to the specified text field */
 	
@@ -8432,6 +8454,15 @@ gushort get_video_framebufsize (void)
 	return R_config_d ("Video/FrameBufSize", 50);
 }
 
+gushort get_video_ringsize (void)
+{
+	/* Return the number of frame buffers in the video recording ring from the
+	 * configuration database.  More buffers ride out longer disk stalls.
+	 */
+	
+	return CLAMP (R_config_d ("Video/RingBuffers", 8), 2, 256);
+}
+
 void ui_show_status_bar_info (void)
 {
 	/* Display image information on the status bar.
@@ -8677,6 +8708,13 @@ gboolean save_file (struct cam_img *img, enum Colour colour, gboolean display)
 						   "%s/%s_%s_%05i_%s.fit", 
 						   dirname, img->exd.ExpType, basename, num, c);
 		}
+		if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (
+			                 xml_get_widget (xml_app, "chkCompressFITS")))) {
+			fname = savefile;  /* Rice-compressed if the name ends in .fz */
+			fname[strlen (fname) - strlen (".fit")] = '\0';
+			savefile = g_strconcat (fname, ".fits.fz", NULL);
+			g_free (fname);
+		}
 		strcpy (img->exd.filename, savefile);
 	} else if (img->id == AUG) {
 		get_entry_int ("txtFileNumAUG", 1, 9999, 0, FIL_PAGE, &num);
@@ -10055,6 +10093,9 @@ static void restore_config_data (void)
 	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (
 				               xml_get_widget (xml_app, "chkBeepExposure")),
                                R_config_d ("Misc/Beep", FALSE));
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (
+				               xml_get_widget (xml_app, "chkCalibrateCCD")),
+                               R_config_d ("Misc/CalibrateCCD", FALSE));
 }
 
 static void save_config_data (void)
@@ -10446,10 +10487,12 @@ gint get_UTC_offset (void)
 void finished_tasks (void)
 {
 	/* This routine is called by the tasks loop when the end of the task list
-	 * has been reached.
+	 * has been reached.  Any calibration frames taken at the end of the list
+	 * are combined into their master now.
 	 */
 	
 	set_task_buttons (FALSE);
+	ccdcam_calib_flush ();
 }
 
 static void warn_PEC_guidespeed (gboolean MsgBox)
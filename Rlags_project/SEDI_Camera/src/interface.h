@@ -145,7 +145,8 @@ enum Debayer {                   /* Debayering methods                        */
 	DB_BILIN,
 	DB_QUAL,
 	DB_DOWN,
-	DB_GRADS
+	DB_GRADS,
+	DB_AHD                       /* Not offered in the menu                   */
 };
 
 enum GreyScale {                 /* Greyscale conversion for autoguider       */
@@ -448,10 +449,16 @@ struct video_data {              /*  image capture, but some Unicap stuff too */
 	} *buffers;                  /* Video buffers                             */
 	struct {
 		GStaticMutex mutex;
-		gint size;
-		guchar *buffer[2];
-		guchar *alloc;
-	} fifo;                      /* FIFO for buffered V4L frames              */
+		struct v4l_frame {
+			gint index;          /* Video buffer index                        */
+			gint64 stamp;        /* Capture time (us, monotonic clock)        */
+		} *frame, current;       /* Frames held, oldest first; frame in use   */
+		gint head, count;        /* Position of oldest frame, number of frames*/
+		gint *release;           /* Buffers finished with, to be re-queued... */
+		gint nrelease;           /*  ...and how many                          */
+		gint queued;             /* Buffers queued with driver                */
+		guint32 sequence;        /* Sequence number of newest frame           */
+	} queue;                     /* Queue of captured V4L frames              */
 	gushort byte_incr;           /* Number of bytes per pixel                 */
 	gushort byte_offset;         /* Offset to first 'Y' data in image         */
 	gint type;                   /* Type of data: 1-2 byte grey, 3 byte colour*/             
@@ -461,7 +468,8 @@ struct video_data {              /*  image capture, but some Unicap stuff too */
 	gint size;                   /* Image size (bytes)                        */
 	gint bufnum;                 /* Number of video buffers / buffer number   */
 	guint frames_tot;            /* Total number of frames received           */
-	guint frames_drop;           /* Total number of frames dropped            */
+	guint frames_drop;           /* Frames dropped because queue was full     */
+	guint frames_lost;           /* Frames missed by driver (sequence gaps)   */
 	gfloat fps;                  /* Frames per second                         */
 	gchar card[128];             /* Card/device name                          */
 	gboolean HasVideoStandard;   /* TRUE if the device can set video standards*/
@@ -566,6 +574,8 @@ struct cam_img {                 /* Camera/image data                         */
 	gboolean FullFrame;          /* Set flag to embed data in full chip area  */
 	gboolean FastFocus;          /* Set flag to use fast readout for focusing */
 	gboolean AutoSave;           /* Flag to indicate if image to be autosaved */
+	gboolean Calibrate;          /* Set flag to calibrate with master frames  */
+	gint calstat;                /* Calibrations applied to image (calib.h)   */
 	gboolean SavePeriodic;       /* Flag to indicate image periodically saved */
 	gboolean FileSaved;          /* Flag to indicate current image is saved   */
 	gboolean Display;            /* Set flag to display image                 */
@@ -599,6 +609,7 @@ extern gboolean get_entry_float (const gchar *name, gdouble minval,
 								 gdouble maxval, gdouble defval, 
 								 gint page, gdouble *val);
 extern gchar *get_entry_string (const gchar *name);
+extern void set_entry_int (const gchar *name, gint val);
 extern void set_entry_float (const gchar *name, gdouble val);
 extern void set_entry_string (const gchar *name, gchar *string);
 extern void set_ccd_gui (gboolean set);
@@ -644,6 +655,7 @@ extern void ui_show_photom_points (gchar *filename, gfloat aperture);
 extern void set_video_range_adjustment (guint num_frames);
 extern void set_video_range_value (guint frame_num);
 extern gushort get_video_framebufsize (void);
+extern gushort get_video_ringsize (void);
 extern gboolean save_file (struct cam_img *img, enum Colour colour, 
 	                       gboolean display);
 extern void file_saved (struct cam_img *img, gboolean saved);
@@ -712,6 +724,7 @@ extern gboolean ccdcam_image_ready (void);
 extern gboolean ccdcam_download_image (void);
 extern gboolean ccdcam_process_image (void);
 extern gboolean ccdcam_debayer (void);
+extern void ccdcam_calib_flush (void);
 extern gboolean ccdcam_set_temperature (gboolean *AtTemperature);
 extern void ccdcam_set_fast_readspeed (gboolean Set);
 extern gboolean ccdcam_measure_HFD (gboolean Initialise, gboolean Plot, 
@@ -766,6 +779,7 @@ extern void xpa_open (void);
 extern void xpa_close (void);
 extern gboolean xpa_display_image (struct cam_img *img, enum Colour colour);
 extern gboolean xpa_get_rect_coords(gfloat *x, gfloat *y, gfloat *w, gfloat *h);
+extern gboolean image_calc_centroid (void);
 extern gboolean image_calc_hist_and_flux (void);
 extern gboolean is_in_image (struct cam_img *img, gushort *xoff1,gushort *yoff1,
 	                         gushort *xoff2, gushort *yoff2);
@@ -773,6 +787,8 @@ extern void image_get_stats (struct cam_img *img, enum Colour col);
 extern gboolean image_embed_data (struct cam_img *img);
 extern gboolean image_save_as_fits (struct cam_img *img, gchar *savefile, 
 	                                enum Colour colour, gboolean display);
+extern gint image_fits_header (struct cam_img *img, gchar *header, 
+	                           enum Colour colour, gboolean display);
 #ifdef HAVE_LIBGRACE_NP
 extern gboolean Grace_Open (gchar *plot, gboolean *AlreadyOpen);
 extern void Grace_SetXAxis (gshort graph, gfloat xmin, gfloat xmax);
@@ -821,7 +837,6 @@ extern void loop_focus_apply_temp_comp (gint pos);
 extern void loop_focus_check_done (void);
 extern void loop_LiveView_open (gboolean open);
 extern void loop_LiveView_record (gboolean record, gchar *dirname);
-extern void loop_LiveView_flush_to_disk (gushort buf);
 extern void loop_video_iter_frames (gboolean Iter);
 extern void loop_telescope_goto (gchar *sRA, gchar *sDec);
 extern void loop_telescope_move (gdouble RA, gdouble Dec);
@@ -956,7 +971,7 @@ extern void focus_get_temp_diff_pos (gdouble *temp_diff, gint *pos);
 extern void tasks_init (GtkBuilder *xml);
 extern void tasks_start (void);
 extern void tasks_pause (gboolean pause);
-extern void tasks_stop (void);
+extern void tasks_stop (gboolean User);
 extern void tasks_task_done (enum TaskTypes Task);
 extern void tasks_move_up (void);
 extern void tasks_move_down (void);
@@ -990,7 +1005,9 @@ extern void tasks_add_YellowButton (void);
 extern void tasks_add_Shutdown (void);
 extern void tasks_add_Exit (void);
 extern void tasks_activate_watch (void);
-extern gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error);
+extern void tasks_deactivate_watch (void);
+extern gboolean tasks_check_tasks (void);
+extern gboolean tasks_execute_tasks (void);
 extern void tasks_watch_file (void);
 extern guint tasks_get_status (void);
 extern gboolean tasks_task_wait (void);
@@ -1013,13 +1030,13 @@ extern gboolean video_record_start (gchar *dirname);
 extern void video_record_stop (void);
 extern void video_buffer_frame (guchar *buffer, struct timeval *fill_time, 
 	                            guint now);
-extern void video_flush_buffer (gushort buf);
 #endif
 extern gboolean video_open_file (gchar *file);
 extern gint video_get_frame_number (void);
 extern void video_set_start_time (void);
 extern void video_set_frame_rate (gushort fps);
 extern gboolean video_show_frame (guint frame_num);
+extern gboolean video_show_time (gchar *stamp);
 extern gboolean video_update_timestamp (gchar *stamp);
 extern void video_set_timestamps (void);
 extern void video_play_frames (gboolean Play);
@@ -1059,6 +1076,8 @@ extern gint dc1394_bayer_AHD_uint16 (
 						 const gushort *restrict bayer, gushort *restrict dst,
 						 gint sx, gint sy, gint pattern, gint bits);
 extern gint debayer_get_tile (gint pattern, gshort h_offset, gshort v_offset);
+extern gint debayer_image (gint method, const gushort *bayer, gushort *rgb,
+						  gint sx, gint sy, gint tile, gint bits);
 
 #endif /* GOQAT_DEBAYER */
 
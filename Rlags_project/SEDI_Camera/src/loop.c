@@ -39,6 +39,8 @@
 #include "interface.h"
 
 #define INTERVAL 25   /* Timer tick interval in milliseconds   */
+#define CCD_POLL 10   /* Image ready polling interval (ms)     */
+#define AF_REPEAT 5   /* HFD measurements for autofocus median */
 
 #define ODL 0x00000000     /* lOop is iDLe                     */
 #define OCL 0x00000001     /* lOop CanceL                      */
@@ -49,10 +51,8 @@
 #define CST 0x00000004     /* Ccd Set Temperature              */
 #define CSF 0x00000008     /* Ccd Set Filter                   */
 #define CSE 0x00000010     /* Ccd Start Exposure               */
-#define CEP 0x00000020     /* Ccd Exposure in Progress         */
 #define CIE 0x00000040     /* Ccd Interrupt Exposure           */
 #define CCE 0x00000080     /* Ccd Cancel Exposure              */
-#define CPI 0x00000100     /* Ccd Process Image                */
 #define CDI 0x00000200     /* Ccd Display single Image         */
 #define CAP 0x00000400     /* Ccd Autofocus calibration stoP   */
 #define CFP 0x00000800     /* Ccd autoFocus stoP               */
@@ -99,7 +99,6 @@
 #define LVR 0x00000002     /* Live View Read                   */
 #define LVE 0x00000004     /* Live View rEcord                 */
 #define LVI 0x00000008     /* Live View Is recording           */
-#define LVD 0x00000010     /* Live View Flush to disk          */
 #define LVS 0x00000020     /* Live View Stop recording         */
 #define LVC 0x00000040     /* Live View Close                  */
 
@@ -131,20 +130,35 @@
 #define KAT 0x00000004	   /* tasKs AT                         */
 #define KEP 0x00000008     /* tasKs Execute script in Progress */
 
-static struct LoopFlags {
-	guint Loop;
-	guint CCD;
-	guint Aug;
-	guint Foc;
-	guint Lvw;
-	guint Pbw;
-	guint Tel;
-	guint Img;
-	guint Dsp;
-	guint Wat;
-	guint Tsk;
+static struct LoopFlags {  /* Shared between threads; change these only via */
+	volatile guint Loop;   /*  flags_set and flags_clear                    */
+	volatile guint CCD;
+	volatile guint Aug;
+	volatile guint Foc;
+	volatile guint Lvw;
+	volatile guint Pbw;
+	volatile guint Tel;
+	volatile guint Img;
+	volatile guint Dsp;
+	volatile guint Wat;
+	volatile guint Tsk;
 } Flags;
 
+enum CCDState {            /* Stages of a CCD exposure, in order            */
+	CCD_IDLE,              /* No exposure in progress                       */
+	CCD_EXPOSING,          /* Exposing; camera thread waits for the image   */
+	CCD_DOWNLOADING,       /* Camera thread is downloading the image        */
+	CCD_PROCESSING,        /* Main thread is to process the image           */
+	CCD_SAVING,            /* Main thread is to display and save the image  */
+	CCD_STATES
+};
+
+static volatile gint ccd_state = CCD_IDLE; /* Changed only by ccd_set_state   */
+static gint64 ccd_state_time[CCD_STATES];  /* When each state began (us)      */
+static gint64 ccd_exp_end;      /* Expected end of current exposure (us)      */
+static GStaticMutex ccd_mutex = G_STATIC_MUTEX_INIT; /* For ccd_cond          */
+static GCond *ccd_cond = NULL;  /* Signalled on every CCD state change        */
+
 static struct AFCalibThreadData {/* Data for autofocus calibration thread     */
 	gint start_pos;
 	gint end_pos;
@@ -171,7 +185,6 @@ static GThread *AFC_thread = NULL; /* Autofocus calibration thread            */
 static GThread *AFF_thread = NULL; /* Autofocus focusing thread               */
 static GThreadPool *thread_pool_autog_calib = NULL; /* Autog. calib. threads  */
 static GThreadPool *thread_pool_focuser_moving = NULL; /* Foc. move threads   */
-static gushort vid_buf;         /* Number of video buffer to flush to disk    */
 static guint save_period;       /* Period for saving autoguider images (s)    */
 static guint handler_id;        /* Timeout handler id                         */
 static gint filter_offset;      /* Focus offset when changing camera filter   */
@@ -213,7 +226,6 @@ void loop_focus_apply_temp_comp (gint pos);
 void loop_focus_check_done (void);
 void loop_LiveView_open (gboolean open);
 void loop_LiveView_record (gboolean record, gchar *dirname);
-void loop_LiveView_flush_to_disk (gushort buf);
 void loop_video_iter_frames (gboolean Iter);
 void loop_telescope_goto (gchar *sRA, gchar *sDec);
 void loop_telescope_move (gdouble RA, gdouble Dec);
@@ -231,11 +243,25 @@ void loop_tasks_script (void);
 void loop_display_blinkrect (gboolean Blink);
 guint loop_elapsed_since_first_iteration (void);
 static gboolean timeout (guint *timer, guint msec);
+static void flags_set (volatile guint *flags, guint bits);
+static void flags_clear (volatile guint *flags, guint bits);
+static gboolean ccd_set_state (enum CCDState from, enum CCDState to);
+static void ccd_wake (void);
+static enum CCDState ccd_wait_while (enum CCDState state1,
+									 enum CCDState state2);
+static void ccd_start_exposure (void);
+static gboolean ccd_image_downloaded (gpointer data);
+static void ccd_process_events (void);
 static gpointer thread_func_ccd (gpointer data);
 static gpointer thread_func_v4l (gpointer data);
 static gpointer thread_func_AFCalib (gpointer data);
 static gpointer thread_func_AFFocus (gpointer data);
 static void AF_focuser_move_and_wait (gint pos);
+static void AF_fit_vcurve (GArray *pos, GArray *hfd);
+static gdouble AF_median_slope (GArray *pos, GArray *hfd, gboolean LH,
+								gdouble min_pos, gdouble lower, gdouble upper,
+								gdouble *b);
+static gint AF_compare (gconstpointer a, gconstpointer b);
 static gboolean AF_measure_HFD (gboolean Init, gboolean Plot, gint box,
 								struct exposure_data *exd, gdouble *hfd);
 static void thread_pool_autog_calib_func (gpointer data, gpointer user_data);
@@ -253,7 +279,8 @@ void loop_start_loop (void)
 	 * start the execution loop.
 	 */
 
-	memset (&Flags, 0, sizeof (Flags));
+	memset ((void *) &Flags, 0, sizeof (Flags));
+	ccd_cond = g_cond_new ();
 	handler_id = g_timeout_add ((guint32) INTERVAL, event_loop, NULL);
 	Flags.Loop = ODL;
 }
@@ -265,9 +292,9 @@ void loop_ccd_open (gboolean Open)
 	 */
 	
 	if (Open)
-		Flags.CCD |= CCO;
+		flags_set (&Flags.CCD, CCO);
 	else
-		Flags.CCD |= CCC;
+		flags_set (&Flags.CCD, CCC);
 }
 
 void loop_ccd_start (void)
@@ -279,10 +306,10 @@ void loop_ccd_start (void)
 	
 	gboolean AtTemperature;
 	
-	Flags.CCD |= (CSF | CSE);
+	flags_set (&Flags.CCD, (CSF | CSE));
 	ccdcam_set_temperature (&AtTemperature);
 	if (!AtTemperature)
-		Flags.CCD |= CST;
+		flags_set (&Flags.CCD, CST);
 	set_exposure_buttons (TRUE);
 }
 
@@ -290,14 +317,14 @@ void loop_ccd_interrupt (void)
 {
 	/* This routine is called to interrupt the current exposure */
 	
-	Flags.CCD |= CIE;
+	flags_set (&Flags.CCD, CIE);
 }
 
 void loop_ccd_cancel (void)
 {
 	/* This routine is called to cancel an exposure */
 	
-	Flags.CCD |= CCE;
+	flags_set (&Flags.CCD, CCE);
 }
 
 void loop_ccd_display_image (void)
@@ -306,7 +333,7 @@ void loop_ccd_display_image (void)
 	 * has been changed.
 	 */
 	
-	Flags.CCD |= CDI;
+	flags_set (&Flags.CCD, CDI);
 }
 
 void loop_ccd_calibrate_autofocus (gboolean Start, gint start_pos, gint end_pos,
@@ -316,7 +343,7 @@ void loop_ccd_calibrate_autofocus (gboolean Start, gint start_pos, gint end_pos,
 	/* This routine is called to start/stop autofocus calibration */
 	
 	if (Start && !AFC_thread) {
-		Flags.Foc |= FFF;
+		flags_set (&Flags.Foc, FFF);
 		AFCalib_thread_data.start_pos = start_pos;
 		AFCalib_thread_data.end_pos = end_pos;
 		AFCalib_thread_data.step = step;
@@ -327,7 +354,7 @@ void loop_ccd_calibrate_autofocus (gboolean Start, gint start_pos, gint end_pos,
 	}
 	
 	if (!Start && AFC_thread)
-			Flags.CCD |= CAP;
+			flags_set (&Flags.CCD, CAP);
 }
 
 void loop_ccd_autofocus (gboolean Start, gdouble LHSlope, gdouble RHSlope,
@@ -337,7 +364,7 @@ void loop_ccd_autofocus (gboolean Start, gdouble LHSlope, gdouble RHSlope,
 	/* This routine is called to start/stop autofocusing */
 
 	if (Start && !AFF_thread) {
-		Flags.Foc |= FFF;
+		flags_set (&Flags.Foc, FFF);
 		AFFocus_thread_data.LHSlope = LHSlope;
 		AFFocus_thread_data.RHSlope = RHSlope;
 		AFFocus_thread_data.PID = PID;
@@ -350,7 +377,7 @@ void loop_ccd_autofocus (gboolean Start, gdouble LHSlope, gdouble RHSlope,
 	}
 	
 	if (!Start && AFF_thread)
-			Flags.CCD |= CFP;
+			flags_set (&Flags.CCD, CFP);
 }
 
 void loop_ccd_temps (gboolean display, guint period)
@@ -360,9 +387,9 @@ void loop_ccd_temps (gboolean display, guint period)
 	 */
 	
 	if (display)
-		Flags.CCD |= CDT;
+		flags_set (&Flags.CCD, CDT);
 	else
-	    Flags.CCD &= ~CDT;
+	    flags_clear (&Flags.CCD, CDT);
 }
 
 void loop_autog_open (gboolean Open)
@@ -372,9 +399,9 @@ void loop_autog_open (gboolean Open)
 	 */
 	
 	if (Open)
-		Flags.Aug |= AGO;
+		flags_set (&Flags.Aug, AGO);
 	else
-		Flags.Aug |= AGC;
+		flags_set (&Flags.Aug, AGC);
 }
 
 void loop_autog_restart (void)
@@ -383,7 +410,7 @@ void loop_autog_restart (void)
 	 * the camera settings.
 	 */
 	 
-	 Flags.Aug |= AGR;
+	 flags_set (&Flags.Aug, AGR);
 }
 
 void loop_autog_calibrate (gboolean Calibrate)
@@ -393,9 +420,9 @@ void loop_autog_calibrate (gboolean Calibrate)
 	 */
 	
 	if (Calibrate)
-		Flags.Aug |= (ACC | ACG);
+		flags_set (&Flags.Aug, (ACC | ACG));
 	else
-		Flags.Aug |= ACP;
+		flags_set (&Flags.Aug, ACP);
 }
 
 void loop_autog_exposure_wait (gboolean Wait, enum MotionDirection dirn)
@@ -413,12 +440,12 @@ void loop_autog_exposure_wait (gboolean Wait, enum MotionDirection dirn)
 	static gushort guide_motion = 0;
 	
 	if (Wait) { 
-		Flags.Aug &= ~ASE;
+		flags_clear (&Flags.Aug, ASE);
 		guide_motion |= dirn;
 	} else {
 		guide_motion &= ~dirn;
 		if (!guide_motion)
-			Flags.Aug |= ASE;
+			flags_set (&Flags.Aug, ASE);
 	}
 }
 
@@ -429,9 +456,9 @@ void loop_autog_guide (gboolean guide)
 	 */
 	
 	if (guide)
-		Flags.Aug |= AGB;
+		flags_set (&Flags.Aug, AGB);
 	else
-		Flags.Aug |= AGQ;
+		flags_set (&Flags.Aug, AGQ);
 }
 
 void loop_autog_pause (gboolean pause)
@@ -441,9 +468,9 @@ void loop_autog_pause (gboolean pause)
 	 */
 	
 	if (pause)
-		Flags.Aug |= AGU;
+		flags_set (&Flags.Aug, AGU);
 	else
-		Flags.Aug |= AGN;
+		flags_set (&Flags.Aug, AGN);
 }
 
 void loop_autog_DS9 (void)
@@ -452,7 +479,7 @@ void loop_autog_DS9 (void)
 	 * in the user interface.
 	 */
 	
-	Flags.Aug |= AGI;
+	flags_set (&Flags.Aug, AGI);
 }
 
 void loop_focus_open (gboolean Open)
@@ -462,9 +489,9 @@ void loop_focus_open (gboolean Open)
 	 */
 	
 	if (Open)
-		Flags.Foc |= FCO;
+		flags_set (&Flags.Foc, FCO);
 	else
-		Flags.Foc &= ~FCO;
+		flags_clear (&Flags.Foc, FCO);
 }
 
 void loop_focus_stop (void)
@@ -473,7 +500,7 @@ void loop_focus_stop (void)
 	 * Focus tab.
 	 */
 	
-	Flags.Foc |= FSM;
+	flags_set (&Flags.Foc, FSM);
 }
 
 gboolean loop_focus_is_focusing (void)
@@ -494,7 +521,7 @@ void loop_focus_apply_filter_offset (gint offset)
 	 */
 	
 	filter_offset = offset;
-	Flags.Foc |= FAO;
+	flags_set (&Flags.Foc, FAO);
 }
 
 void loop_focus_apply_temp_comp (gint pos)
@@ -505,7 +532,7 @@ void loop_focus_apply_temp_comp (gint pos)
 	 */
 	
 	tempcomp_pos = pos;
-	Flags.Foc |= FAT;
+	flags_set (&Flags.Foc, FAT);
 }
 
 void loop_focus_check_done (void)
@@ -514,7 +541,7 @@ void loop_focus_check_done (void)
 	 * when the motion has finished.
 	 */
 	
-	Flags.Foc |= (FCM | FIM);
+	flags_set (&Flags.Foc, (FCM | FIM));
 }
 
 void loop_LiveView_open (gboolean open)
@@ -524,9 +551,9 @@ void loop_LiveView_open (gboolean open)
 	 */
 	
 	if (open)
-		Flags.Lvw |= LVO;
+		flags_set (&Flags.Lvw, LVO);
 	else
-		Flags.Lvw |= LVC;
+		flags_set (&Flags.Lvw, LVC);
 }
 
 void loop_LiveView_record (gboolean record, gchar *dirname)
@@ -536,10 +563,10 @@ void loop_LiveView_record (gboolean record, gchar *dirname)
 	 */
 	
 	if (record) {
-		Flags.Lvw |= LVE;
+		flags_set (&Flags.Lvw, LVE);
 	    VideoDir = g_strdup (dirname);
 	} else {
-		Flags.Lvw |= LVS;
+		flags_set (&Flags.Lvw, LVS);
 		if (VideoDir) {
 			g_free (VideoDir);
 		    VideoDir = NULL;
@@ -547,16 +574,6 @@ void loop_LiveView_record (gboolean record, gchar *dirname)
 	}
 }
 
-void loop_LiveView_flush_to_disk (gushort buf)
-{
-	/* This routine is called when a video buffer has been filled and is ready
-	 * for flushing to disk.
-	 */
-	
-	Flags.Lvw |= LVD;
-    vid_buf = buf;	
-}
-
 void loop_video_iter_frames (gboolean Iter)
 {
 	/* This routine is called to start or stop iterating through selected
@@ -564,9 +581,9 @@ void loop_video_iter_frames (gboolean Iter)
 	 */
 	
 	if (Iter)
-		Flags.Pbw |= PBI;
+		flags_set (&Flags.Pbw, PBI);
 	else
-		Flags.Pbw |= PBF;
+		flags_set (&Flags.Pbw, PBF);
 }
 
 void loop_telescope_goto (gchar *RA, gchar *Dec)
@@ -575,7 +592,7 @@ void loop_telescope_goto (gchar *RA, gchar *Dec)
 	
 	sRA = RA;
 	sDec = Dec;
-	Flags.Tel |= TGO;	
+	flags_set (&Flags.Tel, TGO);	
 }
 
 void loop_telescope_move (gdouble RA, gdouble Dec)
@@ -584,7 +601,7 @@ void loop_telescope_move (gdouble RA, gdouble Dec)
 	
 	MoveRA = RA;
 	MoveDec = Dec;
-	Flags.Tel |= TMV;	
+	flags_set (&Flags.Tel, TMV);	
 }
 
 void loop_telescope_restart (void)
@@ -593,14 +610,14 @@ void loop_telescope_restart (void)
 	 * command.
 	 */
 	
-	Flags.Tel |= TWR;
+	flags_set (&Flags.Tel, TWR);
 }
 
 void loop_telescope_park (void)
 {
 	/* This routine is called when the task list executes a ParkMount command */
 	
-	Flags.Tel |= TPM;
+	flags_set (&Flags.Tel, TPM);
 }
 
 void loop_telescope_yellow (void)
@@ -609,7 +626,7 @@ void loop_telescope_yellow (void)
 	 * command.
 	 */
 	
-	Flags.Tel |= TYB;
+	flags_set (&Flags.Tel, TYB);
 }
 
 void loop_save_image (gint id)
@@ -617,10 +634,10 @@ void loop_save_image (gint id)
 	/* This routine is called when an image is to be autosaved */
 	
 	if (id == AUG)
-		Flags.Img |= SSA;
+		flags_set (&Flags.Img, SSA);
 	
 	if (id == CCD)
-		Flags.Img |= SCI;
+		flags_set (&Flags.Img, SCI);
 }
 
 void loop_save_periodic (gboolean save, guint period)
@@ -630,10 +647,10 @@ void loop_save_periodic (gboolean save, guint period)
 	 */
 
 	if (save) {
-		Flags.Img |= SPA;
+		flags_set (&Flags.Img, SPA);
 		save_period = period;
 	} else
-		Flags.Img &= ~SPA;
+		flags_clear (&Flags.Img, SPA);
 }
 
 void loop_stop_loop (void)
@@ -642,7 +659,7 @@ void loop_stop_loop (void)
 	 * stop the event loop.
 	 */
 	
-	Flags.Loop |= OCL;
+	flags_set (&Flags.Loop, OCL);
 }
 
 void loop_watch_activate (gboolean Activate)
@@ -650,9 +667,9 @@ void loop_watch_activate (gboolean Activate)
 	/* Activate/deactivate watching the designated folder for incoming tasks */
 	
 	if (Activate)
-		Flags.Wat |= WAC;
+		flags_set (&Flags.Wat, WAC);
 	else
-		Flags.Wat |= WAS;
+		flags_set (&Flags.Wat, WAS);
 }
 
 void loop_tasks_wait (void)
@@ -661,7 +678,7 @@ void loop_tasks_wait (void)
 	 * list.
 	 */
 	
-	Flags.Tsk |= KWT;
+	flags_set (&Flags.Tsk, KWT);
 }
 
 void loop_tasks_pause (void)
@@ -670,7 +687,7 @@ void loop_tasks_pause (void)
 	 * list.
 	 */
 	
-	Flags.Tsk |= KPS;	
+	flags_set (&Flags.Tsk, KPS);	
 }
 
 void loop_tasks_at (void)
@@ -679,7 +696,7 @@ void loop_tasks_at (void)
 	 * list.
 	 */
 	
-	Flags.Tsk |= KAT;
+	flags_set (&Flags.Tsk, KAT);
 }
 
 void loop_tasks_script (void)
@@ -688,7 +705,7 @@ void loop_tasks_script (void)
 	 * task list.
 	 */
 	
-	Flags.Tsk |= KEP;
+	flags_set (&Flags.Tsk, KEP);
 }
 
 void loop_display_blinkrect (gboolean Blink)
@@ -698,9 +715,9 @@ void loop_display_blinkrect (gboolean Blink)
 	 */
 	
 	if (Blink)
-		Flags.Dsp |= DBR;
+		flags_set (&Flags.Dsp, DBR);
 	else
-		Flags.Dsp |= DSR;
+		flags_set (&Flags.Dsp, DSR);
 }
 
 guint loop_elapsed_since_first_iteration (void)
@@ -742,6 +759,164 @@ static gboolean timeout (guint *timer, guint msec)
 	    return FALSE;
 }
 
+static void flags_set (volatile guint *flags, guint bits)
+{
+	/* Set bits in one of the Flags words.  The words are shared between the
+	 * main thread and the camera, video and autofocus threads, so this is
+	 * done atomically.
+	 */
+	
+	volatile gint *f = (volatile gint *) flags;
+	gint old;
+	
+	do
+		old = g_atomic_int_get (f);
+	while (!g_atomic_int_compare_and_exchange (f, old, old | bits));
+}
+
+static void flags_clear (volatile guint *flags, guint bits)
+{
+	/* Clear bits in one of the Flags words atomically */
+	
+	volatile gint *f = (volatile gint *) flags;
+	gint old;
+	
+	do
+		old = g_atomic_int_get (f);
+	while (!g_atomic_int_compare_and_exchange (f, old, old & ~bits));
+}
+
+static gboolean ccd_set_state (enum CCDState from, enum CCDState to)
+{
+	/* Move a CCD exposure from one stage to the next: exposing, downloading,
+	 * processing, saving and back to idle.  The change is made atomically
+	 * and fails (returning FALSE) if some other thread has changed the state
+	 * first, e.g. by cancelling the exposure.  The time of each change is 
+	 * recorded, and the time spent in each stage is written to the log in 
+	 * debug mode when the image has been saved.  The camera thread and any 
+	 * other thread waiting in ccd_wait_while are woken.
+	 */
+	
+	gint64 *t = ccd_state_time;
+	
+	if (!g_atomic_int_compare_and_exchange (&ccd_state, from, to))
+		return FALSE;
+	t[to] = g_get_monotonic_time ();
+	
+	if (from == CCD_SAVING)
+		G_print ("CCD timing: exposure %.3fs, download %.3fs, "
+				 "processing %.3fs, saving %.3fs\n",
+				 (t[CCD_DOWNLOADING] - t[CCD_EXPOSING]) / 1e6,
+				 (t[CCD_PROCESSING] - t[CCD_DOWNLOADING]) / 1e6,
+				 (t[CCD_SAVING] - t[CCD_PROCESSING]) / 1e6,
+				 (t[CCD_IDLE] - t[CCD_SAVING]) / 1e6);
+	ccd_wake ();
+	return TRUE;
+}
+
+static void ccd_wake (void)
+{
+	/* Wake the camera thread, and any thread waiting for the CCD state to 
+	 * change, to look at the state and the flags again.
+	 */
+	
+	g_static_mutex_lock (&ccd_mutex);
+	g_cond_broadcast (ccd_cond);
+	g_static_mutex_unlock (&ccd_mutex);
+}
+
+static enum CCDState ccd_wait_while (enum CCDState state1, 
+									 enum CCDState state2)
+{
+	/* Wait (outside the main thread) for the CCD state to be other than 
+	 * state1 or state2, and return the new state.
+	 */
+	
+	enum CCDState state;
+	
+	g_static_mutex_lock (&ccd_mutex);
+	while ((state = g_atomic_int_get (&ccd_state)) == state1 || 
+		                                                     state == state2)
+		g_cond_wait (ccd_cond, g_static_mutex_get_mutex (&ccd_mutex));
+	g_static_mutex_unlock (&ccd_mutex);
+	return state;
+}
+
+static void ccd_start_exposure (void)
+{
+	/* Start a CCD exposure and leave the camera thread to wait for it.  The
+	 * thread sleeps until the exposure is due to end before polling the 
+	 * camera for the image.
+	 */
+	
+	if (ccdcam_start_exposure ()) {
+		g_static_mutex_lock (&ccd_mutex);
+		ccd_exp_end = g_get_monotonic_time () + (gint64) 
+		           ((get_ccd_image_struct ())->exd.req_len * G_USEC_PER_SEC);
+		g_static_mutex_unlock (&ccd_mutex);
+		ccd_set_state (CCD_IDLE, CCD_EXPOSING);
+	}
+}
+
+static gboolean ccd_image_downloaded (gpointer data)
+{
+	/* Idle function, added by the camera thread when it has downloaded an
+	 * image, so that the main thread processes the image straight away 
+	 * rather than at the next timer tick.
+	 */
+	
+	ccd_process_events ();
+	return FALSE;
+}
+
+static void ccd_process_events (void)
+{
+	/* Process, display and save a CCD image in the main thread.  This is
+	 * called from the event loop and from ccd_image_downloaded.
+	 */
+	
+	if (g_atomic_int_get (&ccd_state) == CCD_PROCESSING) { /* Image ready */
+		set_progress_bar (TRUE, loop_elapsed_since_first_iteration ());
+		if (ccdcam_process_image ()) {
+			ccd_set_state (CCD_PROCESSING, CCD_SAVING);
+			flags_set (&Flags.CCD, CDI);
+			flags_clear (&Flags.Aug, AGE); /* Next exposure can't start   */
+		} else                             /*  until autog. is next idle  */
+			ccd_set_state (CCD_PROCESSING, CCD_IDLE);
+	}
+	
+	if (Flags.CCD & CDI) { /* Save CCD image for display and display it */
+		flags_clear (&Flags.CCD, CDI);
+		if ((get_ccd_image_struct ())->Debayer && 
+			(get_ccd_image_struct ())->exd.h_bin == 1 &&
+			(get_ccd_image_struct ())->exd.v_bin == 1) {
+			if (save_file (get_ccd_image_struct (), R, TRUE))
+				xpa_display_image (get_ccd_image_struct (), R);
+			if (save_file (get_ccd_image_struct (), G, TRUE))
+				xpa_display_image (get_ccd_image_struct (), G);
+			if (save_file (get_ccd_image_struct (), B, TRUE))
+				xpa_display_image (get_ccd_image_struct (), B);
+		} else {
+			if (save_file (get_ccd_image_struct (), GREY, TRUE))
+				xpa_display_image (get_ccd_image_struct (), GREY);
+		}
+	}
+	
+	if (Flags.Img & SCI) { /* Save CCD image if autosave requested */
+		flags_clear (&Flags.Img, SCI);
+		if ((get_ccd_image_struct ())->Debayer && 
+			(get_ccd_image_struct ())->exd.h_bin == 1 &&
+			(get_ccd_image_struct ())->exd.v_bin == 1) {
+			save_file (get_ccd_image_struct (), R, FALSE);
+			save_file (get_ccd_image_struct (), G, FALSE);
+			save_file (get_ccd_image_struct (), B, FALSE);
+		} else
+			save_file (get_ccd_image_struct (), GREY, FALSE);
+	}
+	
+	ccd_set_state (CCD_SAVING, CCD_IDLE); /* Ready for the next exposure */
+}
+
 static gpointer thread_func_ccd (gpointer data)
 {
 	/* CCD camera thread function.  Periodic calls to the CCD camera to monitor 
@@ -755,29 +930,58 @@ static gpointer thread_func_ccd (gpointer data)
 	 * Guiding commands issued via the CCD camera are made from the guide 
 	 * timing thread in telescope.c.  They will block in that thread whilst the
 	 * image is being downloaded.
+	 *
+	 * The thread sleeps until woken by ccd_wake (a status request, a change
+	 * of state or closing the camera) or until the current exposure is due to
+	 * end, after which it polls the camera every CCD_POLL ms.  When the image
+	 * has been downloaded, the main thread is told to process it at once.
 	 */
 	
-	while (TRUE) {
-		usleep (50*1000);
-		
-		if (Flags.CCD & CCC)
-			g_thread_exit (NULL);
+	GTimeVal until;
+	gint64 now, wait;
+	
+	g_static_mutex_lock (&ccd_mutex);
+	while (!(Flags.CCD & CCC)) {
 		
 		if (Flags.CCD & CSI) {
-			Flags.CCD &= ~CSI;
+			flags_clear (&Flags.CCD, CSI);
+			g_static_mutex_unlock (&ccd_mutex);
 			if (!ccdcam_get_status ())
-				Flags.CCD |= CUS;
+				flags_set (&Flags.CCD, CUS);
+			g_static_mutex_lock (&ccd_mutex);
+			continue;
+		}
+		
+		if (g_atomic_int_get (&ccd_state) != CCD_EXPOSING) {
+			g_cond_wait (ccd_cond, g_static_mutex_get_mutex (&ccd_mutex));
+			continue;
 		}
 		
-		if (Flags.CCD & CEP) {
-			if (ccdcam_image_ready ()) {
-				Flags.CCD &= ~CEP;
-				if (ccdcam_download_image ())
-					Flags.CCD |= CPI;
+		if ((now = g_get_monotonic_time ()) >= ccd_exp_end) {
+			g_static_mutex_unlock (&ccd_mutex);
+			if (ccdcam_image_ready () &&
+				ccd_set_state (CCD_EXPOSING, CCD_DOWNLOADING)) {
+				if (ccdcam_download_image () &&
+					ccd_set_state (CCD_DOWNLOADING, CCD_PROCESSING))
+					g_idle_add (ccd_image_downloaded, NULL);
+				else
+					ccd_set_state (CCD_DOWNLOADING, CCD_IDLE);
 			}
+			g_static_mutex_lock (&ccd_mutex);
+			if (g_atomic_int_get (&ccd_state) != CCD_EXPOSING)
+				continue;
+			now = g_get_monotonic_time ();
+			ccd_exp_end = now + CCD_POLL * 1000;
 		}
 		
+		wait = ccd_exp_end - now;  /* At most 1s at a time, since the timed */
+		g_get_current_time (&until);   /*  wait is by the wall clock      */
+		g_time_val_add (&until, wait > G_USEC_PER_SEC ? G_USEC_PER_SEC : wait);
+		g_cond_timed_wait (ccd_cond, g_static_mutex_get_mutex (&ccd_mutex),
+						   &until);
 	}
+	g_static_mutex_unlock (&ccd_mutex);
+	
 	return NULL;
 }
 
@@ -785,16 +989,16 @@ static gpointer thread_func_v4l (gpointer data)
 {
 	#ifdef HAVE_LIBV4L2
 	/* V4L (autoguiding camera) frame grabber thread function.
-	 * Frames are stored into a fifo buffer, which is then read whenever the
+	 * Frames are added to a queue, from which they are taken whenever the
 	 * application is ready to use them.
 	 */
 	 
 	while (Flags.Aug & AGA) {
 		if (!(Flags.Aug & AGR)) {
 			if (!augcam_grab_v4l_buffer ())
-				Flags.Aug |= AGC;
+				flags_set (&Flags.Aug, AGC);
 		} else
-			Flags.Aug |= AVP;
+			flags_set (&Flags.Aug, AVP);
 		usleep (1000);
 	}
 	#endif
@@ -807,10 +1011,14 @@ static gpointer thread_func_AFCalib (gpointer data)
 	
 	struct exposure_data exd;
 	
+	GArray *pos, *hfds;
 	gint repeat;
-	gdouble hfd;
+	gdouble hfd, hfd_pos;
 	gboolean NextStep = TRUE, Stopped = FALSE;
 	
+	pos = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	hfds = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	
 	/* Move focuser to initial position */
 	
 	AF_focuser_move_and_wait (AFCalib_thread_data.start_pos);
@@ -846,6 +1054,9 @@ static gpointer thread_func_AFCalib (gpointer data)
 					goto stopped;
 				}
 			}
+			hfd_pos = exd.focus_pos;
+			g_array_append_val (pos, hfd_pos);
+			g_array_append_val (hfds, hfd);
 		}
 			
 		/* Any more steps to do? */
@@ -871,12 +1082,16 @@ static gpointer thread_func_AFCalib (gpointer data)
 	}
 
 stopped:
-	Flags.CCD &= ~CAP;
+	flags_clear (&Flags.CCD, CAP);
 	ccdcam_set_fast_readspeed (FALSE);
+	if (!Stopped)
+		AF_fit_vcurve (pos, hfds);
+	g_array_free (pos, TRUE);
+	g_array_free (hfds, TRUE);
 	L_print ("{b}Autofocus calibration %s\n", Stopped ? "stopped" : "finished");
 	AFC_thread = NULL;
 	g_thread_exit (NULL);
-	Flags.Foc &= ~FFF;
+	flags_clear (&Flags.Foc, FFF);
 	return NULL;	
 }
 
@@ -888,7 +1103,8 @@ static gpointer thread_func_AFFocus (gpointer data)
 	
 	gushort i, retry = 0;
 	gint old_p;
-	gdouble hfd, hfd_ave, old_hfd;
+	gdouble hfd, hfd_med, old_hfd;
+	gdouble hfd_val[AF_REPEAT];
 	gboolean Stopped = FALSE;
 	
 	/* Set camera readout speed */
@@ -966,14 +1182,16 @@ restart:
 	old_p = exd.focus_pos;
 	AF_focuser_move_and_wait (exd.focus_pos);
 	
-	/* Take average of five HFD measurements... */
+	/* Take median of several HFD measurements, so that one bad frame (e.g.
+	 * poor seeing or a passing cloud) doesn't spoil the final position...
+	 */
 	
-	for (i = 0, hfd_ave = 0.0; i < 5; i++) {
+	for (i = 0; i < AF_REPEAT; i++) {
 		if (!AF_measure_HFD(FALSE, FALSE, AFFocus_thread_data.box, &exd, &hfd)){
 			Stopped = TRUE;
 			goto stopped;
 		}
-		hfd_ave += hfd;
+		hfd_val[i] = hfd;
 		
 		/* Test to see if end of thread has been requested */
 		
@@ -982,11 +1200,12 @@ restart:
 			goto stopped;
 		}
 	}
-	hfd_ave /= 5.0;
+	qsort (hfd_val, AF_REPEAT, sizeof (gdouble), AF_compare);
+	hfd_med = hfd_val[AF_REPEAT / 2];
 	
 	/* Move to final position */
 	
-	exd.focus_pos = rint (old_p - hfd_ave / 
+	exd.focus_pos = rint (old_p - hfd_med / 
 						  (AFFocus_thread_data.Inside ? 
 		                   AFFocus_thread_data.LHSlope : 
 		                   AFFocus_thread_data.RHSlope) +
@@ -1007,12 +1226,12 @@ restart:
 	focus_store_temp_and_pos ();
 	
 stopped:
-	Flags.CCD &= ~CFP;
+	flags_clear (&Flags.CCD, CFP);
 	ccdcam_set_fast_readspeed (FALSE);
 	L_print ("{b}Autofocus %s\n", Stopped ? "stopped" : "finished");
 	AFF_thread = NULL;
 	g_thread_exit (NULL);
-	Flags.Foc &= ~FFF;
+	flags_clear (&Flags.Foc, FFF);
 	return NULL;	
 }
 	
@@ -1030,6 +1249,134 @@ static void AF_focuser_move_and_wait (gint pos)
 		usleep (50*1000);
 }
 
+static void AF_fit_vcurve (GArray *pos, GArray *hfd)
+{
+	/* Fit straight lines to the two arms of the V-curve of HFD against 
+	 * focus position, using the measurements with HFD between the lower and
+	 * upper values on the autofocus configuration window.  Each arm is fitted
+	 * by the Theil-Sen method (the median of the slopes between all pairs of
+	 * points), which is not pulled off the line by the odd bad measurement
+	 * as a least-squares fit would be.  The results are written to the 
+	 * autofocus configuration window, as for the fit of the plotted curve.
+	 */
+	
+	guint i, min;
+	gdouble min_pos, HFD_lower, HFD_upper;
+	gdouble LH_m, LH_b, LH_i, RH_m, RH_b, RH_i;
+	gint centre;
+	
+	if (!pos->len)
+		return;
+	
+	gdk_threads_enter ();   /* Try to avoid these calls in future release */
+	get_entry_float ("txtAFConfigFitUpperHFD", 0.0, 500.0, 20.0, 
+					 NO_PAGE, &HFD_upper);
+	get_entry_float ("txtAFConfigFitLowerHFD", 0.0, 500.0, 20.0, 
+					 NO_PAGE, &HFD_lower);
+	gdk_threads_leave ();   /* Try to avoid these calls in future release */
+	
+	/* The arms lie either side of the position with the smallest HFD */
+	
+	for (i = 1, min = 0; i < hfd->len; i++)
+		if (g_array_index (hfd, gdouble, i) < g_array_index (hfd, gdouble, min))
+			min = i;
+	min_pos = g_array_index (pos, gdouble, min);
+	
+	LH_m = AF_median_slope (pos, hfd, TRUE, min_pos, HFD_lower, HFD_upper, 
+							&LH_b);
+	RH_m = AF_median_slope (pos, hfd, FALSE, min_pos, HFD_lower, HFD_upper,
+							&RH_b);
+	if (LH_m >= 0.0 || RH_m <= 0.0) {
+		L_print ("{r}Unable to fit V-curve - need at least two points with "
+				 "HFD between %f and %f on each side of focus\n", 
+				 HFD_lower, HFD_upper);
+		return;
+	}
+	LH_i = -LH_b / LH_m;
+	RH_i = -RH_b / RH_m;
+	centre = (gint) ((gfloat) (0.5 + (LH_i + RH_i) / 2.0));
+	
+	gdk_threads_enter ();   /* Try to avoid these calls in future release */
+	set_entry_float ("txtAFConfigLHSlope", LH_m);
+	set_entry_float ("txtAFConfigLHPosIntercept", LH_i);
+	set_entry_float ("txtAFConfigRHSlope", RH_m);
+	set_entry_float ("txtAFConfigRHPosIntercept", RH_i);
+	set_entry_float ("txtAFConfigSlopeRatio", LH_m / RH_m);
+	set_entry_float ("txtAFConfigPID", LH_i - RH_i);
+	set_entry_int ("txtAFConfigCentreFocus", centre);
+	gdk_threads_leave ();   /* Try to avoid these calls in future release */
+	
+	L_print ("{.}\n");
+	L_print ("HFD range: %f to %f\n", HFD_lower, HFD_upper);
+	L_print ("LH slope: %f, position intercept: %f\n", LH_m, LH_i);
+	L_print ("RH slope: %f, position intercept: %f\n", RH_m, RH_i);
+	L_print ("Slope ratio: %f, intercept difference: %f, best focus: %d\n",
+			 LH_m / RH_m, LH_i - RH_i, centre);
+}
+
+static gdouble AF_median_slope (GArray *pos, GArray *hfd, gboolean LH,
+								gdouble min_pos, gdouble lower, gdouble upper,
+								gdouble *b)
+{
+	/* Return the Theil-Sen slope of the points with HFD between lower and
+	 * upper on the left-hand (LH = TRUE) or right-hand arm of the V-curve 
+	 * (below or above min_pos), and the intercept in b.  Returns zero if
+	 * there are fewer than two points at different positions.
+	 */
+	
+	GArray *x, *y, *m;
+	guint i, j;
+	gdouble p, h, slope;
+	
+	x = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	y = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	m = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	
+	for (i = 0; i < pos->len; i++) {
+		p = g_array_index (pos, gdouble, i);
+		h = g_array_index (hfd, gdouble, i);
+		if (h < lower || h > upper || (LH ? p >= min_pos : p <= min_pos))
+			continue;
+		g_array_append_val (x, p);
+		g_array_append_val (y, h);
+	}
+	
+	for (i = 0; i < x->len; i++)
+		for (j = i + 1; j < x->len; j++) {
+			p = g_array_index (x, gdouble, j) - g_array_index (x, gdouble, i);
+			if (p == 0.0)  /* Repeated measurements at same position */
+				continue;
+			slope = (g_array_index (y, gdouble, j) - 
+					 g_array_index (y, gdouble, i)) / p;
+			g_array_append_val (m, slope);
+		}
+	
+	slope = *b = 0.0;
+	if (m->len) {
+		qsort (m->data, m->len, sizeof (gdouble), AF_compare);
+		slope = g_array_index (m, gdouble, m->len / 2);
+		for (i = 0; i < x->len; i++)
+			g_array_index (y, gdouble, i) -= 
+								   slope * g_array_index (x, gdouble, i);
+		qsort (y->data, y->len, sizeof (gdouble), AF_compare);
+		*b = g_array_index (y, gdouble, y->len / 2);
+	}
+	
+	g_array_free (x, TRUE);
+	g_array_free (y, TRUE);
+	g_array_free (m, TRUE);
+	return slope;
+}
+
+static gint AF_compare (gconstpointer a, gconstpointer b)
+{
+	/* Compare two doubles for qsort */
+	
+	gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+	
+	return (x > y) - (x < y);
+}
+
 static gboolean AF_measure_HFD (gboolean Init, gboolean Plot, gint box,
 								struct exposure_data *exd, gdouble *hfd)
 {
@@ -1049,11 +1396,10 @@ static gboolean AF_measure_HFD (gboolean Init, gboolean Plot, gint box,
 		gdk_threads_leave ();   /* Try to avoid these calls in future release */
 		exd->req_len = exp_len;
 	}
+	ccd_wait_while (CCD_PROCESSING, CCD_SAVING); /* Previous image done? */
 	ccdcam_set_exposure_data (exd);
-	if (ccdcam_start_exposure ())
-		Flags.CCD |= CEP;
-	while (Flags.CCD & CEP)
-		usleep (50*1000);
+	ccd_start_exposure ();
+	ccd_wait_while (CCD_EXPOSING, CCD_DOWNLOADING);
 	OK = ccdcam_measure_HFD (Init, Plot, box, exd, hfd);
 	
 	return OK;
@@ -1117,7 +1463,7 @@ static void thread_pool_autog_calib_func (gpointer data, gpointer user_data)
 		    break;
 		case 4:
 			/* Have captured final star position so set flag and return */
-			Flags.Aug |= ACD;
+			flags_set (&Flags.Aug, ACD);
 			return;
 			break;
 		default:
@@ -1166,7 +1512,7 @@ static void thread_pool_autog_calib_func (gpointer data, gpointer user_data)
 	 * control the exposure.
 	 */
 	
-	Flags.Aug |= ACM;
+	flags_set (&Flags.Aug, ACM);
 }
 
 static void thread_pool_focuser_moving_func (gpointer data, gpointer user_data)
@@ -1180,16 +1526,16 @@ static void thread_pool_focuser_moving_func (gpointer data, gpointer user_data)
 	struct focus f;
 
 	if (Flags.Foc & FSM) {
-		Flags.Foc &= ~FSM;
+		flags_clear (&Flags.Foc, FSM);
 		f.cmd = FC_STOP;
 		while (focus_is_moving ())
 			focus_comms->focus (&f);
 	}
 	
 	if (focus_is_moving ())
-		Flags.Foc |= FCM;
+		flags_set (&Flags.Foc, FCM);
 	else
-		Flags.Foc |= FSP;
+		flags_set (&Flags.Foc, FSP);
 }
 
 static gint event_loop (gpointer data)
@@ -1205,24 +1551,24 @@ static gint event_loop (gpointer data)
 	static guint check_autog_calib_t = 0, check_goto_done_t = 0;
 	static guint check_script_done_t = 0, read_focuser_temp_t = 0;
 	static gboolean Show = FALSE;
-	gboolean AtTemperature, ignore;
+	gboolean AtTemperature;
 	
-	tasks_execute_tasks (FALSE, &ignore); /* Anything in the task list? */
+	tasks_execute_tasks ();             /* Anything in the task list? */
 	
 	if (Flags.Loop & OCL) { /* Cancel event loop */
-		Flags.Loop &= ~OCL;
-		if (Flags.CCD & CCA) Flags.CCD |= CCC;
-		if (Flags.Aug & AGA) Flags.Aug |= AGC;
-		if (Flags.Foc & FIM) Flags.Foc |= FSM;
-		if (Flags.Lvw & LVI) Flags.Lvw |= (LVS | LVC);
-		Flags.Loop |= OIQ;
+		flags_clear (&Flags.Loop, OCL);
+		if (Flags.CCD & CCA) flags_set (&Flags.CCD, CCC);
+		if (Flags.Aug & AGA) flags_set (&Flags.Aug, AGC);
+		if (Flags.Foc & FIM) flags_set (&Flags.Foc, FSM);
+		if (Flags.Lvw & LVI) flags_set (&Flags.Lvw, (LVS | LVC));
+		flags_set (&Flags.Loop, OIQ);
 	}
 	
 	if (Flags.CCD & CCO) { /* Open CCD camera */
-		Flags.CCD &= ~CCO; /* Don't keep trying! */
+		flags_clear (&Flags.CCD, CCO); /* Don't keep trying! */
 		if (ccdcam_open ()) {
 			set_ccd_gui (TRUE);  /* Set the various elements in the GUI */
-			Flags.CCD |= CCA;
+			flags_set (&Flags.CCD, CCA);
 			ccd_thread = g_thread_create (thread_func_ccd, NULL, TRUE, NULL);
 		} else
 			reset_checkbox_state (RCS_OPEN_CCD_LINK, FALSE);
@@ -1230,7 +1576,7 @@ static gint event_loop (gpointer data)
 	
 	if ((Flags.CCD & CSF) && !(Flags.CCD & CCE)) { /* Set CCD filter */
 		if (set_filter (FALSE, (gchar *) NULL, &filter_offset)) {
-			Flags.CCD &= ~CSF;
+			flags_clear (&Flags.CCD, CSF);
 			/* NOTE: Both the QSI and SX filterwheel code blocks in the main
 			 * thread while waiting for confirmation that the correct 
 			 * position has been set, so analysis of autoguider images will
@@ -1244,7 +1590,7 @@ static gint event_loop (gpointer data)
 				loop_focus_apply_filter_offset (filter_offset);
 			}
 		} else
-		    Flags.CCD |= CCE;
+		    flags_set (&Flags.CCD, CCE);
 	}
 	
 	if ((Flags.CCD & CST) && !(Flags.CCD & CCE)) { /* Set CCD temperature */
@@ -1253,168 +1599,138 @@ static gint event_loop (gpointer data)
 				if (AtTemperature) {
 					if (++ccd_temp_check == 4) {
 						ccd_temp_check = 0;
-						Flags.CCD &= ~CST;
+						flags_clear (&Flags.CCD, CST);
 					}
 				} else
 					ccd_temp_check = 0;
 			} else 
-		        Flags.CCD |= CCE;
+		        flags_set (&Flags.CCD, CCE);
 		}
 	}
 	
 	if ((Flags.CCD & CSE) && !(Flags.CCD & (CST | CSF))  /* Start exposure */
-		                  && !(Flags.Foc & (FAO | FIM))) {
+		                  && !(Flags.Foc & (FAO | FIM))
+		                  && g_atomic_int_get (&ccd_state) == CCD_IDLE) {
 		if (Flags.Aug & AGG) {      /*  If autoguiding and autoguider idle */
 			if (Flags.Aug & AGE) {  /*   (i.e. not just made a correction) */
-				Flags.CCD &= ~CSE;
-				if (ccdcam_start_exposure ())
-					Flags.CCD |= CEP;
+				flags_clear (&Flags.CCD, CSE);
+				ccd_start_exposure ();
 			} else {                               /* Add message to log once */
 			    if (timeout (&wait_autog_t, 1000)) /* per second              */
 					L_print ("Waiting for autoguider...\n");
 			}
 		} else {
-			Flags.CCD &= ~CSE;
-			if (ccdcam_start_exposure ())
-				Flags.CCD |= CEP;
+			flags_clear (&Flags.CCD, CSE);
+			ccd_start_exposure ();
 		}
 	}
 	
 	if (Flags.CCD & CIE) { /* Interrupt CCD exposure */
-		Flags.CCD &= ~CIE;
+		flags_clear (&Flags.CCD, CIE);
 		set_progress_bar (TRUE, loop_elapsed_since_first_iteration ());
 		ccdcam_interrupt_exposure ();
+		g_static_mutex_lock (&ccd_mutex);
+		ccd_exp_end = 0;   /* Camera thread should look for the image now */
+		g_static_mutex_unlock (&ccd_mutex);
+		ccd_wake ();
 	}
 		
 	if (Flags.CCD & CCE) { /* Cancel CCD exposure */
-		Flags.CCD &= ~(CCE | CEP | CSF | CST | CSE);
+		flags_clear (&Flags.CCD, (CCE | CSF | CST | CSE));
+		ccd_set_state (CCD_EXPOSING, CCD_IDLE);
 		set_progress_bar (TRUE, loop_elapsed_since_first_iteration ());
 		ccdcam_cancel_exposure ();
 	}
 	
-	if (Flags.CCD & CPI) { /* CCD camera image downloaded */
-		Flags.CCD &= ~CPI;
-		set_progress_bar (TRUE, loop_elapsed_since_first_iteration ());
-		if (ccdcam_process_image ()) {
-			Flags.CCD |= CDI;
-			Flags.Aug &= ~AGE; /* Unset autog. idle flag here; next exposure */
-		}                      /*  can't start until autog. is next idle     */
-	}
-	
-	if (Flags.CCD & CDI) { /* Save CCD image for display and display it */
-		Flags.CCD &= ~CDI;
-		if ((get_ccd_image_struct ())->Debayer && 
-			(get_ccd_image_struct ())->exd.h_bin == 1 &&
-			(get_ccd_image_struct ())->exd.v_bin == 1) {
-			if (save_file (get_ccd_image_struct (), R, TRUE))
-				xpa_display_image (get_ccd_image_struct (), R);
-			if (save_file (get_ccd_image_struct (), G, TRUE))
-				xpa_display_image (get_ccd_image_struct (), G);
-			if (save_file (get_ccd_image_struct (), B, TRUE))
-				xpa_display_image (get_ccd_image_struct (), B);
-		} else {
-			if (save_file (get_ccd_image_struct (), GREY, TRUE))
-				xpa_display_image (get_ccd_image_struct (), GREY);
-		}
-	}
-	
-	if (Flags.Img & SCI) { /* Save CCD image if autosave requested */
-		Flags.Img &= ~SCI;
-		if ((get_ccd_image_struct ())->Debayer && 
-			(get_ccd_image_struct ())->exd.h_bin == 1 &&
-			(get_ccd_image_struct ())->exd.v_bin == 1) {
-			save_file (get_ccd_image_struct (), R, FALSE);
-			save_file (get_ccd_image_struct (), G, FALSE);
-			save_file (get_ccd_image_struct (), B, FALSE);
-		} else
-			save_file (get_ccd_image_struct (), GREY, FALSE);
-	}
+	ccd_process_events (); /* Process, display and save CCD image */
 	
 	if (Flags.CCD & CDT) { /* Plot CCD temperatures */
 		if (!ccdcam_plot_temperatures ())
-			Flags.CCD &= ~CDT;
+			flags_clear (&Flags.CCD, CDT);
 	}
 	
 	if (Flags.CCD & CCC) { /* Close CCD camera */
-		if (Flags.CCD & CEP)
-			Flags.CCD |= CCE; /* Cancel any exposure in progress first */
+		if (g_atomic_int_get (&ccd_state) == CCD_EXPOSING)
+			flags_set (&Flags.CCD, CCE); /* Cancel exposure in progress first */
 		else {
 			if (ccd_thread) {
+				ccd_wake ();
 				g_thread_join (ccd_thread);
 				ccd_thread = NULL;
 			}
-			Flags.CCD &= ~CCC;
+			flags_clear (&Flags.CCD, CCC);
 			if (ccdcam_close ()) {
 				set_ccd_gui (FALSE); /* Reset the various elements in the GUI */
 				set_exposure_buttons (FALSE);
 				show_camera_status (FALSE);
-				Flags.CCD &= ~CCA;
+				flags_clear (&Flags.CCD, CCA);
 			} else
 				reset_checkbox_state (RCS_OPEN_CCD_LINK, TRUE);
 		}
 	}
 	
 	if (Flags.Aug & AGO) { /* Open autoguider */
-		Flags.Aug &= ~AGO;
+		flags_clear (&Flags.Aug, AGO);
 		if (!(Flags.Lvw & LVR)) { /* Open only if not already being used by */
 			if (augcam_open ()) { /*  live view                             */
 				ui_show_aug_window ();
 				set_autog_sensitive (TRUE, TRUE);
-			    Flags.Aug |= (AGA | ASE);
+			    flags_set (&Flags.Aug, (AGA | ASE));
 				if ((get_aug_image_struct ())->device == V4L)
 					v4l_thread =g_thread_create(thread_func_v4l,NULL,TRUE,NULL);
 			} else {
-			    Flags.Aug |= AGC; /* Error condition - reset checkbox state   */
+			    flags_set (&Flags.Aug, AGC); /* Error condition - reset checkbox */
 				reset_checkbox_state (RCS_USE_AUTOGUIDER, FALSE);
 			}
 		} else {
 			ui_show_aug_window ();
 			set_autog_sensitive (TRUE, TRUE);
-		    Flags.Aug |= (AGA | ASE);
+		    flags_set (&Flags.Aug, (AGA | ASE));
 		}
 	}
 	
 	if ((Flags.Aug & AGA) && (Flags.Aug & ASE)) {/* Start autog. cam. exposure*/
-		Flags.Aug &= ~ASE;
+		flags_clear (&Flags.Aug, ASE);
 		if (Flags.Aug & ACM) { /* Need to store star position in this exposure*/
-			Flags.Aug &= ~ACM; /*  for autoguider calibration.                */
-			Flags.Aug |= ACE;
+			flags_clear (&Flags.Aug, ACM); /*  for autoguider calibration.   */
+			flags_set (&Flags.Aug, ACE);
 		}
 		if (augcam_start_exposure ()) {
-			Flags.Aug |= AEP;
+			flags_set (&Flags.Aug, AEP);
 		}
 	}
 	
 	if (Flags.Aug & AEP) {/* Check for autoguider camera image */
 		if (augcam_image_ready ()) {
-			Flags.Aug &= ~AEP;
+			flags_clear (&Flags.Aug, AEP);
 			if (augcam_capture_exposure ()) {
-				Flags.Aug |= AIR;
+				flags_set (&Flags.Aug, AIR);
 			} else {
-				Flags.Aug |= AGC; /* Error condition - reset checkbox state   */
+				flags_set (&Flags.Aug, AGC); /* Error condition - reset checkbox */
 				reset_checkbox_state (RCS_USE_AUTOGUIDER, FALSE);
 			}
 		}
 	}
 	
 	if (Flags.Aug & AIR) { /* Autoguider image ready */
-		Flags.Aug &= ~AIR;
+		flags_clear (&Flags.Aug, AIR);
 		if (augcam_process_image ()) {
-			Flags.Aug |= ASE;
+			flags_set (&Flags.Aug, ASE);
 			if (Flags.Aug & ACE) { /* Finished an exposure following telescope*/
-				Flags.Aug &= ~ACE; /*  motion by the autoguider calibration   */
-				Flags.Aug |= ACG;  /*  procedure, so store this star position.*/
+				flags_clear (&Flags.Aug, ACE); /*  motion by the autoguider    */
+				flags_set (&Flags.Aug, ACG);   /*  calibration procedure, so   */
+				                               /*  store this star position.   */
 			} 
 		} else {
-			Flags.Aug |= AGC; /* Error condition - reset checkbox state   */
+			flags_set (&Flags.Aug, AGC); /* Error condition - reset checkbox */
 			reset_checkbox_state (RCS_USE_AUTOGUIDER, FALSE);
 		}
 	}
 	
 	if ((Flags.Aug & ACC) && (Flags.Aug & ACG)) { /* Calibrate autoguider */
-		Flags.Aug &= ~ACG;
+		flags_clear (&Flags.Aug, ACG);
 		if (!thread_pool_autog_calib) {
-			Flags.Aug |= ACI;
+			flags_set (&Flags.Aug, ACI);
 			thread_pool_autog_calib = g_thread_pool_new (
 							                    &thread_pool_autog_calib_func, 
 											    NULL,
@@ -1431,22 +1747,22 @@ static gint event_loop (gpointer data)
 	}
 	
 	if (Flags.Aug & ACP) { /* Stop autoguider calibration */
-		Flags.Aug &= ~(ACP | ACC | ACI);
+		flags_clear (&Flags.Aug, (ACP | ACC | ACI));
 		if (thread_pool_autog_calib) {
 			g_thread_pool_free (thread_pool_autog_calib, TRUE, TRUE);
 			thread_pool_autog_calib = NULL;
 		}
-		Flags.Aug &= ~ACD; /* Just in case thread sets */
+		flags_clear (&Flags.Aug, ACD); /* Just in case thread sets */
 	}                      /*  this before exiting...  */
 	
 	if (Flags.Aug & ACD) { /* Got autoguider calibration star positions */
-		Flags.Aug &= ~(ACD | ACC);
+		flags_clear (&Flags.Aug, (ACD | ACC));
 		if (thread_pool_autog_calib) {
 			g_thread_pool_free (thread_pool_autog_calib, TRUE, TRUE);
 			thread_pool_autog_calib = NULL;
 		}
 		if (telescope_autog_calib ((gfloat *) calib_coords))
-			Flags.Aug &= ~ACI;
+			flags_clear (&Flags.Aug, ACI);
 	}		
 
 	if (Flags.Aug & AGB) { /* Begin autoguiding */
@@ -1458,47 +1774,47 @@ static gint event_loop (gpointer data)
 		} else {
 			if (telescope_guide (INIT, loop_elapsed_since_first_iteration ())) {
 				set_autog_sensitive (FALSE, FALSE);
-				Flags.Aug &= ~AGB;
-				Flags.Aug |= AGG;
+				flags_clear (&Flags.Aug, AGB);
+				flags_set (&Flags.Aug, AGG);
 			}
 		}
 	}
 	
 	if (Flags.Aug & AGU) { /* If autoguiding, pause issuing guiding commands */
-		Flags.Aug &= ~AGU;
+		flags_clear (&Flags.Aug, AGU);
 		telescope_guide (PAUSE, loop_elapsed_since_first_iteration ());
-		Flags.Aug |= AGP;
+		flags_set (&Flags.Aug, AGP);
 	}
 	
 	if (Flags.Aug & AGN) { /* If paused autoguiding, continue issuing cmds */
-		Flags.Aug &= ~AGN;
+		flags_clear (&Flags.Aug, AGN);
 		telescope_guide (CONT, loop_elapsed_since_first_iteration ());
-		Flags.Aug &= ~AGP;
+		flags_clear (&Flags.Aug, AGP);
 	}	
 	
 	if ((Flags.Aug & AGG) &&     /* Autoguiding and...                   */
 		!(Flags.Aug & AGP) &&    /*  autoguider not paused and...        */
 		!(Flags.Aug & AEP)) {    /*  autoguider exposure not in progress */
 		if (telescope_guide (GUIDE, loop_elapsed_since_first_iteration ()))
-			Flags.Aug |= AGE;
+			flags_set (&Flags.Aug, AGE);
 		else
-			Flags.Aug &= ~AGE;
+			flags_clear (&Flags.Aug, AGE);
 	} 
 	
 	if (Flags.Aug & AGQ) { /* If autoguiding, quit */
-		Flags.Aug &= ~(AGQ | AGG | ACI);		
+		flags_clear (&Flags.Aug, (AGQ | AGG | ACI));		
 		telescope_guide (QUIT, loop_elapsed_since_first_iteration ());
 		set_autog_sensitive (TRUE, FALSE);
 	}
 	
 	if (Flags.Aug & AGC) { /* Close autoguider */
-		Flags.Aug &= ~AGC;
+		flags_clear (&Flags.Aug, AGC);
 		if (Flags.Aug & AGA) {
-			Flags.Aug &= ~(AGA | ASE | AEP | AIR);
+			flags_clear (&Flags.Aug, (AGA | ASE | AEP | AIR));
 			ui_hide_aug_window ();
 			set_autog_sensitive (FALSE, TRUE);
 			if (Flags.Aug & AGG) {
-				Flags.Aug &= ~(AGQ | AGG | ACI);
+				flags_clear (&Flags.Aug, (AGQ | AGG | ACI));
 				telescope_guide (QUIT, loop_elapsed_since_first_iteration ());
 			}
 			if (!(Flags.Lvw & LVR)) {/* Close only if camera not being used by*/
@@ -1518,14 +1834,14 @@ static gint event_loop (gpointer data)
 				augcam_open ();
 				ui_set_augcanv_crosshair (-1, -1);
 				ui_set_augcanv_rect_full_area ();
-				Flags.Aug &= ~(AGR | AVP);
+				flags_clear (&Flags.Aug, (AGR | AVP));
 			}
 		} else
-			Flags.Aug &= ~AGR;
+			flags_clear (&Flags.Aug, AGR);
 	}
 	
 	if (Flags.Aug & AGI) { /* Save autoguider image for display and display it*/
-		Flags.Aug &= ~AGI;
+		flags_clear (&Flags.Aug, AGI);
 		set_fits_data (get_aug_image_struct (), NULL, 
 			  ((get_aug_image_struct())->exd.FreeRunning ? FALSE : TRUE),FALSE);			
 		if (save_file (get_aug_image_struct (), GREY, TRUE))
@@ -1534,7 +1850,7 @@ static gint event_loop (gpointer data)
 	
 	if (Flags.Aug & AGA) { /* Save autoguider image if autosave requested */
 		if (Flags.Img & SSA) {
-			Flags.Img &= ~SSA;
+			flags_clear (&Flags.Img, SSA);
 			set_fits_data (get_aug_image_struct (), NULL, 
 			  ((get_aug_image_struct())->exd.FreeRunning ? FALSE : TRUE),FALSE);			
 			save_file (get_aug_image_struct (), GREY, FALSE);
@@ -1542,7 +1858,7 @@ static gint event_loop (gpointer data)
 	}
 	
 	if (Flags.Foc & FCM) { /* Check to see if focuser is moving */
-		Flags.Foc &= ~FCM;    /* Reset in focuser_moving thread */
+		flags_clear (&Flags.Foc, FCM);    /* Reset in focuser_moving thread */
 		if (Flags.Foc & FCO) {  /* User might have closed focuser link... */
 			if (!thread_pool_focuser_moving)
 				thread_pool_focuser_moving = g_thread_pool_new (
@@ -1555,11 +1871,11 @@ static gint event_loop (gpointer data)
 									GINT_TO_POINTER (1), /*Dummy data to      */
 									NULL);               /*satisfy func. call.*/
 		} else
-		    Flags.Foc |= FSP;
+		    flags_set (&Flags.Foc, FSP);
 	}
 	
 	if (Flags.Foc & FSP) { /* Focuser stopped */
-		Flags.Foc &= ~(FSP | FIM);
+		flags_clear (&Flags.Foc, (FSP | FIM));
 		g_thread_pool_free (thread_pool_focuser_moving, TRUE, FALSE);
 		thread_pool_focuser_moving = NULL;
 		set_focus_done ();
@@ -1568,7 +1884,7 @@ static gint event_loop (gpointer data)
 	if ((Flags.Foc & FCO) && (Flags.Foc & FAO)) { /* Apply filter focus offset*/
 		if (!(Flags.Foc & FIM)) {
 			apply_filter_focus_offset (filter_offset);
-			Flags.Foc &= ~FAO;
+			flags_clear (&Flags.Foc, FAO);
 		}
 	}
 	
@@ -1579,47 +1895,41 @@ static gint event_loop (gpointer data)
 			f.move_to = tempcomp_pos;
 			focus_comms->focus (&f);
 			loop_focus_check_done ();
-			Flags.Foc &= ~FAT;
+			flags_clear (&Flags.Foc, FAT);
 		}
 	}
 	
 	#ifdef HAVE_UNICAP
 	if (Flags.Lvw & LVO) { /* Open live view display */
-		Flags.Lvw &= ~LVO;
+		flags_clear (&Flags.Lvw, LVO);
 		if (!(Flags.Aug & AGA)) { /* Open only if not already being used by   */
 			if (augcam_open ())   /*  autoguider                              */
-				Flags.Lvw |= LVR;
+				flags_set (&Flags.Lvw, LVR);
 			else {
-			    Flags.Aug |= AGC; /* Error condition - reset checkbox state   */
+			    flags_set (&Flags.Aug, AGC); /* Error condition - reset checkbox */
 				reset_checkbox_state (RCS_OPEN_LIVEVIEW_WINDOW, FALSE);
 			}
 		} else {
 		    show_liveview_window ();
-			Flags.Lvw |= LVR;
+			flags_set (&Flags.Lvw, LVR);
 		}
 	}
 	
 	if (Flags.Lvw & LVE) { /* Start recording to disk */
-		Flags.Lvw &= ~LVE;
+		flags_clear (&Flags.Lvw, LVE);
 		if (video_record_start (VideoDir))
-			Flags.Lvw |= LVI;
+			flags_set (&Flags.Lvw, LVI);
 	}
 	
-	if (Flags.Lvw & LVI)
-		if (Flags.Lvw & LVD) { /* Flush buffer to disk */
-			Flags.Lvw &= ~LVD;
-			video_flush_buffer (vid_buf);
-		}
-		
 	if (Flags.Lvw & LVS) { /* Stop recording to disk */
-		Flags.Lvw &= ~(LVS | LVI);
+		flags_clear (&Flags.Lvw, (LVS | LVI));
 		video_record_stop ();
 	}
 	
 	if (Flags.Lvw & LVC && !(Flags.Lvw & LVI)) { /* Close live view display */
-		Flags.Lvw &= ~LVC;
+		flags_clear (&Flags.Lvw, LVC);
 		if (Flags.Lvw & LVR) {
-			Flags.Lvw &= ~LVR;
+			flags_clear (&Flags.Lvw, LVR);
 			hide_liveview_window ();
 			if (!(Flags.Aug & AGA)) /* Close only if camera not being used  */
 				augcam_close ();    /*  by autoguider                       */
@@ -1632,19 +1942,19 @@ static gint event_loop (gpointer data)
 	}
 	
 	if (Flags.Pbw & PBF) { /* Final call to video_iter_frames */
-		Flags.Pbw &= ~(PBI | PBF);
+		flags_clear (&Flags.Pbw, (PBI | PBF));
 		video_iter_frames (TRUE);
 	}
 	
 	if (Flags.Tel & TWR) { /* Telescope Warm Restart */
-		Flags.Tel &= ~TWR;
+		flags_clear (&Flags.Tel, TWR);
 		telescope_warm_restart ();
-		Flags.Tel |= TWS;
+		flags_set (&Flags.Tel, TWS);
 	}
 	
 	if (Flags.Tel & TWS) { /* Telescope is restarting */
 		if (telescope_warm_restart_done ()) {
-			Flags.Tel &= ~TWS;
+			flags_clear (&Flags.Tel, TWS);
 			L_print ("Re-initialising telescope comms link after warm "
 					                                               "restart\n");
 			telescope_close_comms_port ();  /* Re-initialise telescope link */
@@ -1654,62 +1964,64 @@ static gint event_loop (gpointer data)
 	}			
 	
 	if (Flags.Tel & TGO) { /* Telescope GoTo */
-		Flags.Tel &= ~TGO;
+		flags_clear (&Flags.Tel, TGO);
 		if (Flags.Aug & AGG)
 			L_print ("{o}Can't execute GoTo whilst autoguiding!\n");
 		else {
 			telescope_goto (sRA, sDec);
-			Flags.Tel |= TGP;
+			flags_set (&Flags.Tel, TGP);
 		}
 	}
 
 	if (Flags.Tel & TGP) { /* Telescope GoTo is in progress */
 		if (timeout (&check_goto_done_t, 5000)) { /* Check every 5s, waiting  */
 			if (telescope_goto_done ())           /*  5s initially to make    */
-				Flags.Tel &= ~TGP;                /*  sure GoTo has started!  */
+				flags_clear (&Flags.Tel, TGP);    /*  sure GoTo has started!  */
 		}
 	}
 	
 	if (Flags.Tel & TMV) { /* Telescope Move */
-		Flags.Tel &= ~TMV;
+		flags_clear (&Flags.Tel, TMV);
 		if (Flags.Aug & AGG)
 			L_print ("{o}Can't execute Move whilst autoguiding!\n");
 		else {
 			telescope_move_by (MoveRA, MoveDec);
-			Flags.Tel |= TGP;
+			flags_set (&Flags.Tel, TGP);
 		}
 	}
 
 	if (Flags.Tel & TPM) { /* Telescope Park Mount */
-		Flags.Tel &= ~TPM;
+		flags_clear (&Flags.Tel, TPM);
 		if (Flags.Aug & AGG)
 			L_print ("{o}Can't park mount whilst autoguiding!\n");
 		else {
 			telescope_park_mount ();
-		    Flags.Tel |= TPK;
+		    flags_set (&Flags.Tel, TPK);
 		}
 	}
 	
 	if (Flags.Tel & TPK) { /* Telescope is parking */
 		if (telescope_park_mount_done ()) {
-			Flags.Tel &= ~TPK;
+			flags_clear (&Flags.Tel, TPK);
 			save_RA_worm_pos (telescope_get_RA_worm_pos ());
 		}
 	}
 
 	if (Flags.Tel & TYB) { /* Telescope Yellow Button */
-		Flags.Tel &= ~TYB;
+		flags_clear (&Flags.Tel, TYB);
 		telescope_yellow_button ();
 	}
 	
 	if (Flags.Wat & WAC) { /* Watch activate */
-		Flags.Wat &= ~WAC;
+		flags_clear (&Flags.Wat, WAC);
 		tasks_activate_watch ();
-		Flags.Wat |= WAR;
+		flags_set (&Flags.Wat, WAR);
 	}
 	
-	if (Flags.Wat & WAS) /* Stop watching file */
-		Flags.Wat &= ~(WAS | WAR);
+	if (Flags.Wat & WAS) { /* Stop watching file */
+		flags_clear (&Flags.Wat, (WAS | WAR));
+		tasks_deactivate_watch ();
+	}
 	
 	if (Flags.Wat & WAR) /* Watch is running */
 		tasks_watch_file ();
@@ -1717,11 +2029,11 @@ static gint event_loop (gpointer data)
 	if (Flags.Tsk & KEP) { /* Check if script execution is in progress */
 		if (timeout (&check_script_done_t, 1000)) { /* Check once per second */
 			if (tasks_script_done ())
-				Flags.Tsk &= ~KEP;
+				flags_clear (&Flags.Tsk, KEP);
 		}
 	}
 	
-	if (Flags.CCD & CEP) /* Set exposure progress bar on main window */
+	if (g_atomic_int_get (&ccd_state) == CCD_EXPOSING) /* Set progress bar */
 		set_progress_bar (FALSE, loop_elapsed_since_first_iteration ());
 	
 	/***************************************************/
@@ -1747,16 +2059,17 @@ static gint event_loop (gpointer data)
 		
 	if (Flags.CCD & CCA) { /* Display the CCD camera status */
 		if (timeout (&check_status_t, 1000)) {
-			Flags.CCD |= CSI;
+			flags_set (&Flags.CCD, CSI);
+			ccd_wake ();
 		    show_camera_status (TRUE);
 		}
 	}
 	
 	if (Flags.CCD & CUS) { /* Unable to obtain camera status */
-		Flags.CCD &= ~CUS;
+		flags_clear (&Flags.CCD, CUS);
 		L_print ("{r}Error - Unable to obtain CCD camera status information\n");
 	    reset_checkbox_state (RCS_OPEN_CCD_LINK, FALSE);  /* Error condition -*/
-		Flags.CCD |= CCC;            /* Close camera and reset checkbox state */
+		flags_set (&Flags.CCD, CCC);   /* Close camera and reset checkbox state */
 	}
 	
 	if ((Flags.Foc & FCO) && !(Flags.Foc & FIM) && !(Flags.Foc & FFF)) {
@@ -1772,28 +2085,28 @@ static gint event_loop (gpointer data)
 	}
 	
 	if (Flags.Dsp & DSR) { /* Restore selection rectangle after blinking */
-		Flags.Dsp &= ~(DSR | DBR);
+		flags_clear (&Flags.Dsp, (DSR | DBR));
 		ui_show_augcanv_rect (TRUE);
 	}		
 	
 	if (Flags.Tsk & KWT)  /* Check if task Wait time has elapsed */
 		if (tasks_task_wait ())
-			Flags.Tsk &= ~KWT;
+			flags_clear (&Flags.Tsk, KWT);
 		
 	if (Flags.Tsk & KPS)  /* Check if task Pause time has elapsed */
 		if (tasks_task_pause ())
-			Flags.Tsk &= ~KPS;	
+			flags_clear (&Flags.Tsk, KPS);	
 
 	if (Flags.Tsk & KAT)  /* Check if task At time has been reached */
 		if (tasks_task_at ())
-			Flags.Tsk &= ~KAT;	
+			flags_clear (&Flags.Tsk, KAT);	
 			
 	FlushLog ();  /* Flush pending messages from other threads to log window */
 			
 	if (Flags.Loop & OIQ) {
 		if (!(Flags.CCD & CCC) && !(Flags.Aug & AGC) && !(Flags.Foc & FIM) &&
 			                                               !(Flags.Lvw & LVC)) {
-			Flags.Loop &= ~OIQ;
+			flags_clear (&Flags.Loop, OIQ);
 			gtk_main_quit ();
 		    return 0;  /* Timer automatically removed when returning zero */
 		}
@@ -0,0 +1,1297 @@
+/******************************************************************************/
+/*                      HEADLESS SEDI CAPTURE DAEMON                          */
+/*                                                                            */
+/* A small daemon that drives the Starlight Xpress camera through the sxc_*   */
+/* routines in sx.c, with no GTK, X server or task list involved.  Commands  */
+/* are accepted one per line on a Unix domain socket:                         */
+/*                                                                            */
+/*   Expose type filter time htl vtl hbr vbr h_bin v_bin temp file            */
+/*   Cancel                                                                   */
+/*   Temp degC | Temp off                                                     */
+/*   Coadd n [kappa]                                                          */
+/*   Status                                                                   */
+/*   Sync                                                                     */
+/*                                                                            */
+/* 'Expose' takes exactly the arguments of the task list command of the same  */
+/* name (see tasks.c), followed by the name of the FITS file to write, so the */
+/* existing watch files can be sent as they are.  When the chip has been      */
+/* read, "READ file exptime ccdtemp date-obs" is sent to every connected      */
+/* client and the image is queued to be saved by a separate thread, so the    */
+/* next exposure can start while the file is written.  When the file is      */
+/* complete, "DONE file exptime ccdtemp date-obs" is sent; "FAILED file       */
+/* reason" or "CANCELLED file" end an exposure that doesn't get that far.     */
+/* 'Sync' replies once no exposure is in progress and every image has been    */
+/* saved: "OK sync", or "FAILED n images not saved" since the last Sync.      */
+/*                                                                            */
+/* After 'Coadd n', successive exposures to the same file are co-added on     */
+/* board instead of being saved one by one (see coadd.c): "STACKED file k n"  */
+/* follows the READ event of each one, and once n have been read a single     */
+/* file is written with their mean in the primary HDU and its standard error  */
+/* in an extension named NOISE.  With kappa, values more than kappa standard  */
+/* deviations out are rejected.  A stack is finished early, with the frames   */
+/* it has, by an exposure to another file, a 'Coadd' that changes n or kappa, */
+/* or a 'Sync'.  'Coadd 1' goes back to saving every frame.                   */
+/*                                                                            */
+/* Run as 'sedid [socket]'; 'sedid --send "command" [timeout] [socket]'       */
+/* sends one command and prints the replies, waiting for the DONE (or         */
+/* STACKED) event of an 'Expose' command.  'sedid --queue' is the same but    */
+/* waits only for READ.                                                       */
+/* The socket defaults to $SEDID_SOCKET or /tmp/sedid.sock.                   */
+/*                                                                            */
+/* This file is part of GoQat.                                                */
+/*                                                                            */
+/* GoQat is free software; you can redistribute it and/or modify              */
+/* it under the terms of the GNU General Public License as published by       */
+/* the Free Software Foundation; either version 3 of the License, or          */
+/* (at your option) any later version.                                        */
+/*                                                                            */
+/* This program is distributed in the hope that it will be useful,            */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of             */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              */
+/* GNU General Public License for more details.                               */
+/*                                                                            */
+/* You should have received a copy of the GNU General Public License          */
+/* along with this program; if not, see <http://www.gnu.org/licenses/> .      */
+/*                                                                            */
+/******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define TRUE  1
+#define FALSE 0
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sx.h"
+#include "fits.h"
+#include "coadd.h"
+
+#define SEDID_SOCKET "/tmp/sedid.sock"
+#define MAX_CLIENTS 8                  /* Simultaneous client connections     */
+#define LINE_LEN 512                   /* Maximum length of a command line    */
+#define C_TOL 1.0                      /* CCD temperature tolerance (C)       */
+#define TEMP_TIMEOUT 300.0             /* Longest wait for CCD temperature (s)*/
+#define READOUT_TIMEOUT 60.0           /* Time allowed for readout (s)        */
+#define SAVE_QUEUE 2                   /* Images read but not yet saved       */
+
+#ifdef HAVE_SX_CAM
+
+enum ExpState {
+	E_IDLE,
+	E_COOLING,                         /* Waiting for CCD to reach setpoint   */
+	E_EXPOSING                         /* Exposing or reading the chip        */
+};
+
+struct client {
+	int fd;                            /* Socket, or -1 if slot is free       */
+	int len;                           /* Bytes of partial command in buf     */
+	int Sync;                          /* TRUE if waiting for 'Sync' reply    */
+	char buf[LINE_LEN];
+};
+
+struct exposure {
+	enum ExpState state;
+	char type[32];                     /* TARGET, FLAT, DARK, BIAS...         */
+	char file[256];                    /* FITS file to write                  */
+	char date_obs[32];                 /* Start of exposure (UTC)             */
+	double req_len;                    /* Requested exposure length           */
+	double ccdtemp;                    /* Requested CCD temperature           */
+	int h_top_l, v_top_l;              /* User coordinates, origin at (1,1)   */
+	int h_bot_r, v_bot_r;
+	int h_bin, v_bin;
+	struct timespec requested;         /* When the command was received       */
+	struct timespec started;           /* When the exposure was started       */
+};
+
+struct save_job {                      /* An image waiting to be saved        */
+	struct exposure e;                 /* Details of its exposure             */
+	unsigned short *data;              /* The image data...                   */
+	int h_pix, v_pix;                  /*  ...and its size                    */
+	double act_len;                    /* Actual exposure length              */
+	double ccd_temp;                   /* CCD temperature at readout          */
+	int nframes;                       /* Frames co-added, or 0 for one image */
+	unsigned short *noise;             /* Noise of co-added image             */
+	unsigned long rejected;            /* Values rejected from co-added image */
+	double kappa;                      /* Rejection limit, or 0 for none      */
+};
+
+static struct sx_cam sedi_cam;         /* The SEDI camera                     */
+static struct ccd_capability cam_cap;  /* ...and its capabilities             */
+static struct exposure exd;            /* The current exposure                */
+static struct client clients[MAX_CLIENTS];
+static struct save_job save_jobs[SAVE_QUEUE]; /* Ring of images to be saved   */
+static int save_head;                  /* Next job for the save thread...     */
+static int save_count;                 /*  ...and number of jobs queued       */
+static int save_stop;                  /* Save thread to exit when queue empty*/
+static pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t save_thread;
+static int ready_pipe[2];              /* Written to by the exposure thread   */
+static int done_pipe[2];               /* Events written by the save thread   */
+static struct timespec last_start;     /* Start of the previous exposure...   */
+static double last_len;                /*  ...and its length, for duty cycle  */
+static unsigned long images, failures;
+static unsigned long sync_failures;    /* Images not saved since last Sync    */
+static struct coadd stack;             /* Frames being co-added...            */
+static struct save_job stack_job;      /*  ...the first of them, with the sum */
+                                       /*  of their lengths and temperatures  */
+static int coadd_n = 1;                /* Frames to co-add; 1 saves each one  */
+static double coadd_kappa = 0.0;       /* Rejection limit, or 0 for none      */
+static volatile sig_atomic_t Stop = FALSE;
+
+/******************************************************************************/
+/*                           FUNCTION PROTOTYPES                              */
+/******************************************************************************/
+
+struct sx_cam *augcam_get_sx_cam_struct (void);
+static void sedid_error_func (int *err, const char *func, char *msg);
+static void sedid_ready_func (struct sx_cam *cam);
+static void sedid_signal (int sig);
+static void sedid_log (const char *fmt, ...);
+static double sedid_elapsed (struct timespec *since);
+static int sedid_open_camera (void);
+static int sedid_listen (const char *path);
+static void sedid_accept (int lfd);
+static void sedid_read_client (struct client *c);
+static void sedid_reply (struct client *c, const char *fmt, ...);
+static void sedid_broadcast (const char *fmt, ...);
+static void sedid_command (struct client *c, char *line);
+static void sedid_request_exposure (struct client *c, char *args);
+static void sedid_check_temperature (void);
+static void sedid_start_exposure (void);
+static void sedid_cancel_exposure (struct client *c);
+static void sedid_finish_exposure (void);
+static void sedid_stack_frame (struct save_job *job);
+static void sedid_finish_stack (void);
+static int sedid_same_stack (const struct exposure *e);
+static void sedid_set_temp (struct client *c, char *args);
+static void sedid_set_coadd (struct client *c, char *args);
+static void sedid_status (struct client *c);
+static void sedid_sync (struct client *c);
+static struct save_job *sedid_save_slot (void);
+static void sedid_queue_save (void);
+static void *sedid_save_thread (void *data);
+static void sedid_stop_saving (void);
+static void sedid_report_saves (void);
+static int sedid_save_fits (struct save_job *job);
+static int sedid_event_for (const char *line, const char *event,
+							const char *file);
+static int sedid_send (const char *path, const char *cmd, double timeout,
+					   int Queue);
+
+/******************************************************************************/
+/*                           CAMERA CALLBACKS                                 */
+/******************************************************************************/
+
+struct sx_cam *augcam_get_sx_cam_struct (void)
+{
+	/* sx.c refers to this for an SX autoguider camera; there isn't one here */
+
+	return NULL;
+}
+
+static void sedid_error_func (int *err, const char *func, char *msg)
+{
+	/* Error message callback from sx camera routines */
+
+	if (err)
+		sedid_log ("%s: %s", func, msg ? msg : "error");
+}
+
+static void sedid_ready_func (struct sx_cam *cam)
+{
+	/* Called from the exposure thread when the image has been read.  Just wake
+	 * the main loop, which joins the thread and saves the image.
+	 */
+
+	char c = 'r';
+
+	if (write (ready_pipe[1], &c, 1) < 0)
+		return;
+}
+
+static void sedid_signal (int sig)
+{
+	Stop = TRUE;
+}
+
+/******************************************************************************/
+/*                           MISCELLANEOUS FUNCTIONS                          */
+/******************************************************************************/
+
+static void sedid_log (const char *fmt, ...)
+{
+	/* Print a time-stamped message to stdout */
+
+	va_list ap;
+	time_t now;
+	char stamp[16];
+
+	now = time (NULL);
+	strftime (stamp, sizeof (stamp), "%H:%M:%S", localtime (&now));
+	printf ("SEDI: %s ", stamp);
+	va_start (ap, fmt);
+	vprintf (fmt, ap);
+	va_end (ap);
+	printf ("\n");
+	fflush (stdout);
+}
+
+static double sedid_elapsed (struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int sedid_open_camera (void)
+{
+	/* Connect to the first SX camera found and allocate the image buffer */
+
+	const char *serial[SX_MAX_CAMERAS], *desc[SX_MAX_CAMERAS];
+	int i, num = SX_MAX_CAMERAS;
+
+	if (!sxc_get_cameras (&sedi_cam, serial, desc, &num)) {
+		sedid_log ("error searching for cameras");
+		return FALSE;
+	}
+	if (num == 0) {
+		sedid_log ("didn't find any cameras - are permissions set correctly?");
+		return FALSE;
+	}
+	if (num > 1)
+		sedid_log ("found %d cameras, using the first (%s)", num, desc[0]);
+
+	if (!sxc_connect (&sedi_cam, TRUE, serial[0])) {
+		sedid_log ("unable to connect to camera");
+		return FALSE;
+	}
+	strncpy (cam_cap.camera_desc, desc[0], 255);
+	if (!sxc_get_cap (&sedi_cam, &cam_cap)) {
+		sedid_log ("unable to get camera capabilities");
+		return FALSE;
+	}
+	sxc_set_ready_func (&sedi_cam, sedid_ready_func);
+
+	for (i = 0; i < SAVE_QUEUE; i++) {
+		if (!(save_jobs[i].data = (unsigned short *) malloc (
+							cam_cap.max_h * cam_cap.max_v * sizeof (short))) ||
+			!(save_jobs[i].noise = (unsigned short *) malloc (
+							cam_cap.max_h * cam_cap.max_v * sizeof (short)))) {
+			sedid_log ("unable to allocate image buffers");
+			return FALSE;
+		}
+	}
+
+	sedid_log ("opened %s (%s), %dx%d pixels, %s", cam_cap.camera_name,
+			   cam_cap.camera_dinf, cam_cap.max_h, cam_cap.max_v,
+			   cam_cap.CanSetCCDTemp ? "cooled" : "not cooled");
+	return TRUE;
+}
+
+/******************************************************************************/
+/*                           SOCKET HANDLING                                  */
+/******************************************************************************/
+
+static int sedid_listen (const char *path)
+{
+	/* Create the listening socket, replacing any left by a previous run */
+
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+	unlink (path);
+
+	if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+		listen (fd, MAX_CLIENTS) < 0) {
+		close (fd);
+		return -1;
+	}
+	chmod (path, 0666);
+	return fd;
+}
+
+static void sedid_accept (int lfd)
+{
+	/* Accept a new client into a free slot */
+
+	int i, fd;
+
+	if ((fd = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].len = 0;
+			clients[i].Sync = FALSE;
+			return;
+		}
+	}
+
+	send (fd, "ERR too many clients\n", 21, MSG_NOSIGNAL);
+	close (fd);
+}
+
+static void sedid_read_client (struct client *c)
+{
+	/* Read from a client and execute each complete command line */
+
+	int n, i, start;
+
+	n = read (c->fd, c->buf + c->len, LINE_LEN - c->len);
+	if (n <= 0) {
+		close (c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += n;
+
+	for (start = 0, i = 0; i < c->len && c->fd >= 0; i++) {
+		if (c->buf[i] == '\n') {
+			c->buf[i] = '\0';
+			if (i > start && c->buf[i - 1] == '\r')
+				c->buf[i - 1] = '\0';
+			sedid_command (c, c->buf + start);
+			start = i + 1;
+		}
+	}
+	if (c->fd < 0)
+		return;
+
+	c->len -= start;
+	memmove (c->buf, c->buf + start, c->len);
+	if (c->len == LINE_LEN) {  /* Discard over-long lines */
+		sedid_reply (c, "ERR command too long");
+		c->len = 0;
+	}
+}
+
+static void sedid_reply (struct client *c, const char *fmt, ...)
+{
+	/* Send a single line to one client */
+
+	va_list ap;
+	char line[LINE_LEN];
+	int len;
+
+	va_start (ap, fmt);
+	len = vsnprintf (line, LINE_LEN - 1, fmt, ap);
+	va_end (ap);
+	if (len > LINE_LEN - 2)
+		len = LINE_LEN - 2;
+	line[len++] = '\n';
+
+	if (send (c->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+		close (c->fd);
+		c->fd = -1;
+	}
+}
+
+static void sedid_broadcast (const char *fmt, ...)
+{
+	/* Send a completion event to every client, and log it */
+
+	va_list ap;
+	char line[LINE_LEN];
+	int i;
+
+	va_start (ap, fmt);
+	vsnprintf (line, LINE_LEN, fmt, ap);
+	va_end (ap);
+
+	sedid_log ("%s", line);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			sedid_reply (&clients[i], "%s", line);
+}
+
+/******************************************************************************/
+/*                           COMMANDS                                         */
+/******************************************************************************/
+
+static void sedid_command (struct client *c, char *line)
+{
+	/* Execute a single command line */
+
+	char cmd[32];
+	int n = 0;
+
+	if (sscanf (line, "%31s %n", cmd, &n) < 1)
+		return;
+
+	if (!strcasecmp (cmd, "Expose"))
+		sedid_request_exposure (c, line + n);
+	else if (!strcasecmp (cmd, "Cancel"))
+		sedid_cancel_exposure (c);
+	else if (!strcasecmp (cmd, "Temp"))
+		sedid_set_temp (c, line + n);
+	else if (!strcasecmp (cmd, "Coadd"))
+		sedid_set_coadd (c, line + n);
+	else if (!strcasecmp (cmd, "Status"))
+		sedid_status (c);
+	else if (!strcasecmp (cmd, "Sync"))
+		sedid_sync (c);
+	else
+		sedid_reply (c, "ERR unknown command %s", cmd);
+}
+
+static void sedid_request_exposure (struct client *c, char *args)
+{
+	/* Check the parameters of an 'Expose' command and either start the
+	 * exposure or wait for the CCD to reach the requested temperature first.
+	 */
+
+	struct exposure e;
+	char filter[32];
+
+	if (exd.state != E_IDLE) {
+		sedid_reply (c, "ERR busy with %s", exd.file);
+		return;
+	}
+
+	memset (&e, 0, sizeof (e));
+	if (sscanf (args, "%31s %31s %lf %d %d %d %d %d %d %lf %255s",
+				e.type, filter, &e.req_len, &e.h_top_l, &e.v_top_l,
+				&e.h_bot_r, &e.v_bot_r, &e.h_bin, &e.v_bin, &e.ccdtemp,
+				e.file) != 11) {
+		sedid_reply (c, "ERR usage: Expose type filter time htl vtl hbr vbr "
+						"h_bin v_bin temp file");
+		return;
+	}
+	if (strcmp (filter, "-")) {
+		sedid_reply (c, "ERR no filter wheel");
+		return;
+	}
+	if (e.req_len < cam_cap.min_exp || e.req_len > cam_cap.max_exp) {
+		sedid_reply (c, "ERR invalid exposure time");
+		return;
+	}
+	if (e.h_top_l < 1 || e.h_bot_r > cam_cap.max_h || e.h_top_l > e.h_bot_r ||
+		e.v_top_l < 1 || e.v_bot_r > cam_cap.max_v || e.v_top_l > e.v_bot_r) {
+		sedid_reply (c, "ERR invalid coordinates (chip is %dx%d)",
+					 cam_cap.max_h, cam_cap.max_v);
+		return;
+	}
+	if (e.h_bin < 1 || e.h_bin > cam_cap.max_binh ||
+		e.v_bin < 1 || e.v_bin > cam_cap.max_binv) {
+		sedid_reply (c, "ERR invalid binning");
+		return;
+	}
+	if (cam_cap.IsInterlaced && e.v_bin > 1 && e.v_bin % 2) {
+		sedid_log ("vertical binning restricted to even numbers for "
+				   "interlaced camera: using %dx%d", e.h_bin, --e.v_bin);
+	}
+
+	exd = e;
+	clock_gettime (CLOCK_MONOTONIC, &exd.requested);
+	sedid_reply (c, "OK expose %s", exd.file);
+
+	if (cam_cap.CanSetCCDTemp) {
+		sxc_set_state (&sedi_cam, S_TEMP, 0, exd.ccdtemp);
+		sxc_set_state (&sedi_cam, S_COOL, TRUE, 0.0);
+		exd.state = E_COOLING;
+		sedid_check_temperature ();
+	} else
+		sedid_start_exposure ();
+}
+
+static void sedid_check_temperature (void)
+{
+	/* Start the exposure once the CCD is within tolerance of the requested
+	 * temperature.  As in ccdcam_check_temp, a requested temperature above the
+	 * current CCD temperature is accepted at once.  Don't wait forever though;
+	 * an exposure at the wrong temperature is better than none.
+	 */
+
+	struct ccd_state state;
+
+	sxc_get_state (&sedi_cam, &state, FALSE);
+	if (exd.ccdtemp > state.c_ccd || fabs (exd.ccdtemp - state.c_ccd) <= C_TOL)
+		sedid_start_exposure ();
+	else if (sedid_elapsed (&exd.requested) > TEMP_TIMEOUT) {
+		sedid_log ("CCD at %.1fC, not %.1fC, after %.0fs; exposing anyway",
+				   state.c_ccd, exd.ccdtemp, TEMP_TIMEOUT);
+		sedid_start_exposure ();
+	}
+}
+
+static void sedid_start_exposure (void)
+{
+	/* Set the image area and start the exposure thread.  User coordinates are
+	 * converted to internal coordinates as in ccdcam_set_exposure_data: origin
+	 * at (0,0) rather than (1,1), and v increasing downwards.
+	 */
+
+	int light;
+
+	sxc_set_imagearraysize (&sedi_cam,
+							exd.h_top_l - 1,
+							cam_cap.max_v - exd.v_bot_r,
+							exd.h_bot_r - exd.h_top_l + 1,
+							exd.v_bot_r - exd.v_top_l + 1,
+							exd.h_bin, exd.v_bin);
+
+	light = strcasecmp (exd.type, "BIAS") && strcasecmp (exd.type, "DARK");
+	if (!sxc_start_exposure (&sedi_cam, exd.date_obs, exd.req_len, light)) {
+		exd.state = E_IDLE;
+		failures++;
+		sync_failures++;
+		sedid_broadcast ("FAILED %s unable to start exposure", exd.file);
+		return;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &exd.started);
+	exd.state = E_EXPOSING;
+	sedid_log ("exposing %s for %.2fs", exd.file, exd.req_len);
+
+	/* Report the duty cycle (shutter-open time / wall time) since the start
+	 * of the previous exposure.
+	 */
+
+	if (last_start.tv_sec) {
+		double cycle = (exd.started.tv_sec - last_start.tv_sec) +
+					   (exd.started.tv_nsec - last_start.tv_nsec) / 1e9;
+		sedid_log ("duty cycle %.1f%% (%.2fs exposure in %.2fs)",
+				   100.0 * last_len / cycle, last_len, cycle);
+	}
+	last_start = exd.started;
+	last_len = exd.req_len;
+}
+
+static void sedid_cancel_exposure (struct client *c)
+{
+	/* Cancel the current exposure without reading the chip */
+
+	enum ExpState was = exd.state;
+
+	if (was == E_IDLE) {
+		sedid_reply (c, "OK idle");
+		return;
+	}
+
+	exd.state = E_IDLE;
+	if (was == E_EXPOSING && !sxc_cancel_exposure (&sedi_cam)) {
+		sedid_reply (c, "ERR unable to cancel exposure");
+		return;
+	}
+	sedid_reply (c, "OK cancel");
+	sedid_broadcast ("CANCELLED %s", exd.file);
+}
+
+static void sedid_finish_exposure (void)
+{
+	/* The exposure thread has read the chip: fetch the image into a free slot
+	 * in the save queue, hand it to the save thread (or add it to the stack
+	 * being co-added) and tell everyone that the camera is free for the next
+	 * exposure.  This waits only if the save thread has fallen SAVE_QUEUE
+	 * images behind.
+	 */
+
+	struct ccd_state state;
+	struct save_job *job;
+	int ready, bytes;
+
+	if (exd.state != E_EXPOSING)  /* Cancelled just as it finished */
+		return;
+
+	sxc_get_imageready (&sedi_cam, &ready);  /* Joins the exposure thread */
+	if (!ready)  /* Left over from a cancelled exposure */
+		return;
+	exd.state = E_IDLE;
+
+	if (stack.n && !sedid_same_stack (&exd))
+		sedid_finish_stack ();
+
+	job = sedid_save_slot ();
+	job->e = exd;
+	job->nframes = 0;
+	sxc_get_exposuretime (&sedi_cam, job->e.date_obs, &job->act_len);
+	sxc_get_imagearraysize (&sedi_cam, &job->h_pix, &job->v_pix, &bytes);
+	if (!sxc_get_imagearray (&sedi_cam, job->data)) {
+		failures++;
+		sync_failures++;
+		sedid_broadcast ("FAILED %s failed to read image data", exd.file);
+		return;
+	}
+
+	memset (&state, 0, sizeof (state));
+	sxc_get_state (&sedi_cam, &state, FALSE);
+	job->ccd_temp = state.c_ccd;
+
+	if (sedi_cam.usbd.read_secs > 0)
+		sedid_log ("read %ld bytes in %.2fs (%.1f MB/s)", 
+				   sedi_cam.usbd.read_bytes, sedi_cam.usbd.read_secs,
+				   sedi_cam.usbd.read_bytes / sedi_cam.usbd.read_secs / 1e6);
+	sedid_broadcast ("READ %s %.3f %.1f %s", job->e.file, job->act_len,
+					 job->ccd_temp, job->e.date_obs);
+
+	if (coadd_n > 1)
+		sedid_stack_frame (job);
+	else
+		sedid_queue_save ();
+}
+
+static void sedid_stack_frame (struct save_job *job)
+{
+	/* Add a frame that has just been read to the stack being co-added,
+	 * starting a new stack if there isn't one, and finish the stack once it
+	 * has coadd_n frames.  The frame's slot in the save queue isn't queued,
+	 * so it is free again afterwards.
+	 */
+
+	if (!stack.n) {
+		if (!coadd_start (&stack, job->h_pix, job->v_pix, coadd_kappa)) {
+			failures++;
+			sync_failures++;
+			sedid_broadcast ("FAILED %s %s", job->e.file, strerror (errno));
+			return;
+		}
+		stack_job = *job;
+		stack_job.act_len = stack_job.ccd_temp = 0.0;
+	}
+
+	coadd_add (&stack, job->data);
+	stack_job.act_len += job->act_len;
+	stack_job.ccd_temp += job->ccd_temp;
+	sedid_broadcast ("STACKED %s %d %d", job->e.file, stack.n, coadd_n);
+	if (stack.n >= coadd_n)
+		sedid_finish_stack ();
+}
+
+static void sedid_finish_stack (void)
+{
+	/* Write the mean and noise of the stack into a free slot in the save
+	 * queue and queue it; the exposure details are those of the first frame,
+	 * with the mean exposure length and CCD temperature.
+	 */
+
+	struct save_job *job;
+
+	if (!stack.n)
+		return;
+
+	job = sedid_save_slot ();
+	job->e = stack_job.e;
+	job->h_pix = stack.h_pix;
+	job->v_pix = stack.v_pix;
+	job->act_len = stack_job.act_len / stack.n;
+	job->ccd_temp = stack_job.ccd_temp / stack.n;
+	job->nframes = stack.n;
+	job->kappa = stack.kappa;
+	coadd_finish (&stack, job->data, job->noise);
+	job->rejected = stack.rejected;
+	sedid_log ("co-added %d frames into %s, %lu values rejected",
+			   job->nframes, job->e.file, job->rejected);
+	sedid_queue_save ();
+}
+
+static int sedid_same_stack (const struct exposure *e)
+{
+	/* Return TRUE if an exposure belongs in the stack being co-added */
+
+	const struct exposure *s = &stack_job.e;
+
+	return !strcmp (e->file, s->file) && !strcasecmp (e->type, s->type) &&
+		   e->h_top_l == s->h_top_l && e->v_top_l == s->v_top_l &&
+		   e->h_bot_r == s->h_bot_r && e->v_bot_r == s->v_bot_r &&
+		   e->h_bin == s->h_bin && e->v_bin == s->v_bin;
+}
+
+static void sedid_set_temp (struct client *c, char *args)
+{
+	/* Set the CCD temperature and turn the cooler on, or turn it off */
+
+	double temp;
+
+	if (!cam_cap.CanSetCCDTemp) {
+		sedid_reply (c, "ERR camera can't set CCD temperature");
+		return;
+	}
+
+	if (!strncasecmp (args, "off", 3)) {
+		sxc_set_state (&sedi_cam, S_COOL, FALSE, 0.0);
+		sedid_reply (c, "OK cooler off");
+	} else if (sscanf (args, "%lf", &temp) == 1) {
+		sxc_set_state (&sedi_cam, S_TEMP, 0, temp);
+		sxc_set_state (&sedi_cam, S_COOL, TRUE, 0.0);
+		sedid_reply (c, "OK temp %.1f", temp);
+	} else
+		sedid_reply (c, "ERR usage: Temp degC|off");
+}
+
+static void sedid_set_coadd (struct client *c, char *args)
+{
+	/* Set the number of frames to co-add and the rejection limit, finishing
+	 * any stack that was started with other settings.  Repeating the same
+	 * settings leaves the stack alone, so they can be sent again after a
+	 * failed frame in case the daemon has been restarted.
+	 */
+
+	double kappa = 0.0;
+	int n;
+
+	if (sscanf (args, "%d %lf", &n, &kappa) < 1 || n < 1 ||
+		n > COADD_MAX_FRAMES || kappa < 0.0) {
+		sedid_reply (c, "ERR usage: Coadd n [kappa], n = 1 to %d",
+					 COADD_MAX_FRAMES);
+		return;
+	}
+	if (exd.state != E_IDLE) {
+		sedid_reply (c, "ERR busy with %s", exd.file);
+		return;
+	}
+
+	if (n != coadd_n || kappa != coadd_kappa)
+		sedid_finish_stack ();
+	coadd_n = n;
+	coadd_kappa = kappa;
+	sedid_reply (c, "OK coadd %d %.1f", coadd_n, coadd_kappa);
+}
+
+static void sedid_status (struct client *c)
+{
+	/* Report the camera and exposure state on one line */
+
+	struct ccd_state state;
+
+	memset (&state, 0, sizeof (state));
+	sxc_get_state (&sedi_cam, &state, FALSE);
+
+	sedid_reply (c, "STATUS %s ccd %.1f setpoint %.1f cooler %s %s %s "
+				 "elapsed %.1f images %lu failures %lu stacked %d/%d",
+				 exd.state == E_COOLING ? "Cooling" : state.status,
+				 state.c_ccd, sedi_cam.cool.req_temp,
+				 state.CoolState ? "on" : "off",
+				 exd.state == E_IDLE ? "last" : "file",
+				 exd.file[0] ? exd.file : "-",
+				 exd.state == E_EXPOSING ? sedid_elapsed (&exd.started) : 0.0,
+				 images, failures, stack.n, coadd_n);
+}
+
+static void sedid_sync (struct client *c)
+{
+	/* Reply once everything has been saved (see sedid_report_saves) */
+
+	c->Sync = TRUE;
+	sedid_report_saves ();
+}
+
+/******************************************************************************/
+/*                           SAVE QUEUE                                       */
+/******************************************************************************/
+
+static struct save_job *sedid_save_slot (void)
+{
+	/* Return the next free slot in the save queue, waiting for the save thread
+	 * if the queue is full.  The slot isn't queued until sedid_queue_save.
+	 */
+
+	struct save_job *job;
+
+	pthread_mutex_lock (&save_mutex);
+	while (save_count == SAVE_QUEUE)
+		pthread_cond_wait (&save_cond, &save_mutex);
+	job = &save_jobs[(save_head + save_count) % SAVE_QUEUE];
+	pthread_mutex_unlock (&save_mutex);
+	return job;
+}
+
+static void sedid_queue_save (void)
+{
+	/* Queue the slot returned by sedid_save_slot for saving */
+
+	pthread_mutex_lock (&save_mutex);
+	save_count++;
+	pthread_cond_broadcast (&save_cond);
+	pthread_mutex_unlock (&save_mutex);
+}
+
+static void *sedid_save_thread (void *data)
+{
+	/* Save each queued image in turn.  The completion event is passed back to
+	 * the main loop through done_pipe as a fixed-length record (short enough
+	 * to be written atomically), and the slot is freed for the next image.
+	 */
+
+	struct save_job *job;
+	char line[LINE_LEN];
+
+	pthread_mutex_lock (&save_mutex);
+	while (TRUE) {
+		while (!save_count && !save_stop)
+			pthread_cond_wait (&save_cond, &save_mutex);
+		if (!save_count)
+			break;
+		job = &save_jobs[save_head];
+		pthread_mutex_unlock (&save_mutex);
+
+		memset (line, 0, LINE_LEN);
+		if (sedid_save_fits (job))
+			snprintf (line, LINE_LEN, "DONE %s %.3f %.1f %s", job->e.file,
+					  job->act_len, job->ccd_temp, job->e.date_obs);
+		else
+			snprintf (line, LINE_LEN, "FAILED %s %s", job->e.file,
+					  strerror (errno));
+		if (write (done_pipe[1], line, LINE_LEN) < 0)
+			sedid_log ("%s (unable to report)", line);
+
+		pthread_mutex_lock (&save_mutex);
+		save_head = (save_head + 1) % SAVE_QUEUE;
+		save_count--;
+		pthread_cond_broadcast (&save_cond);
+	}
+	pthread_mutex_unlock (&save_mutex);
+	return NULL;
+}
+
+static void sedid_stop_saving (void)
+{
+	/* Let the save thread finish the queue, then stop it */
+
+	pthread_mutex_lock (&save_mutex);
+	save_stop = TRUE;
+	pthread_cond_broadcast (&save_cond);
+	pthread_mutex_unlock (&save_mutex);
+	pthread_join (save_thread, NULL);
+	sedid_report_saves ();
+}
+
+static void sedid_report_saves (void)
+{
+	/* Pass on the events from the save thread, then answer any 'Sync'
+	 * commands if no exposure is in progress and nothing is left to save.
+	 * The save thread reports each image before freeing its slot, so once
+	 * the queue is empty every event is already in the pipe.  A stack still
+	 * being co-added is finished and saved first.
+	 */
+
+	char line[LINE_LEN];
+	int i, queued, Sync = FALSE;
+
+	while (read (done_pipe[0], line, LINE_LEN) == LINE_LEN) {
+		line[LINE_LEN - 1] = '\0';
+		if (!strncmp (line, "DONE", 4))
+			images++;
+		else {
+			failures++;
+			sync_failures++;
+		}
+		sedid_broadcast ("%s", line);
+	}
+
+	pthread_mutex_lock (&save_mutex);
+	queued = save_count;
+	pthread_mutex_unlock (&save_mutex);
+	if (queued || exd.state != E_IDLE)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		Sync |= clients[i].fd >= 0 && clients[i].Sync;
+	if (Sync && stack.n) {
+		sedid_finish_stack ();
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].Sync) {
+			clients[i].Sync = FALSE;
+			if (sync_failures)
+				sedid_reply (&clients[i], "FAILED %lu images not saved",
+							 sync_failures);
+			else
+				sedid_reply (&clients[i], "OK sync");
+			sync_failures = 0;
+		}
+	}
+}
+
+/******************************************************************************/
+/*                           FITS OUTPUT                                      */
+/******************************************************************************/
+
+static int sedid_save_fits (struct save_job *job)
+{
+	/* Save the image in the same FITS format as image_save_as_fits: a single
+	 * 2880 byte header record, then the data offset by -32768, big-endian,
+	 * with the rows in reverse order.  The file is written by fits_write_image
+	 * under a temporary name and renamed when complete; the temporary name
+	 * keeps any '.fz' ending, so that compressed files stay compressed.
+	 * A co-added image is the mean of its frames, and is followed by an
+	 * image extension holding its standard error, scaled so that each ADU
+	 * is COADD_NOISE_SCALE units; the largest value marks pixels for which
+	 * there is no estimate.
+	 * This runs in the save thread, so the "C" locale for the header is set
+	 * for this thread only.
+	 */
+
+	const int HEAD_LEN = 1 * FITS_REC_LEN;
+	const int OFFSET = FITS_OFFSET;
+
+	struct exposure *e = &job->e;
+	unsigned short *data = job->data;
+	locale_t c_locale, old_locale = (locale_t) 0;
+	char tmp[300];
+	char header[FITS_REC_LEN], ext[FITS_REC_LEN];
+	unsigned short min = 65535, max = 0;
+	int h = 0, x = 0, i, numpix, h_pix = job->h_pix, v_pix = job->v_pix;
+
+	numpix = h_pix * v_pix;
+	memset (header, ' ', HEAD_LEN);
+	memset (ext, ' ', HEAD_LEN);
+
+	for (i = 0; i < numpix; i++) {
+		if (data[i] < min)
+			min = data[i];
+		if (data[i] > max)
+			max = data[i];
+	}
+
+	if ((c_locale = newlocale (LC_NUMERIC_MASK, "C", (locale_t) 0)))
+		old_locale = uselocale (c_locale);
+	fits_card (header, &h, "SIMPLE  =                    T /"
+						   "   Standard conforming file");
+	fits_card (header, &h, "BITPIX  =                   16 /"
+						   "   16 bits per pixel");
+	fits_card (header, &h, "NAXIS   =                    2 /"
+						   "   2 image axes");
+	fits_card (header, &h, "NAXIS1  = %20i /   no. pixels on horizontal axis",
+			   h_pix);
+	fits_card (header, &h, "NAXIS2  = %20i /   no. pixels on vertical axis",
+			   v_pix);
+	if (job->nframes)
+		fits_card (header, &h, "EXTEND  =                    T /"
+							   "   noise is in extension");
+	fits_card (header, &h, "CRVAL1  = %20.1f /"
+			   "   pixel offset from start of frame on axis 1",
+			   (float) (e->h_top_l - 1));
+	fits_card (header, &h, "CRVAL2  = %20.1f /"
+			   "   pixel offset from start of frame on axis 2",
+			   (float) (e->v_top_l - 1));
+	fits_card (header, &h, "BINX1   = %20i /   pixel binning on X1 axis",
+			   e->h_bin);
+	fits_card (header, &h, "BINX2   = %20i /   pixel binning on X2 axis",
+			   e->v_bin);
+	fits_card (header, &h, "BZERO   = %20i /"
+			   "   offset to add back on for unsigned integers", OFFSET);
+	fits_card (header, &h, "DATAMAX = %20i /   maximum data value", max);
+	fits_card (header, &h, "DATAMIN = %20i /   minimum data value", min);
+	fits_card (header, &h, "CCDTEMP = %20.1f /   CCD temperature (C)",
+			   job->ccd_temp);
+	fits_card (header, &h, "DATE-OBS= '%-23s'/"
+			   "   date of start of observation (UTC)", e->date_obs);
+	fits_card (header, &h, "EXPTIME = %20.3f /   exposure length (seconds)",
+			   job->act_len);
+	fits_card (header, &h, "IMAGETYP= '%s'", e->type);
+	fits_card (header, &h, "INSTRUME= '%s'", cam_cap.camera_name);
+	if (job->nframes) {
+		fits_card (header, &h, "NCOMBINE= %20i /   no. of frames averaged",
+				   job->nframes);
+		fits_card (header, &h, "CLIPSIG = %20.2f /"
+				   "   rejection limit (std. devs.), 0 if none", job->kappa);
+		fits_card (header, &h, "NREJECT = %20lu /   no. of values rejected",
+				   job->rejected);
+
+		fits_card (ext, &x, "XTENSION= 'IMAGE   '           /"
+							"   image extension");
+		fits_card (ext, &x, "BITPIX  =                   16 /"
+							"   16 bits per pixel");
+		fits_card (ext, &x, "NAXIS   =                    2 /"
+							"   2 image axes");
+		fits_card (ext, &x, "NAXIS1  = %20i /   no. pixels on horizontal axis",
+				   h_pix);
+		fits_card (ext, &x, "NAXIS2  = %20i /   no. pixels on vertical axis",
+				   v_pix);
+		fits_card (ext, &x, "PCOUNT  =                    0 /"
+							"   no extra parameters");
+		fits_card (ext, &x, "GCOUNT  =                    1 /"
+							"   one data group");
+		fits_card (ext, &x, "EXTNAME = 'NOISE   '           /"
+							"   standard error of the mean");
+		fits_card (ext, &x, "BSCALE  = %20.6f /   ADU per unit",
+				   1.0 / COADD_NOISE_SCALE);
+		fits_card (ext, &x, "BZERO   = %20.6f /"
+				   "   offset to add back on for unsigned integers",
+				   (double) OFFSET / COADD_NOISE_SCALE);
+		fits_card (ext, &x, "BUNIT   = 'ADU     '");
+		fits_card (ext, &x, "END");
+	}
+	fits_card (header, &h, "END");
+	if (c_locale) {
+		uselocale (old_locale);
+		freelocale (c_locale);
+	}
+
+	snprintf (tmp, sizeof (tmp), "%s.tmp%s", e->file,
+			  fits_is_compressed (e->file) ? ".fz" : "");
+	if (!fits_write_image (tmp, header, HEAD_LEN, data, sizeof (short), 1,
+						   h_pix, v_pix) ||
+		(job->nframes && !fits_append_image (tmp, ext, HEAD_LEN, job->noise,
+											 sizeof (short), 1, h_pix,
+											 v_pix)) ||
+		rename (tmp, e->file) < 0) {
+		unlink (tmp);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/******************************************************************************/
+/*                           CLIENT MODE                                      */
+/******************************************************************************/
+
+static int sedid_event_for (const char *line, const char *event,
+							const char *file)
+{
+	/* Return TRUE if line is the given event for the given file */
+
+	int n = strlen (event), f = strlen (file);
+
+	return !strncmp (line, event, n) && line[n] == ' ' &&
+		   !strncmp (line + n + 1, file, f) &&
+		   (line[n + 1 + f] == ' ' || line[n + 1 + f] == '\0');
+}
+
+static int sedid_send (const char *path, const char *cmd, double timeout,
+					   int Queue)
+{
+	/* Send one command and print the replies.  For 'Expose', wait for the
+	 * DONE event for its file, or STACKED if it is being co-added (or READ if
+	 * Queue is TRUE); events for the previous file may arrive first, while it
+	 * is still being saved.  Returns 0 on success and 1 on any error, timeout
+	 * or cancelled exposure.
+	 */
+
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	struct timespec start;
+	const char *file = NULL;
+	char buf[LINE_LEN], *nl;
+	int fd, n, len = 0, remaining;
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 1;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+	if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+		fprintf (stderr, "sedid: can't connect to %s: %s\n", path,
+				 strerror (errno));
+		close (fd);
+		return 1;
+	}
+
+	n = snprintf (buf, LINE_LEN, "%s\n", cmd);
+	if (send (fd, buf, n, MSG_NOSIGNAL) != n) {
+		close (fd);
+		return 1;
+	}
+	if (!strncasecmp (cmd, "Expose", 6))
+		file = strrchr (cmd, ' ') ? strrchr (cmd, ' ') + 1 : "";
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (TRUE) {
+		remaining = (int) ((timeout - sedid_elapsed (&start)) * 1000);
+		if (remaining <= 0 || poll (&pfd, 1, remaining) == 0) {
+			fprintf (stderr, "sedid: timed out waiting for reply\n");
+			break;
+		}
+		if ((n = read (fd, buf + len, LINE_LEN - 1 - len)) <= 0)
+			break;
+		len += n;
+		buf[len] = '\0';
+
+		while ((nl = strchr (buf, '\n'))) {
+			*nl = '\0';
+			printf ("%s\n", buf);
+			if (!strncmp (buf, "ERR", 3) || (!file &&
+				!strncmp (buf, "FAILED", 6)) || (file &&
+				(sedid_event_for (buf, "FAILED", file) ||
+				 sedid_event_for (buf, "CANCELLED", file)))) {
+				close (fd);
+				return 1;
+			}
+			if (!file || sedid_event_for (buf, Queue ? "READ" : "DONE",
+										  file) ||
+				(!Queue && sedid_event_for (buf, "STACKED", file))) {
+				close (fd);
+				return 0;
+			}
+			len -= nl + 1 - buf;
+			memmove (buf, nl + 1, len + 1);
+		}
+		if (len == LINE_LEN - 1)
+			len = 0;
+	}
+
+	close (fd);
+	return 1;
+}
+
+/******************************************************************************/
+/*                           MAIN                                             */
+/******************************************************************************/
+
+int main (int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct pollfd pfd[MAX_CLIENTS + 3];
+	const char *path;
+	char c;
+	int i, lfd, timeout;
+
+	path = getenv ("SEDID_SOCKET") ? getenv ("SEDID_SOCKET") : SEDID_SOCKET;
+
+	if (argc > 1 && (!strcmp (argv[1], "--send") ||
+					 !strcmp (argv[1], "--queue"))) {
+		if (argc < 3) {
+			printf ("sedid --send|--queue [Command][TimeoutSeconds]"
+					"[Socket]\n");
+			return 1;
+		}
+		return sedid_send (argc > 4 ? argv[4] : path, argv[2],
+						   argc > 3 ? atof (argv[3]) : 600.0,
+						   !strcmp (argv[1], "--queue"));
+	}
+	if (argc > 1)
+		path = argv[1];
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = sedid_signal;     /* No SA_RESTART, so poll returns */
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGINT, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	if (pipe2 (ready_pipe, O_CLOEXEC | O_NONBLOCK) < 0 ||
+		pipe2 (done_pipe, O_CLOEXEC) < 0 ||
+		fcntl (done_pipe[0], F_SETFL, O_NONBLOCK) < 0)
+		return 1;
+
+	sx_error_func (sedid_error_func);
+	gqusb_init ();
+	if (!sedid_open_camera ())
+		return 1;
+	if (pthread_create (&save_thread, NULL, sedid_save_thread, NULL)) {
+		sedid_log ("unable to start save thread");
+		return 1;
+	}
+
+	if ((lfd = sedid_listen (path)) < 0) {
+		sedid_log ("can't listen on %s: %s", path, strerror (errno));
+		return 1;
+	}
+	sedid_log ("listening on %s", path);
+
+	while (!Stop) {
+
+		/* Nothing here is polled except the CCD temperature while waiting to
+		 * start an exposure; otherwise only a hung readout can time out.
+		 */
+
+		if (exd.state == E_COOLING)
+			timeout = 1000;
+		else if (exd.state == E_EXPOSING) {
+			timeout = (int) ((exd.req_len + READOUT_TIMEOUT -
+							  sedid_elapsed (&exd.started)) * 1000);
+			timeout = timeout < 0 ? 0 : timeout;
+		} else
+			timeout = -1;
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ready_pipe[0];
+		pfd[1].events = POLLIN;
+		pfd[2].fd = done_pipe[0];
+		pfd[2].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			pfd[i + 3].fd = clients[i].fd;
+			pfd[i + 3].events = POLLIN;
+		}
+
+		if (poll (pfd, MAX_CLIENTS + 3, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			while (read (ready_pipe[0], &c, 1) > 0)
+				;
+			sedid_finish_exposure ();
+		}
+		if (pfd[0].revents & POLLIN)
+			sedid_accept (lfd);
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0 && pfd[i + 3].revents)
+				sedid_read_client (&clients[i]);
+		sedid_report_saves ();
+
+		if (exd.state == E_COOLING)
+			sedid_check_temperature ();
+
+		/* A stalled readout fails by itself after GQUSB_READ_STALL seconds,
+		 * but anything else that never finishes can't be cancelled safely
+		 * (the exposure thread disables cancellation during USB I/O), so give
+		 * up and exit; the supervisor restarts the daemon and re-opens the
+		 * camera, as capture.sh used to restart GoQat.
+		 */
+
+		if (exd.state == E_EXPOSING &&
+			sedid_elapsed (&exd.started) > exd.req_len + READOUT_TIMEOUT) {
+			sedid_broadcast ("FAILED %s readout timed out", exd.file);
+			unlink (path);
+			sedid_finish_stack ();
+			sedid_stop_saving ();
+			exit (2);
+		}
+	}
+
+	sedid_log ("stopping");
+	if (exd.state == E_EXPOSING)
+		sxc_cancel_exposure (&sedi_cam);
+	sedid_finish_stack ();
+	sedid_stop_saving ();
+	close (lfd);
+	unlink (path);
+	return 0;
+}
+
+#else
+
+int main (int argc, char *argv[])
+{
+	fprintf (stderr, "sedid: built without libusb, no SX camera support\n");
+	return 1;
+}
+
+#endif /* HAVE_SX_CAM */
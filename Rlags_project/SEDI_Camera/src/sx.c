@@ -57,10 +57,21 @@
 #include <sys/time.h>
 #include <pthread.h>
 
+#if (defined (__ARM_NEON) || defined (__ARM_NEON__)) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define SX_NEON
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define SX_SSE2
+#endif
+
 #include "ccd.h"
 #include "telescope.h"
 
 #define SHORT_EXPOSURE 0.1
+#define SX_UNITY 65536          /* Scale factor of 1.0 for sx_convert_row     */
+#define SX_HIST_SIZE 65536      /* Bins in the field histogram, one per value */
 
 enum RowData {
 	SXOddRows = 1,
@@ -92,6 +103,13 @@ enum CamType {
 	AUG
 };
 
+struct sx_readout {      /* Progress of an image download (see sx_convert_rows)*/
+	struct sx_cam *cam;
+	int x_wid;           /* Row length in pixels                              */
+	int y_wid;           /* Number of rows                                    */
+	int rows;            /* Rows converted so far                             */
+};
+
 int cam_pids[SX_MAX_CAMERAS] = {
 				0x0507,
 				0x0509,
@@ -234,6 +252,8 @@ void sxc_pulseguide (enum TelMotion direction, int duration);
 void sxc_guide_start (enum TelMotion direction);
 void sxc_guide_stop (enum TelMotion direction);
 void sxc_set_guide_command_cam (struct sx_cam *cam);
+void sxc_set_ready_func (struct sx_cam *cam, 
+						 void (*ready_func) (struct sx_cam *cam));
 
 /******************************************************************************/
 /*                           MISCELLANEOUS FUNCTIONS                          */
@@ -254,14 +274,19 @@ static int sx_get_row_data (struct usbdevice *u_dev, enum RowData rows,
 							unsigned char *buf, long bytes, 
 							unsigned int x, unsigned int y, 
 							unsigned int x_wid, unsigned int y_wid,
-							unsigned int x_bin, unsigned int y_bin);
+							unsigned int x_bin, unsigned int y_bin,
+							struct sx_readout *rd);
+static void sx_convert_rows (void *data, int offset, int length);
+static void sx_convert_row (unsigned short *dst, const unsigned char *src,
+							int n, unsigned int scale, unsigned short maxval);
+static unsigned short sx_median (const unsigned char *buf, int n, 
+								 unsigned int *hist);
 static void sx_guide (struct usbdevice *u_dev, unsigned short cmd);
 static void sx_guide_pulse (struct usbdevice *u_dev, enum SXGuide cmd,
 							int duration);
 static int sx_set_cooling (struct usbdevice *u_dev, struct cooler *cool);
 static void *sx_expose (void *data);
 static void delay (struct usbdevice *u_dev, struct timespec *length);
-static unsigned short int torben (unsigned short int m[], int n);
 
 #endif /* HAVE_SX_CAM */
 
@@ -476,13 +501,9 @@ int sxc_connect (struct sx_cam *cam, int connect, const char *serial)
 			free (cam->all_buf);
 			cam->all_buf = NULL;
 		}
-		if (cam->e_buf) {
-			free (cam->e_buf);
-			cam->e_buf = NULL;
-		}
-		if (cam->o_buf) {
-			free (cam->o_buf);
-			cam->o_buf = NULL;
+		if (cam->hist) {
+			free (cam->hist);
+			cam->hist = NULL;
 		}
 		if (cam->img_buf) {
 			free (cam->img_buf);
@@ -538,20 +559,13 @@ int sxc_get_cap (struct sx_cam *cam, struct ccd_capability *cam_cap)
 		free (cam->all_buf);
 	cam->all_buf = (unsigned char *) malloc (buf_size);
 	
-	if (!cam_cap->IsInterlaced) {
-		/* e_buf stores the whole image converted to 16-bit integers */
-		if (cam->e_buf)
-			free (cam->e_buf);
-		cam->e_buf = (unsigned short *) malloc (buf_size);
-	} else {
-		/* Even and odd field data converted to 16-bit integers */
-		if (cam->e_buf)
-			free (cam->e_buf);
-		cam->e_buf = (unsigned short *) malloc (buf_size / 2);
-		if (cam->o_buf)
-			free (cam->o_buf);
-		cam->o_buf  = (unsigned short *) malloc (buf_size / 2);
-	}
+	/* Histogram for the median of each field of interlaced chips */
+	if (cam->hist)
+		free (cam->hist);
+	cam->hist = NULL;
+	if (cam_cap->IsInterlaced)
+		cam->hist = (unsigned int *) malloc (SX_HIST_SIZE * 
+											 sizeof (unsigned int));
 		
 	/* Re-assembled data (if interlaced) and possibly flipped in some
 	 * direction (interlaced or progressive) for whole image, converted to 
@@ -839,6 +853,18 @@ void sxc_set_guide_command_cam (struct sx_cam *cam)
 		guide_cam = cam;
 }
 
+void sxc_set_ready_func (struct sx_cam *cam, 
+						 void (*ready_func) (struct sx_cam *cam))
+{
+	/* Set a function to be called from the exposure thread as soon as the
+	 * image is ready, so that a caller with no event loop of its own (see
+	 * sedid.c) does not have to poll sxc_get_imageready.  The function must
+	 * not join or cancel the exposure thread.
+	 */
+	 
+	cam->ready_func = ready_func;
+}
+
 /******************************************************************************/
 /*                           MISCELLANEOUS FUNCTIONS                          */
 /******************************************************************************/
@@ -1098,9 +1124,13 @@ static int sx_get_row_data (struct usbdevice *u_dev, enum RowData rows,
 							unsigned char *buf, long bytes, 
 							unsigned int x, unsigned int y, 
 							unsigned int x_wid, unsigned int y_wid,
-							unsigned int x_bin, unsigned int y_bin)
+							unsigned int x_bin, unsigned int y_bin,
+							struct sx_readout *rd)
 {
-	/* Get the pixel data */
+	/* Get the pixel data.  If rd is not NULL, rows are converted into the
+	 * image buffer by sx_convert_rows while the rest of the data is still
+	 * being downloaded.
+	 */
 	
 	unsigned char CommandBlock[18];
 	
@@ -1124,12 +1154,118 @@ static int sx_get_row_data (struct usbdevice *u_dev, enum RowData rows,
 	CommandBlock[16] = x_bin;
 	CommandBlock[17] = y_bin;
 	
-	if (!SX_STATUS (u_dev, gqusb_bulk_io (u_dev, CommandBlock, 18, buf, bytes)))
+	if (!SX_STATUS (u_dev, gqusb_bulk_io_async (u_dev, CommandBlock, 18, 
+								buf, bytes, rd ? sx_convert_rows : NULL, rd)))
 		return FALSE;
 		
 	return TRUE;
 }
 
+static void sx_convert_rows (void *data, int offset, int length)
+{
+	/* Called by gqusb_bulk_io_async as each chunk of image data arrives.  Any
+	 * rows that are now complete are converted from byte pairs to 16-bit 
+	 * values and flipped horizontally (and vertically, if the image is to be
+	 * inverted) into img_buf in a single pass.
+	 */
+	
+	struct sx_readout *rd = (struct sx_readout *) data;
+	struct sx_cam *cam = rd->cam;
+	int complete;
+	
+	complete = (offset + length) / (2 * rd->x_wid);
+	for (; rd->rows < complete && rd->rows < rd->y_wid; rd->rows++)
+		sx_convert_row (cam->img_buf + rd->x_wid * (cam->InvertImage ? 
+										rd->y_wid - 1 - rd->rows : rd->rows),
+						cam->all_buf + 2 * rd->rows * rd->x_wid,
+						rd->x_wid, SX_UNITY, 0);
+}
+
+static void sx_convert_row (unsigned short *dst, const unsigned char *src,
+							int n, unsigned int scale, unsigned short maxval)
+{
+	/* Convert a row of n pixels from byte pairs (low byte first) to 16-bit
+	 * values, reversing the order of the pixels.  Unless scale is SX_UNITY,
+	 * each value is also multiplied by scale / SX_UNITY (rounding down) and 
+	 * capped at maxval.  The vector versions do eight pixels at a time and
+	 * give exactly the same result as the scalar loop, which deals with
+	 * whatever is left over.  They only handle scale factors below 2, which
+	 * is all that field scaling ever needs in practice; larger ones are done
+	 * entirely by the scalar loop.
+	 */
+	
+	unsigned int f = scale - SX_UNITY;
+	unsigned int val;
+	int h = 0;
+	
+#if defined (SX_NEON)
+	uint16x8_t v, s, m = vdupq_n_u16 (maxval);
+	
+	if (scale < 2 * SX_UNITY) {
+		for (; h + 8 <= n; h += 8) {
+			v = vreinterpretq_u16_u8 (vld1q_u8 (src + 2 * h));
+			if (f) {
+				s = vcombine_u16 (
+						vshrn_n_u32 (vmull_n_u16 (vget_low_u16 (v), f), 16),
+						vshrn_n_u32 (vmull_n_u16 (vget_high_u16 (v), f), 16));
+				v = vminq_u16 (vqaddq_u16 (v, s), m);
+			}
+			v = vrev64q_u16 (v);
+			vst1q_u16 (dst + n - 8 - h, 
+					   vcombine_u16 (vget_high_u16 (v), vget_low_u16 (v)));
+		}
+	}
+#elif defined (SX_SSE2)
+	__m128i v, m = _mm_set1_epi16 ((short) maxval);
+	__m128i s = _mm_set1_epi16 ((short) f);
+	
+	if (scale < 2 * SX_UNITY) {
+		for (; h + 8 <= n; h += 8) {
+			v = _mm_loadu_si128 ((const __m128i *) (src + 2 * h));
+			if (f) {
+				v = _mm_adds_epu16 (v, _mm_mulhi_epu16 (v, s));
+				v = _mm_sub_epi16 (v, _mm_subs_epu16 (v, m));  /* min */
+			}
+			v = _mm_shufflelo_epi16 (v, 0x1b);
+			v = _mm_shufflehi_epi16 (v, 0x1b);
+			v = _mm_shuffle_epi32 (v, 0x4e);
+			_mm_storeu_si128 ((__m128i *) (dst + n - 8 - h), v);
+		}
+	}
+#endif
+	
+	for (; h < n; h++) {
+		val = src[2 * h] | src[2 * h + 1] << 8;
+		if (f) {
+			val += (unsigned int) (((unsigned long long) val * f) >> 16);
+			val = val < maxval ? val : maxval;
+		}
+		dst[n - 1 - h] = val;
+	}
+}
+
+static unsigned short sx_median (const unsigned char *buf, int n, 
+								 unsigned int *hist)
+{
+	/* Return the median of n 16-bit values held as byte pairs (low byte 
+	 * first), from a histogram of the values.  This takes one pass over the
+	 * data, whereas the torben algorithm that used to be used here takes 
+	 * many.  As with that algorithm, the lower of the two middle values is
+	 * returned when n is even.
+	 */
+	
+	unsigned int count = 0, half = (n + 1) / 2;
+	int i;
+	
+	memset (hist, 0, SX_HIST_SIZE * sizeof (unsigned int));
+	for (i = 0; i < n; i++)
+		hist[buf[2 * i] | buf[2 * i + 1] << 8]++;
+	for (i = 0; i < SX_HIST_SIZE - 1; i++)
+		if ((count += hist[i]) >= half)
+			break;
+	return (unsigned short) i;
+}
+
 static void sx_guide (struct usbdevice *u_dev, unsigned short cmd)
 {
 	/* Start or stop guide motions in the requested direction.  Guide commands
@@ -1238,10 +1374,14 @@ static void *sx_expose (void *params)
 	  
 	struct sx_cam *cam = (struct sx_cam *) params;
 	
+	struct sx_readout rd;
 	struct timespec length;
 	struct timeval start, stop;
-    int x_wid, y_wid, h, v, val, maxval;
-    unsigned long i, ei, oi, buf_size;
+    int x_wid, y_wid, v;
+    unsigned long buf_size;
+	unsigned int scale, o_scale, e_scale;
+	unsigned short maxval, *row;
+	unsigned char *odd, *even;
 	float o_med, e_med, ratio;
 	double dsec;
 	
@@ -1271,30 +1411,21 @@ static void *sx_expose (void *params)
 		sx_close_shutter (&cam->usbd, cam->SXShutter);
 		gettimeofday (&stop, NULL);
 		cam->status = SXReading;
+		
+		/* The byte data are converted to short integers (assuming maximum of 
+		 * 16 bits per pixel) and optionally inverted, row by row, as they 
+		 * arrive.
+		 */
+		
+		rd.cam = cam;
+		rd.x_wid = x_wid;
+		rd.y_wid = y_wid;
+		rd.rows = 0;
 		sx_get_row_data (&cam->usbd, SXAllRows,
 						 cam->all_buf, buf_size, 
 						 cam->ip.x, cam->ip.y, 
 						 cam->ip.x_wid, cam->ip.y_wid, 
-						 cam->ip.x_bin, cam->ip.y_bin);
-
-		/* Convert the byte data to short integers (assuming maximum of 
-		 * 16 bits per pixel).
-		 */
-		 
-		for (ei = 0, i = 0; i < buf_size; i+=2) {
-				cam->e_buf[ei++] = (unsigned char) cam->all_buf[i] | 
-								   (unsigned char) cam->all_buf[i+1] << 8;
-		}
-		
-		/* Optionally invert the image if requested */
-		
-		i = cam->InvertImage ? x_wid * (y_wid - 1) : 0;
-		for (v = 0; v < y_wid; v++) {
-			for (h = 0; h < x_wid; h++) {
-				cam->img_buf[i++] = cam->e_buf[(v + 1) * x_wid - (h + 1)];
-			}
-			i -= cam->InvertImage ? 2 * x_wid : 0;
-		}
+						 cam->ip.x_bin, cam->ip.y_bin, &rd);
 	
 	} else {                   /* Interlaced chips... */
 		
@@ -1330,7 +1461,7 @@ static void *sx_expose (void *params)
 									 cam->all_buf, buf_size, 
 									 cam->ip.x, cam->ip.y,
 									 cam->ip.x_wid, cam->ip.y_wid, 
-									 cam->ip.x_bin, cam->ip.y_bin);
+									 cam->ip.x_bin, cam->ip.y_bin, NULL);
 					sx_dump_charge (&cam->usbd);
 					sx_open_shutter (&cam->usbd, cam->SXShutter);
 					nanosleep (&length, NULL);
@@ -1339,7 +1470,7 @@ static void *sx_expose (void *params)
 									 cam->all_buf+buf_size, buf_size, 
 									 cam->ip.x, cam->ip.y, 
 									 cam->ip.x_wid, cam->ip.y_wid, 
-									 cam->ip.x_bin, cam->ip.y_bin);
+									 cam->ip.x_bin, cam->ip.y_bin, NULL);
 				}
 			} else {
 	
@@ -1355,37 +1486,26 @@ static void *sx_expose (void *params)
 								 cam->all_buf, buf_size, 
 								 cam->ip.x, cam->ip.y, 
 								 cam->ip.x_wid, cam->ip.y_wid, 
-								 cam->ip.x_bin, cam->ip.y_bin);
+								 cam->ip.x_bin, cam->ip.y_bin, NULL);
 				gettimeofday (&stop, NULL);
 				sx_get_row_data (&cam->usbd, SXEvenRows,
 								 cam->all_buf+buf_size, buf_size, 
 								 cam->ip.x, cam->ip.y, 
 								 cam->ip.x_wid, cam->ip.y_wid, 
-								 cam->ip.x_bin, cam->ip.y_bin);
-			}
-			
-			/* Convert the byte data to short integers (assuming maximum of 
-			 * 16 bits per pixel).
-			 */
-			
-			for (oi = 0, ei = 0, i = 0; i < buf_size; i += 2) {
-				cam->o_buf[oi++] = 
-							(unsigned char) cam->all_buf[i] | 
-							(unsigned char) cam->all_buf[i + 1] << 8;
-				cam->e_buf[ei++] = 
-							(unsigned char) cam->all_buf[i + buf_size] | 
-							(unsigned char) cam->all_buf[i + buf_size + 1] << 8;
+								 cam->ip.x_bin, cam->ip.y_bin, NULL);
 			}
 			
 			/* Calculate the median values in each field and a scaling factor.
 			 * Median should be more reliable than average for calculating the
-			 * sky background in a star field.
+			 * sky background in a star field.  The medians come straight from
+			 * the byte data (assuming maximum of 16 bits per pixel).
 			 */
 			
-			o_med = (float) torben (cam->o_buf, buf_size / 2);
-			e_med = (float) torben (cam->e_buf, buf_size / 2);
-			ratio = e_med / o_med;
-					
+			o_med = (float) sx_median (cam->all_buf, x_wid * y_wid, cam->hist);
+			e_med = (float) sx_median (cam->all_buf + buf_size, x_wid * y_wid,
+									   cam->hist);
+			ratio = (o_med > 0 && e_med > 0) ? e_med / o_med : 1;
+			
 			/* Optionally invert the image if requested.
 			 * Scale the odd and even fields to the same median value to
 			 * allow for differences in exposure length.  In practice we scale 
@@ -1402,38 +1522,29 @@ static void *sx_expose (void *params)
 			 * is done for exposure lengths less than SHORT_EXPOSURE, where the 
 			 * two fields are exposed completely independently and in principle
 			 * should have the same median value.
+			 * Each row of each field is converted to 16-bit integers, flipped
+			 * and scaled in a single pass by sx_convert_row, with the scale
+			 * factor in fixed point.
 			 */
 			
 			maxval = (1 << cam->bitspp) - 1;
-			i = cam->InvertImage ? x_wid * (2 * y_wid - 2) : 0;
+			ratio = ratio < 1 ? 1 / ratio : ratio;
+			scale = ratio < 256 ? (unsigned int) (ratio * SX_UNITY) : 
+								  256 * SX_UNITY;
+			o_scale = e_med >= o_med ? scale : SX_UNITY;
+			e_scale = e_med >= o_med ? SX_UNITY : scale;
 			for (v = 0; v < y_wid; v++) {
-				for (h = 0; h < x_wid; h++) {
-					if (!cam->InvertImage) {
-						val = cam->o_buf[(v + 1) * x_wid - (h + 1)];
-						if (ratio >= 1)
-							val = val * ratio < maxval ? val * ratio : maxval;
-						cam->img_buf[i++] = val;
-					} else {
-						val = cam->e_buf[(v + 1) * x_wid - (h + 1)];
-						if (ratio < 1)
-							val = val / ratio < maxval ? val / ratio : maxval;
-						cam->img_buf[i++] = val;
-					}
+				row = cam->img_buf + 2 * x_wid * 
+								(cam->InvertImage ? y_wid - 1 - v : v);
+				odd = cam->all_buf + 2 * v * x_wid;
+				even = odd + buf_size;
+				if (!cam->InvertImage) {
+					sx_convert_row (row, odd, x_wid, o_scale, maxval);
+					sx_convert_row (row + x_wid, even, x_wid, e_scale, maxval);
+				} else {
+					sx_convert_row (row, even, x_wid, e_scale, maxval);
+					sx_convert_row (row + x_wid, odd, x_wid, o_scale, maxval);
 				}
-				for (h = 0; h < x_wid; h++) {
-					if (!cam->InvertImage) {
-						val = cam->e_buf[(v + 1) * x_wid - (h + 1)];
-						if (ratio < 1)
-							val = val / ratio < maxval ? val / ratio : maxval;
-						cam->img_buf[i++] = val;
-					} else {
-						val = cam->o_buf[(v + 1) * x_wid - (h + 1)];
-						if (ratio >= 1)
-							val = val * ratio < maxval ? val * ratio : maxval;
-						cam->img_buf[i++] = val;
-					}
-				}
-				i -= cam->InvertImage ? 4 * x_wid : 0;
 			}
 			
 		} else {   /* p->y_bin > 1 */
@@ -1460,32 +1571,21 @@ static void *sx_expose (void *params)
 			sx_close_shutter (&cam->usbd, cam->SXShutter);
 			gettimeofday (&stop, NULL);
 			cam->status = SXReading;
+			
+			/* Reading both fields together gives the odd and even rows
+			 * combined, so they are converted and optionally inverted as they
+			 * arrive, just as for progressive chips.
+			 */
+			
+			rd.cam = cam;
+			rd.x_wid = x_wid;
+			rd.y_wid = y_wid;
+			rd.rows = 0;
 			sx_get_row_data (&cam->usbd, SXAllRows,
 							 cam->all_buf, buf_size, 
 							 cam->ip.x, cam->ip.y, 
 							 cam->ip.x_wid, cam->ip.y_wid, 
-							 cam->ip.x_bin, cam->ip.y_bin / 2);
-
-			/* Convert the byte data to short integers (assuming maximum of 
-			 * 16 bits per pixel).  (e_buf is used as handy storage space - it's
-			 * actually the odd and even fields combined in this case because
-			 * we've read all the rows in one go).
-			 */
-			 
-			for (ei = 0, i = 0; i < buf_size; i+=2) {
-					cam->e_buf[ei++] = (unsigned char) cam->all_buf[i] | 
-									   (unsigned char) cam->all_buf[i+1] << 8;
-			}
-			
-			/* Optionally invert the image if requested */
-			
-			i = cam->InvertImage ? x_wid * (y_wid - 1) : 0;
-			for (v = 0; v < y_wid; v++) {
-				for (h = 0; h < x_wid; h++) {
-					cam->img_buf[i++] = cam->e_buf[(v + 1) * x_wid - (h + 1)];
-				}
-				i -= cam->InvertImage ? 2 * x_wid : 0;
-			}
+							 cam->ip.x_bin, cam->ip.y_bin / 2, &rd);
 		}
 	}
 	
@@ -1493,6 +1593,8 @@ static void *sx_expose (void *params)
 					 (start.tv_sec + start.tv_usec/1.e6);
 	cam->status = SXIdle;
 	cam->ImageReady = TRUE;
+	if (cam->ready_func)
+		cam->ready_func (cam);
 }
 
 static void delay (struct usbdevice *u_dev, struct timespec *length)
@@ -1525,47 +1627,6 @@ static void delay (struct usbdevice *u_dev, struct timespec *length)
 	}
 }
 
-/*
- * Calculate median without modifying original data array.
- * Algorithm by Torben Mogensen, implementation by N. Devillard.
- * This code is in the public domain.
- * See http://ndevilla.free.fr/median/median/index.html
- */
-
-static unsigned short int torben (unsigned short int m[], int n)
-{
-	int i, less, greater, equal;
-	unsigned short int  min, max, guess, maxltguess, mingtguess;
-
-	min = max = m[0] ;
-	for (i=1 ; i<n ; i++) {
-		if (m[i]<min) min=m[i];
-		if (m[i]>max) max=m[i];
-	}
-
-	while (1) {
-		guess = (min+max)/2;
-		less = 0; greater = 0; equal = 0;
-		maxltguess = min ;
-		mingtguess = max ;
-		for (i=0; i<n; i++) {
-			if (m[i]<guess) {
-				less++;
-				if (m[i]>maxltguess) maxltguess = m[i] ;
-			} else if (m[i]>guess) {
-				greater++;
-				if (m[i]<mingtguess) mingtguess = m[i] ;
-			} else equal++;
-		}
-		if (less <= (n+1)/2 && greater <= (n+1)/2) break ; 
-		else if (less>greater) max = maxltguess ;
-		else min = mingtguess;
-	}
-	if (less >= (n+1)/2) return maxltguess;
-	else if (less+equal >= (n+1)/2) return guess;
-	else return mingtguess;
-}
-
 #endif /* HAVE_SX_CAM */
 
 #ifdef HAVE_SX_FILTERWHEEL
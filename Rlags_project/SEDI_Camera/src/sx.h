@@ -82,10 +82,10 @@ struct sx_cam {
 	int InvertImage;                              /* 1 if image to be inverted*/
 	int Expose;                                   /* 1 if exposure to be made */
 	int ImageReady;                               /* 1 if image is ready      */
-	unsigned short *e_buf;                        /* Memory buffer pointers   */
-	unsigned short *o_buf;
-	unsigned short *img_buf;
+	unsigned short *img_buf;                      /* Memory buffer pointers   */
 	unsigned char *all_buf;
+	unsigned int *hist;                           /* Interlaced field medians */
+	void (*ready_func) (struct sx_cam *cam);      /* Called when image ready  */
 };
 
 extern int sx_get_cameras (const char *serial[], const char *desc[], int *num);
@@ -134,6 +134,8 @@ extern void sxc_pulseguide (enum TelMotion direction, int duration);
 extern void sxc_guide_start (enum TelMotion direction);
 extern void sxc_guide_stop (enum TelMotion direction);
 extern void sxc_set_guide_command_cam (struct sx_cam *cam);
+extern void sxc_set_ready_func (struct sx_cam *cam, 
+								void (*ready_func) (struct sx_cam *cam));
 
 #endif /* HAVE_SX_CAM */
 
@@ -6,7 +6,9 @@
 /* see if there are any pending tasks.  If there are, the tasks are scheduled */
 /* to be run in the coming iteration of the event loop (see loop.c).  The     */
 /* task queue is implemented as a list store, so that a tree model can be     */
-/* used to edit the contents of the task queue interactively.                 */
+/* used to edit the contents of the task queue interactively.  The list is    */
+/* compiled into an array of operations with resolved jumps for loops, If and */
+/* While statements before it is checked or executed (see tasks_compile).     */
 /*                                                                            */
 /* The following keywords have the stated effect:                             */
 /*                                                                            */
@@ -111,11 +113,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 #include <ctype.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <glib/gstdio.h>
 
 #define GOQAT_TASKS
@@ -128,25 +132,40 @@
 #define T_NEXT     0x0010        /* Execute next task                         */
 #define T_EXEC     0x0020        /* Task is currently executing               */
 #define T_TESTONLY 0x0040        /* Task list is in TestOnly mode             */
+#define T_USERSTOP 0x0080        /* Execution was stopped by the user         */
 
 #define MAX_NEST   10            /* Max. depth of nested loops                */
-#define MAX_IF     100           /* Max. no of 'If' statements                */
-#define MAX_WHILE  100           /* Max. no of 'While' loops                  */
-
-#define EL         1             /* Markers for loop integrity checking       */
-#define EI         2
-#define EW         3
 
 #define SCRIPT_RESULTS "script.results" /* File for script results            */
 #define SCRIPT_DONE    "script.done"    /* File to be created when script done*/
 
-/* Definition of task queue items.  TAG is a hidden value (not displayed on   */
-/* the Tasks tab), for book-keeping of If and While statements in             */
-/* tasks_execute_tasks.                                                       */
+#define WATCH_DROP  ".d"         /* Suffix of drop folder for task files      */
+#define WATCH_SPOOL ".queue"     /* Folder in drop folder for queued files    */
+#define WATCH_DONE  "done"       /* Folder in drop folder for records         */
+
+/* Definition of task queue items */
 
 enum TaskQ {TASK, EXP_TYPE, FILTER, TASK_TIME, H1, V1, H2, V2, 
-	        H_BIN, V_BIN, CCDTEMP, NUM, RA, DEC, VALUE, TAG, 
-            N_TASKCOLS};
+	        H_BIN, V_BIN, CCDTEMP, NUM, RA, DEC, VALUE, N_TASKCOLS};
+
+/* Operations of the compiled task list, in the same order as the task names */
+
+enum TaskOps {OP_OBJECT, OP_BEGINSEQUENCE, OP_WAITUNTIL, OP_PAUSEFOR, OP_AT,
+	          OP_EXPOSE, OP_FOCUSTO, OP_FOCUSMOVE, OP_BEGINLOOP, OP_ENDLOOP, 
+	          OP_IFTRUE, OP_IFFALSE, OP_ENDIF, OP_WHILE, OP_ENDWHILE, 
+	          OP_AUGON, OP_AUGOFF, OP_GUIDESTART, OP_GUIDESTOP, OP_GOTO, 
+	          OP_MOVE, OP_EXEC, OP_EXECASYNC, OP_SETPARAM, OP_WARMRESTART, 
+	          OP_PARKMOUNT, OP_RECORDSTART, OP_RECORDSTOP, OP_YELLOWBUTTON, 
+	          OP_SHUTDOWN, OP_EXIT, OP_INVALID};
+
+static const gchar *task_names[OP_INVALID] = {
+	"Object", "BeginSequence", "WaitUntil", "PauseFor", "At",
+	"Expose", "FocusTo", "FocusMove", "BeginLoop", "EndLoop",
+	"IfTrue", "IfFalse", "EndIf", "While", "EndWhile",
+	"AugOn", "AugOff", "GuideStart", "GuideStop", "GoTo",
+	"Move", "Exec", "ExecAsync", "SetParam", "WarmRestart",
+	"ParkMount", "RecordStart", "RecordStop", "YellowButton",
+	"Shutdown", "Exit"};
 
 static struct TaskFlags {        /* Task control flags                        */
 	guint Task;
@@ -157,28 +176,98 @@ static struct TaskFlags {        /* Task control flags                        */
 static struct Tasks {            /* Tasks                                     */
 	guint now;                   /* Time at which pause started (milliseconds)*/
 	gdouble time;                /* Time for At, Pause and WaitUntil tasks    */
-	gchar *type;                 /* Task type                                 */
 } task;
 
+struct watch_script {            /* Task file queued by the watch             */
+	gchar *name;                 /* Name of file as submitted                 */
+	gchar *path;                 /* Queued copy of file                       */
+	guint seq;                   /* Sequence number                           */
+	time_t queued;               /* Time at which file was queued...          */
+	time_t started;              /*  ...and started                           */
+};
+
+static struct Watch {            /* Watch file and queue of task files        */
+	gint fd;                     /* inotify file descriptor, or -1            */
+	gint wd_file;                /* Watch on folder holding the watch file    */
+	gint wd_drop;                /* Watch on drop folder                      */
+	gchar *name;                 /* Name of watch file within its folder      */
+	gchar *drop;                 /* Drop folder...                            */
+	gchar *spool;                /*  ...folder for queued files...            */
+	gchar *done;                 /*  ...and folder for completion records     */
+	GQueue *queue;               /* Queued task files (struct watch_script)   */
+	struct watch_script *cur;    /* Task file being executed, or NULL         */
+	guint seq;                   /* Sequence number of last file queued       */
+	struct timespec mtime;       /* Modification time of watch file when read */
+} watch = {-1};
+
+struct task_op {                 /* Operation of the compiled task list       */
+	enum TaskOps op;             /* Operation                                 */
+	gint line;                   /* Line number in the task list              */
+	gint jump;                   /* Index of task to jump to for loops, If and*/
+	                             /*  While statements, or -1                  */
+	gchar *arg[N_TASKCOLS];      /* Task list columns, stripped of spaces     */
+	gdouble num[N_TASKCOLS];     /* Value of each numeric column...           */
+	gshort param[N_TASKCOLS];    /*  ...or task parameter (%n) it names, or -1*/
+	gboolean OK[N_TASKCOLS];     /* FALSE if a column's value is invalid      */
+};
+
+static const struct task_arg {   /* Numeric arguments of operations           */
+	enum TaskOps op;             /* Operation...                              */
+	enum TaskQ col;              /*  ...column holding the argument...        */
+	gboolean Int;                /*  ...TRUE if it must be an integer...      */
+	gdouble min, max;            /*  ...and its permitted range               */
+} task_args[] = {                /* (limits set by the hardware are checked   */
+	                             /*  when the task is run)                    */
+	{OP_WAITUNTIL, TASK_TIME, FALSE, WAI_MIN, WAI_MAX},
+	{OP_PAUSEFOR, TASK_TIME, FALSE, WAI_MIN, WAI_MAX},
+	{OP_EXPOSE, TASK_TIME, FALSE, 0.0, G_MAXDOUBLE},
+	{OP_EXPOSE, H1, TRUE, 1, G_MAXINT},
+	{OP_EXPOSE, V1, TRUE, 1, G_MAXINT},
+	{OP_EXPOSE, H2, TRUE, 2, G_MAXINT},
+	{OP_EXPOSE, V2, TRUE, 2, G_MAXINT},
+	{OP_EXPOSE, H_BIN, TRUE, 1, G_MAXINT},
+	{OP_EXPOSE, V_BIN, TRUE, 1, G_MAXINT},
+	{OP_EXPOSE, CCDTEMP, FALSE, TPR_MIN, TPR_MAX},
+	{OP_FOCUSTO, VALUE, TRUE, 1, G_MAXINT},
+	{OP_FOCUSMOVE, VALUE, TRUE, G_MININT, G_MAXINT},
+	{OP_BEGINLOOP, NUM, TRUE, REP_MIN, REP_MAX},
+	{OP_IFTRUE, VALUE, TRUE, G_MININT, G_MAXINT},
+	{OP_IFFALSE, VALUE, TRUE, G_MININT, G_MAXINT},
+	{OP_WHILE, VALUE, TRUE, G_MININT, G_MAXINT},
+	{OP_MOVE, RA, FALSE, MOV_MIN, MOV_MAX},
+	{OP_MOVE, DEC, FALSE, MOV_MIN, MOV_MAX},
+	{OP_SETPARAM, NUM, TRUE, 0, NUMTPARAMS - 1}};
+
+static struct Program {          /* Compiled task list                        */
+	struct task_op *ops;         /* Operations, one for each row of the list  */
+	gint n;                      /* Number of operations                      */
+	gint pc;                     /* Index of the next operation to execute    */
+	gchar *exptype;              /* Copies of exposure type and filter for    */
+	gchar *filter;               /*  the exposure in progress                 */
+	gboolean Stale;              /* TRUE if the list has changed since compile*/
+	gboolean Invalid;            /* TRUE if loop, If or While structure is bad*/
+	gboolean Error;              /* TRUE if an error has been found           */
+} prog;
+
 static struct Loops {            /* Structure for simple loop control         */
-	GtkTreePath *path[MAX_NEST]; /* Path to BeginLoop statement in tree       */
 	gushort repeat[MAX_NEST];    /* Number of repeats of loop to make         */
 	gushort count[MAX_NEST];     /* Number of current loop iteration          */
 	gshort depth;                /* Current nesting depth                     */
 } loop;
 
+static struct TaskUI {           /* How executing tasks show themselves in    */
+	                             /*  the UI; each is left NULL when there is  */
+	                             /*  no UI to update                          */
+	void (*show_task) (gint line);                    /* Highlight task line */
+	void (*set_field) (const gchar *name, gchar *s);  /* Set a text field    */
+	void (*set_elapsed) (guint elapsed);              /* Show elapsed time   */
+} ui;
+
 static FILE *sp = NULL;          /* Script execution file pipe (popen)        */	
 static GtkTreeView *trvTasks;    /* Tasks tree view                           */
 static GtkListStore *lisTasks;   /* List store - tasks data                   */
-static GtkTreePath *path_endif[MAX_IF]; /* Path to 'EndIf' statements         */
-static GtkTreePath *path_while[MAX_WHILE]; /* Path to 'While' statements      */
-static GtkTreePath *path_endwhile[MAX_WHILE]; /* Path to 'EndWhile' statements*/
-static time_t mtime;             /* Modification time for 'watch' file        */
-static gushort loop_check[2 * (MAX_IF + MAX_WHILE)]; /* Loop integrity check  */
 static guint seq_expno = 1;      /* Exposure number of current sequence       */
 static guint seq_start = 0;      /* Start time (ms) of current sequence       */
-static gint ip, iep, wp, wep;    /* Counters for 'If', 'While' loops          */
-static gint lc, lec;             /* Counter for checking integrity of 'loops' */
 static gchar *sr = NULL;         /* Script results file                       */
 static gchar *sd = NULL;         /* Script done file                          */
 extern gchar *WatchFile;         /* File to watch for incoming tasks          */
@@ -190,7 +279,7 @@ extern gchar *WatchFile;         /* File to watch for incoming tasks          */
 void tasks_init (GtkBuilder *xml);
 void tasks_start (void);
 void tasks_pause (gboolean pause);
-void tasks_stop (void);
+void tasks_stop (gboolean User);
 void tasks_task_done (enum TaskTypes Task);
 void tasks_move_up (void);
 void tasks_move_down (void);
@@ -224,8 +313,28 @@ void tasks_add_YellowButton (void);
 void tasks_add_Shutdown (void);						 
 void tasks_add_Exit (void);						 
 void tasks_activate_watch (void);
+void tasks_deactivate_watch (void);
 void tasks_watch_file (void);
-gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error);
+static void tasks_watch_events (void);
+static void tasks_watch_scan (const gchar *folder, gboolean Move);
+static void tasks_watch_queue (const gchar *path, const gchar *name, 
+                               guint seq, gboolean Move);
+static void tasks_watch_record (const gchar *status);
+static gint tasks_watch_compare (gconstpointer a, gconstpointer b);
+gboolean tasks_check_tasks (void);
+gboolean tasks_execute_tasks (void);
+static void tasks_compile (void);
+static void tasks_free_program (void);
+static void tasks_compile_args (struct task_op *op);
+static gboolean tasks_parse_num (const gchar *s, gboolean Int, gdouble *val);
+static gboolean tasks_in_range (gdouble val, gdouble min, gdouble max);
+static gboolean tasks_arg (struct task_op *op, enum TaskQ col, gboolean Int,
+                           gdouble min, gdouble max, gdouble *val);
+static gboolean tasks_arg_int (struct task_op *op, enum TaskQ col, gint min,
+                               gint max, gint *val);
+static gchar *tasks_arg_string (struct task_op *op, enum TaskQ col);
+static void tasks_list_changed (GtkTreeModel *model);
+static gint tasks_do_task (struct task_op *op, gboolean TestOnly);
 guint tasks_get_status (void);
 gboolean tasks_task_wait (void);
 gboolean tasks_task_pause (void);
@@ -234,6 +343,9 @@ gboolean tasks_load_file (gchar *filename);
 gboolean tasks_write_file (gchar *filename);
 static void tasks_script_execute (gboolean IsExec, gchar *script);
 gboolean tasks_script_done (void);
+static gboolean tasks_list_locked (void);
+static gboolean tasks_insert_row (GtkTreeIter *iter);
+static void tasks_show_task (gint line);
 static GtkTreeIter *get_selected_iter (GtkTreeIter *iter);
 static void select_current_row (GtkTreeIter *iter);
 static gchar *next_token (gchar **tokens, gboolean Init);
@@ -267,8 +379,19 @@ void tasks_init (GtkBuilder *xml)
 								   G_TYPE_STRING,
 								   G_TYPE_STRING,
 								   G_TYPE_STRING,	
-								   G_TYPE_STRING,
-								   G_TYPE_INT);
+								   G_TYPE_STRING);
+	
+	/* Compile the task list again whenever it changes */
+	
+	g_signal_connect (G_OBJECT (lisTasks), "row-changed",
+					  G_CALLBACK (tasks_list_changed), NULL);
+	g_signal_connect (G_OBJECT (lisTasks), "row-inserted",
+					  G_CALLBACK (tasks_list_changed), NULL);
+	g_signal_connect (G_OBJECT (lisTasks), "row-deleted",
+					  G_CALLBACK (tasks_list_changed), NULL);
+	g_signal_connect (G_OBJECT (lisTasks), "rows-reordered",
+					  G_CALLBACK (tasks_list_changed), NULL);
+	prog.Stale = TRUE;
 	
 	/* Associate the tree view with the list model */
 	
@@ -372,6 +495,12 @@ void tasks_init (GtkBuilder *xml)
                                                       NULL);
 	gtk_tree_view_append_column (trvTasks, column);
 	
+	/* Show executing tasks in the tree view and task fields */
+	
+	ui.show_task = tasks_show_task;
+	ui.set_field = set_entry_string;
+	ui.set_elapsed = set_elapsed_time;
+	
 	/* Initialise task flags */
 	
 	Flags.Task = T_NULL;
@@ -380,20 +509,17 @@ void tasks_init (GtkBuilder *xml)
 void tasks_start (void)
 {
 	/* This routine is called to begin execution at the first task in
-	 * the list.
+	 * the list.  The list is compiled if it has changed since it was last
+	 * compiled.
 	 */
 	
+	if (prog.Stale)
+		tasks_compile ();
+	
 	Flags.Task |= T_START;
-	Flags.Task &= ~(T_STOP | T_EXEC);
+	Flags.Task &= ~(T_STOP | T_USERSTOP | T_EXEC);
 	init_task_params ();
 	
-	ip = -1;   /* Counters for checking if/while/loop statements */
-	iep = -1;
-	wp = -1;
-	wep = -1;
-	lc = -1;
-	lec = -1;
-	
 	loop.depth = -1;  /* Initial BeginLoop depth */
 	seq_expno = 1;    /* First exposure in sequence */
 	seq_start = loop_elapsed_since_first_iteration ();
@@ -409,42 +535,15 @@ void tasks_pause (gboolean pause)
 		Flags.Task &= ~T_PAUSE;
 }
 
-void tasks_stop (void)
+void tasks_stop (gboolean User)
 {
-	/* This routine is called to stop execution of tasks in the list */
-	
-	gint i;
-
-	for (i = 0; i < MAX_NEST; i++) {
-		if (loop.path[i]) {
-			gtk_tree_path_free (loop.path[i]);
-			loop.path[i] = NULL;
-		}
-	}
-	
-	for (i = 0; i < MAX_IF; i++) {
-		if (path_endif[i]) {
-			gtk_tree_path_free (path_endif[i]);
-			path_endif[i] = NULL;
-		}
-	}
-	
-	for (i = 0; i < MAX_WHILE; i++) {
-		if (path_while[i]) {
-			gtk_tree_path_free (path_while[i]);
-			path_while[i] = NULL;
-		}
-		if (path_endwhile[i]) {
-			gtk_tree_path_free (path_endwhile[i]);
-			path_endwhile[i] = NULL;
-		}
-	}
-	
-	for (i = 0; i < 2 * (MAX_IF + MAX_WHILE); i++) {
-		loop_check[i] = 0;
-	}
+	/* This routine is called to stop execution of tasks in the list, either
+	 * by the user (User is TRUE) or because the list has finished.
+	 */
 	
 	Flags.Task |= T_STOP;
+	if (User)
+		Flags.Task |= T_USERSTOP;
 	Flags.Task &= ~T_NEXT;
 	free_task_params ();
 }
@@ -465,7 +564,7 @@ void tasks_move_up (void)
 	GtkTreePath *path;
 	gboolean valid;
 	
-	if (get_selected_iter (&iter)) {
+	if (!tasks_list_locked () && get_selected_iter (&iter)) {
 		path = gtk_tree_model_get_path (GTK_TREE_MODEL (lisTasks), &iter);
 		gtk_tree_path_prev (path);
 		gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), &p_iter, path);
@@ -484,7 +583,7 @@ void tasks_move_down (void)
 	GtkTreePath *path;
 	gboolean valid;
 	
-	if (get_selected_iter (&iter)) {
+	if (!tasks_list_locked () && get_selected_iter (&iter)) {
 		path = gtk_tree_model_get_path (GTK_TREE_MODEL (lisTasks), &iter);
 		gtk_tree_path_next (path);
 		gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), &p_iter, path);
@@ -502,7 +601,7 @@ void tasks_delete (void)
 	GtkTreeIter iter;
 	gboolean valid;
 	
-	if (get_selected_iter (&iter)) {
+	if (!tasks_list_locked () && get_selected_iter (&iter)) {
 		gtk_list_store_remove (lisTasks, get_selected_iter (&iter));
 		if ((valid = (iter.stamp != 0 ? TRUE : FALSE)))
 			select_current_row (&iter);
@@ -515,6 +614,8 @@ void tasks_clear (void)
 
 	GtkTreeIter iter;
 	
+	if (tasks_list_locked ())
+		return;
 	while (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (lisTasks), &iter))
 		gtk_list_store_remove (lisTasks, &iter);
 	
@@ -526,10 +627,10 @@ void tasks_add_Object (gchar *str)
 {
 	/* Adds an object name command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "Object",
 						VALUE, str,
@@ -540,10 +641,10 @@ void tasks_add_BeginSequence (void)
 {
 	/* Adds a BeginSequence marker to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);		
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "BeginSequence",
 						-1);
@@ -553,10 +654,10 @@ void tasks_add_WaitUntil (gchar *str)
 {
 	/* Adds a WaitUntil command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);			
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "WaitUntil",
 						TASK_TIME, str,
@@ -567,10 +668,10 @@ void tasks_add_PauseFor (gchar *str)
 {
 	/* Adds a PauseFor command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);			
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "PauseFor",
 						TASK_TIME, str,
@@ -581,10 +682,10 @@ void tasks_add_At (gchar *str)
 {
 	/* Adds an At command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "At",
 						RA, str,
@@ -595,11 +696,11 @@ void tasks_add_Exposure (gchar **stra)
 {
 	/* Adds an exposure to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	gchar *str_num;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);	
+	if (!tasks_insert_row (&iter))
+		return;
 	str_num = g_strdup_printf ("%d", seq_expno++);
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "Expose",
@@ -622,10 +723,10 @@ void tasks_add_FocusTo (gchar *str)
 {
 	/* Adds a command to move focuser to given position to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "FocusTo",
 						VALUE, str,
@@ -636,10 +737,10 @@ void tasks_add_FocusMove (gchar *str)
 {
 	/* Adds a command to move focuser by given amount to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "FocusMove",
 						VALUE, str,
@@ -650,10 +751,10 @@ void tasks_add_BeginLoop (gchar *str)
 {
 	/* Adds a command to begin a loop to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "BeginLoop",
 						NUM, str,
@@ -664,10 +765,10 @@ void tasks_add_EndLoop (void)
 {
 	/* Adds a command to end a loop to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "EndLoop",
 						-1);	
@@ -677,10 +778,10 @@ void tasks_add_IfTrue (gchar *str)
 {
 	/* Adds a command to begin an If segment to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "IfTrue",
 						VALUE, str,
@@ -691,10 +792,10 @@ void tasks_add_IfFalse (gchar *str)
 {
 	/* Adds a command to begin an If segment to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "IfFalse",
 						VALUE, str,
@@ -705,10 +806,10 @@ void tasks_add_EndIf (void)
 {
 	/* Adds a command to end an If segment to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "EndIf",
 						-1);	
@@ -718,10 +819,10 @@ void tasks_add_While (gchar *str)
 {
 	/* Adds a command to start a while loop to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "While",
 						VALUE, str,
@@ -732,10 +833,10 @@ void tasks_add_EndWhile (void)
 {
 	/* Adds a command to end a while loop to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "EndWhile",
 						-1);	
@@ -745,10 +846,10 @@ void tasks_add_Aug (gboolean on)
 {
 	/* Adds a command to turn autoguider camera on/off to task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, (on ? "AugOn" : "AugOff"),
 						-1);	
@@ -758,10 +859,10 @@ void tasks_add_Guide (gboolean start)
 {
 	/* Adds a command to start/stop autoguiding to task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, (start ? "GuideStart" : "GuideStop"),
 						-1);		
@@ -771,10 +872,10 @@ void tasks_add_GoTo (gchar *str1, gchar *str2)
 {
 	/* Adds a GoTo command to the task list */
 
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "GoTo",
 						RA, str1,
@@ -786,10 +887,10 @@ void tasks_add_Move (gchar *str1, gchar *str2)
 {
 	/* Adds a Move command to the task list */
 
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "Move",
 						RA, str1,
@@ -802,10 +903,10 @@ void tasks_add_Exec (gchar *filename, gboolean Exec)
 	/* Adds an Exec command if Exec == TRUE
 	 * Adds an ExecAsync command if Exec == FALSE
 	 */
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, Exec ? "Exec" : "ExecAsync",
 						VALUE, filename,
@@ -816,10 +917,10 @@ void tasks_add_SetParam (gchar *param, gchar *str)
 {
 	/* Adds a SetParam command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "SetParam",
 						NUM, param,
@@ -831,10 +932,10 @@ void tasks_add_WarmRestart (void)
 {
 	/* Adds a WarmRestart command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "WarmRestart",
 						-1);	
@@ -844,10 +945,10 @@ void tasks_add_ParkMount (void)
 {
 	/* Adds a ParkMount command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "ParkMount",
 						-1);
@@ -857,10 +958,10 @@ void tasks_add_Record (gboolean record)
 {
 	/* Adds a command to start/stop recording to task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, (record ? "RecordStart" : "RecordStop"),
 						-1);	
@@ -870,10 +971,10 @@ void tasks_add_YellowButton (void)
 {
 	/* Adds a YellowButton command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "YellowButton",
 						-1);	
@@ -883,10 +984,10 @@ void tasks_add_Shutdown (void)
 {
 	/* Adds a Shutdown command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "Shutdown",
 						-1);		
@@ -896,10 +997,10 @@ void tasks_add_Exit (void)
 {
 	/* Adds an Exit command to the task list */
 	
-	GtkTreeIter s_iter, iter;
+	GtkTreeIter iter;
 	
-	gtk_list_store_insert_after (lisTasks, &iter, get_selected_iter (&s_iter));
-	select_current_row (&iter);
+	if (!tasks_insert_row (&iter))
+		return;
 	gtk_list_store_set (lisTasks, &iter,
 						TASK, "Exit",
 						-1);		
@@ -907,93 +1008,375 @@ void tasks_add_Exit (void)
 
 void tasks_activate_watch (void)
 {
-	/* Initialise the file modification time variable */
+	/* Start watching the 'watch' file and the drop folder (the watch file
+	 * name with '.d' appended) for incoming task files.  Task files are
+	 * queued when the watch file is written, or when a file is renamed into
+	 * the drop folder, and are executed in turn (see tasks_watch_file).
+	 * Files left in the queue when GoQat last stopped watching are queued
+	 * again, followed by any files already in the drop folder.
+	 */
+	
+	struct stat fileinfo;
+	gchar *folder;
+	
+	tasks_deactivate_watch ();
+	
+	watch.name = g_path_get_basename (WatchFile);
+	watch.drop = g_strconcat (WatchFile, WATCH_DROP, NULL);
+	watch.spool = g_build_filename (watch.drop, WATCH_SPOOL, NULL);
+	watch.done = g_build_filename (watch.drop, WATCH_DONE, NULL);
+	watch.queue = g_queue_new ();
+	watch.cur = NULL;
+	watch.seq = 0;
+	
+	if (g_mkdir_with_parents (watch.spool, 0755) ||
+		g_mkdir_with_parents (watch.done, 0755)) {
+		L_print ("{r}Unable to create folders in %s for queued task files\n",
+				 watch.drop);
+		tasks_deactivate_watch ();
+		return;
+	}
 	
-	time (&mtime);
+	/* The folder holding the watch file is watched rather than the file 
+	 * itself, so that the file may be replaced by renaming another file to
+	 * it.  Only changes made after this point are of interest.
+	 */
+	
+	if ((watch.fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		L_print ("{r}Unable to watch for task files: %s\n", 
+				 g_strerror (errno));
+		tasks_deactivate_watch ();
+		return;
+	}
+	folder = g_path_get_dirname (WatchFile);
+	watch.wd_file = inotify_add_watch (watch.fd, folder, 
+									   IN_CLOSE_WRITE | IN_MOVED_TO);
+	g_free (folder);
+	watch.wd_drop = inotify_add_watch (watch.fd, watch.drop, 
+									   IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (watch.wd_file < 0 || watch.wd_drop < 0) {
+		L_print ("{r}Unable to watch for task files: %s\n", 
+				 g_strerror (errno));
+		tasks_deactivate_watch ();
+		return;
+	}
+	
+	if (!stat (WatchFile, &fileinfo))
+		watch.mtime = fileinfo.st_mtim;
+	else
+		watch.mtime.tv_sec = watch.mtime.tv_nsec = 0;
+	
+	tasks_watch_scan (watch.spool, FALSE);
+	tasks_watch_scan (watch.drop, TRUE);
+}
+
+void tasks_deactivate_watch (void)
+{
+	/* Stop watching for task files.  Queued files remain in the queue folder
+	 * and are queued again when watching is next activated.  If a file is 
+	 * being executed, it is recorded as unfinished; the task list carries on
+	 * regardless.
+	 */
+	
+	struct watch_script *ws;
+	
+	if (watch.cur)
+		tasks_watch_record ("Unfinished");
+	
+	if (watch.queue) {
+		while ((ws = g_queue_pop_head (watch.queue))) {
+			g_free (ws->name);
+			g_free (ws->path);
+			g_free (ws);
+		}
+		g_queue_free (watch.queue);
+		watch.queue = NULL;
+	}
+	
+	if (watch.fd >= 0) {
+		close (watch.fd);
+		watch.fd = -1;
+	}
+	
+	g_free (watch.name);
+	g_free (watch.drop);
+	g_free (watch.spool);
+	g_free (watch.done);
+	watch.name = watch.drop = watch.spool = watch.done = NULL;
 }
 
 void tasks_watch_file (void)
 {
-	/* Watch the specified file, load the contents into the task list if the
-	 * file is updated and execute the tasks.
+	/* Called on each iteration of the event loop whilst watching for task
+	 * files.  Queue any new task files, and when the task list is not active,
+	 * load the next file in the queue into the task list and execute it.
+	 * When a queued file has been executed, a completion record is written
+	 * with the same name in the 'done' folder of the drop folder.
 	 */
 	
-	struct stat fileinfo;
-	gboolean error;
+	struct watch_script *ws;
 	
-	/* If the task list is already running, return without doing anything */
+	if (watch.fd < 0)
+		return;
+	
+	tasks_watch_events ();
 	
-	if (tasks_get_status () & TSK_ACTIVE)
+	/* Return if the task list is active, first recording the completion of
+	 * the file that was executing, if it has finished.
+	 */
+	
+	if ((tasks_get_status () & TSK_ACTIVE) || 
+		((Flags.Task & T_START) && !(Flags.Task & T_STOP)))
 		return;
-		
-	/* If the 'watch' file doesn't exist, return without doing anything */
+	if (watch.cur)
+		tasks_watch_record ((Flags.Task & T_USERSTOP) ? "Stopped" : "Done");
 	
-	if (!g_file_test (WatchFile, G_FILE_TEST_EXISTS))
+	if (!(ws = g_queue_pop_head (watch.queue)))
 		return;
-		
-	/* Compare the latest modification time of the file with its previous
-	 * value.  If it's been modified, load the contents into the task list
-	 * and execute it.
-	 */
 	
-	if (stat (WatchFile, &fileinfo) < 0) {
-		L_print ("{r}Unable to get modification time for watched file\n");
+	/* Load the next file into the task list and execute it */
+	
+	watch.cur = ws;
+	time (&ws->started);
+	tasks_clear ();
+	if (!tasks_load_file (ws->path)) {
+		tasks_watch_record ("Errors");
 		return;
 	}
 	
-	if (difftime (fileinfo.st_mtime, mtime) > 0.0) { /* File has been modified*/
-		mtime = fileinfo.st_mtime;
-		tasks_clear ();
-		tasks_load_file (WatchFile);
-		
-		/* Check for errors in task list */
-		
-		L_print ("{b}Checking task list for errors...\n");
+	/* Check for errors in task list */
+	
+	L_print ("{b}Checking task list %s for errors...\n", ws->name);
+	
+	/* Start tasks if no error */
+	
+	if (tasks_check_tasks ()) {
+		set_task_buttons (TRUE);
 		tasks_start ();
-		while (tasks_execute_tasks (TRUE, &error))
-			;
-		
-		/* Start tasks if no error */
-		
-		if (!error) {
-			//L_print ("{b}Task list OK\n");
-			set_task_buttons (TRUE);
-			tasks_start ();
-			//L_print ("{b}\n\nTask execution STARTED for GoQat %s...\n",VERSION);
+	} else {
+		L_print ("{o}Task list contains errors. Can't execute tasks!\n");
+		tasks_watch_record ("Errors");
+	}
+}
+
+static void tasks_watch_events (void)
+{
+	/* Read the pending inotify events and queue the task files that they 
+	 * report.  The watch file is queued if it was closed after writing or 
+	 * renamed into place, unless it hasn't changed since it was last queued
+	 * (e.g. two events were pending for it).  Files whose names begin with 
+	 * '.' are ignored in the drop folder, so that they may be written there
+	 * before being renamed.  If events were lost, look for changes directly.
+	 */
+	
+	struct inotify_event *ev;
+	struct stat fileinfo;
+	gchar buf[4096] __attribute__ ((aligned (__alignof__ 
+											 (struct inotify_event))));
+	gchar *path;
+	ssize_t len, i;
+	gboolean Changed = FALSE;
+	
+	while ((len = read (watch.fd, buf, sizeof (buf))) > 0) {
+		for (i = 0; i < len; i += sizeof (struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) (buf + i);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				tasks_watch_scan (watch.drop, TRUE);
+				Changed = TRUE;
+			} else if (!ev->len || (ev->mask & IN_ISDIR)) {
+				continue;
+			} else if (ev->wd == watch.wd_file) {
+				if (!strcmp (ev->name, watch.name))
+					Changed = TRUE;
+			} else if (ev->wd == watch.wd_drop && ev->name[0] != '.') {
+				path = g_build_filename (watch.drop, ev->name, NULL);
+				tasks_watch_queue (path, ev->name, ++watch.seq, TRUE);
+				g_free (path);
+			}
+		}
+	}
+	
+	if (Changed && !stat (WatchFile, &fileinfo) &&
+		(fileinfo.st_mtim.tv_sec != watch.mtime.tv_sec ||
+		 fileinfo.st_mtim.tv_nsec != watch.mtime.tv_nsec)) {
+		watch.mtime = fileinfo.st_mtim;
+		tasks_watch_queue (WatchFile, watch.name, ++watch.seq, FALSE);
+	}
+}
+
+static void tasks_watch_scan (const gchar *folder, gboolean Move)
+{
+	/* Queue the files in the given folder in order of name.  If Move is TRUE,
+	 * the folder is the drop folder and the files are moved to the queue; 
+	 * otherwise it is the queue folder itself, whose files are named after
+	 * their sequence numbers, and watch.seq is set to follow the last of them.
+	 */
+	
+	GDir *dir;
+	GPtrArray *names;
+	const gchar *name;
+	gchar *path, *end;
+	guint i, seq;
+	
+	if (!(dir = g_dir_open (folder, 0, NULL)))
+		return;
+	names = g_ptr_array_new ();
+	while ((name = g_dir_read_name (dir))) {
+		path = g_build_filename (folder, name, NULL);
+		if (name[0] != '.' && g_file_test (path, G_FILE_TEST_IS_REGULAR))
+			g_ptr_array_add (names, g_strdup (name));
+		g_free (path);
+	}
+	g_dir_close (dir);
+	g_ptr_array_sort (names, (GCompareFunc) tasks_watch_compare);
+	
+	for (i = 0; i < names->len; i++) {
+		name = g_ptr_array_index (names, i);
+		path = g_build_filename (folder, name, NULL);
+		if (Move) {
+			tasks_watch_queue (path, name, ++watch.seq, TRUE);
+		} else {
+			seq = (guint) strtoul (name, &end, 10);
+			if (*end == '_') {
+				watch.seq = MAX (watch.seq, seq);
+				tasks_watch_queue (path, end + 1, seq, FALSE);
+			}
+		}
+		g_free (path);
+		g_free (g_ptr_array_index (names, i));
+	}
+	g_ptr_array_free (names, TRUE);
+}
+
+static void tasks_watch_queue (const gchar *path, const gchar *name, 
+                               guint seq, gboolean Move)
+{
+	/* Add a task file to the queue.  A file in the drop folder is renamed 
+	 * into the queue folder (Move is TRUE); the watch file is copied there,
+	 * so that it may be written again straight away.  The queued file is
+	 * named after its sequence number and the name of the original file.
+	 * A file that is already in the queue folder is just added to the queue.
+	 */
+	
+	struct watch_script *ws;
+	gchar *spool, *buffer = NULL;
+	gsize len;
+	
+	spool = g_strdup_printf ("%s/%06u_%s", watch.spool, seq, name);
+	if (strcmp (path, spool)) {
+		if (Move) {
+			if (g_rename (path, spool)) {
+				L_print ("{r}Unable to queue task file %s: %s\n", path,
+						 g_strerror (errno));
+				g_free (spool);
+				return;
+			}
+		} else if (!g_file_get_contents (path, &buffer, &len, NULL) ||
+				   !g_file_set_contents (spool, buffer, len, NULL)) {
+			L_print ("{r}Unable to queue task file %s\n", path);
+			g_free (buffer);
+			g_free (spool);
+			return;
 		} else
-			L_print ("{o}Task list contains errors. Can't execute tasks!\n");
+			g_free (buffer);
 	}
+	
+	ws = g_new0 (struct watch_script, 1);
+	ws->name = g_strdup (name);
+	ws->path = spool;
+	ws->seq = seq;
+	time (&ws->queued);
+	g_queue_push_tail (watch.queue, ws);
+	L_print ("{b}Queued task file %s (%d waiting)\n", name, 
+			 g_queue_get_length (watch.queue));
 }
 
-gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
+static void tasks_watch_record (const gchar *status)
 {
-	/* Execute the next task in the list, if no other tasks are currently
-	 * in progress.
+	/* Write the completion record for the task file being executed, and 
+	 * remove it from the queue folder.  The record is named after the file as
+	 * submitted, so a record for the watch file is replaced each time; its
+	 * sequence number shows which submission it refers to.  It is written to
+	 * a temporary file and renamed, so that it appears complete.
 	 */
 	
-	struct cam_img *ccd = get_ccd_image_struct ();
-	struct cam_img *aug = get_aug_image_struct ();
+	struct watch_script *ws = watch.cur;
+	time_t now;
+	gchar queued[24], started[24], finished[24];
+	gchar *path, *record;
+	
+	time (&now);
+	strftime (queued, sizeof (queued), "%Y-%m-%dT%H:%M:%S", 
+			  gmtime (&ws->queued));
+	strftime (started, sizeof (started), "%Y-%m-%dT%H:%M:%S", 
+			  gmtime (&ws->started));
+	strftime (finished, sizeof (finished), "%Y-%m-%dT%H:%M:%S", 
+			  gmtime (&now));
+	record = g_strdup_printf ("File      %s\nSequence  %u\nQueued    %s\n"
+							  "Started   %s\nFinished  %s\nStatus    %s\n",
+							  ws->name, ws->seq, queued, started, finished, 
+							  status);
+	path = g_build_filename (watch.done, ws->name, NULL);
+	if (!g_file_set_contents (path, record, -1, NULL))
+		L_print ("{r}Unable to write completion record %s\n", path);
+	g_free (path);
+	g_free (record);
+	
+	if (strcmp (status, "Done"))
+		L_print ("{o}Task file %s: %s\n", ws->name, status);
+	g_remove (ws->path);
+	g_free (ws->name);
+	g_free (ws->path);
+	g_free (ws);
+	watch.cur = NULL;
+}
+
+static gint tasks_watch_compare (gconstpointer a, gconstpointer b)
+{
+	/* Compare file names for sorting by tasks_watch_scan */
+	
+	return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+gboolean tasks_check_tasks (void)
+{
+	/* Compile the task list and check it for errors without executing any
+	 * tasks.  Each task is checked once in list order; no rows are selected
+	 * and nothing in the UI is changed apart from the error messages.  Return
+	 * TRUE if the task list is free of errors.
+	 */
+	
+	gint i;
+	guint flags;
+	
+	/* Task parameters and entry values are checked in TestOnly mode while
+	 * the task list appears to be active.
+	 */
+	
+	flags = Flags.Task;
+	Flags.Task |= (T_NEXT | T_TESTONLY);
+	
+	tasks_compile ();
+	prog.Error = prog.Invalid;
+	for (i = 0; i < prog.n; i++)
+		tasks_do_task (&prog.ops[i], TRUE);
+	
+	Flags.Task = flags;
+	return !prog.Error;
+}
+
+gboolean tasks_execute_tasks (void)
+{
+	/* Execute the next task in the compiled task list, if no other tasks are
+	 * currently in progress.
+	 */
 	
-	struct exposure_data exd;
-	struct focus f;
-	static GtkTreeIter iter;
-	GtkTreePath *path;
 	guint elapsed;
-	static gint line = 0;
-	gint i, n, o, intval;
-	gdouble val, val1;
-	static gchar *stra[15];
-	static gchar sRA[9], sDec[10];
-	static gchar obj[128];
-	gchar *tp[NUMTPARAMS];
-	gboolean IsExec, BadFilter;
-	static gboolean WhileBreak = FALSE;
-	static gboolean Error = FALSE;
-	static gboolean GetNextIter = TRUE;
 	
 	elapsed = (guint) floor ((loop_elapsed_since_first_iteration () - 
 							                               seq_start) / 1000.0);
-	set_elapsed_time (elapsed);
+	if (ui.set_elapsed)
+		ui.set_elapsed (elapsed);
 	
 	/* Return if task execution is stopped */
 
@@ -1010,97 +1393,371 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 	if (Flags.Task & T_EXEC)
 		return TRUE;
 
-	/* Get the first task */
+	/* Go to the first task.  Tasks are not executed if the list has errors
+	 * in its loop, If or While statements.
+	 */
 	
 	if (Flags.Task & T_START) {
-		Flags.Task &= ~T_START;
-		if (TestOnly)
-			Flags.Task |= T_TESTONLY;
-		else
-			Flags.Task &= ~T_TESTONLY;
-		if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (lisTasks), &iter)) {
+		Flags.Task &= ~(T_START | T_TESTONLY);
+		prog.pc = 0;
+		prog.Error = prog.Invalid;
+		if (prog.n)
 			Flags.Task |= T_NEXT;
-		    line = 0;
-			Error = FALSE;
-		} else
+		else
 			Flags.Task &= ~T_NEXT;
 	}
 
 	if (Flags.Task & T_NEXT) {
-		line++;
 		
-		/* Select the row */
+		/* Show the task in the list (which can't be changed while it runs) */
 	
-		path = gtk_tree_model_get_path (GTK_TREE_MODEL (lisTasks), &iter);
-		gtk_tree_view_set_cursor (trvTasks, path, NULL, FALSE);
-	
-		/* Scroll selected row to top of window */
-
-		gtk_tree_view_scroll_to_cell (trvTasks, path, NULL, TRUE, 0.0, 0.0);
-		gtk_tree_path_free (path);
+		if (ui.show_task)
+			ui.show_task (prog.ops[prog.pc].line);
+		
+		/* Schedule the task to be done and move on to the next one */
 		
-		/* Get the task type */
+		prog.pc = tasks_do_task (&prog.ops[prog.pc], FALSE);
+		if (prog.pc >= prog.n)
+			Flags.Task &= ~T_NEXT;  /* Must have reached end of list */
 			
-		gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-							TASK, &task.type,
-							-1);			
+	} else {
+		L_print ("{b}Task execution FINISHED\n");
+		tasks_stop (FALSE);
+		finished_tasks ();
+	}
+	
+	return Flags.Task & T_NEXT;
+}
 
-		/* Schedule the task to be done */	
+static void tasks_compile (void)
+{
+	/* Compile the task list into an array of operations.  The list store is
+	 * read once here rather than on every iteration of the event loop, and 
+	 * the jumps for loops, If and While statements are resolved so that
+	 * executing a task is just a switch on the operation and a new index.
+	 */
+	
+	GtkTreeModel *model = GTK_TREE_MODEL (lisTasks);
+	GtkTreeIter iter;
+	struct task_op *op;
+	gint i, k, depth, nest;
+	gint *open;
+	gchar *s;
+	gboolean valid;
+	
+	tasks_free_program ();
+	
+	prog.n = gtk_tree_model_iter_n_children (model, NULL);
+	prog.ops = g_new0 (struct task_op, MAX (prog.n, 1));
+	open = g_new (gint, MAX (prog.n, 1)); /* Unclosed loop/If/While stack */
+	depth = 0;
+	nest = 0;
+	
+	valid = gtk_tree_model_get_iter_first (model, &iter);
+	for (i = 0; valid; i++, valid = gtk_tree_model_iter_next (model,&iter)) {
+		op = &prog.ops[i];
+		for (k = 0; k < N_TASKCOLS; k++) {
+			gtk_tree_model_get (model, &iter, k, &s, -1);
+			op->arg[k] = s ? g_strstrip (s) : NULL;
+		}
+		for (op->op = 0; op->op < OP_INVALID; op->op++)
+			if (op->arg[TASK] && !strcmp (op->arg[TASK], task_names[op->op]))
+				break;
+		op->line = i + 1;
+		op->jump = -1;
+		tasks_compile_args (op);
 		
-		if (!(strcmp (task.type, "Object"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],
-								-1);
-			strcpy (obj, g_strstrip (stra[0]));
-			stra[0] = get_task_param_value (FALSE, g_strstrip (stra[0]), &n);
-			strcpy (obj, stra[0]);
-			if (!strcmp (obj, "")) {
+		switch (op->op) {
+			case OP_BEGINLOOP:
+				if (++nest > MAX_NEST) {
+					L_print ("{r}Task 'BeginLoop' exceeds maximum nesting "
+							 "depth at line %d\n", op->line);
+					prog.Invalid = TRUE;
+				}
+				/* Fall through: a loop is also a block to be closed */
+			case OP_IFTRUE:
+			case OP_IFFALSE:
+			case OP_WHILE:
+				open[depth++] = i;
+				break;
+			case OP_ENDLOOP:
+			case OP_ENDIF:
+			case OP_ENDWHILE:
+				if (!depth) {
+					L_print ("{r}Task '%s' has no corresponding '%s' at "
+							 "line %d\n", op->arg[TASK], 
+							 op->op == OP_ENDLOOP ? "BeginLoop" :
+							 op->op == OP_ENDIF ? "If" : "While", op->line);
+					prog.Invalid = TRUE;
+					break;
+				}
+				k = open[--depth];
+				if (prog.ops[k].op == OP_BEGINLOOP)
+					nest--;
+				if (op->op == OP_ENDLOOP && prog.ops[k].op == OP_BEGINLOOP)
+					op->jump = k + 1;        /* Repeat after BeginLoop    */
+				else if (op->op == OP_ENDIF && (prog.ops[k].op == OP_IFTRUE ||
+											   prog.ops[k].op == OP_IFFALSE))
+					prog.ops[k].jump = i;    /* Skip If to EndIf          */
+				else if (op->op == OP_ENDWHILE && prog.ops[k].op == OP_WHILE) {
+					op->jump = k;            /* Back to While...          */
+					prog.ops[k].jump = i + 1;/*  ...or skip past EndWhile */
+				} else {
+					L_print ("{r}Unclosed BeginLoop, If or While statement "
+							 "at line %d\n", op->line);
+					prog.Invalid = TRUE;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	
+	if (depth) {
+		L_print ("{r}There are BeginLoop, If or While statements with no "
+				 "corresponding EndLoop, EndIf or EndWhile statements!\n");
+		prog.Invalid = TRUE;
+	}
+	
+	g_free (open);
+	prog.Stale = FALSE;
+}
+
+static void tasks_free_program (void)
+{
+	/* Free the compiled task list */
+	
+	gint i, k;
+	
+	for (i = 0; i < prog.n; i++)
+		for (k = 0; k < N_TASKCOLS; k++)
+			g_free (prog.ops[i].arg[k]);
+	g_free (prog.ops);
+	prog.ops = NULL;
+	prog.n = 0;
+	prog.pc = 0;
+	prog.Invalid = FALSE;
+}
+
+static void tasks_compile_args (struct task_op *op)
+{
+	/* Note which columns of the task name task parameters (%n), and parse 
+	 * and range-check the numeric arguments of the task (see task_args).
+	 * The values of task parameters, and limits set by the hardware, can 
+	 * only be checked when the task is run (see tasks_arg).  Nothing is
+	 * reported here; the task reports any invalid argument when it is
+	 * checked or run.
+	 */
+	
+	guint i;
+	gint k, n;
+	gchar *end;
+	
+	for (k = 0; k < N_TASKCOLS; k++) {
+		op->param[k] = -1;
+		op->OK[k] = TRUE;
+		if (op->arg[k] && op->arg[k][0] == '%') {
+			n = (gint) strtol (op->arg[k] + 1, &end, 10);
+			if (isdigit (op->arg[k][1]) && !*end && n < NUMTPARAMS)
+				op->param[k] = (gshort) n;
+			else
+				op->OK[k] = FALSE;
+		}
+	}
+	
+	for (i = 0; i < G_N_ELEMENTS (task_args); i++) {
+		if (task_args[i].op != op->op || op->param[task_args[i].col] >= 0)
+			continue;
+		k = task_args[i].col;
+		op->OK[k] = tasks_parse_num (op->arg[k], task_args[i].Int, 
+									 &op->num[k]) &&
+					tasks_in_range (op->num[k], task_args[i].min, 
+									task_args[i].max);
+	}
+}
+
+static gboolean tasks_parse_num (const gchar *s, gboolean Int, gdouble *val)
+{
+	/* Parse a number as typed in the task list: an optional minus sign and
+	 * digits with, unless Int is TRUE, at most one decimal point.  Floating
+	 * point values are rounded to 4 d.p. as for the GUI entry fields.
+	 * Returns FALSE if the string isn't such a number.
+	 */
+	
+	const gchar *c;
+	gchar *end;
+	gint decimal = 0;
+	
+	if (!s || !*s || !strcmp (s, "-"))
+		return FALSE;
+	for (c = (*s == '-') ? s + 1 : s; *c; c++) {
+		if (isdigit (*c))
+			continue;
+		if (Int || (*c != '.' && *c != ',') || ++decimal > 1)
+			return FALSE;
+	}
+	
+	if (Int) {
+		errno = 0;
+		*val = (gdouble) strtol (s, &end, 10);
+		return !errno && *val >= G_MININT && *val <= G_MAXINT;
+	}
+	*val = rint (strtod (s, &end) * 10000.0) / 10000.0;
+	return TRUE;
+}
+
+static gboolean tasks_in_range (gdouble val, gdouble min, gdouble max)
+{
+	/* Return TRUE if val lies between min and max, comparing to 4 d.p. */
+	
+	return rint (val * 10000.0) >= rint (min * 10000.0) && 
+		   rint (val * 10000.0) <= rint (max * 10000.0);
+}
+
+static gboolean tasks_arg (struct task_op *op, enum TaskQ col, gboolean Int,
+                           gdouble min, gdouble max, gdouble *val)
+{
+	/* Return the value of a numeric argument of a task if it lies between
+	 * min and max.  An argument that names a task parameter takes the 
+	 * parameter's current value; when the task list is only being checked,
+	 * the parameter may not have been set yet, so it is taken to be valid
+	 * (with the value min).
+	 */
+	
+	gchar *tp[NUMTPARAMS];
+	
+	if (!op->OK[col])
+		return FALSE;
+	if (op->param[col] < 0) {
+		*val = op->num[col];
+		return tasks_in_range (*val, min, max);
+	}
+	if (Flags.Task & T_TESTONLY) {
+		*val = min;
+		return TRUE;
+	}
+	get_task_params (tp);
+	if (!tasks_parse_num (tp[op->param[col]], Int, val) || 
+		!tasks_in_range (*val, min, max)) {
+		L_print ("{r}Task parameter %%%d has invalid value '%s'\n", 
+				 op->param[col], tp[op->param[col]] ? tp[op->param[col]] : "");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean tasks_arg_int (struct task_op *op, enum TaskQ col, gint min,
+                               gint max, gint *val)
+{
+	/* Return the value of an integer argument of a task (see tasks_arg) */
+	
+	gdouble v;
+	
+	if (!tasks_arg (op, col, TRUE, min, max, &v))
+		return FALSE;
+	*val = (gint) v;
+	return TRUE;
+}
+
+static gchar *tasks_arg_string (struct task_op *op, enum TaskQ col)
+{
+	/* Return a text argument of a task, or the current value of the task
+	 * parameter that it names.
+	 */
+	
+	gchar *tp[NUMTPARAMS];
+	
+	if (op->param[col] < 0)
+		return op->arg[col];
+	get_task_params (tp);
+	return tp[op->param[col]] ? tp[op->param[col]] : "";
+}
+
+static void tasks_list_changed (GtkTreeModel *model)
+{
+	/* Called when a row of the task list is changed, inserted, deleted or
+	 * moved.  The task list is compiled again before it is next started.
+	 */
+	
+	prog.Stale = TRUE;
+}
+
+static gint tasks_do_task (struct task_op *op, gboolean TestOnly)
+{
+	/* Check the given task and, unless TestOnly is TRUE, schedule it to be
+	 * done.  Return the index of the next task to be executed.  Numeric
+	 * arguments were parsed when the list was compiled; task parameters and
+	 * limits set by the hardware are checked here (see tasks_arg).
+	 */
+	
+	struct cam_img *ccd = get_ccd_image_struct ();
+	struct cam_img *aug = get_aug_image_struct ();
+	
+	struct exposure_data exd;
+	struct focus f;
+	guint elapsed;
+	gint line = op->line, next = op - prog.ops + 1;
+	gint i, o, intval;
+	gdouble val, val1;
+	gchar *stra[3], *s;
+	static gchar sRA[9], sDec[10];
+	static gchar obj[128];
+	gchar *tp[NUMTPARAMS];
+	gboolean IsExec, BadFilter;
+	
+	switch (op->op) {
+		case OP_OBJECT:
+			s = tasks_arg_string (op, VALUE);
+			g_strlcpy (obj, s ? s : "", sizeof (obj));
+			if (!op->OK[VALUE]) {
+				L_print ("{r}Task 'Object' has invalid task parameter at "
+						 "line %d\n", line);
+				prog.Error = TRUE;
+			} else if (!strcmp (obj, "") && 
+					   !(TestOnly && op->param[VALUE] >= 0)) {
 				L_print ("{r}Task 'Object' has missing name at line %d\n",
 						 line);
-				Error = TRUE;
-			}
-			if (n < 0)  /* Invalid task parameter */
-				Error = TRUE;
-			if (!TestOnly && !Error) {
-				L_print ("{b}TASK Object %s\n", obj);			
-				set_entry_string ("txtObject", obj);
-				set_entry_string ("txtCCDFile", obj);
-				set_entry_string ("txtAUGFile", obj);
-			}
-		} else if (!(strcmp (task.type, "BeginSequence"))) {
-			if (!TestOnly && !Error) {
+				prog.Error = TRUE;
+			}
+			if (!TestOnly && !prog.Error) {
+				L_print ("{b}TASK Object %s\n", obj);
+				if (ui.set_field) {
+					ui.set_field ("txtObject", obj);
+					ui.set_field ("txtCCDFile", obj);
+					ui.set_field ("txtAUGFile", obj);
+				}
+			}
+			break;
+		case OP_BEGINSEQUENCE:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK BeginSequence\n");			
 				seq_start = loop_elapsed_since_first_iteration ();
 			}
-		} else if (!(strcmp (task.type, "WaitUntil"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								TASK_TIME, &stra[0],
-								-1);
-			if (!get_entry_float (g_strstrip (stra[0]), 
-								  WAI_MIN, WAI_MAX, WAI_DEF, 
-								  TSK_PAGE, &task.time)) {
+			break;
+		case OP_WAITUNTIL:
+			if (!tasks_arg (op, TASK_TIME, FALSE, WAI_MIN, WAI_MAX, 
+							&task.time)) {
 				L_print ("{r}Task 'WaitUntil' has invalid number of "
 						 "seconds at line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK WaitUntil %.1fs\n", task.time);			
 				Flags.Type = T_WTU;
 				Flags.Task |= T_EXEC;
 				loop_tasks_wait ();
 			}
-		} else if (!(strcmp (task.type, "PauseFor"))) {	
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								TASK_TIME, &stra[0],
-								-1);
-			if (!get_entry_float (g_strstrip (stra[0]), 
-							      WAI_MIN, WAI_MAX, WAI_DEF, 
-							      TSK_PAGE, &task.time)) {
+			break;
+		case OP_PAUSEFOR:	
+			if (!tasks_arg (op, TASK_TIME, FALSE, WAI_MIN, WAI_MAX, 
+							&task.time)) {
 				L_print ("{r}Task 'PauseFor' has invalid number of seconds "
 						 "at line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
+				elapsed = (guint) floor ((loop_elapsed_since_first_iteration () 
+				                                         - seq_start) / 1000.0);
 				L_print ("{b}TASK PauseFor %.1fs (starting at %ds elapsed)\n", 
 														    task.time, elapsed);			
 				task.now = loop_elapsed_since_first_iteration ();
@@ -1108,55 +1765,46 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 				Flags.Task |= T_EXEC;
 				loop_tasks_pause ();
 			}
-		} else if (!(strcmp (task.type, "At"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								RA, &stra[0],
-								-1);
-			strcpy (sRA, g_strstrip (stra[0]));
-			if (!check_format (TRUE, sRA)) {
+			break;
+		case OP_AT:
+			s = tasks_arg_string (op, RA);
+			g_strlcpy (sRA, s ? s : "", sizeof (sRA));
+			if (!op->OK[RA] || (!(TestOnly && op->param[RA] >= 0) && 
+								!check_format (TRUE, sRA))) {
 				L_print ("{r}Task 'At' has invalid time at line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK At %s\n", sRA);
 				task.time = (gdouble) stof_RA (sRA) * 12.0 / M_PI;
 				Flags.Type = T_EAT;
 				Flags.Task |= T_EXEC;
 				loop_tasks_at ();
 			}
-		} else if (!(strcmp (task.type, "Expose"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								EXP_TYPE, &stra[0],
-								FILTER, &stra[1],
-								TASK_TIME, &stra[2],
-								H1, &stra[3],
-								V1, &stra[4],
-								H2, &stra[5],
-								V2, &stra[6],
-								H_BIN, &stra[7],
-								V_BIN, &stra[8],
-								CCDTEMP, &stra[9],
-								NUM, &stra[10],
-								-1);
+			break;
+		case OP_EXPOSE:
+			stra[0] = op->arg[EXP_TYPE];
+			stra[1] = op->arg[FILTER];
+			stra[2] = op->arg[NUM];
 			if (!menu.OpenCCDCam) {
 				L_print ("{r}Task 'Expose' at line %d requires CCD camera "
 						 "to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
 			
 			if (menu.OpenCCDCam) {
 				
-				exd.ExpType = g_strstrip (stra[0]);
+				exd.ExpType = stra[0];
 				if (strcmp ("TARGET", exd.ExpType) && 
 					strcmp ("FLAT", exd.ExpType) &&
 					strcmp ("DARK", exd.ExpType) && 
 					strcmp ("BIAS", exd.ExpType)) {
 						L_print ("{r}Task 'Expose' has invalid exposure "
 								 "type at line %d\n", line);
-						Error = TRUE;
+						prog.Error = TRUE;
 				}
 				
-				exd.filter = g_strstrip (stra[1]);
+				exd.filter = stra[1];
 				if (strcmp (exd.filter, "-")) {
 					BadFilter = FALSE;
 					if (!strcmp (menu.filterwheel, "filterwheel_int")) {
@@ -1166,124 +1814,116 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 							L_print ("{r}Task 'Expose': CCD camera does not "
 							         "have internal filter wheel at line %d\n",
 							         line);
-							Error = TRUE;
+							prog.Error = TRUE;
 						}
 					} else if (filter_is_open ())
 						BadFilter = !get_filter_info (NULL, exd.filter, &i, &o);
 					else {
 						L_print ("{r}Task 'Expose' at line %d requires filter "
 								 "wheel to be open\n", line);
-						Error = TRUE;
+						prog.Error = TRUE;
 					}
 						
 					if (BadFilter) {
 						L_print ("{r}Task 'Expose': Filter not found at "
 								 "line %d\n", line);
-						Error = TRUE;
+						prog.Error = TRUE;
 					}
 				}
 				
-				if (!get_entry_float (g_strstrip (stra[2]), 
-									  ccd->cam_cap.min_exp, 
-									  ccd->cam_cap.max_exp, 1.0, TSK_PAGE, 
-									  &exd.req_len)) {
+				if (!tasks_arg (op, TASK_TIME, FALSE, ccd->cam_cap.min_exp, 
+								ccd->cam_cap.max_exp, &exd.req_len)) {
 					L_print ("{r}Task 'Expose' has invalid exposure time at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				}
 				
-				if (!get_entry_int (g_strstrip (stra[3]), 1,
-									ccd->cam_cap.max_h - 1, 1, TSK_PAGE, 
+				if (!tasks_arg_int (op, H1, 1, ccd->cam_cap.max_h - 1, 
 									&intval)) {
 					L_print ("{r}Task 'Expose' has invalid H1 coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 				    exd.h_top_l = (gushort) intval;
 
-				if (!get_entry_int (g_strstrip (stra[4]), 1,
-									ccd->cam_cap.max_v - 1, 1, TSK_PAGE,
+				if (!tasks_arg_int (op, V1, 1, ccd->cam_cap.max_v - 1, 
 									&intval)) {
 					L_print ("{r}Task 'Expose' has invalid V1 coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 					exd.v_top_l = (gushort) intval;
 				
-				if (!get_entry_int (g_strstrip (stra[5]), exd.h_top_l + 1, 
-									ccd->cam_cap.max_h, ccd->cam_cap.max_h, 
-								    TSK_PAGE, &intval)) {
+				if (!tasks_arg_int (op, H2, exd.h_top_l + 1, 
+									ccd->cam_cap.max_h, &intval)) {
 					L_print ("{r}Task 'Expose' has invalid H2 coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 				    exd.h_bot_r = (gushort) intval;				
 				
-				if (!get_entry_int (g_strstrip (stra[6]), exd.v_top_l + 1,
-									ccd->cam_cap.max_v, ccd->cam_cap.max_v,
-									TSK_PAGE, &intval)) {
+				if (!tasks_arg_int (op, V2, exd.v_top_l + 1, 
+									ccd->cam_cap.max_v, &intval)) {
 					L_print ("{r}Task 'Expose' has invalid V2 coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 				    exd.v_bot_r = (gushort) intval;	
 				
-				if (!get_entry_int (g_strstrip (stra[7]), 1,
-									ccd->cam_cap.max_binh, 1, TSK_PAGE, 
+				if (!tasks_arg_int (op, H_BIN, 1, ccd->cam_cap.max_binh, 
 									&intval)) {
 					L_print ("{r}Task 'Expose' has invalid H-bin coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 				    exd.h_bin = (gushort) intval;
 				
-				if (!get_entry_int (g_strstrip (stra[8]), 1,
-									ccd->cam_cap.max_binv, 1, TSK_PAGE, 
+				if (!tasks_arg_int (op, V_BIN, 1, ccd->cam_cap.max_binv, 
 									&intval)) {
 					L_print ("{r}Task 'Expose' has invalid V-bin coordinate at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				} else
 				    exd.v_bin = (gushort) intval;
 
-				if (!get_entry_float (g_strstrip (stra[9]), TPR_MIN, TPR_MAX, 
-									  TPR_DEF, TSK_PAGE, &exd.ccdtemp)) {
+				if (!tasks_arg (op, CCDTEMP, FALSE, TPR_MIN, TPR_MAX, 
+								&exd.ccdtemp)) {
 					L_print ("{r}Task 'Expose' has invalid CCD temperature at "
 							 "line %d\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				}
 			}
 			
 			/* Start the exposure */
 			
-			if (!TestOnly && !Error) {
-				L_print ("{b}TASK Expose (%s)\n", stra[10]);
+			if (!TestOnly && !prog.Error) {
+				L_print ("{b}TASK Expose (%s)\n", stra[2]);
+				g_free (prog.exptype);
+				g_free (prog.filter);
+				exd.ExpType = prog.exptype = g_strdup (exd.ExpType);
+				exd.filter = prog.filter = g_strdup (exd.filter);
 				ccdcam_set_exposure_data (&exd);
 				Flags.Type = T_EXP;
 				Flags.Task |= T_EXEC;
 				loop_ccd_start ();
 			}
-		} else if (!(strcmp (task.type, "FocusTo"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],  
-								-1);
+			break;
+		case OP_FOCUSTO:
 			if (!menu.OpenFocusPort) {
 				L_print ("{r}Task 'FocusTo' at line %d requires focuser link "
 						 "to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else {
 				f.cmd = FC_MAX_TRAVEL_GET;
 				focus_comms->focus (&f);
-				if (!get_entry_int (g_strstrip (stra[0]), 
-									1, f.max_travel, f.max_travel / 2, 
-									TSK_PAGE, &f.move_to)) {
+				if (!tasks_arg_int (op, VALUE, 1, f.max_travel, &f.move_to)) {
 				    L_print ("{r}Task 'FocusTo' has invalid focuser position "
 							 "at line %d\n", line);
-				    Error = TRUE;
+				    prog.Error = TRUE;
 			    }
 			}
 			
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK FocusTo %d\n", f.move_to);
 				Flags.Type = T_FOC;
 				Flags.Task |= T_EXEC;
@@ -1291,33 +1931,30 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 				focus_comms->focus (&f);
 				loop_focus_check_done ();
 			}
-		} else if (!(strcmp (task.type, "FocusMove"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],  
-								-1);
+			break;
+		case OP_FOCUSMOVE:
 			if (!menu.OpenFocusPort) {
 				L_print ("{r}Task 'FocusMove' at line %d requires focuser link "
 						 "to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else {
 				f.cmd = (FC_MAX_TRAVEL_GET | FC_CUR_POS_GET);
 				focus_comms->focus (&f);
-				if (!get_entry_int (g_strstrip (stra[0]), 
-									-f.max_travel, f.max_travel, 0, 
-									TSK_PAGE, &f.move_by)) {
+				if (!tasks_arg_int (op, VALUE, -f.max_travel, f.max_travel, 
+									&f.move_by)) {
 				    L_print ("{r}Task 'FocusMove' has invalid focuser motion "
 							 "value at line %d\n", line);
-				    Error = TRUE;
-			    }
-				if ((f.cur_pos + f.move_by) < 1 || 
-					(f.cur_pos + f.move_by) > f.max_travel) {
+				    prog.Error = TRUE;
+			    } else if (!(TestOnly && op->param[VALUE] >= 0) &&
+						   ((f.cur_pos + f.move_by) < 1 || 
+							(f.cur_pos + f.move_by) > f.max_travel)) {
 				    L_print ("{r}Task 'FocusMove' has invalid focuser motion "
 							 "value at line %d\n", line);
-				    Error = TRUE;
+				    prog.Error = TRUE;
 			    }
 			}
 			
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK FocusMove %d\n", f.move_by);
 				Flags.Type = T_FOC;
 				Flags.Task |= T_EXEC;
@@ -1325,401 +1962,199 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 				focus_comms->focus (&f);
 				loop_focus_check_done ();
 			}
-		} else if (!(strcmp (task.type, "BeginLoop"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								NUM, &stra[0],  
-								-1);
-			if (!get_entry_int (g_strstrip (stra[0]), 
-							    REP_MIN, REP_MAX, REP_DEF, 
-							    TSK_PAGE, &intval)) {
+			break;
+		case OP_BEGINLOOP:
+			if (!tasks_arg_int (op, NUM, REP_MIN, REP_MAX, &intval)) {
 				L_print ("{r}Task 'BeginLoop' has invalid repeat value at "
 						 "line %d\n", line);
-				Error = TRUE;
-			}
-			
-			++loop.depth;
-			if (TestOnly) {
-				if (loop.depth >= MAX_NEST) {
-					L_print ("{r}Task 'BeginLoop' exceeds maximum nesting "
-							 "depth at line %d\n", line);
-					Error = TRUE;
-				}
-				loop_check[++lc] = EL;
-				lec = lc;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK BeginLoop\n");
+				++loop.depth;
 				loop.repeat[loop.depth] = (gushort) intval;
 				loop.count[loop.depth] = 1;
-				loop.path[loop.depth] = 
-					 gtk_tree_model_get_path (GTK_TREE_MODEL (lisTasks), &iter);
 				L_print ("Loop depth %d, beginning iteration %d...\n",
 								        loop.depth + 1, loop.count[loop.depth]);
 			}
-		} else if (!(strcmp (task.type, "EndLoop"))) {
-			if (TestOnly) {
-				++lec;
-				while (--lec >= 0) {
-					if (loop_check[lec]) {
-						if (loop_check[lec] == EL) {
-							loop_check[lec] = 0;
-						} else {
-							L_print ("{r}Unclosed BeginLoop, If or While "
-									 "statement at line %d\n", line);
-							Error = TRUE;
-						}
-						break;
-					}
-				}
-				if (loop.depth < 0) {
-					L_print ("{r}Task 'EndLoop' has no corresponding "
-							 "'BeginLoop' at line %d\n", line);
-					Error = TRUE;
-				}
-				loop.depth--;
-			} 
-			if (!TestOnly && !Error) {
+			break;
+		case OP_ENDLOOP:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK EndLoop\n");
 				if (loop.depth > -1) {
 					if (loop.count[loop.depth]++ < loop.repeat[loop.depth]){
-						if (loop.path[loop.depth] != NULL)
-							gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), 
-													 &iter, 
-													 loop.path[loop.depth]);
+						next = op->jump;
 						L_print ("Loop depth %d, beginning iteration %d...\n",
 								 loop.depth + 1, loop.count[loop.depth]);
 					} else {
 						L_print ("Loop depth %d, iterations completed\n", 
 															    loop.depth + 1);
-						gtk_tree_path_free (loop.path[loop.depth]);
-						loop.path[loop.depth--] = NULL;
+						loop.depth--;
 					}
 				}
 		    }
-		} else if (!(strcmp (task.type, "IfTrue"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],
-								-1);
-			if (!get_entry_int (g_strstrip (stra[0]), 
-							    G_MININT, G_MAXINT, 0, 
-							    TSK_PAGE, &intval)) {
-				L_print ("{r}Task 'IfTrue' has invalid parameter at "
-						 "line %d\n", line);
-				Error = TRUE;
-			}
-			if (TestOnly) {
-				if (++ip >= MAX_IF) {  /* ip set to -1 initially */
-					L_print ("{r}Task 'IfTrue' exceeds maximum number of "
-							 "statements at line %d\n", line);
-					Error = TRUE;
-				}
-				gtk_list_store_set (lisTasks, &iter,
-									TAG, ip,
-									-1);
-				iep = ip;
-				loop_check[++lc] = EI;
-				lec = lc;
-			}
-			if (!TestOnly && !Error) {
-				L_print ("{b}TASK IfTrue %d\n", intval);			
-				if (!intval) {
-					gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-										TAG, &ip,
-										-1);
-					gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), 
-											 &iter, 
-											 path_endif[ip]);
-					GetNextIter = FALSE;
-				}
-			}
-		} else if (!(strcmp (task.type, "IfFalse"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],
-								-1);
-			if (!get_entry_int (g_strstrip (stra[0]), 
-								G_MININT, G_MAXINT, 0, 
-								TSK_PAGE, &intval)) {
-				L_print ("{r}Task 'IfFalse' has invalid parameter at "
-						 "line %d\n", line);
-				Error = TRUE;
-			}
-			if (TestOnly) {
-				if (++ip >= MAX_IF) {  /* ip set to -1 initially */
-					L_print ("{r}Task 'IfFalse' exceeds maximum number of "
-							 "statements at line %d\n", line);
-					Error = TRUE;
-				}
-				gtk_list_store_set (lisTasks, &iter,
-									TAG, ip,
-									-1);
-				iep = ip;
-				loop_check[++lc] = EI;
-				lec = lc;
-			}
-			if (!TestOnly && !Error) {
-				L_print ("{b}TASK IfFalse %d\n", intval);			
-				if (intval) {
-					gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-										TAG, &ip,
-										-1);
-					gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), 
-											 &iter, 
-											 path_endif[ip]);
-					GetNextIter = FALSE;
-				}
-			}
-		} else if (!(strcmp (task.type, "EndIf"))) {
-			if (TestOnly) {
-				++lec;
-				while (--lec >= 0) {
-					if (loop_check[lec]) {
-						if (loop_check[lec] == EI) {
-							loop_check[lec] = 0;
-						} else {
-							L_print ("{r}Unclosed BeginLoop, If or While "
-									 "statement at line %d\n", line);
-							Error = TRUE;
-						}
-						break;
-					}
-				}
-				path = gtk_tree_model_get_path(GTK_TREE_MODEL (lisTasks),&iter);
-				while (iep >= 0) {
-					if (!path_endif[iep]) {
-						path_endif[iep] = path;
-						gtk_list_store_set (lisTasks, &iter,
-											TAG, iep,
-											-1);
-						break;
-					}
-					iep--;
-				}
-				if (iep < 0) {
-					L_print ("{r}Task 'EndIf' has no corresponding 'If' "
-							 "at line %d\n", line);
-					Error = TRUE;
-				}
-			}
-			if (!TestOnly && !Error) {
+			break;
+		case OP_IFTRUE:
+		case OP_IFFALSE:
+			if (!tasks_arg_int (op, VALUE, G_MININT, G_MAXINT, &intval)) {
+				L_print ("{r}Task '%s' has invalid parameter at line %d\n", 
+						 op->arg[TASK], line);
+				prog.Error = TRUE;
+			}
+			if (!TestOnly && !prog.Error) {
+				L_print ("{b}TASK %s %d\n", op->arg[TASK], intval);
+				if (op->op == OP_IFTRUE ? !intval : intval)
+					next = op->jump;  /* Continue at EndIf */
+			}
+			break;
+		case OP_ENDIF:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK EndIf\n");			
 			}
-		} else if (!(strcmp (task.type, "While"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],
-								-1);
-			if (!get_entry_int (g_strstrip (stra[0]), 
-							    G_MININT, G_MAXINT, 0, 
-							    TSK_PAGE, &intval)) {
+			break;
+		case OP_WHILE:
+			if (!tasks_arg_int (op, VALUE, G_MININT, G_MAXINT, &intval)) {
 				L_print ("{r}Task 'While' has invalid parameter at "
 						 "line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (TestOnly) {
-				if (++wp >= MAX_WHILE) {  /* wp set to -1 initially */
-					L_print ("{r}Task 'While' exceeds maximum number of "
-							 "statements at line %d\n", line);
-					Error = TRUE;
-				}
-				gtk_list_store_set (lisTasks, &iter,
-									TAG, wp,
-									-1);
-				wep = wp;
-				path_while[wp] = gtk_tree_model_get_path (
-												GTK_TREE_MODEL(lisTasks),&iter);
-				loop_check[++lc] = EW;
-				lec = lc;
-			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK While %d\n", intval);			
-				gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-									TAG, &wp,
-									-1);
-				wep = wp;
-				if (!intval) {
-					gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), 
-											 &iter, 
-											 path_endwhile[wp]);
-					GetNextIter = FALSE;
-					WhileBreak = TRUE;
-				} else {
-					WhileBreak = FALSE;
-				}
-			}
-		} else if (!(strcmp (task.type, "EndWhile"))) {
-			if (TestOnly) {
-				++lec;
-				while (--lec >= 0) {
-					if (loop_check[lec]) {
-						if (loop_check[lec] == EW) {
-							loop_check[lec] = 0;
-						} else {
-							L_print ("{r}Unclosed BeginLoop, If or While "
-									 "statement at line %d\n", line);
-							Error = TRUE;
-						}
-						break;
-					}
-				}
-				path = gtk_tree_model_get_path(GTK_TREE_MODEL (lisTasks),&iter);
-				while (wep >= 0) {
-					if (!path_endwhile[wep]) {
-						path_endwhile[wep] = path;
-						gtk_list_store_set (lisTasks, &iter,
-											TAG, wep,
-											-1);
-						break;
-					}
-					wep--;
-				}
-				if (wep < 0) {
-					L_print ("{r}Task 'EndWhile' has no corresponding 'While' "
-							 "at line %d\n", line);
-					Error = TRUE;
-				}
+				if (!intval)
+					next = op->jump;  /* Continue after EndWhile */
 			}
-			if (!TestOnly && !Error) {
+			break;
+		case OP_ENDWHILE:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK EndWhile\n");			
-				gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-									TAG, &wep,
-									-1);
-				if (!WhileBreak) {
-					gtk_tree_model_get_iter (GTK_TREE_MODEL (lisTasks), 
-											 &iter, 
-											 path_while[wep]);
-					GetNextIter = FALSE;
-				} else {
-					WhileBreak = FALSE;
-				}
+				next = op->jump;      /* Evaluate the While again */
 			}
-		} else if (!(strcmp (task.type, "AugOn"))) {
-			if (!TestOnly && !Error) {
+			break;
+		case OP_AUGON:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK AugOn\n");			
 				Flags.Type = T_AGN;
 				Flags.Task |= T_EXEC;
 				set_autog_on (TRUE);
 			}
-		} else if (!(strcmp (task.type, "AugOff"))) {
-			if (!TestOnly && !Error) {
+			break;
+		case OP_AUGOFF:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK AugOff\n");			
 				Flags.Type = T_AGF;
 				Flags.Task |= T_EXEC;
 				set_autog_on (FALSE);
 			}
-		} else if (!(strcmp (task.type, "GuideStart"))) {
+			break;
+		case OP_GUIDESTART:
 			if (autog_comms->pnum == LPT && !menu.OpenParPort) {
 				L_print ("{r}Task 'GuideStart' at line %d requires parallel "
 				         "port to be open to send guide signals\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else if (autog_comms->pnum == USBAUG && !aug->Open) {
 				L_print ("{r}Task 'GuideStart' at line %d requires autoguider "
 				         "camera to be open to send guide signals\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else if (autog_comms->pnum == USBCCD && !menu.OpenCCDCam) {
 				L_print ("{r}Task 'GuideStart' at line %d requires CCD camera "
 				         "to be open to send guide signals\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else if (autog_comms->pnum >= TTY0 && !menu.OpenAutogPort) {
 				L_print ("{r}Task 'GuideStart' at line %d requires "
 						 "guide signals link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
 			if (!aug->Open) {
 				L_print ("{r}Task 'GuideStart' at line %d requires "
 						 "autoguider camera to be open for guiding\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK GuideStart\n");			
 				Flags.Type = T_GST;
 				Flags.Task |= T_EXEC;
 				set_guide_on (TRUE);
 			}
-		} else if (!(strcmp (task.type, "GuideStop"))) { 
-			if (!TestOnly && !Error) {
+			break;
+		case OP_GUIDESTOP:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK GuideStop\n");			
 				Flags.Type = T_GSP;
 				Flags.Task |= T_EXEC;
 				set_guide_on (FALSE);
 			}
-		} else if (!(strcmp (task.type, "GoTo"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								RA, &stra[0],
-								DEC, &stra[1],			
-								-1);
+			break;
+		case OP_GOTO:
+			stra[0] = tasks_arg_string (op, RA);
+			stra[1] = tasks_arg_string (op, DEC);
 			if (!menu.OpenTelPort) {
 				L_print ("{r}Task 'GoTo' at line %d requires the telescope "
 						 "link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			strcpy (sRA, g_strstrip (stra[0]));
-			if (!check_format (TRUE, sRA)) {
+			g_strlcpy (sRA, stra[0] ? stra[0] : "", sizeof (sRA));
+			if (!op->OK[RA] || (!(TestOnly && op->param[RA] >= 0) && 
+								!check_format (TRUE, sRA))) {
 				L_print ("{r}Task 'GoTo' has invalid RA at line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			strcpy (sDec, g_strstrip (stra[1]));
-			if (!check_format (FALSE, sDec)) {
+			g_strlcpy (sDec, stra[1] ? stra[1] : "", sizeof (sDec));
+			if (!op->OK[DEC] || (!(TestOnly && op->param[DEC] >= 0) && 
+								 !check_format (FALSE, sDec))) {
 				L_print("{r}Task 'GoTo' has invalid Dec at line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK GoTo %s %s\n", sRA, sDec);
 				Flags.Type = T_GTO;
 				Flags.Task |= T_EXEC;
 				loop_telescope_goto (sRA, sDec);
 			}
-		} else if (!(strcmp (task.type, "Move"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								RA, &stra[0],
-								DEC, &stra[1],			
-								-1);
+			break;
+		case OP_MOVE:
 			if (!menu.OpenTelPort) {
 				L_print ("{r}Task 'Move' at line %d requires the telescope "
 						 "link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!get_entry_float (g_strstrip (stra[0]), 
-							      MOV_MIN, MOV_MAX, MOV_DEF, 
-							      TSK_PAGE, &val)) {
+			if (!tasks_arg (op, RA, FALSE, MOV_MIN, MOV_MAX, &val)) {
 				L_print ("{r}Task 'Move' has invalid RA motion value at "
 						 "line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!get_entry_float (g_strstrip (stra[1]), 
-							      MOV_MIN, MOV_MAX, MOV_DEF, 
-							      TSK_PAGE, &val1)) {
+			if (!tasks_arg (op, DEC, FALSE, MOV_MIN, MOV_MAX, &val1)) {
 				L_print ("{r}Task 'Move' has invalid Dec motion value at "
 						 "line %d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK Move %.2f %.2f\n", val, val1);
 				Flags.Type = T_GTO;
 				Flags.Task |= T_EXEC;
 				loop_telescope_move (val, val1);
 			}
-		} else if (!(strcmp (task.type, "Exec")) || 
-				   !(strcmp (task.type, "ExecAsync"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[0],
-								-1);
-			IsExec = !(strcmp (task.type, "Exec")) ? TRUE : FALSE;
+			break;
+		case OP_EXEC:
+		case OP_EXECASYNC:
+			stra[0] = op->arg[VALUE];
+			IsExec = (op->op == OP_EXEC);
 			if (!stra[0]) {
 				L_print ("{r}Task '%s' has missing script file at "
 						 "line %d\n", IsExec ? "Exec" : "ExecAsync", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else {
 				if (!g_file_test (stra[0], G_FILE_TEST_EXISTS)) {
 					L_print ("{r}Task '%s' script file does not exist at "
 							 "line %d\n", IsExec ? "Exec":"ExecAsync",line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				}
 				if (!g_file_test (stra[0], G_FILE_TEST_IS_EXECUTABLE)) {
 					L_print("{r}Task '%s' script file is not executable at "
 							 "line %d\n", IsExec ? "Exec":"ExecAsync",line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				}
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK %s %s\n", IsExec? "Exec":"ExecAsync",stra[0]);
 				tasks_script_execute (IsExec, stra[0]);
 				if (IsExec) {
@@ -1728,147 +2163,125 @@ gboolean tasks_execute_tasks (gboolean TestOnly, gboolean *error)
 					loop_tasks_script ();
 				}
 			}
-		} else if (!(strcmp (task.type, "SetParam"))) {
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								NUM, &stra[0],
-								-1);
-			gtk_tree_model_get (GTK_TREE_MODEL (lisTasks), &iter,
-								VALUE, &stra[1],
-								-1);
-			if (!get_entry_int (g_strstrip (stra[0]), 
-								0, NUMTPARAMS - 1, 0, 
-								TSK_PAGE, &intval)) {
+			break;
+		case OP_SETPARAM:
+			stra[0] = op->arg[NUM];
+			stra[1] = op->arg[VALUE];
+			if (!tasks_arg_int (op, NUM, 0, NUMTPARAMS - 1, &intval)) {
 				L_print ("{r}Task SetParam has invalid parameter at line "
 						 "%d\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK SetParam %%%d %s\n", intval, stra[1]);
 				get_task_params (tp);
-				tp[intval] = g_strstrip (stra[1]);
+				tp[intval] = stra[1];
 				set_task_params (tp);
 			}
-		} else if (!(strcmp (task.type, "WarmRestart"))) {
+			break;
+		case OP_WARMRESTART:
 			if (!menu.OpenTelPort) {
 				L_print ("{r}Task 'WarmRestart' at line %d requires the "
 						 "telescope link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
 			if (!menu.Gemini) {
 				L_print ("{r}Task 'WarmRestart' at line %d requires the "
 						 "'Gemini commands' option to be selected\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK WarmRestart\n");			
 				Flags.Type = T_WRT;
 				Flags.Task |= T_EXEC;
 				loop_telescope_restart ();
 			}
-		} else if (!(strcmp (task.type, "ParkMount"))) {
+			break;
+		case OP_PARKMOUNT:
 			if (!menu.OpenTelPort) {
 				L_print ("{r}Task 'ParkMount' at line %d requires the "
 						 "telescope link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK ParkMount\n");			
 				Flags.Type = T_PMT;
 				Flags.Task |= T_EXEC;
 				loop_telescope_park ();
 			}
+			break;
 		#ifdef HAVE_UNICAP
-		} else if (!(strcmp (task.type, "RecordStart"))) { 
+		case OP_RECORDSTART:
 			if (!menu.LiveView) {
 				L_print ("{r}Task 'RecordStart' at line %d requires "
 						 "Live View window to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			} else {
 				if (!liveview_record_is_writeable ()) {
 					L_print ("{r}Task 'RecordStart' at line %d requires "
 							 "destination for recording file to be "
 							 "writeable\n", line);
-					Error = TRUE;
+					prog.Error = TRUE;
 				}
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK RecordStart\n");			
 				Flags.Type = T_RST;
 				Flags.Task |= T_EXEC;
-				set_entry_string ("txtLVComment", obj);
+				if (ui.set_field)
+					ui.set_field ("txtLVComment", obj);
 				set_record_on (TRUE);
 			}
-		} else if (!(strcmp (task.type, "RecordStop"))) { 
+			break;
+		case OP_RECORDSTOP:
 			if (!menu.LiveView) {
 				L_print ("{r}Task 'RecordStop' at line %d requires "
 						 "Live View window to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK RecordStop\n");			
 				Flags.Type = T_RSP;
 				Flags.Task |= T_EXEC;
 				set_record_on (FALSE);
 			}
+			break;
 		#endif /*HAVE_UNICAP*/
-		} else if (!(strcmp (task.type, "YellowButton"))) {
+		case OP_YELLOWBUTTON:
 			if (!menu.OpenAutogPort) {
 				L_print ("{r}Task 'YellowButton' at line %d requires "
 						 "guide signals link to be open\n", line);
-				Error = TRUE;
+				prog.Error = TRUE;
 			}
-			if (!TestOnly && !Error) {
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK YellowButton\n");
 				Flags.Type = T_YBT;
 				Flags.Task |= T_EXEC;
 				loop_telescope_yellow ();
 			}
-		} else if (!(strcmp (task.type, "Shutdown"))) {
-			if (!TestOnly && !Error) {
+			break;
+		case OP_SHUTDOWN:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK Shutdown\n");			
 				Flags.Type = T_SDN;
 				Flags.Task |= T_EXEC;
 				exit_and_shutdown ();
 			}
-		} else if (!(strcmp (task.type, "Exit"))) {
-			if (!TestOnly && !Error) {
+			break;
+		case OP_EXIT:
+			if (!TestOnly && !prog.Error) {
 				L_print ("{b}TASK Exit\n");			
-				tasks_stop ();
+				tasks_stop (FALSE);
 				finished_tasks ();
 			}
-		} else
-			L_print ("{r}Invalid task type: %s\n", task.type); 
-
-		/* Get the next row of the task list, but not if this has already been
-		 * set via an If or While segment.
-		 */
-	    
-		if (GetNextIter)
-			if (!gtk_tree_model_iter_next (GTK_TREE_MODEL (lisTasks), &iter))
-				Flags.Task &= ~T_NEXT;  /* Must have reached end of list */
-			
-		GetNextIter = TRUE;
-
-		if (!(Flags.Task & T_NEXT) && TestOnly) {
-			while (lc >= 0) {
-				if (loop_check[lc--]) {
-					L_print ("{r}There are BeginLoop, If or While "
-						 	 "statements with no corresponding "
-							 "EndLoop, EndIf or EndWhile statements!\n");
-					Error = TRUE;
-					break;
-				}
-			}
-		}
-			
-	} else {
-		L_print ("{b}Task execution FINISHED\n");
-		tasks_stop ();
-		finished_tasks ();
+			break;
+		default:
+			L_print ("{r}Invalid task type: %s\n", op->arg[TASK]);
+			break;
 	}
+
 	
-	*error = Error;
-	return Flags.Task & T_NEXT;
+	return next;
 }
 
 guint tasks_get_status (void)
@@ -1945,6 +2358,8 @@ gboolean tasks_load_file (gchar *filename)
 	gchar *buffer, *buf, *line, **strings, **tokens;
 	gchar *cmd, *token, *stra[10];
 	
+	if (tasks_list_locked ())
+		return FALSE;
 	if (!g_file_get_contents (filename, &buffer, NULL, NULL))
 		return show_error (__func__, "Couldn't get file contents");
 	
@@ -2373,6 +2788,48 @@ gboolean tasks_script_done (void)
 	return TRUE;
 }
 
+static gboolean tasks_list_locked (void)
+{
+	/* Return TRUE (with a message) if the task list is running.  The list
+	 * can't be changed then, since the compiled program refers to its rows
+	 * by line number.
+	 */
+	
+	if (!(Flags.Task & (T_START | T_NEXT)))
+		return FALSE;
+	L_print ("{o}The task list can't be changed while it is running\n");
+	return TRUE;
+}
+
+static gboolean tasks_insert_row (GtkTreeIter *iter)
+{
+	/* Insert a new row after the selected one and select it, unless the 
+	 * task list is running.  Returns TRUE if the row was inserted.
+	 */
+	
+	GtkTreeIter s_iter;
+	
+	if (tasks_list_locked ())
+		return FALSE;
+	gtk_list_store_insert_after (lisTasks, iter, get_selected_iter (&s_iter));
+	select_current_row (iter);
+	return TRUE;
+}
+
+static void tasks_show_task (gint line)
+{
+	/* Select the given line of the task list and scroll it to the top of the
+	 * window.
+	 */
+	
+	GtkTreePath *path;
+	
+	path = gtk_tree_path_new_from_indices (line - 1, -1);
+	gtk_tree_view_set_cursor (trvTasks, path, NULL, FALSE);
+	gtk_tree_view_scroll_to_cell (trvTasks, path, NULL, TRUE, 0.0, 0.0);
+	gtk_tree_path_free (path);
+}
+
 static GtkTreeIter *get_selected_iter (GtkTreeIter *iter)
 {
 	/* Return the iter corresponding to the currently selected row, or NULL
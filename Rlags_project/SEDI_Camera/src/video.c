@@ -31,18 +31,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <math.h>
 
 #define GOQAT_VIDEO
 #include "interface.h"
+#include "fits.h"
 
 #define VID_BLACK     0          /* Black level                               */
 #define VID_WHITE   255          /* White level                               */
 
 #define ID "<GQVID>"             /* GoQat video file 'magic' identifier       */
 #define FRAME_HEADER_SIZE 100    /* 100 bytes header for each video frame     */
+#define RING_ALIGN 4096          /* Alignment of recording ring buffers       */
+#define MAP_WINDOW (256 << 20)   /* Most of a video file mapped for playback  */
+#define TIME_TOL 0.0005          /* Tolerance (s) when finding frames by time */
+#define EXPORT_BATCH 64          /* Frames per batch when saving FITS frames  */
+#define EXPORT_MAX_BATCHES 2     /* Batches being saved at any one time       */
+#define EXPORT_MAX_THREADS 4     /* Most threads writing FITS frames          */
+#define PHOT_BATCH 250           /* Frames per batch for range photometry     */
+#define PHOT_SKY_GAP 2.0         /* Gap between aperture and sky annulus (px) */
+#define PHOT_SKY_WIDTH 5.0       /* Width of sky annulus (px)                 */
 
 #ifdef HAVE___AUTOGEN_SH
 #undef GOQAT_SEXTRACTOR_PL
@@ -62,6 +76,7 @@ enum VideoActions {              /* Possible actions for video_iter_frames    */
 	VA_SF = 4,                   /* Save frames as FITS files                 */
 	VA_SV = 8,                   /* Save frames in GoQat video format         */
 	VA_PS = 16,                  /* Perform photometry on single frame        */
+	VA_PR = 32,                  /* Perform photometry on range of frames     */
 };
 
 struct video_header {            /* Header for entire video file              */
@@ -76,6 +91,31 @@ struct frame_times {             /* Time values (absolute or increments)      */
 	gint usec;                   /* Microseconds                              */
 };
 
+struct frame_batch {             /* Run of frames mapped from the video file  */
+	gpointer map;                /* Start of the mapping...                   */
+	gsize len;                   /*  ...and its length                        */
+	const guchar *frames;        /* Header of the first frame in the run      */
+	guint first;                 /* Number of the first frame                 */
+	volatile gint pending;       /* Frames still to be saved                  */
+};
+
+struct phot_star {               /* Star measured through a range of frames   */
+	gdouble x, y;                /* Position in the video frame (pixels)      */
+	gdouble flux, err;           /* Aperture flux and its error (ADU)         */
+	gdouble sky;                 /* Sky level per pixel (ADU)                 */
+	guint frame;                 /* Last frame in which the star was found    */
+};
+
+struct frame_job {               /* Frame to be saved as a FITS file          */
+	struct frame_batch *batch;   /* Batch holding the frame                   */
+	const guchar *frame;         /* Frame data, following the frame header    */
+	gchar *file;                 /* Name of FITS file                         */
+	gchar header[FITS_REC_LEN];  /* FITS header...                            */
+	gint head_len;               /*  ...and its length                        */
+	gushort xo1, yo1;            /* Top left of region to save...             */
+	gushort h_pix, v_pix;        /*  ...and its size                          */
+};
+
 static struct rec_play_buffer {  /* Record/playback buffer                    */
 	FILE *fp;                    /* File pointer for video file               */
 	struct video_header vh;      /* File header for video file                */
@@ -83,8 +123,8 @@ static struct rec_play_buffer {  /* Record/playback buffer                    */
 	struct frame_times first_time;/* Absolute time for first frame of sequence*/
 	struct frame_times incr_time;/* Time increment between 1st & 2nd frames   */
 	gushort fps;                 /* Frame rate in fps                         */
-	gushort buf;                 /* Buffer counter (0 or 1)                   */
 	gushort nbf;                 /* Number of frames per buffer               */
+	gushort nslots;              /* Number of buffers in the recording ring   */
 	gushort h;                   /* Horizontal size of video frame            */
 	gushort v;                   /* Vertical size of video frame              */
 	guint hd_size;               /* Size of header for each video frame       */
@@ -98,13 +138,37 @@ static struct rec_play_buffer {  /* Record/playback buffer                    */
 	guint mark_first;            /* First marked frame                        */
 	guint mark_last;             /* Last marked frame                         */
 	guint mark_step;             /* Increment for marked frames               */
-	guchar *vid_buf;             /* Buffer pointer for video data             */
-	guchar *vid_bufptr[2];       /* Pointers into vid_buf area for next frame */
+	gpointer map;                /* Window of file mapped for playback...     */
+	gsize map_len;               /*  ...its length...                         */
+	off_t map_off;               /*  ...and offset in the file                */
+	off_t file_size;             /* Size of file opened for playback          */
+	gdouble *times;              /* Time of each frame (s), or NULL if not    */
+	gboolean TimesSorted;        /*  indexed; TRUE if times never decrease    */
+	guchar *ring;                /* Ring of buffers for recording             */
+	gsize slot_size;             /* Size of each buffer, rounded to pages     */
+	guint slot_frames;           /* Frames in the buffer being filled         */
+	gint rec_fd;                 /* File descriptor of recording file         */
+	GThread *writer;             /* Thread writing full buffers to disk       */
+	GCond *ring_cond;            /* Signalled when a buffer is filled         */
+	volatile gint filled;        /* Buffers filled by the camera callback...  */
+	volatile gint flushed;       /*  ...and written to disk by the writer     */
+	volatile gint Recording;     /* TRUE while frames may be buffered         */
+	volatile gint in_callback;   /* Camera callbacks using the ring           */
+	volatile gint StopWriter;    /* TRUE to make the writer finish            */
+	volatile gint WriteError;    /* errno of a failed write, or 0             */
+	guint dropped;               /* Frames dropped because ring was full      */
+	guint stalls;                /* Times the camera found the ring full      */
+	guint max_queued;            /* Most buffers waiting to be written        */
+	GThreadPool *export_pool;    /* Threads saving frames as FITS files       */
+	volatile gint batches;       /* Batches not yet completely saved          */
+	volatile gint saved;         /* Frames saved by the export threads        */
+	volatile gint ExportError;   /* errno of a failed FITS write, or 0        */
+	guint export_start;          /* Time at which saving frames started       */
 	gchar *comment;              /* Video file comment                        */
 	gchar *savefile;             /* Name of video/FITS file to be saved       */
 	gchar *vidfile;              /* Name of video file opened for playback    */
 	gboolean FirstFrame;         /* TRUE if this is the first recorded frame  */
-	gboolean vid_buf_flushed[2]; /* Flags to indicate if buffers are flushed  */
+	gboolean Dropping;           /* TRUE while frames are being dropped       */
 } rp;
 
 static struct photom {           /* Photometry parameters for video images    */
@@ -113,13 +177,19 @@ static struct photom {           /* Photometry parameters for video images    */
 	gfloat aperture;             /* SExtractor PHOT_APERTURES                 */
 	gfloat shift;                /* Max. shift in star position between frames*/
 	gchar *type;                 /* "Single" to do photometry on the current  */
-                                 /*  frame, "InitRange" to initialise         */
-                                 /*  photometry on a range of frames, "Range" */
-                                 /*  to do photometry on a frame within a     */
-                                 /*  range of frames.                         */
+                                 /*  frame with SExtractor                    */
+	struct phot_star *stars;     /* Stars measured in a range of frames...    */
+	gint nstars;                 /*  ...and how many                          */
+	gushort xo1, yo1, xo2, yo2;  /* Region of each frame used for photometry  */
+	time_t day;                  /* Start of UT day of first frame in range   */
+	guint measured;              /* Frames measured so far                    */
+	FILE *table;                 /* Photometry table for the range...         */
+	gchar *table_file;           /*  ...its name...                           */
+	gchar *catalog_file;         /*  ...and that of the final star catalog    */
 } phot;
 
 static struct cam_img vid_cam_obj, *vid;
+static GStaticMutex ring_mutex = G_STATIC_MUTEX_INIT; /* For rp.ring_cond     */
 gushort video_action = VA_NONE;
 static gchar *GOQAT_SEXTRACTOR_RESULTS = NULL;
 
@@ -132,13 +202,21 @@ void video_init (void);
 gboolean video_record_start (gchar *dirname);
 void video_record_stop (void);
 void video_buffer_frame (guchar *buffer, struct timeval *fill_time, guint now);
-void video_flush_buffer (gushort buf);
+static gpointer video_ring_writer (gpointer data);
+static gboolean video_write_slot (guint slot, guint frames);
 #endif
 gboolean video_open_file (gchar *file);
 gint video_get_frame_number (void);
 void video_set_start_time (void);
 void video_set_frame_rate (gushort fps);
 gboolean video_show_frame (guint frame_num);
+gboolean video_show_time (gchar *stamp);
+static guchar *video_frame (guint frame_num);
+static gboolean video_index_frames (void);
+static guint video_find_frames (gdouble start, gdouble end, guint *first, 
+                                guint *last);
+static gboolean video_parse_time (gchar *stamp, struct timeval *tv);
+static void video_range_times_to_frames (void);
 gboolean video_update_timestamp (gchar *stamp);
 void video_set_timestamps (void);
 void video_play_frames (gboolean Play);
@@ -146,9 +224,22 @@ void video_show_prev (void);
 void video_show_next (void);
 void video_close_file (void);
 gboolean video_save_frames (gchar *file, gint filetype, gboolean Range);
+static gboolean video_mark_frames (gboolean Range);
 gboolean video_iter_frames (gboolean Final);
+static gboolean video_export_batch (gushort xo1, gushort yo1, gushort xo2, 
+                                    gushort yo2, gchar *filename);
+static void video_export_frame (gpointer data, gpointer user_data);
+static struct frame_batch *video_map_frames (guint first, guint last);
+static void video_unmap_frames (struct frame_batch *batch);
 void video_photom_frames (gfloat aperture, gfloat minarea, gfloat thresh,
 						  gfloat shift, gboolean Range);
+static gboolean video_photom_start (void);
+static void video_photom_frame (const guchar *frame, guint num);
+static void video_photom_star (const guchar *data, struct phot_star *star,
+							   guint num);
+static gint video_photom_sky (const guchar *data, gdouble x, gdouble y,
+							  gdouble *sky, gdouble *sigma);
+static void video_photom_finish (void);
 struct cam_img *get_vid_image_struct (void);
 
 
@@ -167,7 +258,11 @@ void video_init (void)
     vid->canv.cviImage = NULL;
 	rp.fp = NULL;
     rp.disp_frame = 0;
-	rp.vid_buf = NULL;
+	rp.map = NULL;
+	rp.times = NULL;
+	rp.ring = NULL;
+	rp.rec_fd = -1;
+	rp.Recording = FALSE;
 	rp.savefile = NULL;
 	rp.vidfile = NULL;
 }
@@ -175,7 +270,11 @@ void video_init (void)
 #ifdef HAVE_UNICAP
 gboolean video_record_start (gchar *dirname)
 {
-	/* Allocate memory and open the file for recording */
+	/* Allocate the recording ring, open the file for recording and start the
+	 * thread that writes the ring to disk.  The ring holds rp.nslots buffers
+	 * of rp.nbf frames each; the camera callback fills them in turn and the
+	 * writer thread writes each full buffer with a single write.
+	 */
 	
 	struct cam_img *aug = get_aug_image_struct ();
 	
@@ -187,33 +286,44 @@ gboolean video_record_start (gchar *dirname)
 
 	/* Initialise buffer structure */
 	
-	rp.fp = NULL;
-	rp.vid_buf = NULL;
-	rp.buf = 0;
 	rp.nbf = get_video_framebufsize ();
+	rp.nslots = get_video_ringsize ();
 	rp.hd_size = FRAME_HEADER_SIZE;  /* Space for each frame header */
 	rp.fr_size = aug->exd.h_pix * aug->exd.v_pix * sizeof (guchar);
+	rp.slot_size = ((gsize) rp.nbf * (rp.hd_size + rp.fr_size) + 
+					RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN;
+	rp.slot_frames = 0;
 	rp.num_frames = 0;
+	rp.filled = 0;
+	rp.flushed = 0;
+	rp.dropped = 0;
+	rp.stalls = 0;
+	rp.max_queued = 0;
+	rp.StopWriter = FALSE;
+	rp.WriteError = 0;
 	rp.FirstFrame = TRUE;
-	rp.vid_buf_flushed[0] = TRUE;
-	rp.vid_buf_flushed[1] = TRUE;
+	rp.Dropping = FALSE;
 	
 	/* Allocate memory */
 	
-	if (!(rp.vid_buf = (guchar *) g_malloc0 (2 * rp.nbf * 
-											(rp.hd_size + rp.fr_size)))) {
+	if (posix_memalign ((void **) &rp.ring, RING_ALIGN, 
+						rp.nslots * rp.slot_size)) {
+		rp.ring = NULL;
 		aug->Record = FALSE;
 		return show_error (__func__, "Can't allocate buffer for recording!");
 	}
-	rp.vid_bufptr[0] = rp.vid_buf;
-	rp.vid_bufptr[1] = rp.vid_buf + rp.nbf * (rp.hd_size + rp.fr_size);
+	memset (rp.ring, 0, rp.nslots * rp.slot_size);
+	if (!rp.ring_cond)
+		rp.ring_cond = g_cond_new ();
 	
 	/* Open the file */
 	
 	set_fits_data (aug, NULL, FALSE, FALSE);  /* Get date/time in handy format*/
 	file = g_strconcat (dirname, "/", aug->fits.date_obs, ".vid", NULL);
-	if (!(rp.fp = fopen (file, "wb"))) {
+	if ((rp.rec_fd = open (file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
 		g_free (file);
+		free (rp.ring);
+		rp.ring = NULL;
 		aug->Record = FALSE;
 		return show_error (__func__, "Can't open video file for recording!");
 	}
@@ -222,16 +332,34 @@ gboolean video_record_start (gchar *dirname)
 	
 	/* Write header info */
 	
+	memset (&rp.vh, 0, sizeof (struct video_header));
 	strcpy (rp.vh.id, ID);
 	rp.vh.h = aug->exd.h_pix;
 	rp.vh.v = aug->exd.v_pix;
 	comment = get_entry_string ("txtLVComment");
-	strcpy (rp.vh.comment, comment);
+	strncpy (rp.vh.comment, comment, sizeof (rp.vh.comment) - 1);
 	g_free (comment);
-	if ((fwrite (&rp.vh, sizeof (struct video_header), 1, rp.fp) != 1)) {
+	if (write (rp.rec_fd, &rp.vh, sizeof (struct video_header)) != 
+											   sizeof (struct video_header)) {
+		close (rp.rec_fd);
+		rp.rec_fd = -1;
+		free (rp.ring);
+		rp.ring = NULL;
 		aug->Record = FALSE;
 		return show_error (__func__, "Can't write video file header!");
 	}
+	
+	/* Start the writer thread, then let the camera callback fill the ring */
+	
+	if (!(rp.writer = g_thread_create (video_ring_writer, NULL, TRUE, NULL))) {
+		close (rp.rec_fd);
+		rp.rec_fd = -1;
+		free (rp.ring);
+		rp.ring = NULL;
+		aug->Record = FALSE;
+		return show_error (__func__, "Can't start video writer thread!");
+	}
+	g_atomic_int_set (&rp.Recording, TRUE);
 	return TRUE;
 }
 #endif
@@ -239,11 +367,39 @@ gboolean video_record_start (gchar *dirname)
 #ifdef HAVE_UNICAP
 void video_record_stop (void)
 {
-    /* Free memory, close recording file and display statistics */
+    /* Stop buffering frames, let the writer thread write the full buffers and
+	 * write the partly-filled one, then free memory, close the recording file
+	 * and display statistics.
+	 */
 
 	gdouble seconds;
 	
-	video_flush_buffer (rp.buf);
+	if (!rp.ring)
+		return;
+	
+	/* Wait for any camera callback that is using the ring to finish */
+	
+	g_atomic_int_set (&rp.Recording, FALSE);
+	while (g_atomic_int_get (&rp.in_callback))
+		g_usleep (1000);
+	
+	g_static_mutex_lock (&ring_mutex);
+	g_atomic_int_set (&rp.StopWriter, TRUE);
+	g_cond_signal (rp.ring_cond);
+	g_static_mutex_unlock (&ring_mutex);
+	g_thread_join (rp.writer);
+	rp.writer = NULL;
+	
+	if (rp.slot_frames && !rp.WriteError)
+		video_write_slot (rp.filled % rp.nslots, rp.slot_frames);
+	if (rp.WriteError)
+		L_print ("{r}Error writing video recording to disk: %s\n",
+				 g_strerror (rp.WriteError));
+	
+	close (rp.rec_fd);
+	rp.rec_fd = -1;
+	free (rp.ring);
+	rp.ring = NULL;
 	video_close_file ();
 	
 	seconds = (gdouble) (rp.latest - rp.start) / 1000.0;
@@ -251,6 +407,9 @@ void video_record_stop (void)
 			 rp.num_frames,
 			 seconds, 
 			 (gfloat) rp.num_frames / seconds);
+	L_print ("{b}Dropped %u frames; ring of %d buffers was full %u times, "
+			 "at most %u buffers waiting\n", rp.dropped, rp.nslots, rp.stalls,
+			 rp.max_queued);
 	L_print ("{b}Expected %d frames at 25.000 fps\n",(guint) (seconds * 25.0));
 	L_print ("{b}Expected %d frames at 30.000 fps\n",(guint) (seconds * 30.0));
 	L_print ("{b}Expected %d frames at 60.000 fps\n",(guint) (seconds * 60.0));
@@ -263,100 +422,154 @@ void video_buffer_frame (guchar *buffer, struct timeval *fill_time, guint now)
 	/* Buffer every 'save_every' video frames.  Note that this buffers only
 	 * the first rp.fr_size bytes of the passed buffer - i.e. enough for one
 	 * byte per pixel greyscale data but no more.
+	 *
+	 * This is the only producer for the recording ring: it copies each frame
+	 * straight into the buffer being filled and hands the buffer to the
+	 * writer thread when it is full.  If the writer has fallen so far behind
+	 * that every buffer is waiting to be written, frames are dropped (and
+	 * counted) until a buffer is free, rather than overwriting data.
 	 */
 	
-	/*struct cam_img *aug = get_aug_image_struct ();*/
-		
-	static gushort f_num = 0;
 	static gint save_every = 0;
 	static gint save_count = 0;
 	
-	if (!rp.vid_buf)
+	guchar *frame;
+	guint queued;
+	
+	g_atomic_int_inc (&rp.in_callback);
+	if (!g_atomic_int_get (&rp.Recording)) {
+		g_atomic_int_add (&rp.in_callback, -1);
 		return;
+	}
 	
 	if (rp.FirstFrame) {
-		f_num = 0;
 		save_count = 0;
 		get_entry_int ("txtLVSaveFrames", 1, 99999, 1, NO_PAGE, &save_every);
 		rp.start = now;
 		rp.FirstFrame = FALSE;
+		g_atomic_int_add (&rp.in_callback, -1);
 		return;
 	}
 	
-	if (++save_count < save_every)
+	if (++save_count < save_every) {
+		g_atomic_int_add (&rp.in_callback, -1);
 		return;
-	else
+	} else
 		save_count = 0;
 	
+	/* Starting a new buffer needs one that the writer has finished with */
+	
+	if (!rp.slot_frames) {
+		queued = rp.filled - g_atomic_int_get (&rp.flushed);
+		if (queued >= rp.nslots) {
+			rp.dropped++;
+			if (!rp.Dropping) {
+				rp.stalls++;
+				rp.Dropping = TRUE;
+				L_print ("{r}Disk writes too slow for video recording - "
+						 "dropping frames!\n");
+			}
+			g_atomic_int_add (&rp.in_callback, -1);
+			return;
+		}
+		rp.Dropping = FALSE;
+	}
+	
 	/* Increment frame counter and set latest time */
 	
 	rp.num_frames++;
 	rp.latest = now;
 	
-	/* Buffer the memory */
-	
-	memcpy (rp.vid_bufptr[rp.buf], fill_time, sizeof (struct timeval));
-	rp.vid_bufptr[rp.buf] += rp.hd_size;
-	memcpy (rp.vid_bufptr[rp.buf], buffer, rp.fr_size);
-	rp.vid_bufptr[rp.buf] += rp.fr_size;
-	
-	/* Flush to disk and swap buffers every rp.nbf frames */
-	
-	if (++f_num == rp.nbf) {
-		f_num = 0;
-		loop_LiveView_flush_to_disk (rp.buf);  /* Flush this buffer       */
-		rp.buf = (rp.buf == 0) ? 1 : 0;        /* Swap buffers            */
-		if (rp.vid_buf_flushed[rp.buf]) {      /* Check it's been flushed */
-			rp.vid_bufptr[rp.buf] = rp.vid_buf + rp.buf * rp.nbf * 
-			                                          (rp.hd_size + rp.fr_size);
-			rp.vid_buf_flushed[rp.buf] = FALSE;
-		} else {
-			L_print ("{r}Disk writes too slow for video recording!\n");
-			/*aug->Record = FALSE;*/
-			/*return;*/
-		}
+	/* Buffer the frame */
+	
+	frame = rp.ring + (rp.filled % rp.nslots) * rp.slot_size + 
+						rp.slot_frames * (rp.hd_size + rp.fr_size);
+	memcpy (frame, fill_time, sizeof (struct timeval));
+	memcpy (frame + rp.hd_size, buffer, rp.fr_size);
+	
+	/* Pass the buffer to the writer thread every rp.nbf frames */
+	
+	if (++rp.slot_frames == rp.nbf) {
+		rp.slot_frames = 0;
+		g_static_mutex_lock (&ring_mutex);
+		g_atomic_int_inc (&rp.filled);
+		g_cond_signal (rp.ring_cond);
+		g_static_mutex_unlock (&ring_mutex);
+		queued = rp.filled - g_atomic_int_get (&rp.flushed);
+		rp.max_queued = MAX (rp.max_queued, queued);
 	}
+	g_atomic_int_add (&rp.in_callback, -1);
 }
 #endif
 
 #ifdef HAVE_UNICAP
-void video_flush_buffer (gushort buf)
+static gpointer video_ring_writer (gpointer data)
 {
-	/* Flush the video buffer to disk */
+	/* Write each full buffer in the recording ring to disk, in order, until
+	 * told to stop.  A write error stops recording.
+	 */
 	
 	struct cam_img *aug = get_aug_image_struct ();
 	
-	gushort frames_to_buffer;
-    guchar *bufptr;
-	
-	if (!rp.vid_buf)
-		return;
-	
-	bufptr = rp.vid_buf + buf * rp.nbf * (rp.hd_size + rp.fr_size);
-	
-	if (!(frames_to_buffer = rp.num_frames%rp.nbf))
-		frames_to_buffer = rp.nbf;
-	
-	if (rp.fp) {
-		if ((fwrite (bufptr, (rp.hd_size + rp.fr_size) * sizeof (guchar), 
-				                frames_to_buffer, rp.fp) != frames_to_buffer)) {
-		    L_print ("{r}Error flushing recording buffer to disk!\n");
+	while (TRUE) {
+		g_static_mutex_lock (&ring_mutex);
+		while (g_atomic_int_get (&rp.flushed) == 
+			   g_atomic_int_get (&rp.filled) && 
+			   !g_atomic_int_get (&rp.StopWriter))
+			g_cond_wait (rp.ring_cond, g_static_mutex_get_mutex (&ring_mutex));
+		g_static_mutex_unlock (&ring_mutex);
+		
+		if (g_atomic_int_get (&rp.flushed) == g_atomic_int_get (&rp.filled))
+			break;  /* Stopped and nothing left to write */
+		
+		if (!video_write_slot (rp.flushed % rp.nslots, rp.nbf)) {
 			aug->Record = FALSE;
-		} else
-	        rp.vid_buf_flushed[buf] = TRUE;
+			g_atomic_int_set (&rp.Recording, FALSE);
+			break;
+		}
+		g_atomic_int_inc (&rp.flushed);
+	}
+	return NULL;
+}
+#endif
+
+#ifdef HAVE_UNICAP
+static gboolean video_write_slot (guint slot, guint frames)
+{
+	/* Write the given number of frames from a buffer in the recording ring,
+	 * in as few writes as the kernel allows.
+	 */
+	
+	guchar *p;
+	gsize len;
+	gssize n;
+	
+	p = rp.ring + slot * rp.slot_size;
+	len = frames * (rp.hd_size + rp.fr_size);
+	while (len) {
+		if ((n = write (rp.rec_fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			g_atomic_int_set (&rp.WriteError, errno);
+			return FALSE;
+		}
+		p += n;
+		len -= n;
 	}
+	return TRUE;
 }
 #endif
 
 gboolean video_open_file (gchar *file)
 {
 	/* Open the video file, get the header information and display the first
-	 * frame.
+	 * frame.  The frames are read from the file by mapping it into memory 
+	 * (see video_frame).
 	 */
 	
 	struct stat fil;
     gint i, j;
-    guchar *disp, *val;
+    guchar *disp, *val, *frame;
 	
 	/* Close any previously open file and free memory */
 	
@@ -365,7 +578,8 @@ gboolean video_open_file (gchar *file)
 	/* Initialise buffer structure */
 	
 	rp.fp = NULL;
-	rp.vid_buf = NULL;
+	rp.map = NULL;
+	rp.times = NULL;
 	rp.cur_frame = 1;
     rp.disp_frame = 0;
 	
@@ -394,6 +608,22 @@ gboolean video_open_file (gchar *file)
 	rp.v = rp.vh.v;
 	rp.hd_size = FRAME_HEADER_SIZE;
 	rp.fr_size = rp.h * rp.v;
+	
+	/* Calculate number of frames in file */
+	
+	if (fstat (fileno (rp.fp), &fil)) {
+        video_close_file ();
+		return show_error (__func__, "Can't get size of video file");
+	}
+	rp.file_size = fil.st_size;
+	rp.num_frames = (fil.st_size - sizeof (struct video_header)) / 
+	                                                  (rp.hd_size + rp.fr_size);
+	if (!rp.num_frames) {
+		msg ("Warning - Video file contains no frames!");
+		video_close_file ();
+		return FALSE;
+	}
+	
 	rp.comment = rp.vh.comment;
 	set_entry_string ("txtPBComment", rp.comment);
 	rp.vidfile = g_strdup (file);
@@ -417,7 +647,7 @@ gboolean video_open_file (gchar *file)
 	vid->r161 = NULL;
     vid->disp083 = NULL;
     
-	/* Allocate buffer memory, read and display the first frame */
+	/* Allocate buffer memory, map and display the first frame */
 	
 	if (!(vid->disp083 = (guchar *) g_malloc0 (vid->exd.h_pix * 
 	                                   vid->exd.v_pix * 3 * sizeof (guchar)))) {
@@ -425,35 +655,24 @@ gboolean video_open_file (gchar *file)
 		return show_error (__func__, "Unable to allocate buffer memory");
 	}
     
-	if (!(rp.vid_buf = (guchar *) g_malloc0 ((rp.hd_size + rp.fr_size) * 
-                                                            sizeof (guchar)))) {
-        video_close_file ();
-		return show_error (__func__, "Unable to allocate buffer memory");
-    }
-	
-	if (fread (rp.vid_buf, (rp.hd_size + rp.fr_size) * sizeof (guchar), 1, 
-                                                                  rp.fp) != 1) {
+	if (!(frame = video_frame (rp.cur_frame))) {
         video_close_file ();
-		return show_error (__func__, "Error reading frame from video file");
+		return FALSE;
     }
         
-	memcpy (&rp.tv, rp.vid_buf, sizeof (struct timeval));
+	memcpy (&rp.tv, frame, sizeof (struct timeval));
 	set_fits_data (vid, &rp.tv, TRUE, FALSE);
     disp = vid->disp083;
-    val = rp.vid_buf + rp.hd_size;
+    val = frame + rp.hd_size;
     for (i = 0; i < rp.fr_size; i++) { /* Expand data to 3 x 8 bits per pixel */
         for (j = 0; j < 3; j++)
 			*disp++ = *val;
         val++;
     }
-	ui_show_video_frame (rp.vid_buf + rp.hd_size, vid->fits.date_obs, 
+	ui_show_video_frame (frame + rp.hd_size, vid->fits.date_obs, 
 					                                  rp.cur_frame, rp.h, rp.v);
                                                       
-	/* Calculate and display number of frames in file */
-	
-	stat (file, &fil);
-	rp.num_frames = (fil.st_size - sizeof (struct video_header)) / 
-	                                                  (rp.hd_size + rp.fr_size);
+	/* Display number of frames in file */
 	
 	L_print ("{b}Opened video file %s: contains %d frames of size %dx%d\n", 
 			                                   file, rp.num_frames, rp.h, rp.v);
@@ -493,10 +712,10 @@ void video_set_frame_rate (gushort fps)
 
 gboolean video_show_frame (guint frame_num)
 {
-	/* Read and show the requested video frame */
+	/* Show the requested video frame */
 	
     gint i, j;
-    guchar *disp, *val;
+    guchar *disp, *val, *frame;
     
 	if (frame_num < 1 || frame_num > rp.num_frames) {
 		loop_video_iter_frames (FALSE);
@@ -508,39 +727,24 @@ gboolean video_show_frame (guint frame_num)
 		return FALSE;
 	}
 	
-	if (!rp.vid_buf) {
-		loop_video_iter_frames (FALSE);
-		return FALSE;
-	}
-    
     if (frame_num == rp.disp_frame)
         return TRUE;
     
-	if (frame_num != rp.cur_frame + 1) {  /* frame no. is not the next frame */
-		if (fseeko (rp.fp, (off_t) (sizeof (struct video_header) + 
-		    ((off_t) (frame_num - 1) * (rp.hd_size + rp.fr_size))), SEEK_SET)) {
-			perror ("fseeko");
-			loop_video_iter_frames (FALSE);
-			return show_error (__func__, "Error seeking frame in video file");
-		}
-	}
-		
-	if (fread (rp.vid_buf, (rp.hd_size + rp.fr_size) * sizeof (guchar), 1, 
-			                                                      rp.fp) != 1) {
+	if (!(frame = video_frame (frame_num))) {
 		loop_video_iter_frames (FALSE);
-		return show_error (__func__, "Error reading frame from video file");
+		return FALSE;
 	}
     
-	memcpy (&rp.tv, rp.vid_buf, sizeof (struct timeval));
+	memcpy (&rp.tv, frame, sizeof (struct timeval));
 	set_fits_data (vid, &rp.tv, TRUE, FALSE);
     disp = vid->disp083;
-    val = rp.vid_buf + rp.hd_size;
+    val = frame + rp.hd_size;
     for (i = 0; i < rp.fr_size; i++) { /* Expand data to 3 x 8 bits per pixel */
         for (j = 0; j < 3; j++)
 			*disp++ = *val;
         val++;
     }
-    ui_show_video_frame (rp.vid_buf + rp.hd_size, vid->fits.date_obs, 
+    ui_show_video_frame (frame + rp.hd_size, vid->fits.date_obs, 
 					                                     frame_num, rp.h, rp.v);
     
     rp.disp_frame = frame_num;
@@ -550,48 +754,255 @@ gboolean video_show_frame (guint frame_num)
 	return TRUE;
 }
 
-gboolean video_update_timestamp (gchar *stamp)
+gboolean video_show_time (gchar *stamp)
 {
-	/* Update the time stamp of the current frame (always interpreted as UTC) */
+	/* Show the first frame at or after the given UTC time stamp (see 
+	 * video_parse_time for its format).
+	 */
+	
+	struct timeval tv;
+	guint first, last;
 	
-	struct tm dt;
-	GDate *now, *epoch;
-		
 	if (!rp.fp)
 		return FALSE;
+	
+	if (!video_parse_time (stamp, &tv)) {
+		L_print ("{o}Please enter a frame number or a time stamp as "
+				 "YYYY-MM-DDThh:mm:ss.sss or hh:mm:ss.sss\n");
+		return FALSE;
+	}
+	if (!video_find_frames (tv.tv_sec + tv.tv_usec / 1.0e6, G_MAXDOUBLE, 
+							&first, &last)) {
+		L_print ("{o}No video frames at or after %s\n", stamp);
+		return FALSE;
+	}
+	return video_show_frame (first);
+}
 
-	strptime (stamp, "%Y-%m-%dT%T", &dt);
-	now = g_date_new_dmy (dt.tm_mday, 1 + dt.tm_mon, 1900 + dt.tm_year);
-	epoch = g_date_new_dmy (1, 1, 1970);
-	rp.tv.tv_sec = (time_t) (g_date_days_between (epoch, now) * 86400 + 
-                                dt.tm_hour * 3600 + dt.tm_min * 60 + dt.tm_sec);
-	rp.tv.tv_usec = (suseconds_t)(1.e3 * strtol (stamp+20, (gchar **) NULL,10));
-	g_date_free (epoch);
-	g_date_free (now);
-
-	/* Seek to beginning of current frame */
-	
-	if (fseeko (rp.fp, (off_t) (sizeof (struct video_header) + 
-		 ((off_t) (rp.cur_frame - 1) * (rp.hd_size + rp.fr_size))), SEEK_SET)) {
-		perror ("fseeko");
-		return show_error (__func__, "Error seeking frame in video file");
+static guchar *video_frame (guint frame_num)
+{
+	/* Return the address of the given frame (i.e. of its header) in the video
+	 * file opened for playback.  The file is mapped into memory in a window
+	 * of about MAP_WINDOW bytes, which is moved to centre on the frame if the
+	 * frame lies outside it.  The address is therefore valid only until
+	 * the next call.  The mapping is shared and writable, so time stamps can
+	 * be updated in place.  Returns NULL (having shown an error) on failure.
+	 */
+	
+	off_t start, end, page;
+	
+	start = sizeof (struct video_header) + 
+	                       (off_t) (frame_num - 1) * (rp.hd_size + rp.fr_size);
+	end = start + rp.hd_size + rp.fr_size;
+	
+	if (!rp.map || start < rp.map_off || end > rp.map_off + rp.map_len) {
+		if (rp.map)
+			munmap (rp.map, rp.map_len);
+		rp.map = NULL;
+		
+		page = sysconf (_SC_PAGESIZE);
+		rp.map_off = 0;
+		if (rp.file_size > MAP_WINDOW)
+			rp.map_off = CLAMP (start - MAP_WINDOW / 2, 0, 
+								rp.file_size - MAP_WINDOW) / page * page;
+		rp.map_len = MIN (MAP_WINDOW + page, rp.file_size - rp.map_off);
+		
+		rp.map = mmap (NULL, rp.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, 
+					   fileno (rp.fp), rp.map_off);
+		if (rp.map == MAP_FAILED) {
+			rp.map = NULL;
+			show_error (__func__, "Unable to map video file into memory");
+			return NULL;
+		}
 	}
 	
-	/* Write the timeval */	
+	return (guchar *) rp.map + (start - rp.map_off);
+}
+
+static gboolean video_index_frames (void)
+{
+	/* Build the index of frame times used by video_find_frames, if it hasn't
+	 * already been built.  This reads just the time stamp at the start of 
+	 * each frame.  The index is discarded whenever a time stamp is changed.
+	 */
 	
-	if (!fwrite (&rp.tv, sizeof (struct timeval), 1, rp.fp))
-		return show_error (__func__, "Error updating time stamp");
+	struct timeval tv;
+	guchar *frame;
+	guint i;
 	
-	/* Reset file postion indicator to its previous value */
+	if (rp.times)
+		return TRUE;
 	
-	if (fseeko (rp.fp, (off_t) (rp.hd_size + rp.fr_size), SEEK_CUR)) {
-		perror ("fseeko");
-		return show_error (__func__, "Error seeking frame in video file");
+	rp.times = (gdouble *) g_malloc (rp.num_frames * sizeof (gdouble));
+	rp.TimesSorted = TRUE;
+	for (i = 0; i < rp.num_frames; i++) {
+		if (!(frame = video_frame (i + 1))) {
+			g_free (rp.times);
+			rp.times = NULL;
+			return FALSE;
+		}
+		memcpy (&tv, frame, sizeof (struct timeval));
+		rp.times[i] = tv.tv_sec + tv.tv_usec / 1.0e6;
+		if (i && rp.times[i] < rp.times[i - 1])
+			rp.TimesSorted = FALSE;
 	}
 	
 	return TRUE;
 }
 
+static guint video_find_frames (gdouble start, gdouble end, guint *first, 
+                                guint *last)
+{
+	/* Find the frames with time stamps (in seconds since the epoch) from start
+	 * to end inclusive, to within TIME_TOL.  Returns the number of frames in
+	 * the range, with the first and last of them in first and last, or zero
+	 * if there are none.  If the time stamps never decrease (as recorded),
+	 * the frames are found by a binary search of the index; otherwise, first
+	 * and last are the lowest and highest numbered frames in the range.
+	 */
+	
+	guint i, lo, hi, mid, n = 0;
+	
+	if (!video_index_frames ())
+		return 0;
+	
+	start -= TIME_TOL;
+	end += TIME_TOL;
+	
+	if (rp.TimesSorted) {
+		lo = 0;                         /* First frame at or after start... */
+		hi = rp.num_frames;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (rp.times[mid] < start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		*first = lo + 1;
+		hi = rp.num_frames;             /* ...and first frame after end */
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (rp.times[mid] <= end)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		*last = lo;
+		n = *last >= *first ? *last - *first + 1 : 0;
+	} else {
+		for (i = 0; i < rp.num_frames; i++)
+			if (rp.times[i] >= start && rp.times[i] <= end) {
+				if (!n++)
+					*first = i + 1;
+				*last = i + 1;
+			}
+	}
+	
+	return n;
+}
+
+static gboolean video_parse_time (gchar *stamp, struct timeval *tv)
+{
+	/* Convert a UTC time stamp to a timeval.  The time stamp is given either
+	 * in full as shown for each frame (YYYY-MM-DDThh:mm:ss.sss) or as just
+	 * the time of day (hh:mm:ss.sss), in which case it is taken to be on the
+	 * date of the first frame, or on the next day if it is earlier than the 
+	 * time of the first frame.  The fraction of a second is optional.
+	 */
+	
+	struct tm dt;
+	struct timeval first;
+	GDate *date, *epoch;
+	gchar *rest;
+	guchar *frame;
+	
+	memset (&dt, 0, sizeof (struct tm));
+	if ((rest = strptime (stamp, "%Y-%m-%dT%T", &dt))) {
+		date = g_date_new_dmy (dt.tm_mday, 1 + dt.tm_mon, 1900 + dt.tm_year);
+		epoch = g_date_new_dmy (1, 1, 1970);
+		tv->tv_sec = (time_t) (g_date_days_between (epoch, date) * 86400);
+		g_date_free (epoch);
+		g_date_free (date);
+	} else if ((rest = strptime (stamp, "%T", &dt))) {
+		if (!(frame = video_frame (1)))
+			return FALSE;
+		memcpy (&first, frame, sizeof (struct timeval));
+		tv->tv_sec = first.tv_sec - first.tv_sec % 86400;
+		if (tv->tv_sec + dt.tm_hour * 3600 + dt.tm_min * 60 + dt.tm_sec + 1 < 
+		                                                          first.tv_sec)
+			tv->tv_sec += 86400;
+	} else
+		return FALSE;
+	
+	tv->tv_sec += dt.tm_hour * 3600 + dt.tm_min * 60 + dt.tm_sec;
+	tv->tv_usec = (*rest == '.') ? 
+			   (suseconds_t) (1.0e6 * strtod (rest, (gchar **) NULL) + 0.5) : 0;
+	if (tv->tv_usec >= 1000000)
+		tv->tv_usec = 999999;
+	
+	return TRUE;
+}
+
+static void video_range_times_to_frames (void)
+{
+	/* The first and last frames of a range may be entered as time stamps
+	 * (see video_parse_time) instead of frame numbers.  Replace them by the
+	 * numbers of the first frame at or after the first time, and the last
+	 * frame at or before the last time, respectively.  An entry that can't be
+	 * converted is cleared, so that it is reported when the range is read.
+	 */
+	
+	struct timeval tv;
+	guint first, last;
+	gchar *entry;
+	
+	entry = get_entry_string ("txtPBFirst");
+	if (strchr (entry, ':')) {
+		if (video_parse_time (entry, &tv) && video_find_frames (
+			   tv.tv_sec + tv.tv_usec / 1.0e6, G_MAXDOUBLE, &first, &last))
+			set_entry_int ("txtPBFirst", first);
+		else
+			set_entry_string ("txtPBFirst", "");
+	}
+	g_free (entry);
+	
+	entry = get_entry_string ("txtPBLast");
+	if (strchr (entry, ':')) {
+		if (video_parse_time (entry, &tv) && video_find_frames (
+			  -G_MAXDOUBLE, tv.tv_sec + tv.tv_usec / 1.0e6, &first, &last))
+			set_entry_int ("txtPBLast", last);
+		else
+			set_entry_string ("txtPBLast", "");
+	}
+	g_free (entry);
+}
+
+gboolean video_update_timestamp (gchar *stamp)
+{
+	/* Update the time stamp of the current frame (always interpreted as UTC) */
+	
+	guchar *frame;
+		
+	if (!rp.fp)
+		return FALSE;
+
+	if (!video_parse_time (stamp, &rp.tv)) {
+		L_print ("{o}Please enter the time stamp as YYYY-MM-DDThh:mm:ss.sss\n");
+		return FALSE;
+	}
+
+	/* Write the timeval into the current frame */	
+	
+	if (!(frame = video_frame (rp.cur_frame)))
+		return FALSE;
+	memcpy (frame, &rp.tv, sizeof (struct timeval));
+	g_free (rp.times);
+	rp.times = NULL;
+	
+	return TRUE;
+}
+
 void video_set_timestamps (void)
 {
 	/* Set the time stamps within the selected range.  The increment is
@@ -604,6 +1015,7 @@ void video_set_timestamps (void)
 	
 	/* Get the selected range */
 	
+	video_range_times_to_frames ();
 	if (!get_entry_int ("txtPBFirst", 1, rp.num_frames, 0, NO_PAGE, &first) ||
 	    !get_entry_int ("txtPBLast", first + 1,rp.num_frames,0,NO_PAGE,&last)) {
 		L_print ("{o}Please enter valid values for the first and last "
@@ -627,10 +1039,8 @@ void video_set_timestamps (void)
 		rp.incr_time.usec += 1e6;
 	}
 	
-	rp.cur_frame++;/* This is a bodge so that the loop code in                */
-	               /* video_iter_frames works as expected i.e. although THIS  */
-	               /* frame has been read and is being displayed, the file    */
-	               /* pointer is positioned at the beginning of the NEXT frame*/
+	rp.cur_frame++;/* video_iter_frames starts with the frame after the two   */
+	               /* that define the increment                               */
 	
 	video_action |= VA_FT;
 	loop_video_iter_frames (TRUE);
@@ -667,6 +1077,21 @@ void video_close_file (void)
 {
 	/* Close the video file and release memory */
 	
+	if (rp.export_pool) {         /* Frames being saved don't need the file, */
+		g_thread_pool_free (rp.export_pool, FALSE, TRUE); /* but finish them */
+		rp.export_pool = NULL;
+	}
+	
+	if (rp.map) {
+		munmap (rp.map, rp.map_len);
+		rp.map = NULL;
+	}
+	
+	if (rp.times) {
+		g_free (rp.times);
+		rp.times = NULL;
+	}
+	
 	if (rp.fp) {
 		fclose (rp.fp);
 		rp.fp = NULL;
@@ -677,11 +1102,6 @@ void video_close_file (void)
 		vid->disp083 = NULL;
 	}
 	
-	if (rp.vid_buf) {
-		g_free (rp.vid_buf);
-		rp.vid_buf = NULL;
-	}
-	
 	if (rp.vidfile) {
 		g_free (rp.vidfile);
 		rp.vidfile = NULL;
@@ -702,7 +1122,7 @@ gboolean video_save_frames (gchar *file, gint filetype, gboolean Range)
 	 */
 	
 	FILE *fp;
-	gint first, last, save_every;
+	glong ncpu;
 	
 	/* Check that there's an open video file */
 	
@@ -711,30 +1131,8 @@ gboolean video_save_frames (gchar *file, gint filetype, gboolean Range)
 		return FALSE;
 	}
 	
-	if (Range) {
-	
-		/* Get the range to save */
-	
-		if (!get_entry_int("txtPBFirst", 1, rp.num_frames, 0, NO_PAGE, &first)||
-	        !get_entry_int("txtPBLast", first, rp.num_frames, 0,NO_PAGE,&last)){
-		    L_print ("{o}Please enter valid values for the first and last "
-				                                                    "frames\n");
-		    return FALSE;
-	    }
-	    rp.mark_first = (guint) first;
-	    rp.mark_last = (guint) last;
-	    get_entry_int ("txtPBSaveFrames", 1, 99999, 1, NO_PAGE, &save_every);
-	    rp.mark_step = (guint) save_every;
-	    rp.cur_frame = rp.mark_first;
-	
-    } else {
-		
-		/* Set range to current frame */
-		
-		rp.mark_first = rp.cur_frame;
-		rp.mark_last = rp.cur_frame;
-		rp.mark_step = 1;		
-	}
+	if (!video_mark_frames (Range))
+		return FALSE;
 
 	/* Save the data */
 	
@@ -759,6 +1157,27 @@ gboolean video_save_frames (gchar *file, gint filetype, gboolean Range)
 			return show_error (__func__, "Unable to allocate buffer memory "
 							                              "for writing frames");
 		
+		/* Unless SExtractor photometry is to be done on the frame, the 
+		 * frames are written by a pool of threads; see video_export_batch.
+		 */
+		
+		if (!(video_action & VA_PS)) {
+			ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+			ncpu = CLAMP (ncpu, 1, EXPORT_MAX_THREADS);
+			if (!(rp.export_pool = g_thread_pool_new (&video_export_frame, 
+													  NULL, (gint) ncpu, 
+													  TRUE, NULL))) {
+				g_free (vid->r161);
+				vid->r161 = NULL;
+				return show_error (__func__, "Unable to start threads for "
+								                          "writing frames");
+			}
+			rp.batches = 0;
+			rp.saved = 0;
+			rp.ExportError = 0;
+			rp.export_start = loop_elapsed_since_first_iteration ();
+		}
+		
 		/* Set the base file name to be used for saving individual frames in
 		 * video_iter_frames.
 		 */
@@ -797,6 +1216,42 @@ gboolean video_save_frames (gchar *file, gint filetype, gboolean Range)
 	return TRUE;
 }
 
+static gboolean video_mark_frames (gboolean Range)
+{
+	/* Mark the range of frames given in the Playback window, or just the
+	 * current frame if Range is FALSE, to be saved or measured.
+	 */
+	
+	gint first, last, save_every;
+	
+	if (Range) {
+	
+		/* Get the range to save */
+	
+		video_range_times_to_frames ();
+		if (!get_entry_int("txtPBFirst", 1, rp.num_frames, 0, NO_PAGE, &first)||
+	        !get_entry_int("txtPBLast", first, rp.num_frames, 0,NO_PAGE,&last)){
+		    L_print ("{o}Please enter valid values for the first and last "
+				                                                    "frames\n");
+		    return FALSE;
+	    }
+	    rp.mark_first = (guint) first;
+	    rp.mark_last = (guint) last;
+	    get_entry_int ("txtPBSaveFrames", 1, 99999, 1, NO_PAGE, &save_every);
+	    rp.mark_step = (guint) save_every;
+	    rp.cur_frame = rp.mark_first;
+	
+    } else {
+		
+		/* Set range to current frame */
+		
+		rp.mark_first = rp.cur_frame;
+		rp.mark_last = rp.cur_frame;
+		rp.mark_step = 1;		
+	}
+	return TRUE;
+}
+
 gboolean video_iter_frames (gboolean Final)
 {
 	/* Iterate over selected frames performing desired action until done.  Note
@@ -808,15 +1263,19 @@ gboolean video_iter_frames (gboolean Final)
 	 */
 	
 	static FILE *fp = NULL;
+	struct frame_batch *batch;
 	gushort xo1, xo2, yo1, yo2;
-	guint next;
-	gint j, r, c, sec, usec;
+	guchar *frame;
+	guint next, last, frames;
+	gint j, r, c, sec, usec, err;
 	gint exit;
 	static gchar *filename = NULL;
 	gchar *strnum;
 	gchar *s = NULL;
 	
 	if (!rp.fp) {
+		if (video_action & VA_PR)
+			video_photom_finish ();
 		loop_video_iter_frames (FALSE);
 		video_action = VA_NONE;
 		return FALSE;
@@ -842,6 +1301,7 @@ gboolean video_iter_frames (gboolean Final)
 
 	} else if (video_action & VA_FT) {           /* Set frame time stamps */
 		if (Final) {
+			rp.disp_frame = 0;                  /* Show the new time stamp */
 			video_show_frame (rp.cur_frame);
 			L_print ("Set time stamps for frames %d to %d\n", 
 											       rp.mark_first, rp.mark_last);
@@ -850,13 +1310,13 @@ gboolean video_iter_frames (gboolean Final)
 		}
 		
 		/* Set frame time stamps according to time stamp of first frame
-		 * and the increment between the first and second frames.  Do this
-		 * in batches of 100 frames, allowing the user to cancel between 
-		 * batches.
+		 * and the increment between the first and second frames.  The time
+		 * stamps are written straight into the mapped file.  Do this in 
+		 * batches of 1000 frames, allowing the user to cancel between batches.
 		 */
 		
 		next = rp.cur_frame;
-		for (rp.cur_frame = next; rp.cur_frame < next + 100; rp.cur_frame++) {
+		for (rp.cur_frame = next; rp.cur_frame < next + 1000; rp.cur_frame++){
 												 
 			if (rp.cur_frame > rp.mark_last) {   /* Got to end of sequence */
 				rp.cur_frame--;
@@ -879,22 +1339,27 @@ gboolean video_iter_frames (gboolean Final)
 			
 			/* Write the timeval */	
 
-			if (!fwrite (&rp.tv, sizeof (struct timeval), 1, rp.fp))
-				return show_error (__func__, "Error updating time stamp");
-			
-			/* Seek to beginning of next frame */
-
-			if (rp.cur_frame < rp.mark_last)
-				if (fseeko (rp.fp, (off_t) (rp.hd_size + rp.fr_size - 
-									      sizeof (struct timeval)), SEEK_CUR)) {
-					perror ("fseeko");
-					return show_error (__func__, "Error seeking frame in "
-															      "video file");
-				}
+			if (!(frame = video_frame (rp.cur_frame))) {
+				loop_video_iter_frames (FALSE);
+				return FALSE;
+			}
+			memcpy (frame, &rp.tv, sizeof (struct timeval));
 		}
+		g_free (rp.times);                  /* Index is now out of date */
+		rp.times = NULL;
 			
 	} else if (video_action & VA_SF) {           /* Save frames as FITS files */
 		if (Final) {
+			if (rp.export_pool) {     /* Wait for frames already queued */
+				g_thread_pool_free (rp.export_pool, FALSE, TRUE);
+				rp.export_pool = NULL;
+				if ((err = g_atomic_int_get (&rp.ExportError)))
+					show_error (__func__, g_strerror (err));
+				L_print ("Saved %d frames as %s_NNNNNN.fit in %.1fs\n",
+						 rp.saved, filename ? filename : rp.savefile,
+						 (loop_elapsed_since_first_iteration () - 
+						  rp.export_start) / 1000.0);
+			}
             video_show_frame (rp.cur_frame);
 			if (video_action & VA_PS) {
 				s = g_strdup_printf("%s --%s "
@@ -950,10 +1415,14 @@ gboolean video_iter_frames (gboolean Final)
 			return TRUE;
 		}
 
-		/* Save selected frames as FITS files in batches of 10, allowing the
-		 * user to cancel between batches.  Note that r161 is gushort and  
-		 * vid_buf is guchar, so we can't do a memcpy.  Perform photometry on
-		 * saved frames if requested.
+		/* Save selected frames as FITS files in batches, allowing the user to
+		 * cancel between batches.  Without photometry, the frames are handed
+		 * to the export threads EXPORT_BATCH at a time, and this returns 
+		 * without queuing more whilst EXPORT_MAX_BATCHES are in hand.  With
+		 * SExtractor photometry (of a single frame; ranges are measured in
+		 * process, see VA_PR below), the frame is saved here for SExtractor.
+		 * Note that r161 is gushort and the frame is guchar, so we can't do a
+		 * memcpy.
 		 */
 
 		if (!filename && rp.savefile) {         /* Save base part of filename */
@@ -961,6 +1430,25 @@ gboolean video_iter_frames (gboolean Final)
 			g_free (rp.savefile);
 			rp.savefile = NULL;
 		}
+		
+		if (rp.export_pool) {
+			if (g_atomic_int_get (&rp.ExportError)) {
+				loop_video_iter_frames (FALSE);
+				return FALSE;
+			}
+			if (g_atomic_int_get (&rp.batches) >= EXPORT_MAX_BATCHES)
+				return TRUE;
+			if (!is_in_image (vid, &xo1, &yo1, &xo2, &yo2)) {
+				L_print ("{o}No video frame within selection rectangle!\n");
+				loop_video_iter_frames (FALSE);
+				return FALSE;
+			}
+			if (!video_export_batch (xo1, yo1, xo2, yo2, filename)) {
+				loop_video_iter_frames (FALSE);
+				return FALSE;
+			}
+			return TRUE;
+		}
 			
 		next = rp.cur_frame;
 		for (rp.cur_frame = next; rp.cur_frame < next + 10 * rp.mark_step; 
@@ -979,12 +1467,14 @@ gboolean video_iter_frames (gboolean Final)
 				rp.savefile = g_strconcat (filename, "_", strnum, ".fit", NULL);
 				g_free (strnum);
 				video_show_frame (rp.cur_frame);
+				if (!(frame = video_frame (rp.cur_frame))) {
+					loop_video_iter_frames (FALSE);
+					return FALSE;
+				}
 				for (j = 0, r = yo1; r <= yo2; r++)
 					for (c = xo1; c <= xo2; c++)
-						vid->r161[j++] =rp.vid_buf[(r * rp.h) + c + rp.hd_size];
+						vid->r161[j++] = frame[(r * rp.h) + c + rp.hd_size];
                 image_save_as_fits (vid, rp.savefile, GREY, FALSE);
-                if (!(video_action & VA_PS))
-                    L_print ("Saved %s\n", rp.savefile);
                 if (video_action & VA_PS) {   /* Performing photometry... */
                     s = g_strdup_printf("%s --%s "
                                         "--hoffset %d "
@@ -1018,12 +1508,6 @@ gboolean video_iter_frames (gboolean Final)
                                         phot.aperture);
                     g_spawn_command_line_sync (s, NULL, NULL, &exit, NULL);
                     g_free (s);
-                    /* If called with phot.type = "InitRange", this must next */
-                    /*  be called with phot.type = "Range".  If it was called */
-                    /*  with phot.type = "Single", then it will be called only*/
-                    /*  once anyway, so either way we can just set phot.type  */
-                    /*  to "Range" here.                                      */
-                    phot.type = "Range";
                 }
 			} else {
 				L_print ("{o}No video frame within selection rectangle!\n");
@@ -1032,6 +1516,42 @@ gboolean video_iter_frames (gboolean Final)
 			}
 		}
 		
+	} else if (video_action & VA_PR) {  /* Photometry on a range of frames */
+		if (Final) {
+			video_photom_finish ();
+			video_action = VA_NONE;
+			return TRUE;
+		}
+		
+		/* Measure the marked frames in batches of PHOT_BATCH, allowing the
+		 * user to cancel between batches.  Each batch is mapped from the
+		 * video file and measured in place, in order, since each frame's
+		 * stars are looked for where they were in the frame before.  The
+		 * last frame measured is shown as the current frame.
+		 */
+		
+		next = phot.measured ? rp.cur_frame + rp.mark_step : rp.cur_frame;
+		last = next + (PHOT_BATCH - 1) * rp.mark_step;
+		if (last > rp.mark_last)
+			last = rp.mark_last - (rp.mark_last - next) % rp.mark_step;
+		if (!(batch = video_map_frames (next, last))) {
+			loop_video_iter_frames (FALSE);
+			return FALSE;
+		}
+		for (; next <= last; next += rp.mark_step)
+			video_photom_frame (batch->frames + (gsize) (next - batch->first) *
+							    (rp.hd_size + rp.fr_size), next);
+		video_unmap_frames (batch);
+		
+		if (ferror (phot.table)) {
+			loop_video_iter_frames (FALSE);
+			return show_error (__func__, "Error writing photometry table");
+		}
+		rp.cur_frame = last;
+		video_show_frame (rp.cur_frame);
+		if (rp.cur_frame + rp.mark_step > rp.mark_last)  /* Got to end */
+			loop_video_iter_frames (FALSE);
+		
 	} else if (video_action & VA_SV) {          /* Save frames as VID file */
 		if (Final) {
 			video_show_frame (rp.cur_frame);
@@ -1049,42 +1569,34 @@ gboolean video_iter_frames (gboolean Final)
 		}
 		
 		/* Save selected frames as VID file in batches of 100, allowing the 
-		 * user to cancel between batches.
+		 * user to cancel between batches.  The frames in each batch are
+		 * contiguous in the file, so they are mapped into memory and written
+		 * out in one go.
 		 */
 
+		last = MIN (rp.cur_frame + 99, rp.mark_last);
+		frames = last - rp.cur_frame + 1;
+		if (!(batch = video_map_frames (rp.cur_frame, last))) {
+			loop_video_iter_frames (FALSE);
+			return FALSE;
+		}
 		if (!(fp = fopen (rp.savefile, "ab"))) {
+			video_unmap_frames (batch);
 			loop_video_iter_frames (FALSE);
 			return show_error (__func__, "Can't save to video file!");
 		}
-		video_show_frame (rp.cur_frame);
-		next = rp.cur_frame;
-		for (rp.cur_frame = next; rp.cur_frame < next + 100; rp.cur_frame++) {  
-												 
-			if (rp.cur_frame > rp.mark_last) {  /* Got to end of sequence */
-				rp.cur_frame--;
-				loop_video_iter_frames (FALSE);
-				break;
-			}
-			
-			/* This is potentially quite inefficient, but buffering the
-			 * data to read and write bigger chunks in one go didn't seem
-			 * to make much difference.  Probably the operating system does that
-             * anyway.
-			 */
-			
-			if (!fwrite (rp.vid_buf, (rp.hd_size + rp.fr_size) *
-												  sizeof (guchar), 1, fp)) {
-				loop_video_iter_frames (FALSE);
-				return show_error (__func__, "Error writing video frame");
-			}
-			if (rp.cur_frame < rp.mark_last)
-				if (!fread (rp.vid_buf, (rp.hd_size + rp.fr_size) *
-											   sizeof (guchar), 1, rp.fp)) {
-				loop_video_iter_frames (FALSE);
-				return show_error (__func__, "Error reading video frame");
-			}
-			
+		if (fwrite (batch->frames, rp.hd_size + rp.fr_size, frames, fp) != 
+		                                                              frames) {
+			video_unmap_frames (batch);
+			loop_video_iter_frames (FALSE);
+			return show_error (__func__, "Error writing video frame");
 		}
+		video_unmap_frames (batch);
+		video_show_frame (last);
+		if (last == rp.mark_last)             /* Got to end of sequence */
+			loop_video_iter_frames (FALSE);
+		else
+			rp.cur_frame = last + 1;
 		fclose (fp);
 		fp = NULL;
 
@@ -1092,10 +1604,148 @@ gboolean video_iter_frames (gboolean Final)
 	return TRUE;
 }
 
+static gboolean video_export_batch (gushort xo1, gushort yo1, gushort xo2, 
+                                    gushort yo2, gchar *filename)
+{
+	/* Queue the next batch of marked frames, starting at rp.cur_frame, to be
+	 * saved as FITS files by the export threads.  The region (xo1, yo1) to
+	 * (xo2, yo2) of each frame is saved.  The headers are built here, since
+	 * that needs the user interface, and the threads copy the data straight
+	 * from the mapped video file.  The mapping is released by whichever
+	 * thread saves the last frame of the batch.
+	 */
+
+	struct frame_batch *batch;
+	struct frame_job *job;
+	struct timeval tv;
+	guint last, frame;
+	
+	last = rp.cur_frame + (EXPORT_BATCH - 1) * rp.mark_step;
+	if (last > rp.mark_last)
+		last = rp.mark_last - (rp.mark_last - rp.cur_frame) % rp.mark_step;
+	if (!(batch = video_map_frames (rp.cur_frame, last)))
+		return FALSE;
+	batch->pending = (last - rp.cur_frame) / rp.mark_step + 1;
+	g_atomic_int_inc (&rp.batches);
+	
+	vid->exd.h_pix = xo2 - xo1 + 1;      /* reset to rp.h on 'Final' call */
+	vid->exd.v_pix = yo2 - yo1 + 1;      /* reset to rp.v on 'Final' call */
+	for (frame = rp.cur_frame; frame <= last; frame += rp.mark_step) {
+		job = g_new (struct frame_job, 1);
+		job->batch = batch;
+		job->frame = batch->frames + (gsize) (frame - batch->first) * 
+		                                  (rp.hd_size + rp.fr_size) + rp.hd_size;
+		memcpy (&tv, job->frame - rp.hd_size, sizeof (struct timeval));
+		set_fits_data (vid, &tv, TRUE, FALSE);
+		job->head_len = image_fits_header (vid, job->header, GREY, FALSE);
+		job->file = g_strdup_printf ("%s_%06i.fit", filename, frame);
+		job->xo1 = xo1;
+		job->yo1 = yo1;
+		job->h_pix = vid->exd.h_pix;
+		job->v_pix = vid->exd.v_pix;
+		g_thread_pool_push (rp.export_pool, job, NULL);
+	}
+	
+	/* Show the last frame of the batch to indicate progress */
+	
+	video_show_frame (last);
+	if (last + rp.mark_step > rp.mark_last)  /* Got to end of sequence */
+		loop_video_iter_frames (FALSE);
+	else
+		rp.cur_frame = last + rp.mark_step;
+	
+	return TRUE;
+}
+
+static void video_export_frame (gpointer data, gpointer user_data)
+{
+	/* Save a frame queued by video_export_batch as a FITS file.  This runs in
+	 * one of the export threads.  The 8-bit data are written directly from
+	 * the mapped file if the whole width of the frame is saved; otherwise
+	 * the region is copied out first.
+	 */
+	
+	struct frame_job *job = (struct frame_job *) data;
+	const guchar *src;
+	guchar *roi = NULL;
+	gint r;
+	
+	if (job->h_pix == rp.h) {
+		src = job->frame + (gsize) job->yo1 * rp.h;
+	} else {
+		roi = g_malloc (job->h_pix * job->v_pix);
+		for (r = 0; r < job->v_pix; r++)
+			memcpy (roi + r * job->h_pix, 
+					job->frame + (gsize) (job->yo1 + r) * rp.h + job->xo1,
+					job->h_pix);
+		src = roi;
+	}
+	
+	if (!g_atomic_int_get (&rp.ExportError)) {
+		if (fits_write_image (job->file, job->header, job->head_len, src, 1, 1,
+							  job->h_pix, job->v_pix))
+			g_atomic_int_inc (&rp.saved);
+		else
+			g_atomic_int_compare_and_exchange (&rp.ExportError, 0, 
+											   errno ? errno : EIO);
+	}
+	
+	g_free (roi);
+	g_free (job->file);
+	if (g_atomic_int_dec_and_test (&job->batch->pending)) {
+		video_unmap_frames (job->batch);
+		g_atomic_int_add (&rp.batches, -1);
+	}
+	g_free (job);
+}
+
+static struct frame_batch *video_map_frames (guint first, guint last)
+{
+	/* Map frames first to last of the open video file into memory, read-only.
+	 * Returns NULL (having shown an error) on failure.
+	 */
+	
+	struct frame_batch *batch;
+	off_t start, end, page;
+	
+	page = sysconf (_SC_PAGESIZE);
+	start = sizeof (struct video_header) + 
+	                           (off_t) (first - 1) * (rp.hd_size + rp.fr_size);
+	end = sizeof (struct video_header) + 
+	                                  (off_t) last * (rp.hd_size + rp.fr_size);
+	
+	batch = g_new (struct frame_batch, 1);
+	batch->len = end - start / page * page;
+	batch->map = mmap (NULL, batch->len, PROT_READ, MAP_SHARED, 
+					   fileno (rp.fp), start / page * page);
+	if (batch->map == MAP_FAILED) {
+		g_free (batch);
+		show_error (__func__, "Unable to map video file into memory");
+		return NULL;
+	}
+	madvise (batch->map, batch->len, MADV_SEQUENTIAL);
+	batch->frames = (const guchar *) batch->map + start % page;
+	batch->first = first;
+	
+	return batch;
+}
+
+static void video_unmap_frames (struct frame_batch *batch)
+{
+	/* Release frames mapped by video_map_frames */
+	
+	munmap (batch->map, batch->len);
+	g_free (batch);
+}
+
 void video_photom_frames (gfloat aperture, gfloat minarea, gfloat thresh,
 						  gfloat shift, gboolean Range)
 {
-	/* Perform photometry on video frame(s) */
+	/* Perform photometry on video frame(s).  A single frame is saved as a
+	 * FITS file and SExtractor finds and measures the stars in it.  A range
+	 * of frames is measured here, following the stars that SExtractor found 
+	 * in the single frame from one frame to the next (see video_photom_star).
+	 */
 	
 	/* Save photometry parameters */
 	
@@ -1103,15 +1753,312 @@ void video_photom_frames (gfloat aperture, gfloat minarea, gfloat thresh,
 	phot.thresh = thresh;
 	phot.aperture = aperture;
 	phot.shift = shift;
-	phot.type = Range ? "InitRange" : "Single";
+	phot.type = "Single";
+	
+	if (Range) {
+		if (!rp.fp) {
+			msg ("Warning - No video frames to measure!");
+			return;
+		}
+		if (!video_mark_frames (TRUE) || !video_photom_start ())
+			return;
+		video_action |= VA_PR;
+		loop_video_iter_frames (TRUE);
+		return;
+	}
 	
 	/* Set flag to perform photometry after saving frame */
 	
 	video_action |= VA_PS;
 	
-	/* Save frame(s) */
+	/* Save frame */
+	
+	video_save_frames (NULL, SVF_FITS, FALSE);
+}
+
+static gboolean video_photom_start (void)
+{
+	/* Get ready to measure the marked range of frames: read the positions of
+	 * the stars from the catalog written by the last SExtractor photometry,
+	 * and open a new photometry table for the results.  The table has one 
+	 * row per frame: the frame number, its time stamp (in seconds since the
+	 * start of the UT day of the first frame, so the times carry on past 
+	 * midnight), then the flux, flux error and x and y position in the video
+	 * frame of each star in turn, and finally the average sky level.  The
+	 * tables are numbered as the SExtractor script numbers its catalogs.
+	 */
+	
+	struct timeval tv;
+	guchar *frame;
+	gdouble x, y;
+	gint i, n, v;
+	gchar *buffer, **lines, *s1, *s2;
+	
+	if (!is_in_image (vid, &phot.xo1, &phot.yo1, &phot.xo2, &phot.yo2)) {
+		L_print ("{o}No video frame within selection rectangle!\n");
+		return FALSE;
+	}
+	v = phot.yo2 - phot.yo1 + 1;
+	phot.measured = 0;
+	
+	/* Catalog positions are as SExtractor measured them in the region saved
+	 * as a FITS file: from 1 at the left, and from 1 at the bottom since the
+	 * rows were saved in reverse order.
+	 */
+	
+	if (!g_file_get_contents (GOQAT_SEXTRACTOR_RESULTS, &buffer, NULL, NULL)) {
+		L_print ("{o}Please do photometry on a single frame first, to find "
+				 "the stars to measure\n");
+		return FALSE;
+	}
+	lines = g_strsplit (buffer, "\n", -1);
+	g_free (buffer);
+	phot.stars = g_new0 (struct phot_star, g_strv_length (lines) + 1);
+	phot.nstars = 0;
+	for (i = 0; lines[i]; i++) {
+		n = (gint) strtol (lines[i], &s1, 10);
+		x = strtod (s1, &s2);
+		y = strtod (s2, NULL);
+		if (n <= 0)
+			continue;
+		phot.stars[phot.nstars].x = phot.xo1 + x - 1.0;
+		phot.stars[phot.nstars].y = phot.yo1 + v - y;
+		phot.stars[phot.nstars].frame = rp.mark_first;
+		phot.nstars++;
+	}
+	g_strfreev (lines);
+	if (!phot.nstars) {
+		L_print ("{o}No stars in %s to measure\n", GOQAT_SEXTRACTOR_RESULTS);
+		g_free (phot.stars);
+		phot.stars = NULL;
+		return FALSE;
+	}
+	
+	/* Open the next free table and note the start of the first frame's day */
+	
+	for (i = 0; ; i++) {
+		phot.table_file = g_strdup_printf ("%s_photom_%d.txt", rp.vidfile, i);
+		phot.catalog_file = g_strdup_printf ("%s_catalog_%d.txt",rp.vidfile,i);
+		if (!g_file_test (phot.table_file, G_FILE_TEST_EXISTS) &&
+			!g_file_test (phot.catalog_file, G_FILE_TEST_EXISTS))
+			break;
+		g_free (phot.table_file);
+		g_free (phot.catalog_file);
+	}
+	if (!(phot.table = fopen (phot.table_file, "w"))) {
+		show_error (__func__, "Can't open photometry table for writing");
+		video_photom_finish ();
+		return FALSE;
+	}
+	fprintf (phot.table, "# frame\ttime");
+	for (i = 1; i <= phot.nstars; i++)
+		fprintf (phot.table, "\tflux_%d\terr_%d\tx_%d\ty_%d", i, i, i, i);
+	fprintf (phot.table, "\tsky\n");
+	
+	if (!(frame = video_frame (rp.mark_first))) {
+		video_photom_finish ();
+		return FALSE;
+	}
+	memcpy (&tv, frame, sizeof (struct timeval));
+	phot.day = tv.tv_sec - tv.tv_sec % 86400;
+	
+	L_print ("Measuring %d stars in frames %d to %d\n", phot.nstars, 
+			 rp.mark_first, rp.mark_last);
+	return TRUE;
+}
+
+static void video_photom_frame (const guchar *frame, guint num)
+{
+	/* Measure every star in a frame (starting with its header) and add a row
+	 * for it to the photometry table.
+	 */
+	
+	struct timeval tv;
+	gdouble sky = 0.0;
+	gint i;
+	
+	memcpy (&tv, frame, sizeof (struct timeval));
+	fprintf (phot.table, "%u\t%.6f", num, 
+			 (gdouble) (tv.tv_sec - phot.day) + tv.tv_usec / 1.0e6);
+	for (i = 0; i < phot.nstars; i++) {
+		video_photom_star (frame + rp.hd_size, &phot.stars[i], num);
+		fprintf (phot.table, "\t%.4f\t%.4f\t%.3f\t%.3f", 
+				 phot.stars[i].flux, phot.stars[i].err,
+				 phot.stars[i].x, phot.stars[i].y);
+		sky += phot.stars[i].sky;
+	}
+	fprintf (phot.table, "\t%.4f\n", sky / phot.nstars);
+	phot.measured++;
+}
+
+static void video_photom_star (const guchar *data, struct phot_star *star,
+							   guint num)
+{
+	/* Find a star near where it was in the previous frame and measure it.
+	 * The star's new position is the centroid of the pixels more than 
+	 * phot.thresh standard deviations above the sky, within phot.shift of 
+	 * the old position plus the aperture radius.  If there are none, or the
+	 * centroid is more than phot.shift away, the star is taken to be where
+	 * it was (as when it disappears in an occultation).  The flux is then 
+	 * summed in a circular aperture of diameter phot.aperture, less the sky
+	 * level measured in an annulus around it.  The error is from the scatter
+	 * of the sky values, as SExtractor gives it with GAIN 0.
+	 */
+	
+	gdouble r_ap, r_search, sky, sigma, val, sum, sx, sy, dx, dy, cx, cy;
+	gint c, r, c1, c2, r1, r2, n, nsky;
+	
+	r_ap = phot.aperture / 2.0;
+	r_search = r_ap + phot.shift;
+	
+	/* Find the star */
+	
+	if (video_photom_sky (data, star->x, star->y, &sky, &sigma)) {
+		c1 = MAX ((gint) floor (star->x - r_search), phot.xo1);
+		c2 = MIN ((gint) ceil (star->x + r_search), phot.xo2);
+		r1 = MAX ((gint) floor (star->y - r_search), phot.yo1);
+		r2 = MIN ((gint) ceil (star->y + r_search), phot.yo2);
+		sum = sx = sy = 0.0;
+		for (r = r1; r <= r2; r++) {
+			for (c = c1; c <= c2; c++) {
+				dx = c - star->x;
+				dy = r - star->y;
+				val = data[r * rp.h + c] - sky;
+				if (dx * dx + dy * dy <= r_search * r_search &&
+					val > phot.thresh * sigma && val > 0.0) {
+					sum += val;
+					sx += val * c;
+					sy += val * r;
+				}
+			}
+		}
+		if (sum > 0.0) {
+			cx = sx / sum;
+			cy = sy / sum;
+			if (hypot (cx - star->x, cy - star->y) <= phot.shift) {
+				star->x = cx;
+				star->y = cy;
+				star->frame = num;
+			}
+		}
+	}
+	
+	/* Measure it */
+	
+	nsky = video_photom_sky (data, star->x, star->y, &sky, &sigma);
+	c1 = MAX ((gint) floor (star->x - r_ap), phot.xo1);
+	c2 = MIN ((gint) ceil (star->x + r_ap), phot.xo2);
+	r1 = MAX ((gint) floor (star->y - r_ap), phot.yo1);
+	r2 = MIN ((gint) ceil (star->y + r_ap), phot.yo2);
+	sum = 0.0;
+	n = 0;
+	for (r = r1; r <= r2; r++) {
+		for (c = c1; c <= c2; c++) {
+			dx = c - star->x;
+			dy = r - star->y;
+			if (dx * dx + dy * dy <= r_ap * r_ap) {
+				sum += data[r * rp.h + c];
+				n++;
+			}
+		}
+	}
+	star->sky = sky;
+	star->flux = sum - n * sky;
+	star->err = nsky ? sigma * sqrt (n * (1.0 + (gdouble) n / nsky)) : 0.0;
+}
+
+static gint video_photom_sky (const guchar *data, gdouble x, gdouble y,
+							  gdouble *sky, gdouble *sigma)
+{
+	/* Measure the sky level per pixel and its standard deviation in an 
+	 * annulus PHOT_SKY_GAP outside the aperture around (x, y) and 
+	 * PHOT_SKY_WIDTH wide.  Values more than three standard deviations from
+	 * the mean (stars, hot pixels) are rejected once and the rest averaged.
+	 * Returns the number of values used, or zero (with the sky and sigma set
+	 * to zero) if there are none.
+	 */
+	
+	gdouble r_in, r_out, d2, val, sum, sum2, mean, sd;
+	gint c, r, c1, c2, r1, r2, n, pass;
+	
+	r_in = phot.aperture / 2.0 + PHOT_SKY_GAP;
+	r_out = r_in + PHOT_SKY_WIDTH;
+	c1 = MAX ((gint) floor (x - r_out), phot.xo1);
+	c2 = MIN ((gint) ceil (x + r_out), phot.xo2);
+	r1 = MAX ((gint) floor (y - r_out), phot.yo1);
+	r2 = MIN ((gint) ceil (y + r_out), phot.yo2);
+	
+	mean = sd = 0.0;
+	n = 0;
+	for (pass = 0; pass < 2; pass++) {
+		sum = sum2 = 0.0;
+		n = 0;
+		for (r = r1; r <= r2; r++) {
+			for (c = c1; c <= c2; c++) {
+				d2 = (c - x) * (c - x) + (r - y) * (r - y);
+				val = data[r * rp.h + c];
+				if (d2 < r_in * r_in || d2 > r_out * r_out ||
+					(pass && fabs (val - mean) > 3.0 * sd))
+					continue;
+				sum += val;
+				sum2 += val * val;
+				n++;
+			}
+		}
+		if (!n)
+			break;
+		mean = sum / n;
+		sd = sqrt (MAX (sum2 / n - mean * mean, 0.0));
+	}
+	*sky = n ? mean : 0.0;
+	*sigma = n ? sd : 0.0;
+	return n;
+}
+
+static void video_photom_finish (void)
+{
+	/* Finish measuring a range of frames: close the photometry table, write
+	 * the stars' last positions and measurements as a catalog in the format
+	 * SExtractor uses (with the frame in which each was last found), and show
+	 * them on the current frame.
+	 */
+	
+	FILE *fp;
+	gint i, v;
+	
+	if (phot.table) {
+		fclose (phot.table);
+		phot.table = NULL;
+		L_print ("Measured %u frames; results are in %s\n", phot.measured,
+				 phot.table_file);
+	}
+	
+	if (phot.stars && phot.measured && (fp = fopen (phot.catalog_file, "w"))){
+		v = phot.yo2 - phot.yo1 + 1;
+		for (i = 0; i < phot.nstars; i++)
+			fprintf (fp, "%10d %10.3f %10.3f %12.4f %12.4f %12.4f %3d %u\n", 
+					 i + 1, phot.stars[i].x - phot.xo1 + 1.0,
+					 phot.yo1 + v - phot.stars[i].y, phot.stars[i].flux,
+					 phot.stars[i].err, phot.stars[i].sky,
+					 phot.stars[i].frame == rp.mark_last ? 0 : 1,
+					 phot.stars[i].frame);
+		fclose (fp);
+		unlink (GOQAT_SEXTRACTOR_RESULTS);
+		if (symlink (phot.catalog_file, GOQAT_SEXTRACTOR_RESULTS))
+			L_print ("{o}Can't link %s to %s\n", GOQAT_SEXTRACTOR_RESULTS,
+					 phot.catalog_file);
+		vid->exd.v_pix = v;               /* As the catalog, for display */
+		ui_show_photom_points (GOQAT_SEXTRACTOR_RESULTS, phot.aperture);
+		vid->exd.v_pix = rp.v;
+	}
 	
-	video_save_frames (NULL, SVF_FITS, Range);
+	g_free (phot.stars);
+	phot.stars = NULL;
+	phot.nstars = 0;
+	g_free (phot.table_file);
+	phot.table_file = NULL;
+	g_free (phot.catalog_file);
+	phot.catalog_file = NULL;
 }
 
 struct cam_img *get_vid_image_struct (void)
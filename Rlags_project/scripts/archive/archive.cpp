@@ -0,0 +1,89 @@
+/*
+ * Command line front end to the mirrored archive writer, for the bash loops.
+ *
+ *   archive append <path> [file]   append file (or stdin) to <path> on every SSD
+ *   archive put <path> <file>      store file as a new <path> on every SSD
+ *   archive verify <path>          check every mirror copy against its checksums
+ *
+ * <path> is relative to the mirror roots, e.g. "polarizer/stream.<start>.txt".
+ * Exit status is 0 when every mirror succeeded, 2 when at least one mirror
+ * failed but a copy was still stored, and 1 when nothing could be stored.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iostream>
+
+#include "archiveWriter.hpp"
+#include "latestData.hpp"
+
+static int verify(const std::string& relPath)
+{
+  std::vector<std::string> roots = defaultMirrors();
+  int result = 0;
+
+  for (size_t i = 0; i < roots.size(); i++)
+  {
+    std::string report;
+    long bad = verifyArchive(roots[i], relPath, report);
+    std::cout << report;
+    if (bad != 0)
+    {
+      std::cout << "Archive: " << roots[i] << "/" << relPath << " failed verification" << std::endl;
+      result = 2;
+    }
+  }
+  return result;
+}
+
+int main(int argc, char const *argv[])
+{
+  if (argc < 3 || (strcmp(argv[1], "put") == 0 && argc < 4))
+  {
+    printf("archive append [Path][File]\narchive put [Path][File]\narchive verify [Path]\n");
+    return 1;
+  }
+
+  std::string command = argv[1];
+  std::string relPath = argv[2];
+
+  if (command == "verify")
+    return verify(relPath);
+  if (command != "append" && command != "put")
+  {
+    printf("archive: unknown command %s\n", argv[1]);
+    return 1;
+  }
+
+  int fd = argc > 3 ? open(argv[3], O_RDONLY) : STDIN_FILENO;
+  if (fd == -1)
+  {
+    perror(("archive: cannot open " + std::string(argv[3])).c_str());
+    return 1;
+  }
+
+  std::vector<MirrorStatus> status;
+  bool stored;
+  {
+    ArchiveFile file(defaultMirrors(), relPath, command == "put");
+    stored = file.appendFd(fd) && file.flush();
+    status = file.status();
+  }
+  if (fd != STDIN_FILENO)
+    close(fd);
+
+  int result = stored ? 0 : 1;
+  for (size_t i = 0; i < status.size(); i++)
+  {
+    if (status[i].healthy)
+      continue;
+    std::cout << "Archive: mirror " << status[i].root << " failed: " << status[i].error << std::endl;
+    if (result == 0)
+      result = 2;
+  }
+
+  publishArchiveStatus(status);
+  return result;
+}
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sstream>
+
+#include "archiveWriter.hpp"
+#include "crc32c.hpp"
+#include "latestData.hpp"
+
+// blocks queued per mirror before append() waits for the writers to catch up
+static const size_t MAX_QUEUED_BLOCKS = 64;
+
+std::vector<std::string> defaultMirrors()
+{
+  std::vector<std::string> roots;
+  const char* env = getenv("ARCHIVE_MIRRORS");
+  std::string list = env ? env : "/media/ssd_0:/media/ssd_1";
+
+  std::stringstream ss(list);
+  std::string root;
+  while (std::getline(ss, root, ':'))
+    if (!root.empty())
+      roots.push_back(root);
+  return roots;
+}
+
+static bool makeParentDirs(const std::string& path)
+{
+  for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+  {
+    std::string dir = path.substr(0, slash);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
+
+static bool writeAllAt(int fd, const char* data, size_t size, unsigned long long offset)
+{
+  while (size > 0)
+  {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+ArchiveFile::ArchiveFile(const std::vector<std::string>& roots, const std::string& relPath, bool truncate)
+: relPath_(relPath),
+  stopping_(false)
+{
+  for (size_t i = 0; i < roots.size(); i++)
+  {
+    std::unique_ptr<Mirror> m(new Mirror);
+    m->status.root = roots[i];
+    m->status.healthy = true;
+    m->status.bytesWritten = 0;
+    m->fd = -1;
+    m->crcFd = -1;
+    m->offset = 0;
+    m->unsynced = 0;
+    m->syncRequested = false;
+
+    open(*m, truncate);
+    if (m->status.healthy)
+      m->worker = std::thread(&ArchiveFile::run, this, std::ref(*m));
+    mirrors_.push_back(std::move(m));
+  }
+}
+
+ArchiveFile::~ArchiveFile()
+{
+  flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+
+  for (size_t i = 0; i < mirrors_.size(); i++)
+  {
+    Mirror& m = *mirrors_[i];
+    if (m.worker.joinable())
+      m.worker.join();
+    if (m.fd != -1)
+      close(m.fd);
+    if (m.crcFd != -1)
+      close(m.crcFd);
+  }
+}
+
+void ArchiveFile::fail(Mirror& m, const std::string& what)
+{
+  m.status.healthy = false;
+  m.status.error = what + ": " + strerror(errno);
+  m.queue.clear();
+  m.syncRequested = false;
+}
+
+void ArchiveFile::open(Mirror& m, bool truncate)
+{
+  // an SSD that failed to mount leaves an empty directory on the root filesystem
+  struct stat rootStat, mirrorStat;
+  if (stat(m.status.root.c_str(), &mirrorStat) == -1)
+  {
+    fail(m, "mirror missing");
+    return;
+  }
+  if (stat("/", &rootStat) == 0 && rootStat.st_dev == mirrorStat.st_dev)
+  {
+    errno = ENODEV;
+    fail(m, "mirror not mounted");
+    return;
+  }
+
+  std::string path = m.status.root + "/" + relPath_;
+  if (!makeParentDirs(path))
+  {
+    fail(m, "cannot create directory for " + path);
+    return;
+  }
+
+  int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0);
+  m.fd = ::open(path.c_str(), flags, 0644);
+  if (m.fd == -1)
+  {
+    fail(m, "cannot open " + path);
+    return;
+  }
+
+  m.crcFd = ::open((path + ".crc32c").c_str(), flags | O_APPEND, 0644);
+  if (m.crcFd == -1)
+  {
+    fail(m, "cannot open checksums for " + path);
+    return;
+  }
+
+  struct stat st;
+  if (fstat(m.fd, &st) == -1)
+  {
+    fail(m, "cannot stat " + path);
+    return;
+  }
+  m.offset = st.st_size;
+}
+
+bool ArchiveFile::append(const char* data, size_t size)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool anyHealthy = false;
+
+  while (size > 0)
+  {
+    size_t n = size < ARCHIVE_BLOCK_SIZE ? size : ARCHIVE_BLOCK_SIZE;
+    Block block(new std::vector<char>(data, data + n));
+    data += n;
+    size -= n;
+
+    // the block is stored once and shared by every mirror's queue
+    anyHealthy = false;
+    for (size_t i = 0; i < mirrors_.size(); i++)
+    {
+      Mirror& m = *mirrors_[i];
+      if (!m.status.healthy)
+        continue;
+      idle_.wait(lock, [&m]() { return !m.status.healthy || m.queue.size() < MAX_QUEUED_BLOCKS; });
+      if (!m.status.healthy)
+        continue;
+      m.queue.push_back(block);
+      anyHealthy = true;
+    }
+    wake_.notify_all();
+  }
+
+  for (size_t i = 0; i < mirrors_.size(); i++)
+    anyHealthy = anyHealthy || mirrors_[i]->status.healthy;
+  return anyHealthy;
+}
+
+bool ArchiveFile::appendFd(int fd)
+{
+  std::vector<char> buf(ARCHIVE_BLOCK_SIZE);
+  while (true)
+  {
+    ssize_t n = read(fd, &buf[0], buf.size());
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return false;
+    if (n == 0)
+      return true;
+    if (!append(&buf[0], n))
+      return false;
+  }
+}
+
+bool ArchiveFile::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < mirrors_.size(); i++)
+    if (mirrors_[i]->status.healthy)
+      mirrors_[i]->syncRequested = true;
+  wake_.notify_all();
+
+  bool anyHealthy = false;
+  for (size_t i = 0; i < mirrors_.size(); i++)
+  {
+    Mirror& m = *mirrors_[i];
+    idle_.wait(lock, [&m]() { return !m.status.healthy || (m.queue.empty() && !m.syncRequested); });
+    anyHealthy = anyHealthy || m.status.healthy;
+  }
+  return anyHealthy;
+}
+
+std::vector<MirrorStatus> ArchiveFile::status()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<MirrorStatus> out;
+  for (size_t i = 0; i < mirrors_.size(); i++)
+    out.push_back(mirrors_[i]->status);
+  return out;
+}
+
+bool ArchiveFile::writeBlock(Mirror& m, const Block& block)
+{
+  if (!writeAllAt(m.fd, &(*block)[0], block->size(), m.offset))
+    return false;
+
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%llu %lu %08x\n", m.offset,
+                     (unsigned long)block->size(), crc32c(0, &(*block)[0], block->size()));
+  if (write(m.crcFd, line, len) != len)
+    return false;
+
+  m.offset += block->size();
+  m.unsynced += block->size();
+  return true;
+}
+
+bool ArchiveFile::sync(Mirror& m)
+{
+  if (fdatasync(m.fd) == -1 || fdatasync(m.crcFd) == -1)
+    return false;
+  m.unsynced = 0;
+  return true;
+}
+
+// one of these per mirror; only this thread touches the mirror's descriptors
+void ArchiveFile::run(Mirror& m)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (m.status.healthy)
+  {
+    wake_.wait(lock, [this, &m]() { return stopping_ || !m.queue.empty() || m.syncRequested; });
+
+    if (!m.queue.empty())
+    {
+      Block block = m.queue.front();
+      lock.unlock();
+      bool ok = writeBlock(m, block);
+      bool synced = !ok || m.unsynced < ARCHIVE_SYNC_BYTES || sync(m);
+      int err = errno;
+      lock.lock();
+      errno = err;
+
+      if (!ok || !synced)
+      {
+        fail(m, ok ? "sync failed" : "write failed");
+        idle_.notify_all();
+        break;
+      }
+      m.queue.pop_front();
+      m.status.bytesWritten += block->size();
+      idle_.notify_all();
+      continue;
+    }
+
+    if (m.syncRequested)
+    {
+      lock.unlock();
+      bool ok = m.unsynced == 0 || sync(m);
+      int err = errno;
+      lock.lock();
+      errno = err;
+
+      if (!ok)
+        fail(m, "sync failed");
+      m.syncRequested = false;
+      idle_.notify_all();
+      continue;
+    }
+
+    if (stopping_)
+      break;
+  }
+}
+
+long verifyArchive(const std::string& root, const std::string& relPath, std::string& report)
+{
+  std::string path = root + "/" + relPath;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  FILE* sums = fopen((path + ".crc32c").c_str(), "r");
+  if (fd == -1 || sums == NULL)
+  {
+    report = "cannot open " + path + " or its checksums\n";
+    if (fd != -1)
+      close(fd);
+    if (sums != NULL)
+      fclose(sums);
+    return -1;
+  }
+
+  long bad = 0;
+  unsigned long long offset;
+  unsigned long length;
+  unsigned int expected;
+  std::vector<char> buf;
+  std::stringstream out;
+
+  while (fscanf(sums, "%llu %lu %x", &offset, &length, &expected) == 3)
+  {
+    buf.resize(length);
+    ssize_t n = length ? pread(fd, &buf[0], length, offset) : 0;
+    if (n != (ssize_t)length || crc32c(0, length ? &buf[0] : NULL, length) != expected)
+    {
+      bad++;
+      out << path << ": bad block at " << offset << " (" << length << " bytes)" << std::endl;
+    }
+  }
+
+  fclose(sums);
+  close(fd);
+  report = out.str();
+  return bad;
+}
+
+void publishArchiveStatus(const std::vector<MirrorStatus>& status)
+{
+  std::stringstream ss;
+  ss << time(NULL) << std::endl;
+  for (size_t i = 0; i < status.size(); i++)
+  {
+    ss << status[i].root << ": " << (status[i].healthy ? "ok" : "FAILED");
+    if (!status[i].healthy)
+      ss << " (" << status[i].error << ")";
+    ss << std::endl;
+  }
+  latestPublish("archive_status.txt", ss.str());
+}
@@ -0,0 +1,93 @@
+#ifndef ARCHIVE_WRITER_HPP
+#define ARCHIVE_WRITER_HPP
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Mirrored, append-only archive writer
+ *
+ * An ArchiveFile is one relative path (e.g. "imu/cc_stream.<first seen>.txt")
+ * kept on every mirror root (/media/ssd_0 and /media/ssd_1 by default, or
+ * the colon separated $ARCHIVE_MIRRORS). Appended data is held in memory
+ * once and handed to one writer thread per mirror, so both SSDs are written
+ * in parallel. Each block gets a CRC-32C line ("offset length crc") in a
+ * "<path>.crc32c" sidecar on the same mirror, and data is fdatasync'd every
+ * ARCHIVE_SYNC_BYTES or when the file is flushed or closed.
+ *
+ * A mirror that is not mounted, or that fails a write or sync, is marked
+ * failed and skipped from then on; the others keep going.
+ */
+
+const size_t ARCHIVE_BLOCK_SIZE = 64 * 1024;
+const size_t ARCHIVE_SYNC_BYTES = 4 * 1024 * 1024;
+
+struct MirrorStatus
+{
+  std::string root;
+  bool healthy;
+  std::string error;
+  unsigned long long bytesWritten;
+};
+
+class ArchiveFile
+{
+  public:
+    // truncate = start the file (and its checksums) over rather than appending
+    ArchiveFile(const std::vector<std::string>& roots, const std::string& relPath, bool truncate);
+    ~ArchiveFile();
+
+    bool append(const char* data, size_t size);
+    bool appendFd(int fd);
+
+    // waits for every queued block to reach every healthy mirror and syncs it;
+    // returns true if at least one mirror still holds a complete copy
+    bool flush();
+
+    std::vector<MirrorStatus> status();
+    const std::string& path() const { return relPath_; }
+
+  private:
+    typedef std::shared_ptr<std::vector<char> > Block;
+
+    struct Mirror
+    {
+      MirrorStatus status;
+      int fd;
+      int crcFd;
+      unsigned long long offset;
+      unsigned long long unsynced;
+      std::deque<Block> queue;
+      bool syncRequested;
+      std::thread worker;
+    };
+
+    void open(Mirror& m, bool truncate);
+    void fail(Mirror& m, const std::string& what);
+    void run(Mirror& m);
+    bool writeBlock(Mirror& m, const Block& block);
+    bool sync(Mirror& m);
+
+    std::string relPath_;
+    std::vector<std::unique_ptr<Mirror> > mirrors_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    bool stopping_;
+};
+
+std::vector<std::string> defaultMirrors();
+
+// checks a mirror copy against its sidecar; returns the number of bad blocks, or -1 if unreadable
+long verifyArchive(const std::string& root, const std::string& relPath, std::string& report);
+
+// one line per mirror, published to latestData as archive_status.txt for housekeeping
+void publishArchiveStatus(const std::vector<MirrorStatus>& status);
+
+#endif
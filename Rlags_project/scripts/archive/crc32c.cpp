@@ -0,0 +1,50 @@
+#include "crc32c.hpp"
+
+// Castagnoli polynomial, reflected
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+static uint32_t table[8][256];
+
+static void buildTable()
+{
+  for (int n = 0; n < 256; n++)
+  {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    table[0][n] = crc;
+  }
+
+  for (int n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+}
+
+// slicing-by-8: the Odroid's ARMv7 has no CRC instructions, so this is the
+// fastest portable form (8 table lookups per 8 input bytes)
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+  static struct Init { Init() { buildTable(); } } init;
+  (void)init;
+
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+
+  while (size >= 8)
+  {
+    uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+    uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+    crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+          table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+          table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    p += 8;
+    size -= 8;
+  }
+
+  while (size--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+
+  return ~crc;
+}
@@ -0,0 +1,10 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli). Pass 0 as 'crc' to start, or a previous result to continue.
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Incremental archiver for ever-growing stream files (gpsStream.txt,
+ * the Arduino serial_output, the IMU cc_stream.txt and d2_stream.txt).
+ *
+ *   tail_follow [--skip-blank] <source> <archive prefix> <latest channel> <lines> <period>
+ *
+ * Every <period> seconds only the bytes added to <source> since the last
+ * pass are read, appended to "<archive prefix>.<first seen>.txt" on every SSD
+ * through the archive writer, and fed to an in-memory ring holding the last
+ * <lines> lines, which is published to latestData as <latest channel>.
+ *
+ * The byte offset, the source's inode and the archive name are persisted
+ * (after the archive is synced) in $TAIL_FOLLOW_STATE/<channel>.state, so a
+ * restarted follower resumes where it left off. If the source is replaced
+ * or truncated, a new archive file is started from offset 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include "archiveWriter.hpp"
+#include "latestData.hpp"
+
+class LineRing
+{
+  public:
+    LineRing(size_t capacity, bool skipBlank)
+    : capacity_(capacity),
+      skipBlank_(skipBlank),
+      changed_(false)
+    {
+      //Empty
+    }
+
+    void feed(const char* data, size_t size)
+    {
+      for (size_t i = 0; i < size; i++)
+      {
+        if (data[i] != '\n')
+        {
+          partial_ += data[i];
+          continue;
+        }
+        if (!partial_.empty() && partial_[partial_.size() - 1] == '\r')
+          partial_.erase(partial_.size() - 1);
+        if (!(skipBlank_ && partial_.empty()))
+        {
+          lines_.push_back(partial_);
+          if (lines_.size() > capacity_)
+            lines_.pop_front();
+          changed_ = true;
+        }
+        partial_.clear();
+      }
+    }
+
+    void reset()
+    {
+      lines_.clear();
+      partial_.clear();
+      changed_ = true;
+    }
+
+    // returns true (once) when lines were added since the last call
+    bool takeChanged()
+    {
+      bool changed = changed_;
+      changed_ = false;
+      return changed;
+    }
+
+    std::string str() const
+    {
+      std::string out;
+      for (size_t i = 0; i < lines_.size(); i++)
+        out += lines_[i] + "\n";
+      return out;
+    }
+
+  private:
+    size_t capacity_;
+    bool skipBlank_;
+    bool changed_;
+    std::deque<std::string> lines_;
+    std::string partial_;
+};
+
+struct FollowState
+{
+  unsigned long long offset;
+  unsigned long long inode;
+  std::string archivePath;
+};
+
+static std::string statePath(const std::string& channel)
+{
+  const char* dir = getenv("TAIL_FOLLOW_STATE");
+  std::string name = channel;
+  for (size_t i = 0; i < name.size(); i++)
+    if (name[i] == '/')
+      name[i] = '_';
+  return std::string(dir ? dir : "/home/linaro/.tail_follow") + "/" + name + ".state";
+}
+
+static bool loadState(const std::string& path, FollowState& state)
+{
+  std::ifstream in(path.c_str());
+  return (bool)(in >> state.offset >> state.inode >> state.archivePath);
+}
+
+static bool saveState(const std::string& path, const FollowState& state)
+{
+  size_t slash = path.rfind('/');
+  mkdir(path.substr(0, slash).c_str(), 0755);
+
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream out(temp.c_str(), std::ofstream::out | std::ofstream::trunc);
+    out << state.offset << " " << state.inode << " " << state.archivePath << std::endl;
+    if (!out)
+      return false;
+  }
+  return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// rebuilds the ring after a restart from the end of the already archived data
+static void seedRing(int fd, unsigned long long end, LineRing& ring)
+{
+  const unsigned long long window = 64 * 1024;
+  unsigned long long start = end > window ? end - window : 0;
+  std::vector<char> buf(end - start);
+
+  ssize_t n = buf.empty() ? 0 : pread(fd, &buf[0], buf.size(), start);
+  if (n <= 0)
+    return;
+
+  // drop the (probably partial) first line unless we read from the beginning
+  size_t first = 0;
+  if (start > 0)
+    while (first < (size_t)n && buf[first++] != '\n')
+      ;
+  ring.feed(&buf[first], n - first);
+}
+
+int main(int argc, char const *argv[])
+{
+  bool skipBlank = argc > 1 && strcmp(argv[1], "--skip-blank") == 0;
+  int a = skipBlank ? 2 : 1;
+
+  if (argc - a != 5)
+  {
+    printf("tail_follow [--skip-blank][Source][ArchivePrefix][LatestChannel][Lines][PeriodSeconds]\n");
+    return 1;
+  }
+
+  const std::string source = argv[a];
+  const std::string prefix = argv[a + 1];
+  const std::string channel = argv[a + 2];
+  const int nLines = atoi(argv[a + 3]);
+  const int period = atoi(argv[a + 4]) > 0 ? atoi(argv[a + 4]) : 10;
+  const std::string stateFile = statePath(channel);
+
+  FollowState state;
+  bool haveState = loadState(stateFile, state);
+  LineRing ring(nLines > 0 ? nLines : 20, skipBlank);
+  std::unique_ptr<ArchiveFile> archive;
+  std::set<std::string> reported;
+  int fd = -1;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (true)
+  {
+    struct stat st;
+    bool replaced = fd == -1 || stat(source.c_str(), &st) == -1 || (unsigned long long)st.st_ino != state.inode;
+
+    if (replaced)
+    {
+      if (fd != -1)
+        close(fd);
+      fd = open(source.c_str(), O_RDONLY);
+    }
+
+    if (fd != -1 && fstat(fd, &st) == 0)
+    {
+      if (replaced || !archive || (unsigned long long)st.st_size < state.offset)
+      {
+        bool resume = haveState && (unsigned long long)st.st_ino == state.inode &&
+                      (unsigned long long)st.st_size >= state.offset;
+        if (!resume)
+        {
+          std::stringstream name;
+          name << prefix << "." << time(NULL) << ".txt";
+          state.offset = 0;
+          state.inode = st.st_ino;
+          state.archivePath = name.str();
+        }
+
+        ring.reset();
+        seedRing(fd, state.offset, ring);
+        archive.reset(new ArchiveFile(defaultMirrors(), state.archivePath, false));
+        haveState = true;
+        std::cout << "Archive: following " << source << " into " << state.archivePath
+                  << (resume ? " (resumed)" : "") << std::endl;
+      }
+
+      // only the bytes added since the last pass are read and archived
+      bool stored = true;
+      unsigned long long end = st.st_size;
+      std::vector<char> buf(ARCHIVE_BLOCK_SIZE);
+      while (state.offset < end && stored)
+      {
+        size_t want = end - state.offset < buf.size() ? end - state.offset : buf.size();
+        ssize_t n = pread(fd, &buf[0], want, state.offset);
+        if (n <= 0)
+          break;
+        stored = archive->append(&buf[0], n);
+        ring.feed(&buf[0], n);
+        state.offset += n;
+      }
+
+      if (archive->flush() && stored)
+        saveState(stateFile, state);
+
+      std::vector<MirrorStatus> status = archive->status();
+      for (size_t i = 0; i < status.size(); i++)
+        if (!status[i].healthy && reported.insert(status[i].root + state.archivePath).second)
+          std::cout << "Archive: mirror " << status[i].root << " failed: " << status[i].error << std::endl;
+      publishArchiveStatus(status);
+
+      if (ring.takeChanged())
+        latestPublish(channel, ring.str());
+    }
+
+    // absolute deadlines keep the period from drifting
+    next.tv_sec += period;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+      ;
+  }
+
+  return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * Uplink command daemon
+ * ---------------------
+ *
+ * Reads the binary uplink stream straight from /dev/ttyUSB1, syncs on the
+ * FAF3 frame header, validates each frame and dispatches it through the
+ * command registry. Replaces the old chain of
+ *   hexdump | perl | cut >> uplinkBuffer.txt ; tail -f | stream_uplink_pull.sh
+ *
+ * Every frame is archived to both SSDs, and every command is acknowledged
+ * (ACK/NAK) in ~/latestData/uplink_acks.txt so the housekeeping bundle
+ * carries the result back down.
+ *
+ * Usage: uplink [serialport]     (defaults to /dev/ttyUSB1 @ 1200 baud)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "uplink.hpp"
+
+std::string UplinkFrame::hex() const
+{
+  char buf[8];
+  std::string out;
+
+  snprintf(buf, sizeof(buf), "%02X%02X", target, opcode);
+  out += buf;
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    snprintf(buf, sizeof(buf), "%02X", args[i]);
+    out += buf;
+  }
+  return out;
+}
+
+void CommandRegistry::add(uint8_t opcode, const std::string& name, int nArgs, CommandHandler handler)
+{
+  CommandSpec spec;
+  spec.name = name;
+  spec.nArgs = nArgs;
+  spec.handler = handler;
+  commands_[opcode] = spec;
+}
+
+const CommandSpec* CommandRegistry::find(uint8_t opcode) const
+{
+  std::map<uint8_t, CommandSpec>::const_iterator it = commands_.find(opcode);
+  return it == commands_.end() ? NULL : &it->second;
+}
+
+FrameDecoder::FrameDecoder(const CommandRegistry& registry)
+: registry_(registry),
+  state_(SYNC_0),
+  value_(0),
+  field_(0),
+  nArgs_(0),
+  rejected_(0)
+{
+  //Empty
+}
+
+void FrameDecoder::reject(const std::string& why, uint8_t byte)
+{
+  rejected_++;
+  lastError_ = why;
+
+  // the offending byte may itself be the start of the next frame
+  state_ = (byte == UPLINK_SYNC_0) ? SYNC_1 : SYNC_0;
+}
+
+bool FrameDecoder::push(uint8_t byte, UplinkFrame& frame)
+{
+  switch (state_)
+  {
+    case SYNC_0:
+      if (byte == UPLINK_SYNC_0)
+        state_ = SYNC_1;
+      return false;
+
+    case SYNC_1:
+      if (byte == UPLINK_SYNC_1)
+      {
+        current_.args.clear();
+        field_ = 0;
+        state_ = VALUE;
+      }
+      else if (byte != UPLINK_SYNC_0)
+        state_ = SYNC_0;
+      return false;
+
+    case VALUE:
+      value_ = byte;
+      state_ = COMPLEMENT;
+      return false;
+
+    case COMPLEMENT:
+      if ((uint8_t)~value_ != byte)
+      {
+        reject("complement mismatch", byte);
+        if (value_ == UPLINK_SYNC_0 && byte == UPLINK_SYNC_1)
+        {
+          // the bad byte pair was really the header of a new frame
+          current_.args.clear();
+          field_ = 0;
+          state_ = VALUE;
+        }
+        return false;
+      }
+      state_ = VALUE;
+      break;
+  }
+
+  // a validated byte is in value_
+  if (field_ == 0)
+  {
+    if (value_ != UPLINK_TARGET_A && value_ != UPLINK_TARGET_B)
+    {
+      reject("unknown target", byte);
+      return false;
+    }
+    current_.target = value_;
+  }
+  else if (field_ == 1)
+  {
+    const CommandSpec* spec = registry_.find(value_);
+    current_.opcode = value_;
+    if (spec == NULL)
+    {
+      char why[32];
+      snprintf(why, sizeof(why), "unknown opcode %02X", value_);
+      reject(why, byte);
+      return false;
+    }
+    nArgs_ = spec->nArgs;
+  }
+  else
+    current_.args.push_back(value_);
+
+  field_++;
+  if (field_ >= 2 && (int)current_.args.size() == nArgs_)
+  {
+    frame = current_;
+    state_ = SYNC_0;
+    return true;
+  }
+  return false;
+}
+
+std::string homeDir()
+{
+  const char* home = getenv("HOME");
+  return home ? home : "/home/linaro";
+}
+
+// takes the string name of the serial port and a baud rate, and opens it
+// raw 8N1 for reading binary frames. returns valid fd, or -1 on error
+int uplink_port_init(const char* serialport, int baud)
+{
+  struct termios toptions;
+  int fd;
+
+  fd = open(serialport, O_RDONLY | O_NOCTTY);
+  if (fd == -1)
+  {
+    perror("uplink_port_init: Unable to open port ");
+    return -1;
+  }
+
+  if (tcgetattr(fd, &toptions) < 0)
+  {
+    perror("uplink_port_init: Couldn't get term attributes");
+    close(fd);
+    return -1;
+  }
+
+  speed_t brate = B1200;
+  switch (baud)
+  {
+    case 600:    brate = B600;    break;
+    case 1200:   brate = B1200;   break;
+    case 2400:   brate = B2400;   break;
+    case 4800:   brate = B4800;   break;
+    case 9600:   brate = B9600;   break;
+    case 19200:  brate = B19200;  break;
+    case 115200: brate = B115200; break;
+  }
+  cfsetispeed(&toptions, brate);
+  cfsetospeed(&toptions, brate);
+  cfmakeraw(&toptions);
+  toptions.c_cflag |= CREAD | CLOCAL;
+
+  // block until at least one byte is available
+  toptions.c_cc[VMIN]  = 1;
+  toptions.c_cc[VTIME] = 0;
+
+  if (tcsetattr(fd, TCSANOW, &toptions) < 0)
+  {
+    perror("uplink_port_init: Couldn't set term attributes");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static std::string timestamp()
+{
+  struct timeval tv;
+  char buf[32];
+
+  gettimeofday(&tv, NULL);
+  snprintf(buf, sizeof(buf), "%ld.%06ld", (long)tv.tv_sec, (long)tv.tv_usec);
+  return buf;
+}
+
+static void appendLine(const std::string& path, const std::string& line)
+{
+  std::ofstream out(path.c_str(), std::ofstream::out | std::ofstream::app);
+  out << line << std::endl;
+}
+
+// write the whole file next to its destination, then rename over it, so
+// the capture loops never read a half-written file
+static bool replaceFile(const std::string& path, const std::string& contents)
+{
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream out(temp.c_str(), std::ofstream::out | std::ofstream::trunc);
+    out << contents;
+    if (!out)
+      return false;
+  }
+  return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+static int argWord(const UplinkFrame& frame, int first)
+{
+  return (frame.args[first] << 8) | frame.args[first + 1];
+}
+
+void registerFlightCommands(CommandRegistry& registry)
+{
+  const std::string scripts = homeDir() + "/Rlags_project/scripts";
+  const std::string latest = homeDir() + "/latestData";
+
+  CommandHandler reboot = [](const UplinkFrame&) -> std::string
+  {
+    sync();
+    if (system("sudo reboot -f") != 0)
+      return "reboot failed";
+    return "";
+  };
+  registry.add(0x10, "reboot", 0, reboot);
+  registry.add(0xEF, "reboot", 0, reboot);  // byte-swapped form, also honoured by the old script
+
+  // star camera: slot (1..3), exposure (16 bit, big endian), read by capture_star.sh
+  registry.add(0x20, "set_exposure", 3, [scripts](const UplinkFrame& f) -> std::string
+  {
+    int slot = f.args[0];
+    if (slot < 1 || slot > 3)
+      return "slot must be 1-3";
+
+    int exposures[3] = {300, 500, 700};
+    std::string path = scripts + "/star_camera/exposures";
+    std::ifstream in(path.c_str());
+    for (int i = 0; i < 3 && in; i++)
+      in >> exposures[i];
+    exposures[slot - 1] = argWord(f, 1);
+
+    std::stringstream ss;
+    ss << exposures[0] << " " << exposures[1] << " " << exposures[2] << std::endl;
+    return replaceFile(path, ss.str()) ? "" : "could not write " + path;
+  });
+
+  // SEDI: capture cycle (1..3), integration time in seconds (16 bit, big endian)
+  registry.add(0x21, "set_sedi_integration", 3, [scripts](const UplinkFrame& f) -> std::string
+  {
+    int cycle = f.args[0];
+    int seconds = argWord(f, 1);
+    if (cycle < 1 || cycle > 3)
+      return "cycle must be 1-3";
+    if (seconds < 1)
+      return "integration time must be positive";
+
+    std::stringstream path, line;
+    path << scripts << "/sedi_camera/" << cycle << "_exposure_watchfile";
+    line << "Expose  TARGET - " << seconds << ".0 1 1 1392 1040 1 1 15.00" << std::endl;
+    return replaceFile(path.str(), line.str()) ? "" : "could not write " + path.str();
+  });
+
+  // calibration lamp: 1 = on, 0 = off (Arduino codes 200/201)
+  registry.add(0x30, "lamp", 1, [scripts](const UplinkFrame& f) -> std::string
+  {
+    if (f.args[0] > 1)
+      return "lamp state must be 0 or 1";
+    appendLine(scripts + "/communication/build/rawSerialInput", f.args[0] ? "200" : "201");
+    return "";
+  });
+
+  // the supervisor runs the cameras job at once when this fifo is written
+  registry.add(0x40, "capture_now", 0, [latest](const UplinkFrame&) -> std::string
+  {
+    std::string path = latest + "/capture_now";
+    int fd = open(path.c_str(), O_WRONLY | O_NONBLOCK);
+    if (fd == -1)
+      return "supervisor is not listening";
+    ssize_t n = write(fd, "now\n", 4);
+    close(fd);
+    return n == 4 ? "" : "could not signal supervisor";
+  });
+
+  // queue one of the latestData files for stream_downlink_push.sh
+  registry.add(0x50, "downlink_file", 1, [latest](const UplinkFrame& f) -> std::string
+  {
+    static const char* files[] = {
+      "bundle.txt", "gpsData.txt", "thermal_sensors.txt", "polarizerInfo.txt",
+      "cc_imu.txt", "d2_imu.txt", "status.log", "uplink_acks.txt"
+    };
+    const int nFiles = sizeof(files) / sizeof(files[0]);
+
+    if (f.args[0] >= nFiles)
+      return "unknown file id";
+    appendLine(latest + "/downlink_queue", files[f.args[0]]);
+    return "";
+  });
+}
+
+int main(int argc, char *argv[])
+{
+  const char* port = argc > 1 ? argv[1] : "/dev/ttyUSB1";
+  const std::string started = timestamp();
+  const std::string acks = homeDir() + "/latestData/uplink_acks.txt";
+
+  CommandRegistry registry;
+  registerFlightCommands(registry);
+  FrameDecoder decoder(registry);
+
+  int fd = uplink_port_init(port, UPLINK_BAUDRATE);
+  if (fd == -1)
+    return 1;
+
+  std::cout << "Link: uplink daemon listening on " << port << std::endl;
+
+  unsigned long rejected = 0;
+  uint8_t buf[64];
+  while (true)
+  {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("Link: uplink read failed");
+      break;
+    }
+
+    for (ssize_t i = 0; i < n; i++)
+    {
+      UplinkFrame frame;
+      bool complete = decoder.push(buf[i], frame);
+
+      if (decoder.framesRejected() != rejected)
+      {
+        rejected = decoder.framesRejected();
+        appendLine(acks, timestamp() + " NAK " + decoder.lastError());
+      }
+      if (!complete)
+        continue;
+
+      const std::string hex = frame.hex();
+      appendLine("/media/ssd_0/link_received/received_" + started + ".txt", hex);
+      appendLine("/media/ssd_1/link_received/received_" + started + ".txt", hex);
+
+      const CommandSpec* spec = registry.find(frame.opcode);
+      std::cout << "Link: received command " << spec->name << " (" << hex << ")" << std::endl;
+
+      std::string error = spec->handler(frame);
+      if (error.empty())
+        appendLine(acks, timestamp() + " ACK " + spec->name + " " + hex);
+      else
+        appendLine(acks, timestamp() + " NAK " + spec->name + " " + hex + ": " + error);
+    }
+  }
+
+  close(fd);
+  return 1;
+}
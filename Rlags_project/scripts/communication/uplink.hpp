@@ -0,0 +1,88 @@
+#ifndef UPLINK_HPP
+#define UPLINK_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Uplink frame layout (as sent by the ground station over /dev/ttyUSB1):
+ *
+ *   FA F3 | target ~target | opcode ~opcode | arg0 ~arg0 | arg1 ~arg1 | ...
+ *
+ * Every byte after the sync word is followed by its one's complement, which
+ * is how the old hexdump/perl pipeline recognised "E01F", "E11E" and "10EF".
+ * The number of argument bytes is fixed per opcode by the command registry.
+ */
+
+const uint8_t UPLINK_SYNC_0 = 0xFA;
+const uint8_t UPLINK_SYNC_1 = 0xF3;
+const uint8_t UPLINK_TARGET_A = 0xE0;
+const uint8_t UPLINK_TARGET_B = 0xE1;
+const int UPLINK_BAUDRATE = 1200;
+
+struct UplinkFrame
+{
+  uint8_t target;
+  uint8_t opcode;
+  std::vector<uint8_t> args;
+
+  std::string hex() const;
+};
+
+// a handler returns an empty string on success, otherwise the reason it failed
+typedef std::function<std::string(const UplinkFrame&)> CommandHandler;
+
+struct CommandSpec
+{
+  std::string name;
+  int nArgs;
+  CommandHandler handler;
+};
+
+class CommandRegistry
+{
+  public:
+    void add(uint8_t opcode, const std::string& name, int nArgs, CommandHandler handler);
+    const CommandSpec* find(uint8_t opcode) const;
+
+  private:
+    std::map<uint8_t, CommandSpec> commands_;
+};
+
+// Byte-at-a-time state machine; resynchronises on the sync word after any
+// complement mismatch, so a corrupted frame never swallows the next one.
+class FrameDecoder
+{
+  public:
+    FrameDecoder(const CommandRegistry& registry);
+
+    // returns true when a complete, validated frame is available in 'frame'
+    bool push(uint8_t byte, UplinkFrame& frame);
+
+    unsigned long framesRejected() const { return rejected_; }
+    const std::string& lastError() const { return lastError_; }
+
+  private:
+    enum State { SYNC_0, SYNC_1, VALUE, COMPLEMENT };
+
+    void reject(const std::string& why, uint8_t byte);
+
+    const CommandRegistry& registry_;
+    State state_;
+    uint8_t value_;
+    int field_;     // 0 = target, 1 = opcode, 2.. = arguments
+    int nArgs_;
+    UplinkFrame current_;
+    unsigned long rejected_;
+    std::string lastError_;
+};
+
+std::string homeDir();
+int uplink_port_init(const char* serialport, int baud);
+void registerFlightCommands(CommandRegistry& registry);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Command line front end to the latest data store, for the bash loops.
+ *
+ *   latest publish <channel> [file]   publish file (or stdin) as <channel>
+ *   latest read <channel>             print a consistent snapshot of <channel>
+ *
+ * Replaces the getDataLock.sh / releaseDataLock.sh busy-poll lock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "latestData.hpp"
+
+int main(int argc, char const *argv[])
+{
+  if (argc < 3 || (strcmp(argv[1], "publish") != 0 && strcmp(argv[1], "read") != 0))
+  {
+    printf("latest publish [Channel][File]\nlatest read [Channel]\n");
+    return 1;
+  }
+
+  std::string channel = argv[2];
+
+  if (strcmp(argv[1], "read") == 0)
+  {
+    std::string contents;
+    if (!latestRead(channel, contents))
+    {
+      perror(("latest: cannot read " + channel).c_str());
+      return 1;
+    }
+    std::cout << contents;
+    return 0;
+  }
+
+  bool ok = argc > 3 ? latestPublishFile(channel, argv[3]) : latestPublishFd(channel, STDIN_FILENO);
+  if (!ok)
+  {
+    perror(("latest: cannot publish " + channel).c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "latestData.hpp"
+
+std::string latestDataDir()
+{
+  const char* dir = getenv("LATEST_DATA_DIR");
+  return dir ? dir : "/home/linaro/latestData";
+}
+
+std::string latestChannelPath(const std::string& channel)
+{
+  return latestDataDir() + "/" + channel;
+}
+
+static bool writeAll(int fd, const char* data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t n = write(fd, data, size);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// creates the hidden temporary next to the channel, so the rename stays on one filesystem
+static int openTemp(const std::string& channel, std::string& tempPath)
+{
+  std::string path = latestChannelPath(channel);
+  size_t slash = path.rfind('/');
+  tempPath = path.substr(0, slash + 1) + "." + path.substr(slash + 1) + ".XXXXXX";
+
+  int fd = mkstemp(&tempPath[0]);
+  if (fd != -1)
+    fchmod(fd, 0644);
+  return fd;
+}
+
+static bool commitTemp(int fd, const std::string& tempPath, const std::string& channel, bool ok)
+{
+  int saved = errno;
+  if (close(fd) == -1 && ok)
+  {
+    ok = false;
+    saved = errno;
+  }
+
+  if (ok && rename(tempPath.c_str(), latestChannelPath(channel).c_str()) == 0)
+    return true;
+
+  if (ok)
+    saved = errno;
+  unlink(tempPath.c_str());
+  errno = saved;
+  return false;
+}
+
+bool latestPublish(const std::string& channel, const std::string& contents)
+{
+  std::string tempPath;
+  int fd = openTemp(channel, tempPath);
+  if (fd == -1)
+    return false;
+
+  bool ok = writeAll(fd, contents.data(), contents.size());
+  return commitTemp(fd, tempPath, channel, ok);
+}
+
+bool latestPublishFd(const std::string& channel, int sourceFd)
+{
+  std::string tempPath;
+  int fd = openTemp(channel, tempPath);
+  if (fd == -1)
+    return false;
+
+  bool ok = true;
+  char buf[64 * 1024];
+  while (true)
+  {
+    ssize_t n = read(sourceFd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      ok = (n == 0);
+      break;
+    }
+    if (!writeAll(fd, buf, n))
+    {
+      ok = false;
+      break;
+    }
+  }
+  return commitTemp(fd, tempPath, channel, ok);
+}
+
+bool latestPublishFile(const std::string& channel, const std::string& sourcePath)
+{
+  int src = open(sourcePath.c_str(), O_RDONLY);
+  if (src == -1)
+    return false;
+
+  bool ok = latestPublishFd(channel, src);
+  int saved = errno;
+  close(src);
+  errno = saved;
+  return ok;
+}
+
+bool latestRead(const std::string& channel, std::string& contents)
+{
+  // the descriptor pins whichever version was current when it was opened
+  int fd = open(latestChannelPath(channel).c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  contents.clear();
+  char buf[64 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) != 0)
+  {
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      int saved = errno;
+      close(fd);
+      errno = saved;
+      return false;
+    }
+    contents.append(buf, n);
+  }
+  close(fd);
+  return true;
+}
@@ -0,0 +1,31 @@
+#ifndef LATEST_DATA_HPP
+#define LATEST_DATA_HPP
+
+#include <string>
+
+/*
+ * "Latest data" store
+ *
+ * Every channel is one file under the store directory (~linaro/latestData by
+ * default, or $LATEST_DATA_DIR). Writers never modify a channel in place:
+ * the new contents go to a hidden temporary file in the same directory which
+ * is then rename()d over the channel. rename is atomic within a filesystem,
+ * so a reader that opens a channel always sees one complete version, old or
+ * new, and no lock is needed between the capture loops and the housekeeping
+ * and downlink readers.
+ *
+ * Channel names may contain one level of subdirectory, e.g. "sedi/1_capture.fit".
+ */
+
+std::string latestDataDir();
+std::string latestChannelPath(const std::string& channel);
+
+// each returns true on success; on failure errno is left describing why
+bool latestPublish(const std::string& channel, const std::string& contents);
+bool latestPublishFile(const std::string& channel, const std::string& sourcePath);
+bool latestPublishFd(const std::string& channel, int sourceFd);
+
+// reads a consistent snapshot of one channel
+bool latestRead(const std::string& channel, std::string& contents);
+
+#endif
@@ -1,3 +0,0 @@
-#!/bin/bash
-
-sudo rm ~/latestData/lock
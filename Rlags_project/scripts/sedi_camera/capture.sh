@@ -3,6 +3,21 @@
 #this script must be run as root!
 #arguments: <watch file name> <type of capture> <output directory name>
 
+sedid=~/Rlags_project/SEDI_Camera/src/sedid
+
+#sedid writes names ending in .fz as lossless Rice tile-compressed FITS
+#(funpack, ds9 and astropy read them directly); SEDI_FITS_EXT=fit for plain
+ext=${SEDI_FITS_EXT:-fits.fz}
+
+#SEDI_COADD=n takes n exposures and has sedid co-add them on board into one
+#file holding their mean and its noise; SEDI_CLIP=kappa also rejects values
+#(cosmic rays) more than kappa standard deviations out.  1 saves every one
+coadd=${SEDI_COADD:-1}
+
+#a failed exposure is tried again up to SEDI_RETRIES times in all; if it still
+#fails the script gives up and exits with status 1
+retries=${SEDI_RETRIES:-3}
+
 cd ~/Rlags_project/scripts/sedi_camera/workingDir/
 
 if [ ! -d $3 ]; then
@@ -10,36 +25,71 @@ if [ ! -d $3 ]; then
 	echo "SEDI: made working directory "$3
 fi
 
-echo "SEDI: triggering GoQat camera for "$2", "$(date +%H:%M:%S)
-cp ../$1 /home/my_watch
+echo "SEDI: triggering SEDI camera for "$2", "$(date +%H:%M:%S)
 cp ../$1 $(pwd)/$3/
 
-startTime=$(date +"%s.%N")
-counter=0
+#the watch file holds the arguments of an Expose command; sedid replies with
+#READ once the chip has been read and saves the file in the background, so the
+#next capture can start at once (capture_sedi_loop.sh waits for the files with
+#'sedid --send Sync'); wait up to 6 minutes past the exposure
+timeout=$(awk '{print $4 + 360}' ../$1)
 
-while [ ! -f /root/GoQat/ccd_display.fit ];
-do
-	((counter++))
+#sedid forgets the co-add settings and the frames stacked so far if it is
+#restarted (a hung readout makes it exit and the supervisor restarts it), so
+#the settings are sent once here and again after a failed frame, and the stack
+#is started over if it has lost frames; repeating them doesn't disturb it
+function setCoadd() {
+	$sedid --send "Coadd $coadd ${SEDI_CLIP:-0}" 5 > /dev/null
+}
 
-	if [[ $counter -gt 3600 ]]; then #if longer than 6 minutes (3600 ticks)
-		echo "SEDI: DETECTED HANG, RETRYING CAPTURE, "$(date)
+function stackedFrames() {
+	$sedid --send Status 5 |
+		awk '/^STATUS/ { for (i = 1; i < NF; i++) if ($i == "stacked") print $(i + 1) + 0 }'
+}
 
-		(cd ~/Rlags_project/scripts/sedi_camera; sudo ./initialize_goqat.sh) #restart SEDI
-		sleep 5
-		cp ../$1 /home/my_watch
-		startTime=$(date +"%s.%N")
-		counter=0
+function exposeFrame() {
+	if [ $attempt -gt 1 ] && [ $coadd -gt 1 ]; then
+		setCoadd || return 1
+		stacked=$(stackedFrames)
+		[ -n "$stacked" ] || return 1
+		if [ $stacked -ne $((frame - 1)) ]; then
+			echo "SEDI: co-added frames lost, starting the stack for "$name" again"
+			frame=1
+		fi
 	fi
+	$sedid --queue "$(cat ../$watchFile) $(pwd)/$dir/$name.$ext" $timeout
+}
+
+watchFile=$1
+name=$2
+dir=$3
 
-	sleep 0.1
+if ! setCoadd; then
+	echo "SEDI: error: sedid did not accept Coadd $coadd, "$(date)
+	exit 1
+fi
+
+startTime=$(date +"%s.%N")
+for ((frame = 1; frame <= coadd; frame++))
+do
+	attempt=1
+	until exposeFrame
+	do
+		if [ $attempt -ge $retries ]; then
+			echo "SEDI: error: capture of "$2" failed "$attempt" times, giving up, "$(date)
+			exit 1
+		fi
+
+		echo "SEDI: CAPTURE FAILED, RETRYING CAPTURE, "$(date)
+		$sedid --send Cancel 5
+		sleep 5
+		((attempt++))
+	done
 done
 
 endTime=$(date +"%s.%N")
 echo "SEDI: camera returned image, "$(date +"%H:%M:%S")
 
-#move .fit file into directory
-mv /root/GoQat/ccd_display.fit $(pwd)/$3/$2.fit
-
 #create housekeeping data file
 dataFile=$(pwd)/$3/$2_data.txt
 echo "start time, end time" >> $dataFile
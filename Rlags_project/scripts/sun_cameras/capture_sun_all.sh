@@ -40,16 +40,19 @@ echo '1-2.1.2.3' | sudo tee /sys/bus/usb/drivers/usb/unbind > /dev/null
 
 #--------------------------------------------------------------------------
 
-(cd ~/Rlags_project/scripts; ./getDataLock.sh) #request mutex on latestData/
-sudo cp sun_cam_*.jpg /home/linaro/latestData/
-(cd ~/Rlags_project/scripts; ./releaseDataLock.sh) #release mutex on latestData/
+for image in sun_cam_*.jpg
+do
+	sudo /home/linaro/Rlags_project/scripts/latest_data/build/latest publish $image $image
+done
 
 sudo mv sun_cam_0.jpg suncam_$time0.0.jpg
 sudo mv sun_cam_1.jpg suncam_$time1.1.jpg
 sudo mv sun_cam_2.jpg suncam_$time2.2.jpg
 
-sudo cp suncam_*.jpg /media/ssd_0/sun_cameras/
-sudo cp suncam_*.jpg /media/ssd_1/sun_cameras/
+for image in suncam_*.jpg
+do
+	sudo /home/linaro/Rlags_project/scripts/archive/build/archive put sun_cameras/$image $image
+done
 
 sudo rm suncam_*.jpg
 
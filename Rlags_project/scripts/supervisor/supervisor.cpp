@@ -0,0 +1,395 @@
+/*
+ * Flight supervisor
+ * -----------------
+ *
+ * One process that owns every periodic capture job and long-running service
+ * (see supervisor.hpp and jobs.conf), replacing the "while true ... sleep
+ * $(echo ... | bc)" bash loops. Each periodic job has its own timerfd with
+ * an interval, so periods never drift; children are reaped through a
+ * signalfd, and their CPU time comes from wait4()'s rusage.
+ *
+ * The state of every job is published to latestData as supervisor.txt for
+ * the housekeeping bundle.
+ *
+ * Usage: supervisor [jobs.conf]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "supervisor.hpp"
+#include "latestData.hpp"
+
+static std::vector<Job> jobs;
+static std::string startedAt;
+
+bool loadJobs(const std::string& path, std::vector<Job>& out)
+{
+  std::ifstream in(path.c_str());
+  if (!in)
+    return false;
+
+  std::string line;
+  int lineNo = 0;
+  while (std::getline(in, line))
+  {
+    lineNo++;
+    std::stringstream ss(line);
+    std::string kind, word;
+    Job job;
+
+    if (!(ss >> job.name) || job.name[0] == '#')
+      continue;
+    if (!(ss >> kind >> job.period) ||
+        (kind != "periodic" && kind != "repeat" && kind != "service"))
+    {
+      std::cerr << "Supervisor: " << path << ":" << lineNo << ": bad job line" << std::endl;
+      return false;
+    }
+    job.service = (kind == "service");
+    job.repeat = (kind == "repeat");
+
+    while (ss >> word)
+    {
+      if (job.command.empty() && word.compare(0, 8, "trigger=") == 0)
+        job.trigger = word.substr(8);
+      else if (job.command.empty() && word.compare(0, 6, "after=") == 0)
+        job.after = word.substr(6);
+      else
+        job.command += (job.command.empty() ? "" : " ") + word;
+    }
+
+    job.pid = 0;
+    job.triggered = false;
+    job.timerFd = -1;
+    job.triggerFd = -1;
+    job.runs = job.failures = job.overruns = job.restarts = 0;
+    job.backoff = 1;
+    job.cpuSeconds = job.lastDuration = job.maxDuration = 0;
+    out.push_back(job);
+  }
+  return true;
+}
+
+static double elapsed(const struct timespec& since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since.tv_sec) + (now.tv_nsec - since.tv_nsec) / 1e9;
+}
+
+static void setTimer(int fd, double first, double interval)
+{
+  struct itimerspec spec;
+  spec.it_value.tv_sec = (time_t)first;
+  spec.it_value.tv_nsec = (long)((first - (time_t)first) * 1e9);
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1;  // zero would disarm the timer
+  spec.it_interval.tv_sec = (time_t)interval;
+  spec.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+static bool startJob(Job& job)
+{
+  struct stat st;
+  if (!job.after.empty() && stat(job.after.c_str(), &st) == -1)
+    return false;
+
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    perror(("Supervisor: cannot fork " + job.name).c_str());
+    return false;
+  }
+
+  if (pid == 0)
+  {
+    // own process group, so stopping a job also stops whatever it started
+    setpgid(0, 0);
+    sigset_t all;
+    sigfillset(&all);
+    sigprocmask(SIG_UNBLOCK, &all, NULL);
+    setenv("SUPERVISOR_STARTED", startedAt.c_str(), 1);
+    execl("/bin/bash", "bash", "-c", job.command.c_str(), (char*)NULL);
+    _exit(127);
+  }
+
+  job.pid = pid;
+  job.triggered = false;
+  job.runs++;
+  clock_gettime(CLOCK_MONOTONIC, &job.started);
+  return true;
+}
+
+static void jobExited(Job& job, int status, const struct rusage& usage)
+{
+  job.pid = 0;
+  job.lastDuration = elapsed(job.started);
+  if (job.lastDuration > job.maxDuration)
+    job.maxDuration = job.lastDuration;
+  job.cpuSeconds += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+  std::stringstream exit;
+  if (WIFEXITED(status))
+    exit << "exit " << WEXITSTATUS(status);
+  else
+    exit << "signal " << WTERMSIG(status);
+  job.lastExit = exit.str();
+
+  bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  if (failed)
+    job.failures++;
+
+  if (job.repeat)
+  {
+    setTimer(job.timerFd, job.period, 0);
+    return;
+  }
+
+  if (!job.service)
+  {
+    if (job.lastDuration > job.period)
+      std::cout << "Supervisor: " << job.name << " took " << job.lastDuration
+                << " s, longer than its " << job.period << " s period" << std::endl;
+    return;
+  }
+
+  // a service that stayed up for a while earns its backoff back
+  if (job.lastDuration > MAX_BACKOFF)
+    job.backoff = 1;
+  std::cout << "Supervisor: " << job.name << " stopped (" << job.lastExit << "), restarting in "
+            << job.backoff << " s" << std::endl;
+  setTimer(job.timerFd, job.backoff, 0);
+  job.backoff = job.backoff * 2 > MAX_BACKOFF ? MAX_BACKOFF : job.backoff * 2;
+  job.restarts++;
+}
+
+static void publishStatus()
+{
+  std::stringstream ss;
+  ss << "started " << startedAt << ", now " << time(NULL) << std::endl;
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    const Job& j = jobs[i];
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%-10s %-8s runs %lu fail %lu overrun %lu restart %lu cpu %.1fs last %.1fs max %.1fs %s\n",
+             j.name.c_str(), j.pid ? "running" : "idle", j.runs, j.failures, j.overruns,
+             j.restarts, j.cpuSeconds, j.lastDuration, j.maxDuration,
+             j.lastExit.empty() ? "" : ("(" + j.lastExit + ")").c_str());
+    ss << line;
+  }
+  latestPublish("supervisor.txt", ss.str());
+}
+
+static size_t jobsRunning()
+{
+  size_t running = 0;
+  for (size_t i = 0; i < jobs.size(); i++)
+    if (jobs[i].pid)
+      running++;
+  return running;
+}
+
+// SIGTERM every job and wait for it, so that none outlives the supervisor;
+// whatever is still running after STOP_TIMEOUT seconds is killed
+static void stopAll()
+{
+  for (size_t i = 0; i < jobs.size(); i++)
+    if (jobs[i].pid)
+      kill(-jobs[i].pid, SIGTERM);
+
+  struct timespec since;
+  clock_gettime(CLOCK_MONOTONIC, &since);
+  bool killed = false;
+  while (jobsRunning())
+  {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+    if (pid == -1 && errno != EINTR)
+      break;
+    if (pid > 0)
+    {
+      for (size_t i = 0; i < jobs.size(); i++)
+        if (jobs[i].pid == pid)
+          jobs[i].pid = 0;
+      continue;
+    }
+
+    if (!killed && elapsed(since) > STOP_TIMEOUT)
+    {
+      for (size_t i = 0; i < jobs.size(); i++)
+        if (jobs[i].pid)
+        {
+          std::cout << "Supervisor: " << jobs[i].name << " did not stop, killing it" << std::endl;
+          kill(-jobs[i].pid, SIGKILL);
+        }
+      killed = true;
+    }
+    usleep(50000);
+  }
+}
+
+int main(int argc, char const *argv[])
+{
+  const char* config = argc > 1 ? argv[1] : "jobs.conf";
+  if (!loadJobs(config, jobs) || jobs.empty())
+  {
+    std::cerr << "Supervisor: no jobs loaded from " << config << std::endl;
+    return 1;
+  }
+
+  std::stringstream now;
+  now << time(NULL);
+  startedAt = now.str();
+
+  // children are reaped and signals handled from the event loop, not handlers
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int epfd = epoll_create1(0);
+  int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  int statusFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  setTimer(statusFd, STATUS_PERIOD, STATUS_PERIOD);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint64_t)-1;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+  ev.data.u64 = (uint64_t)-2;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, statusFd, &ev);
+
+  for (size_t i = 0; i < jobs.size(); i++)
+  {
+    Job& job = jobs[i];
+    job.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ev.data.u64 = i * 2;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, job.timerFd, &ev);
+
+    // periodic jobs tick from now on; repeat jobs and services start at once
+    setTimer(job.timerFd, 0, job.service || job.repeat ? 0 : job.period);
+
+    if (!job.trigger.empty())
+    {
+      // O_RDWR keeps the fifo open, so writers never see "no reader"
+      mkfifo(job.trigger.c_str(), 0666);
+      job.triggerFd = open(job.trigger.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      ev.data.u64 = i * 2 + 1;
+      if (job.triggerFd != -1)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, job.triggerFd, &ev);
+    }
+
+    if (job.service)
+      std::cout << "Supervisor: " << job.name << " service: " << job.command << std::endl;
+    else if (job.repeat)
+      std::cout << "Supervisor: " << job.name << " " << job.period << " s after each run: "
+                << job.command << std::endl;
+    else
+      std::cout << "Supervisor: " << job.name << " every " << job.period << " s: " << job.command << std::endl;
+  }
+
+  bool stopping = false;
+  while (!stopping)
+  {
+    struct epoll_event events[16];
+    int n = epoll_wait(epfd, events, 16, -1);
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    for (int e = 0; e < n; e++)
+    {
+      uint64_t id = events[e].data.u64;
+
+      if (id == (uint64_t)-1)
+      {
+        struct signalfd_siginfo si;
+        if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+          continue;
+        if (si.ssi_signo != SIGCHLD)
+        {
+          stopping = true;
+          continue;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+          for (size_t i = 0; i < jobs.size(); i++)
+            if (jobs[i].pid == pid)
+              jobExited(jobs[i], status, usage);
+        continue;
+      }
+
+      if (id == (uint64_t)-2)
+      {
+        uint64_t ticks;
+        if (read(statusFd, &ticks, sizeof(ticks)) == sizeof(ticks))
+          publishStatus();
+        continue;
+      }
+
+      Job& job = jobs[id / 2];
+      if (id % 2 == 1)
+      {
+        char buf[64];
+        while (read(job.triggerFd, buf, sizeof(buf)) > 0)
+          ;
+        if (!job.pid)
+        {
+          std::cout << "Supervisor: " << job.name << " triggered" << std::endl;
+          job.triggered = startJob(job);
+        }
+        continue;
+      }
+
+      uint64_t ticks;
+      if (read(job.timerFd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        continue;
+
+      if (job.service || job.repeat)
+      {
+        if (!job.pid && !startJob(job))
+          setTimer(job.timerFd, 1, 0);  // not ready yet (after=), look again shortly
+        continue;
+      }
+
+      // more than one expiration means whole periods went by unserved;
+      // a run started early by its trigger is not an overrun of the schedule
+      if (job.pid)
+        job.overruns += job.triggered ? ticks - 1 : ticks;
+      else
+      {
+        job.overruns += ticks - 1;
+        startJob(job);
+      }
+    }
+  }
+
+  std::cout << "Supervisor: stopping all jobs" << std::endl;
+  stopAll();
+  publishStatus();
+  return 0;
+}
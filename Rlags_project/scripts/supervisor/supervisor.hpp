@@ -0,0 +1,62 @@
+#ifndef SUPERVISOR_HPP
+#define SUPERVISOR_HPP
+
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+/*
+ * A job is either
+ *   periodic - its command is run once per period, on a drift-free timerfd
+ *              schedule; a tick that arrives while the previous run is still
+ *              going is counted as an overrun and skipped, or
+ *   repeat   - its command is run again <period> seconds after each run
+ *              exits, back to back, so the period is a gap, not a rate, or
+ *   service  - its command runs forever and is restarted when it exits,
+ *              with a backoff that doubles from 1 s up to MAX_BACKOFF.
+ *
+ * Jobs are read from jobs.conf, one per line:
+ *   <name> <periodic|repeat|service> <period seconds> [trigger=<fifo>] [after=<file>] <command...>
+ *
+ * trigger= runs a periodic job early whenever a line is written to the fifo,
+ * after= holds a job back until the file exists. Commands are run with
+ * /bin/bash -c, with $SUPERVISOR_STARTED set to the supervisor's start time.
+ * On SIGTERM every job is sent SIGTERM and waited for, and any still running
+ * after STOP_TIMEOUT seconds is killed.
+ */
+
+const int MAX_BACKOFF = 60;
+const int STATUS_PERIOD = 10;
+const int STOP_TIMEOUT = 5;
+
+struct Job
+{
+  std::string name;
+  bool service;
+  bool repeat;
+  double period;
+  std::string trigger;
+  std::string after;
+  std::string command;
+
+  pid_t pid;
+  bool triggered;
+  int timerFd;
+  int triggerFd;
+  struct timespec started;
+
+  unsigned long runs;
+  unsigned long failures;
+  unsigned long overruns;
+  unsigned long restarts;
+  int backoff;
+  double cpuSeconds;
+  double lastDuration;
+  double maxDuration;
+  std::string lastExit;
+};
+
+bool loadJobs(const std::string& path, std::vector<Job>& jobs);
+
+#endif
@@ -1,7 +1,7 @@
 #!/bin/bash
 
 echo "Housekeeping: assembling latest data"
-(cd ~/Rlags_project/scripts; ./getDataLock.sh) #request mutex on latestData/
+latest=~/Rlags_project/scripts/latest_data/build/latest
 
 cd ~/latestData/
 mkdir housekeeping/
@@ -15,8 +15,8 @@ echo -e "\n****EVENTS***" 	>> housekeeping/bundle.txt
 tail -150 status.log		>> housekeeping/bundle.txt
 echo -e "\n****SEDI*****"       >> housekeeping/bundle.txt
 grep -E "SEDI|UPTIME" status.log | tail -40 >> housekeeping/bundle.txt
-echo -e "\n****GOQAT****" 	>> housekeeping/bundle.txt
-sudo tail -40 /root/GoQat/log.txt >> housekeeping/bundle.txt
+echo -e "\n****SEDID****" 	>> housekeeping/bundle.txt
+~/Rlags_project/SEDI_Camera/src/sedid --send Status 5 >> housekeeping/bundle.txt 2>&1
 echo -e "\n****TEMPS****" 	>> housekeeping/bundle.txt
 cat odroidTemperature.txt 	>> housekeeping/bundle.txt
 echo ""				>> housekeeping/bundle.txt
@@ -26,12 +26,17 @@ cat cc_imu.txt			>> housekeeping/bundle.txt
 cat d2_imu.txt			>> housekeeping/bundle.txt
 echo -e "\n*****GPS*****"	>> housekeeping/bundle.txt
 cat gpsData.txt			>> housekeeping/bundle.txt
+echo -e "\n**SUPERVISOR*"	>> housekeeping/bundle.txt
+cat supervisor.txt		>> housekeeping/bundle.txt
+echo -e "\n***ARCHIVE***"	>> housekeeping/bundle.txt
+cat archive_status.txt		>> housekeeping/bundle.txt
+echo -e "\n****UPLINK***"	>> housekeeping/bundle.txt
+tail -10 uplink_acks.txt	>> housekeeping/bundle.txt
 echo -e "\n*****END*****"	>> housekeeping/bundle.txt
 
 #cp polarizerInfo.txt housekeeping/polarizerInfo.txt
 
-cp housekeeping/bundle.txt bundle.txt
+$latest publish bundle.txt housekeeping/bundle.txt #atomic, no lock needed
 rm -r housekeeping/
 
-(cd ~/Rlags_project/scripts; ./releaseDataLock.sh) #release mutex on latestData/
 echo "Housekeeping: bundling complete"
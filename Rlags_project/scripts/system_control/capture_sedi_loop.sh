@@ -1,5 +1,9 @@
 #!/bin/bash
 
+latest=~/Rlags_project/scripts/latest_data/build/latest
+archive=~/Rlags_project/scripts/archive/build/archive
+sedid=~/Rlags_project/SEDI_Camera/src/sedid
+
 cd ~/Rlags_project/scripts/communication
 commPID=$(./get_arduino_comm_pid.sh)
 echo "SEDI: Arduino communication PID is: "$commPID
@@ -10,6 +14,36 @@ mkdir workingDir
 
 echo "SEDI: capture loop started"
 
+# takes one argument: the working directory of a finished capture cycle
+function storeCycle() {
+	echo "SEDI: storing camera data for "$1
+	cd workingDir
+
+	#publish and archive SEDI data, written once to both SSDs in parallel;
+	#keep the worst status over all the files (1 = neither SSD, 2 = one SSD)
+	stored=0
+	for file in $1/*
+	do
+		$latest publish sedi/$(basename $file) $file
+		$archive put sedi_camera/$file $file
+		status=$?
+		if [ $status -eq 1 ] || [ $stored -eq 0 ]; then
+			stored=$status
+		fi
+	done
+
+	if [ $stored -eq 0 ]; then
+		echo "SEDI: data directory confirmed on both SSDs"
+	elif [ $stored -eq 2 ]; then
+		echo "SEDI: error: data stored on one SSD only"
+	else
+		echo "SEDI: error: data not stored on either SSD"
+	fi
+
+	rm -r $1
+	cd ..
+}
+
 # takes one argument: the capture trial number, 1, 2, or 3
 function startCycle() {
 	echo "SEDI: capture cycle started, "$(date)
@@ -22,43 +56,34 @@ function startCycle() {
 	sleep 6
 
 	#calibration with lamp
-	sudo ./capture.sh calibration_watchfile $1_calibration_lamp $dirName
+	sudo ./capture.sh calibration_watchfile $1_calibration_lamp $dirName ||
+		echo "SEDI: error: no lamp calibration image for cycle "$1
 
 	echo "SEDI: turning lamp off"
 	echo 201 >> ~/Rlags_project/scripts/communication/build/rawSerialInput
 	sleep 6
 
 	#calibration with no lamp
-	sudo ./capture.sh calibration_watchfile $1_calibration_nolamp $dirName
+	sudo ./capture.sh calibration_watchfile $1_calibration_nolamp $dirName ||
+		echo "SEDI: error: no lamp-off calibration image for cycle "$1
 
 	#scientific capture
-	sudo ./capture.sh $1_exposure_watchfile $1_capture $dirName
-
-	echo "SEDI: storing camera data"
-	cd workingDir
-
-	(cd ~/Rlags_project/scripts; ./getDataLock.sh) #request mutex on latestData/
-	cp $dirName/* ~/latestData/sedi/
-	(cd ~/Rlags_project/scripts; ./releaseDataLock.sh) #release mutex on latestData/
-
-	#archive SEDI data
-	cp -r $dirName /media/ssd_0/sedi_camera/
-	cp -r $dirName /media/ssd_1/sedi_camera/
-
-	if [ -d /media/ssd_0/sedi_camera/$dirName ]; then
-        	echo "SEDI: data directory confirmed on SSD 0"
-	else
-		echo "SEDI: error: data not stored on SSD 0"
+	sudo ./capture.sh $1_exposure_watchfile $1_capture $dirName ||
+		echo "SEDI: error: no science image for cycle "$1
+
+	#wait for sedid to finish saving the last images, then store them while the
+	#next cycle exposes; only one store runs at a time, so a slow SSD delays
+	#the cycle rather than piling up stores
+	if ! $sedid --send Sync 120; then
+		echo "SEDI: error: not all images were saved"
 	fi
+	sudo chown -R linaro workingDir/$dirName
 
-	if [ -d /media/ssd_1/sedi_camera/$dirName ]; then
-                echo "SEDI: data directory confirmed on SSD 1"
-        else
-                echo "SEDI: error: data not stored on SSD 1"
-        fi
-
-	rm -r $dirName
-	cd ..
+	if [ -n "$storePID" ]; then
+		wait $storePID
+	fi
+	storeCycle $dirName &
+	storePID=$!
 
 	echo "SEDI: capture cycle ended, "$(date)
 	echo "UPTIME: "$(uptime)
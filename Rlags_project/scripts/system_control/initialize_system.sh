@@ -10,13 +10,9 @@ echo "Sys init: SSDs recognized by kernel, will now mount"
 echo "Sys init: mounting SSDs..."
 sudo ~/Rlags_project/scripts/drives/mount_drives
 
-echo "Sys init: initializing GoQat SEDI camera..."
-sudo ~/Rlags_project/scripts/sedi_camera/initialize_goqat.sh
-
 echo "Sys init: resetting ~/latestData"
 rm -f ~/latestData/*.jpg
 rm -f ~/latestData/*.tar.bz2
-rm -f ~/latestData/lock
 rm -r -f ~/latestData/sedi
 mkdir ~/latestData/sedi
 
@@ -45,16 +41,14 @@ cd ~/Rlags_project/scripts/gps
 sleep 0.5
 tail -f gpsStream.txt | grep --line-buffered -E "GPRMC" | python parse.py &
 
-echo "Sys init: initializing uplink reading..."
-cd ~/Rlags_project/scripts/communication
-rm -f uplinkBuffer.txt
-hexdump -e '/1 "%02X"' < /dev/ttyUSB1 | perl -wlne 'print $1 if /(FAF3(E01F|E11E)10EF.*)/g' | cut -b 9-12 >> uplinkBuffer.txt &
+echo "Sys init: preparing uplink command channels..."
+rm -f ~/latestData/downlink_queue ~/latestData/capture_now
+touch ~/latestData/uplink_acks.txt
+mkfifo ~/latestData/capture_now
 
 echo "Sys init: archiving IMU timestamp..."
 cd ~/Rlags_project/scripts/imu/build
 ./get_imu_data.sh
 now=$(date +%s.%N)
-cat new_cc_data.txt >> /media/ssd_0/time/imu_cc_$now.txt
-cat new_d2_data.txt >> /media/ssd_0/time/imu_d2_$now.txt
-cat new_cc_data.txt >> /media/ssd_1/time/imu_cc_$now.txt
-cat new_d2_data.txt >> /media/ssd_1/time/imu_d2_$now.txt
+~/Rlags_project/scripts/archive/build/archive append time/imu_cc_$now.txt new_cc_data.txt
+~/Rlags_project/scripts/archive/build/archive append time/imu_d2_$now.txt new_d2_data.txt
@@ -0,0 +1,16 @@
+#!/bin/bash
+
+#run by the supervisor every 45 seconds, or at once on an uplinked capture_now
+
+start=$(date +%s.%N)
+echo "Sun/star cameras: capture started "$start", "$(date)
+
+cd /home/linaro/Rlags_project/scripts/sun_cameras/
+./capture_sun_all.sh
+
+echo "Sun/star cameras: star cam firing"
+cd /home/linaro/Rlags_project/scripts/star_camera/
+./capture_star.sh
+
+end=$(date +%s.%N)
+echo "Sun/star cameras: capture ended "$end
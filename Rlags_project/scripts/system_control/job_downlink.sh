@@ -0,0 +1,29 @@
+#!/bin/bash
+
+#run by the supervisor every 60 seconds
+
+start=$(date +%s.%N)
+echo "Comm: preparing for downlink transmission. "$(date)
+
+cd ~/control_scripts
+./assemble_housekeeping.sh
+
+cd ~/latestData
+cat -en bundle.txt > /dev/ttyUSB2
+
+echo "Comm: transmission completed. Archiving."
+
+~/Rlags_project/scripts/archive/build/archive put link_sent/data_$start.txt bundle.txt
+
+rm bundle.txt
+
+#send any files requested over the uplink (downlink_file command)
+if [ -s downlink_queue ]; then
+	mv downlink_queue downlink_sending
+	while read requested
+	do
+		echo "Comm: downlinking requested file "$requested
+		cat -en $requested > /dev/ttyUSB2
+	done < downlink_sending
+	rm downlink_sending
+fi
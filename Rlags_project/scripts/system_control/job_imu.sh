@@ -0,0 +1,20 @@
+#!/bin/bash
+
+#run by the supervisor 0.5 s after the previous run finishes; the samples
+#are appended to local stream files, which the supervisor's "imu_cc" and
+#"imu_d2" tail_follow services archive
+
+latest=~/Rlags_project/scripts/latest_data/build/latest
+cd ~/Rlags_project/scripts/imu/build
+
+./get_imu_data.sh
+
+now=$(date +%s.%N)
+ccData=$now": "$(cat new_cc_data.txt)
+d2Data=$now": "$(cat new_d2_data.txt)
+
+echo $ccData | $latest publish cc_imu.txt
+echo $d2Data | $latest publish d2_imu.txt
+
+echo $ccData >> cc_stream.txt
+echo $d2Data >> d2_stream.txt
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+#run by the supervisor every 7 seconds
+#IMU JOB MUST BE RUNNING FOR THIS TO WORK RIGHT
+
+latest=~/Rlags_project/scripts/latest_data/build/latest
+archive=~/Rlags_project/scripts/archive/build/archive
+cd ~/Rlags_project/scripts/polarizer/build
+
+./updatePolarizer.sh | $latest publish polarizerInfo.txt
+
+$archive append polarizer/stream.$SUPERVISOR_STARTED.txt ~/latestData/polarizerInfo.txt
+
+angle=$(tail -1 ~/latestData/polarizerInfo.txt)
+echo "Polarizer: set to "$angle
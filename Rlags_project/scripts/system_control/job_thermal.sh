@@ -0,0 +1,18 @@
+#!/bin/bash
+
+#run by the supervisor every 10 seconds; the Arduino stream itself is
+#archived by the supervisor's "arduino" tail_follow service
+
+latest=~/Rlags_project/scripts/latest_data/build/latest
+archive=~/Rlags_project/scripts/archive/build/archive
+
+start=$(date +%s.%N)
+
+odroidTemp=$(cat /sys/devices/virtual/thermal/thermal_zone0/temp | sed 's/000//g')
+odroidData=$(echo $odroidTemp" : "$start)
+
+echo $odroidData | $latest publish odroidTemperature.txt
+
+echo $odroidData | $archive append thermal_data/odroidTemp.$SUPERVISOR_STARTED.txt
+
+echo "Thermal: Odroid at "$odroidTemp"C, "$start
@@ -53,22 +53,17 @@ echo "Startup: end of sanity checks"
 sleep 5 #ensure that everything is fully ready
 echo "Startup: beginning scientific capture"
 
-./capture_cameras_loop.sh &>> ~/latestData/status.log &  #Sun and star capturing loop
-./capture_imu_loop.sh &>> ~/latestData/status.log &	  #IMU querying and archiving
-./capture_gps_loop.sh &>> ~/latestData/status.log &	  #Periodically archive GPS data stream
-./capture_thermal_loop.sh &>> ~/latestData/status.log &  #Timestamp and archive thermal data
-sleep 0.6
-./calibrate_polarizer_loop.sh &>> ~/latestData/status.log & #keep the polarizer calibrated properly
-sleep 1
-./capture_sedi_loop.sh &>> ~/latestData/status.log &      #SEDI camera capturing loop
-
-#wait until star/sun images come in, then we have something
-while [ ! -f ~/latestData/star_cam.jpg ];
+#sun/star cameras stay unbound between captures
+for port in 1-2.1.2.1 1-2.1.2.2 1-2.1.2.3 1-2.1.2.4
 do
-        sleep 0.25
+	echo $port | sudo tee /sys/bus/usb/drivers/usb/unbind
+	sleep 0.25
 done
 
-./stream_uplink_pull.sh &>> ~/latestData/status.log &	  #handle incoming commands from uplink
-./stream_downlink_push.sh &>> ~/latestData/status.log &  #transmit data bundles to downlink
+#every capture job, the SEDI loop, uplink and downlink run under the supervisor,
+#see ~/Rlags_project/scripts/supervisor/jobs.conf; uplink and downlink wait for
+#the first star camera image
+cd ~/Rlags_project/scripts/supervisor/build
+./supervisor jobs.conf &>> ~/latestData/status.log &
 
 echo "Startup: startup complete, all systems activated. "$(date)
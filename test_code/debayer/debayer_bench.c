@@ -0,0 +1,190 @@
+/******************************************************************************/
+/*                      BENCHMARK FOR THE BAYER DECODING                      */
+/*                                                                            */
+/* Times each debayering method in Rlags_project/SEDI_Camera/src/debayer.c    */
+/* at several frame sizes, two ways:                                          */
+/*                                                                            */
+/*   serial   - the dc1394_bayer_*_uint16 routine on the whole frame, as      */
+/*              ccdcam_debayer used to call it                                */
+/*   parallel - debayer_image, which decodes bands of rows on separate        */
+/*              threads where that's worthwhile                               */
+/*                                                                            */
+/* and checks that the two give exactly the same result.  debayer.c has no    */
+/* GTK or GLib dependencies, so it is built in as it is.                      */
+/*                                                                            */
+/* Usage: debayer_bench [runs [sx sy]]                                        */
+/*        runs is the number of times each method is timed (default 3, the    */
+/*        fastest is reported); with sx and sy only that frame size is done,  */
+/*        otherwise 640x480, 1392x1040, 1391x1039 and 3000x2000 are.          */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RGGB 512                /* DC1394_COLOR_FILTER_RGGB in debayer.c      */
+#define BITS 16                 /* Bits per pixel of the test frames          */
+
+typedef int (*decode_func) (const unsigned short *bayer, unsigned short *rgb,
+							int sx, int sy, int tile, int bits);
+
+extern int dc1394_bayer_Simple_uint16 (const unsigned short *bayer,
+									   unsigned short *rgb, int sx, int sy,
+									   int tile, int bits);
+extern int dc1394_bayer_NearestNeighbor_uint16 (const unsigned short *bayer,
+												unsigned short *rgb, int sx,
+												int sy, int tile, int bits);
+extern int dc1394_bayer_Bilinear_uint16 (const unsigned short *bayer,
+										 unsigned short *rgb, int sx, int sy,
+										 int tile, int bits);
+extern int dc1394_bayer_HQLinear_uint16 (const unsigned short *bayer,
+										 unsigned short *rgb, int sx, int sy,
+										 int tile, int bits);
+extern int dc1394_bayer_Downsample_uint16 (const unsigned short *bayer,
+										   unsigned short *rgb, int sx,
+										   int sy, int tile, int bits);
+extern int dc1394_bayer_VNG_uint16 (const unsigned short *bayer,
+									unsigned short *rgb, int sx, int sy,
+									int tile, int bits);
+extern int dc1394_bayer_AHD_uint16 (const unsigned short *bayer,
+									unsigned short *rgb, int sx, int sy,
+									int tile, int bits);
+extern int debayer_image (int method, const unsigned short *bayer,
+						  unsigned short *rgb, int sx, int sy, int tile,
+						  int bits);
+
+static const struct {           /* The methods, in the order of enum Debayer  */
+	const char *name;
+	decode_func decode;
+} METHOD[] = {
+	{"Simple", dc1394_bayer_Simple_uint16},
+	{"Nearest", dc1394_bayer_NearestNeighbor_uint16},
+	{"Bilinear", dc1394_bayer_Bilinear_uint16},
+	{"HQLinear", dc1394_bayer_HQLinear_uint16},
+	{"Downsample", dc1394_bayer_Downsample_uint16},
+	{"VNG", dc1394_bayer_VNG_uint16},
+	{"AHD", dc1394_bayer_AHD_uint16}
+};
+
+#define NUM_METHODS (sizeof (METHOD) / sizeof (METHOD[0]))
+
+static int bench_size (int sx, int sy, int runs);
+static void make_frame (unsigned short *bayer, int sx, int sy);
+static double now (void);
+
+
+int main (int argc, char *argv[])
+{
+	const int SIZE[][2] = {{640, 480}, {1392, 1040}, {1391, 1039},
+						   {3000, 2000}};
+	int i, runs, failed = 0;
+
+	runs = argc > 1 ? atoi (argv[1]) : 3;
+	if (runs < 1 || argc == 3 || (argc > 3 && (atoi (argv[2]) < 8 ||
+											   atoi (argv[3]) < 8))) {
+		fprintf (stderr, "Usage: %s [runs [sx sy]]\n", argv[0]);
+		return 1;
+	}
+
+	printf ("%-12s %-10s %12s %12s %8s\n", "Frame", "Method", "serial ms",
+			"parallel ms", "speed-up");
+	if (argc > 3)
+		failed = bench_size (atoi (argv[2]), atoi (argv[3]), runs);
+	else
+		for (i = 0; i < sizeof (SIZE) / sizeof (SIZE[0]); i++)
+			failed |= bench_size (SIZE[i][0], SIZE[i][1], runs);
+
+	if (failed)
+		printf ("FAILED: debayer_image doesn't match the serial decoding\n");
+	return failed;
+}
+
+static int bench_size (int sx, int sy, int runs)
+{
+	/* Time every method on one frame size.  Returns non-zero if the parallel
+	 * decoding didn't match the serial one for any method.
+	 */
+
+	unsigned short *bayer, *serial, *parallel;
+	size_t n = (size_t) sx * sy;
+	double t, t_serial, t_parallel;
+	char frame[32];
+	int m, r, failed = 0;
+
+	bayer = (unsigned short *) malloc (n * sizeof (unsigned short));
+	serial = (unsigned short *) malloc (3 * n * sizeof (unsigned short));
+	parallel = (unsigned short *) malloc (3 * n * sizeof (unsigned short));
+	if (!bayer || !serial || !parallel) {
+		fprintf (stderr, "Out of memory for %d x %d\n", sx, sy);
+		free (bayer);
+		free (serial);
+		free (parallel);
+		return 1;
+	}
+	make_frame (bayer, sx, sy);
+	snprintf (frame, sizeof (frame), "%dx%d", sx, sy);
+
+	for (m = 0; m < NUM_METHODS; m++) {
+		memset (serial, 0, 3 * n * sizeof (unsigned short));
+		memset (parallel, 0, 3 * n * sizeof (unsigned short));
+		t_serial = t_parallel = 1e30;
+		for (r = 0; r < runs; r++) {
+			t = now ();
+			METHOD[m].decode (bayer, serial, sx, sy, RGGB, BITS);
+			t = now () - t;
+			t_serial = t < t_serial ? t : t_serial;
+
+			t = now ();
+			debayer_image (m, bayer, parallel, sx, sy, RGGB, BITS);
+			t = now () - t;
+			t_parallel = t < t_parallel ? t : t_parallel;
+		}
+		printf ("%-12s %-10s %12.2f %12.2f %7.1fx%s\n", frame, METHOD[m].name,
+				t_serial * 1e3, t_parallel * 1e3, t_serial / t_parallel,
+				memcmp (serial, parallel, 3 * n * sizeof (unsigned short)) ?
+				"  MISMATCH" : "");
+		if (memcmp (serial, parallel, 3 * n * sizeof (unsigned short)))
+			failed = 1;
+	}
+
+	free (bayer);
+	free (serial);
+	free (parallel);
+	return failed;
+}
+
+static void make_frame (unsigned short *bayer, int sx, int sy)
+{
+	/* Fill a frame with smooth colour gradients under an RGGB mosaic, plus
+	 * noise and some sharp-edged blocks for the edge-directed methods to
+	 * work on.
+	 */
+
+	unsigned int seed = 12345;
+	int x, y, val;
+
+	for (y = 0; y < sy; y++)
+		for (x = 0; x < sx; x++) {
+			seed = seed * 1103515245 + 12345;
+			if (y % 2 == 0 && x % 2 == 0)       /* Red */
+				val = 4000 + 20000 * x / sx;
+			else if (y % 2 == 1 && x % 2 == 1)  /* Blue */
+				val = 4000 + 20000 * y / sy;
+			else                                /* Green */
+				val = 12000;
+			if ((x / 97 + y / 61) % 5 == 0)
+				val += 30000;
+			val += (seed >> 16) % 512;
+			bayer[(size_t) y * sx + x] = val;
+		}
+}
+
+static double now (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}